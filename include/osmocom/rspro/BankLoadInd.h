@@ -0,0 +1,44 @@
+/*
+ * Generated by asn1c-0.9.28 (http://lionet.info/asn1c)
+ * From ASN.1 module "RSPRO"
+ * 	found in "../../asn1/RSPRO.asn"
+ */
+
+#ifndef	_BankLoadInd_H_
+#define	_BankLoadInd_H_
+
+
+#include <asn_application.h>
+
+/* Including external dependencies */
+#include <osmocom/rspro/SlotNumber.h>
+#include <NativeInteger.h>
+#include <constr_SEQUENCE.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* BankLoadInd */
+typedef struct BankLoadInd {
+	SlotNumber_t	 activeSlots;
+	long	 apduRate;
+	long	 meanLatencyUs;
+	/*
+	 * This type is extensible,
+	 * possible extensions are below.
+	 */
+	
+	/* Context for parsing across buffer boundaries */
+	asn_struct_ctx_t _asn_ctx;
+} BankLoadInd_t;
+
+/* Implementation */
+extern asn_TYPE_descriptor_t asn_DEF_BankLoadInd;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _BankLoadInd_H_ */
+#include <asn_internal.h>
@@ -19,6 +19,9 @@
 extern "C" {
 #endif
 
+/* Forward declarations */
+struct ClientSlot;
+
 /* ConfigClientBankReq */
 typedef struct ConfigClientBankReq {
 	BankSlot_t	 bankSlot;
@@ -27,6 +30,7 @@ typedef struct ConfigClientBankReq {
 	 * This type is extensible,
 	 * possible extensions are below.
 	 */
+	struct ClientSlot	*clientSlot	/* OPTIONAL */;
 	
 	/* Context for parsing across buffer boundaries */
 	asn_struct_ctx_t _asn_ctx;
@@ -39,5 +43,8 @@ extern asn_TYPE_descriptor_t asn_DEF_ConfigClientBankReq;
 }
 #endif
 
+/* Referred external types */
+#include <osmocom/rspro/ClientSlot.h>
+
 #endif	/* _ConfigClientBankReq_H_ */
 #include <asn_internal.h>
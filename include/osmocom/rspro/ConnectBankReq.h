@@ -14,12 +14,16 @@
 #include <osmocom/rspro/ComponentIdentity.h>
 #include <osmocom/rspro/BankId.h>
 #include <osmocom/rspro/SlotNumber.h>
+#include <NativeInteger.h>
 #include <constr_SEQUENCE.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Forward declarations */
+struct IpPort;
+
 /* ConnectBankReq */
 typedef struct ConnectBankReq {
 	ComponentIdentity_t	 identity;
@@ -29,6 +33,8 @@ typedef struct ConnectBankReq {
 	 * This type is extensible,
 	 * possible extensions are below.
 	 */
+	struct IpPort	*bankdEndpoint	/* OPTIONAL */;
+	long	*mappingsDigest	/* OPTIONAL */;
 	
 	/* Context for parsing across buffer boundaries */
 	asn_struct_ctx_t _asn_ctx;
@@ -41,5 +47,8 @@ extern asn_TYPE_descriptor_t asn_DEF_ConnectBankReq;
 }
 #endif
 
+/* Referred external types */
+#include <osmocom/rspro/IpPort.h>
+
 #endif	/* _ConnectBankReq_H_ */
 #include <asn_internal.h>
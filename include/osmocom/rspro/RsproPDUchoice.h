@@ -32,6 +32,7 @@
 #include <osmocom/rspro/TpduCardToModem.h>
 #include <osmocom/rspro/ClientSlotStatusInd.h>
 #include <osmocom/rspro/BankSlotStatusInd.h>
+#include <osmocom/rspro/BankLoadInd.h>
 #include <constr_CHOICE.h>
 
 #ifdef __cplusplus
@@ -63,7 +64,7 @@ typedef enum RsproPDUchoice_PR {
 	RsproPDUchoice_PR_clientSlotStatusInd,
 	RsproPDUchoice_PR_bankSlotStatusInd,
 	/* Extensions may appear below */
-	
+	RsproPDUchoice_PR_bankLoadInd
 } RsproPDUchoice_PR;
 
 /* RsproPDUchoice */
@@ -95,6 +96,7 @@ typedef struct RsproPDUchoice {
 		 * This type is extensible,
 		 * possible extensions are below.
 		 */
+		BankLoadInd_t	 bankLoadInd;
 	} choice;
 	
 	/* Context for parsing across buffer boundaries */
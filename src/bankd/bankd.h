@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -11,6 +13,7 @@
 #include <winscard.h>
 
 #include <osmocom/core/linuxlist.h>
+#include <osmocom/core/timer.h>
 
 #include "rspro_util.h"
 #include "slotmap.h"
@@ -65,6 +68,9 @@ struct bankd_worker {
 	/* slot number we are representing */
 	struct bank_slot slot;
 
+	/* lock-free access to bankd->slotmaps from this thread */
+	struct slotmap_reader slotmap_reader;
+
 	/* thread of this worker. */
 	pthread_t thread;
 	/* top talloc context for this worker/thread */
@@ -125,7 +131,8 @@ struct bankd {
 	/* TCP socket at which we are listening */
 	int accept_fd;
 
-	/* list of slot mappings. only ever modified in main thread! */
+	/* list of slot mappings. only ever modified in main thread, which publishes
+	 * a snapshot to the workers via slotmap_publish() after each modification */
 	struct slotmaps *slotmaps;
 
 	/* pthread ID of main thread */
@@ -156,10 +163,29 @@ struct bankd {
 			unsigned int virtual_slot_start;  /* Start of virtual slot range (e.g., 900) */
 			unsigned int virtual_slot_end;    /* End of virtual slot range (e.g., 999) */
 		} ki_proxy;
+		/* interval of BankLoadInd towards the server in seconds; 0 to disable */
+		unsigned int load_interval_s;
+		/* use mock cards answering each APDU after mock_delay_us, rather than PC/SC */
+		bool mock_card;
+		unsigned int mock_delay_us;
 	} cfg;
+
+	/* load figures reported to the server */
+	struct {
+		/* TPDUs exchanged with the cards, and the sum of their response times; counted
+		 * by the workers */
+		atomic_ulong apdus;
+		atomic_ulong latency_us;
+		/* main thread only: the above as of the previous report */
+		unsigned long last_apdus;
+		unsigned long last_latency_us;
+		struct timespec last;
+		struct osmo_timer_list timer;
+	} load;
 };
 
 int bankd_pcsc_read_slotnames(struct bankd *bankd, const char *csv_file);
 const char *bankd_pcsc_get_slot_name(struct bankd *bankd, const struct bank_slot *slot);
 
 extern const struct bankd_driver_ops pcsc_driver_ops;
+extern const struct bankd_driver_ops mock_driver_ops;
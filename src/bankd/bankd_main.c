@@ -25,6 +25,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
+#include <time.h>
 
 #include <pthread.h>
 
@@ -86,6 +87,7 @@ static void bankd_init(struct bankd *bankd)
 
 	/* initialize members of 'bankd' */
 	bankd->slotmaps = slotmap_init(bankd);
+	OSMO_ASSERT(bankd->slotmaps);
 	INIT_LLIST_HEAD(&bankd->workers);
 	pthread_mutex_init(&bankd->workers_mutex, NULL);
 
@@ -115,6 +117,7 @@ static void bankd_init(struct bankd *bankd)
 	bankd->cfg.ki_proxy.next_slot_idx = 0;
 	bankd->cfg.ki_proxy.virtual_slot_start = 0;
 	bankd->cfg.ki_proxy.virtual_slot_end = 0;
+	bankd->cfg.load_interval_s = 10;
 }
 
 /* create + start a new bankd_worker thread */
@@ -129,7 +132,12 @@ static struct bankd_worker *bankd_create_worker(struct bankd *bankd, unsigned in
 
 	worker->bankd = bankd;
 	worker->num = i;
-	worker->ops = &pcsc_driver_ops;
+	if (bankd->cfg.mock_card) {
+		worker->ops = &mock_driver_ops;
+		/* no PC/SC reader to be resolved */
+		worker->reader.name = "mock";
+	} else
+		worker->ops = &pcsc_driver_ops;
 	worker->last_vccPresent = true; /* allow cold reset should first indication be false */
 	worker->last_resetActive = false; /* allow warm reset should first indication be true */
 
@@ -168,26 +176,142 @@ static void send_signal_to_worker(const struct bank_slot *bs, const struct clien
 	pthread_mutex_unlock(&g_bankd->workers_mutex);
 }
 
-/* Remove a mapping */
-static void bankd_srvc_remove_mapping(struct slot_mapping *map)
+/* slotmap changes collected while holding the slotmaps lock; the respective workers are
+ * only signalled once the lock is released and the new snapshot is published */
+struct map_changes {
+	unsigned int num_del;
+	unsigned int num_add;
+	struct bank_slot del[RSPRO_BATCH_MAX_PDUS];
+	struct client_slot add[RSPRO_BATCH_MAX_PDUS];
+};
+
+/* Remove a mapping; caller must hold slotmaps->rwlock for writing */
+static void _bankd_remove_map(struct slot_mapping *map, struct map_changes *chg)
 {
-	struct bank_slot bs = map->bank;
+	chg->del[chg->num_del++] = map->bank;
+	_slotmap_del(g_bankd->slotmaps, map);
+}
 
-	slotmap_del(g_bankd->slotmaps, map);
+/* handle a CreateMappingReq; caller must hold slotmaps->rwlock for writing */
+static RsproPDU_t *_bankd_create_mapping(struct rspro_server_conn *srvc, const CreateMappingReq_t *creq,
+					 struct map_changes *chg)
+{
+	struct slot_mapping *map;
+	struct bank_slot bs;
+	struct client_slot cs;
 
-	/* kill/reset the respective worker, if any! */
-	send_signal_to_worker(&bs, NULL, SIGMAPDEL);
+	if (creq->bank.bankId != g_bankd->srvc.bankd.bank_id) {
+		LOGPFSML(srvc->fi, LOGL_ERROR, "createMapping specifies invalid Bank ID %lu "
+			 "(we are %u)\n", creq->bank.bankId, g_bankd->srvc.bankd.bank_id);
+		return rspro_gen_CreateMappingRes(ResultCode_illegalBankId);
+	}
+	if (creq->bank.slotNr >= g_bankd->srvc.bankd.num_slots) {
+		LOGPFSML(srvc->fi, LOGL_ERROR, "createMapping specifies invalid Slot Nr %lu "
+			 "(we have %u)\n", creq->bank.slotNr, g_bankd->srvc.bankd.num_slots);
+		return rspro_gen_CreateMappingRes(ResultCode_illegalSlotId);
+	}
+
+	rspro2bank_slot(&bs, &creq->bank);
+	rspro2client_slot(&cs, &creq->client);
+	/* check if map exists */
+	map = _slotmap_by_bank(g_bankd->slotmaps, &bs);
+	if (map) {
+		if (client_slot_equals(&map->client, &cs)) {
+			LOGPFSML(srvc->fi, LOGL_ERROR, "ignoring identical slotmap\n");
+			return rspro_gen_CreateMappingRes(ResultCode_ok);
+		}
+		LOGPFSML(srvc->fi, LOGL_NOTICE, "implicitly removing slotmap\n");
+		_bankd_remove_map(map, chg);
+	}
+	/* Add a new mapping */
+	map = _slotmap_add(g_bankd->slotmaps, &bs, &cs);
+	if (!map) {
+		LOGPFSML(srvc->fi, LOGL_ERROR, "could not create slotmap\n");
+		return rspro_gen_CreateMappingRes(ResultCode_illegalSlotId);
+	}
+	chg->add[chg->num_add++] = cs;
+	return rspro_gen_CreateMappingRes(ResultCode_ok);
 }
 
-/* handle incoming messages from server */
-static int bankd_srvc_handle_rx(struct rspro_server_conn *srvc, const RsproPDU_t *pdu)
+/* handle a RemoveMappingReq; caller must hold slotmaps->rwlock for writing */
+static RsproPDU_t *_bankd_remove_mapping(struct rspro_server_conn *srvc, const RemoveMappingReq_t *rreq,
+					 struct map_changes *chg)
 {
-	const CreateMappingReq_t *creq = NULL;
-	const RemoveMappingReq_t *rreq = NULL;
-	struct bankd_worker *worker;
 	struct slot_mapping *map;
 	struct bank_slot bs;
 	struct client_slot cs;
+
+	if (rreq->bank.bankId != g_bankd->srvc.bankd.bank_id) {
+		LOGPFSML(srvc->fi, LOGL_ERROR, "removeMapping specifies invalid Bank ID %lu "
+			 "(we are %u)\n", rreq->bank.bankId, g_bankd->srvc.bankd.bank_id);
+		return rspro_gen_RemoveMappingRes(ResultCode_illegalBankId);
+	}
+	if (rreq->bank.slotNr >= g_bankd->srvc.bankd.num_slots) {
+		LOGPFSML(srvc->fi, LOGL_ERROR, "removeMapping specifies invalid Slot Nr %lu "
+			 "(we have %u)\n", rreq->bank.slotNr, g_bankd->srvc.bankd.num_slots);
+		return rspro_gen_RemoveMappingRes(ResultCode_illegalSlotId);
+	}
+
+	rspro2bank_slot(&bs, &rreq->bank);
+	/* Remove a mapping */
+	map = _slotmap_by_bank(g_bankd->slotmaps, &bs);
+	if (!map) {
+		LOGPFSML(srvc->fi, LOGL_ERROR, "B(%lu:%lu) could not find to-be-deleted slotmap\n", rreq->bank.bankId, rreq->bank.slotNr);
+		return rspro_gen_RemoveMappingRes(ResultCode_unknownSlotmap);
+	}
+	rspro2client_slot(&cs, &rreq->client);
+	if (!client_slot_equals(&map->client, &cs)) {
+		LOGPFSML(srvc->fi, LOGL_NOTICE, "B(%lu:%lu): ClientId in removeMappingReq != map\n", rreq->bank.bankId, rreq->bank.slotNr);
+		return rspro_gen_RemoveMappingRes(ResultCode_unknownSlotmap);
+	}
+	LOGPFSML(srvc->fi, LOGL_INFO, "B(%lu:%lu): removing slotmap\n", rreq->bank.bankId, rreq->bank.slotNr);
+	_bankd_remove_map(map, chg);
+	return rspro_gen_RemoveMappingRes(ResultCode_ok);
+}
+
+/* apply a sequence of Create/RemoveMappingReq under a single slotmaps lock, publish the
+ * resulting slotmaps once, notify the affected workers and respond to each request */
+static void bankd_srvc_apply_mappings(struct rspro_server_conn *srvc, const RsproPDU_t **pdus,
+				      unsigned int num_pdus)
+{
+	static struct map_changes chg;
+	RsproPDU_t *resps[RSPRO_BATCH_MAX_PDUS];
+	unsigned int i;
+
+	OSMO_ASSERT(num_pdus <= ARRAY_SIZE(resps));
+	chg.num_del = chg.num_add = 0;
+
+	slotmaps_wrlock(g_bankd->slotmaps);
+	for (i = 0; i < num_pdus; i++) {
+		if (pdus[i]->msg.present == RsproPDUchoice_PR_createMappingReq)
+			resps[i] = _bankd_create_mapping(srvc, &pdus[i]->msg.choice.createMappingReq, &chg);
+		else
+			resps[i] = _bankd_remove_mapping(srvc, &pdus[i]->msg.choice.removeMappingReq, &chg);
+		/* echo the OperationTag so the server can correlate the response */
+		if (resps[i])
+			resps[i]->tag = pdus[i]->tag;
+	}
+	slotmaps_unlock(g_bankd->slotmaps);
+
+	if (chg.num_del || chg.num_add)
+		slotmap_publish(g_bankd->slotmaps);
+
+	/* kill/reset the respective workers, if any! */
+	for (i = 0; i < chg.num_del; i++)
+		send_signal_to_worker(&chg.del[i], NULL, SIGMAPDEL);
+	for (i = 0; i < chg.num_add; i++)
+		send_signal_to_worker(NULL, &chg.add[i], SIGMAPADD);
+
+	if (num_pdus == 1)
+		server_conn_send_rspro(srvc, resps[0]);
+	else
+		server_conn_send_rspro_batch(srvc, resps, num_pdus);
+}
+
+/* handle incoming messages from server */
+static int bankd_srvc_handle_rx(struct rspro_server_conn *srvc, const RsproPDU_t *pdu)
+{
+	struct bankd_worker *worker;
 	RsproPDU_t *resp;
 
 	LOGPFSML(srvc->fi, LOGL_DEBUG, "Rx RSPRO %s\n", rspro_msgt_name(pdu));
@@ -206,77 +330,13 @@ static int bankd_srvc_handle_rx(struct rspro_server_conn *srvc, const RsproPDU_t
 		osmo_fsm_inst_dispatch(srvc->fi, SRVC_E_CLIENT_CONN_RES, (void *) pdu);
 		break;
 	case RsproPDUchoice_PR_createMappingReq:
-		creq = &pdu->msg.choice.createMappingReq;
-		if (creq->bank.bankId != g_bankd->srvc.bankd.bank_id) {
-			LOGPFSML(srvc->fi, LOGL_ERROR, "createMapping specifies invalid Bank ID %lu "
-				 "(we are %u)\n", creq->bank.bankId, g_bankd->srvc.bankd.bank_id);
-			resp = rspro_gen_CreateMappingRes(ResultCode_illegalBankId);
-		} else if (creq->bank.slotNr >= g_bankd->srvc.bankd.num_slots) {
-			LOGPFSML(srvc->fi, LOGL_ERROR, "createMapping specifies invalid Slot Nr %lu "
-				 "(we have %u)\n", creq->bank.slotNr, g_bankd->srvc.bankd.num_slots);
-			resp = rspro_gen_CreateMappingRes(ResultCode_illegalSlotId);
-		} else {
-			rspro2bank_slot(&bs, &creq->bank);
-			rspro2client_slot(&cs, &creq->client);
-			/* check if map exists */
-			map = slotmap_by_bank(g_bankd->slotmaps, &bs);
-			if (map) {
-				if (client_slot_equals(&map->client, &cs)) {
-					LOGPFSML(srvc->fi, LOGL_ERROR, "ignoring identical slotmap\n");
-					resp = rspro_gen_CreateMappingRes(ResultCode_ok);
-					goto send_resp;
-				} else {
-					LOGPFSML(srvc->fi, LOGL_NOTICE, "implicitly removing slotmap\n");
-					bankd_srvc_remove_mapping(map);
-				}
-			}
-			/* Add a new mapping */
-			map = slotmap_add(g_bankd->slotmaps, &bs, &cs);
-			if (!map) {
-				LOGPFSML(srvc->fi, LOGL_ERROR, "could not create slotmap\n");
-				resp = rspro_gen_CreateMappingRes(ResultCode_illegalSlotId);
-			} else {
-				send_signal_to_worker(NULL, &cs, SIGMAPADD);
-				resp = rspro_gen_CreateMappingRes(ResultCode_ok);
-			}
-		}
-send_resp:
-		server_conn_send_rspro(srvc, resp);
-		break;
 	case RsproPDUchoice_PR_removeMappingReq:
-		rreq = &pdu->msg.choice.removeMappingReq;
-		if (rreq->bank.bankId != g_bankd->srvc.bankd.bank_id) {
-			LOGPFSML(srvc->fi, LOGL_ERROR, "removeMapping specifies invalid Bank ID %lu "
-				 "(we are %u)\n", rreq->bank.bankId, g_bankd->srvc.bankd.bank_id);
-			resp = rspro_gen_RemoveMappingRes(ResultCode_illegalBankId);
-		} else if (rreq->bank.slotNr >= g_bankd->srvc.bankd.num_slots) {
-			LOGPFSML(srvc->fi, LOGL_ERROR, "removeMapping specifies invalid Slot Nr %lu "
-				 "(we have %u)\n", rreq->bank.slotNr, g_bankd->srvc.bankd.num_slots);
-			resp = rspro_gen_RemoveMappingRes(ResultCode_illegalSlotId);
-		} else {
-			rspro2bank_slot(&bs, &rreq->bank);
-			/* Remove a mapping */
-			map = slotmap_by_bank(g_bankd->slotmaps, &bs);
-			if (!map) {
-				LOGPFSML(srvc->fi, LOGL_ERROR, "B(%lu:%lu) could not find to-be-deleted slotmap\n", rreq->bank.bankId, rreq->bank.slotNr);
-				resp = rspro_gen_RemoveMappingRes(ResultCode_unknownSlotmap);
-			} else {
-				rspro2client_slot(&cs, &rreq->client);
-				if (!client_slot_equals(&map->client, &cs)) {
-					LOGPFSML(srvc->fi, LOGL_NOTICE, "B(%lu:%lu): ClientId in removeMappingReq != map\n", rreq->bank.bankId, rreq->bank.slotNr);
-					resp = rspro_gen_RemoveMappingRes(ResultCode_unknownSlotmap);
-				} else {
-					LOGPFSML(srvc->fi, LOGL_INFO, "B(%lu:%lu): removing slotmap\n", rreq->bank.bankId, rreq->bank.slotNr);
-					bankd_srvc_remove_mapping(map);
-					resp = rspro_gen_RemoveMappingRes(ResultCode_ok);
-				}
-			}
-		}
-		server_conn_send_rspro(srvc, resp);
+		bankd_srvc_apply_mappings(srvc, &pdu, 1);
 		break;
 	case RsproPDUchoice_PR_resetStateReq:
 		/* delete all slotmaps */
 		slotmap_del_all(g_bankd->slotmaps);
+		slotmap_publish(g_bankd->slotmaps);
 		/* notify all workers about maps having disappeared */
 		pthread_mutex_lock(&g_bankd->workers_mutex);
 		llist_for_each_entry(worker, &g_bankd->workers, list) {
@@ -296,6 +356,34 @@ send_resp:
 	return 0;
 }
 
+/* handle a batch frame of incoming messages from server */
+static int bankd_srvc_handle_rx_batch(struct rspro_server_conn *srvc, const RsproPDU_t **pdus,
+				      unsigned int num_pdus)
+{
+	unsigned int i;
+	int rc = 0;
+
+	LOGPFSML(srvc->fi, LOGL_DEBUG, "Rx RSPRO batch of %u PDUs\n", num_pdus);
+
+	for (i = 0; i < num_pdus; i++) {
+		switch (pdus[i]->msg.present) {
+		case RsproPDUchoice_PR_createMappingReq:
+		case RsproPDUchoice_PR_removeMappingReq:
+			break;
+		default:
+			/* anything else: process one by one, in order */
+			for (i = 0; i < num_pdus; i++) {
+				if (bankd_srvc_handle_rx(srvc, pdus[i]) < 0)
+					rc = -1;
+			}
+			return rc;
+		}
+	}
+
+	bankd_srvc_apply_mappings(srvc, pdus, num_pdus);
+	return 0;
+}
+
 static void printf_help(FILE *out)
 {
 	fprintf(out,
@@ -310,6 +398,10 @@ static void printf_help(FILE *out)
 "                               connections (default: INADDR_ANY)\n"
 "  -P --bind-port <1-65535>		Local TCP port to bind for incoming client\n"
 "                               connections (default: 9999)\n"
+"  -a --advertise-ip ADDR       IPv4/IPv6 address clients shall use to reach this bankd,\n"
+"                               e.g. behind NAT (default: our address as seen by the server)\n"
+"  -o --advertise-port <1-65535> TCP port clients shall use to reach this bankd\n"
+"                               (default: the bind port)\n"
 "  -s --permit-shared-pcsc      Permit SHARED access to PC/SC readers (default: exclusive)\n"
 "  -g --gsmtap-ip A.B.C.D       Enable GSMTAP and send APDU traces to given IP\n"
 "  -G --gsmtap-slot <0-1023>    Limit tracing to given bank slot, only (default: all slots)\n"
@@ -320,6 +412,10 @@ static void printf_help(FILE *out)
 "  -C --ki-proxy-carrier <num>  KI Proxy carrier number\n"
 "  -M --ki-proxy-imsi <imsi>    KI Proxy IMSI\n"
 "  -c --ki-proxy-iccid <iccid>  KI Proxy ICCID\n"
+"  -l --load-interval SECS      Interval of load reports to the server, used by it to\n"
+"                               place new slot mappings; 0 to disable (default: 10)\n"
+"  -m --mock-card USECS         Emulate cards answering each APDU after USECS, rather\n"
+"                               than using PC/SC readers; for benchmarking\n"
 "  -L --disable-color           Disable colors for logging to stderr\n"
 "  -T --timestamp               Prefix every log line with a timestamp\n"
 "  -e --log-level number        Set a global loglevel.\n"
@@ -328,6 +424,8 @@ static void printf_help(FILE *out)
 
 static int g_bind_port = 9999;
 static char *g_bind_ip = NULL;
+static char *g_advertise_ip = NULL;
+static int g_advertise_port = 0;
 
 static void handle_options(int argc, char **argv)
 {
@@ -344,6 +442,8 @@ static void handle_options(int argc, char **argv)
 			{ "component-name", 1, 0, 'N' },
 			{ "bind-ip", 1, 0, 'I' },
 			{ "bind-port", 1, 0, 'P' },
+			{ "advertise-ip", 1, 0, 'a' },
+			{ "advertise-port", 1, 0, 'o' },
 			{ "permit-shared-pcsc", 0, 0, 's' },
 			{ "gsmtap-ip", 1, 0, 'g' },
 			{ "gsmtap-slot", 1, 0, 'G' },
@@ -357,10 +457,12 @@ static void handle_options(int argc, char **argv)
 			{ "ki-proxy-carrier", 1, 0, 'C' },
 			{ "ki-proxy-imsi", 1, 0, 'M' },
 			{ "ki-proxy-iccid", 1, 0, 'c' },
+			{ "load-interval", 1, 0, 'l' },
+			{ "mock-card", 1, 0, 'm' },
 			{ 0, 0, 0, 0 }
 		};
 
-		c = getopt_long(argc, argv, "hVd:i:p:b:n:N:I:P:sg:G:LTe:kK:S:v:C:M:c:", long_options, &option_index);
+		c = getopt_long(argc, argv, "hVd:i:p:b:n:N:I:P:a:o:sg:G:LTe:kK:S:v:C:M:c:l:m:", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -397,6 +499,12 @@ static void handle_options(int argc, char **argv)
 		case 'P':
 			g_bind_port = atoi(optarg);
 			break;
+		case 'a':
+			g_advertise_ip = optarg;
+			break;
+		case 'o':
+			g_advertise_port = atoi(optarg);
+			break;
 		case 's':
 			g_bankd->cfg.permit_shared_pcsc = true;
 			break;
@@ -508,10 +616,71 @@ static void handle_options(int argc, char **argv)
 		case 'c':
 			g_bankd->cfg.ki_proxy.iccid = optarg;
 			break;
+		case 'l':
+			g_bankd->cfg.load_interval_s = atoi(optarg);
+			break;
+		case 'm':
+			g_bankd->cfg.mock_card = true;
+			g_bankd->cfg.mock_delay_us = atoi(optarg);
+			break;
 		}
 	}
 }
 
+/* periodically report our load to the server, so it can place new slot mappings on the least
+ * loaded bankd */
+static void bankd_load_timer_cb(void *data)
+{
+	struct bankd *bankd = data;
+	unsigned long apdus, latency_us, d_apdus;
+	unsigned int active_slots = 0;
+	struct bankd_worker *worker;
+	struct timespec now;
+	int64_t elapsed_ms;
+	RsproPDU_t *pdu;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	apdus = atomic_load(&bankd->load.apdus);
+	latency_us = atomic_load(&bankd->load.latency_us);
+	elapsed_ms = (now.tv_sec - bankd->load.last.tv_sec) * 1000 +
+		     (now.tv_nsec - bankd->load.last.tv_nsec) / 1000000;
+	d_apdus = apdus - bankd->load.last_apdus;
+
+	pthread_mutex_lock(&bankd->workers_mutex);
+	llist_for_each_entry(worker, &bankd->workers, list) {
+		if (worker->state == BW_ST_CONN_CLIENT_MAPPED_CARD)
+			active_slots++;
+	}
+	pthread_mutex_unlock(&bankd->workers_mutex);
+
+	if (server_conn_is_connected(&bankd->srvc) && bankd->srvc.peer_version >= RSPRO_VERSION_LOAD) {
+		pdu = rspro_gen_BankLoadInd(active_slots,
+					    elapsed_ms > 0 ? d_apdus * 1000 / elapsed_ms : 0,
+					    d_apdus ? (latency_us - bankd->load.last_latency_us) / d_apdus : 0);
+		server_conn_send_rspro(&bankd->srvc, pdu);
+	}
+
+	bankd->load.last_apdus = apdus;
+	bankd->load.last_latency_us = latency_us;
+	bankd->load.last = now;
+	osmo_timer_schedule(&bankd->load.timer, bankd->cfg.load_interval_s, 0);
+}
+
+/* digest of all our maps, so a server taking over from another one can tell whether its
+ * replicated copy of our maps is still what we have */
+static int64_t bankd_maps_digest(struct rspro_server_conn *srvc)
+{
+	struct slot_mapping *map;
+	uint32_t digest = 0;
+
+	slotmaps_rdlock(g_bankd->slotmaps);
+	llist_for_each_entry(map, &g_bankd->slotmaps->mappings, list)
+		digest += slotmap_digest(map);
+	slotmaps_unlock(g_bankd->slotmaps);
+
+	return digest & 0x7fffffff;
+}
+
 int main(int argc, char **argv)
 {
 	struct rspro_server_conn *srvc;
@@ -529,6 +698,8 @@ int main(int argc, char **argv)
 	srvc->server_host = NULL;
 	srvc->server_port = 9998;
 	srvc->handle_rx = bankd_srvc_handle_rx;
+	srvc->handle_rx_batch = bankd_srvc_handle_rx_batch;
+	srvc->bankd.maps_digest = bankd_maps_digest;
 	srvc->own_comp_id.type = ComponentType_remsimBankd;
 	OSMO_STRLCPY_ARRAY(srvc->own_comp_id.name, g_hostname);
 	OSMO_STRLCPY_ARRAY(srvc->own_comp_id.software, "remsim-bankd");
@@ -543,19 +714,32 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
+	/* tell the server where clients can reach us; an all-zero address lets the server
+	 * use the address from which we connect to it */
+	if (g_advertise_ip) {
+		if (rspro_endpoint_from_str(&srvc->bankd.endpoint, g_advertise_ip, 0) < 0) {
+			fprintf(stderr, "ERROR: Invalid advertise IP address '%s'\n", g_advertise_ip);
+			exit(2);
+		}
+	} else
+		srvc->bankd.endpoint.af = AF_INET;
+	srvc->bankd.endpoint.port = g_advertise_port ? g_advertise_port : g_bind_port;
+
 	g_bankd->main = pthread_self();
 	signal(SIGMAPDEL, handle_sig_mapdel);
 	signal(SIGMAPADD, handle_sig_mapadd);
 	signal(SIGUSR1, handle_sig_usr1);
 
-	LOGP(DMAIN, LOGL_INFO, "Reading PCSC slots...\n");
-	/* Np lock or mutex required for the pcsc_slot_names list, as this is only
-	 * read once during bankd initialization, when the worker threads haven't
-	 * started yet */
-	rc = bankd_pcsc_read_slotnames(g_bankd, "bankd_pcsc_slots.csv");
-	if (rc) {
-		fprintf(stderr, "ERROR: failed reading bankd_pcsc_slots.csv file\n");
-		exit(1);
+	if (!g_bankd->cfg.mock_card) {
+		LOGP(DMAIN, LOGL_INFO, "Reading PCSC slots...\n");
+		/* Np lock or mutex required for the pcsc_slot_names list, as this is only
+		 * read once during bankd initialization, when the worker threads haven't
+		 * started yet */
+		rc = bankd_pcsc_read_slotnames(g_bankd, "bankd_pcsc_slots.csv");
+		if (rc) {
+			fprintf(stderr, "ERROR: failed reading bankd_pcsc_slots.csv file\n");
+			exit(1);
+		}
 	}
 
 	/* Connection towards remsim-server */
@@ -598,6 +782,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (g_bankd->cfg.load_interval_s) {
+		clock_gettime(CLOCK_MONOTONIC, &g_bankd->load.last);
+		osmo_timer_setup(&g_bankd->load.timer, bankd_load_timer_cb, g_bankd);
+		osmo_timer_schedule(&g_bankd->load.timer, g_bankd->cfg.load_interval_s, 0);
+	}
+
 	while (!terminate) {
 		osmo_select_main(0);
 	}
@@ -691,6 +881,8 @@ static void worker_cleanup(void *arg)
 	struct bankd_worker *worker = (struct bankd_worker *) arg;
 	struct bankd *bankd = worker->bankd;
 
+	slotmap_reader_unregister(bankd->slotmaps, &worker->slotmap_reader);
+
 	/* FIXME: should we still do this? in the thread ?!? */
 	pthread_mutex_lock(&bankd->workers_mutex);
 	llist_del(&worker->list);
@@ -803,10 +995,13 @@ static int worker_send_rspro(struct bankd_worker *worker, RsproPDU_t *pdu)
 /* attempt to obtain slot-map */
 static int worker_try_slotmap(struct bankd_worker *worker)
 {
-	struct slot_mapping *slmap;
+	struct bank_slot bslot;
+	int rc;
 
-	slmap = slotmap_by_client(worker->bankd->slotmaps, &worker->client.clslot);
-	if (!slmap) {
+	/* never blocks on the main thread; we obtain a copy, not a pointer to the map */
+	rc = slotmap_lookup_client(worker->bankd->slotmaps, &worker->slotmap_reader,
+				   &worker->client.clslot, &bslot);
+	if (rc < 0) {
 		LOGW(worker, "No slotmap (yet) for client C(%u:%u)\n",
 			worker->client.clslot.client_id, worker->client.clslot.slot_nr);
 		/* check in 10s if the map has been installed meanwhile by main thread */
@@ -814,9 +1009,9 @@ static int worker_try_slotmap(struct bankd_worker *worker)
 		return -1;
 	} else {
 		LOGW(worker, "slotmap found: C(%u:%u) -> B(%u:%u)\n",
-			slmap->client.client_id, slmap->client.slot_nr,
-			slmap->bank.bank_id, slmap->bank.slot_nr);
-		worker->slot = slmap->bank;
+			worker->client.clslot.client_id, worker->client.clslot.slot_nr,
+			bslot.bank_id, bslot.slot_nr);
+		worker->slot = bslot;
 		worker_set_state_timeout(worker, BW_ST_CONN_CLIENT_MAPPED, 10);
 		return worker_open_card(worker);
 	}
@@ -1005,6 +1200,7 @@ static int worker_handle_tpduModemToCard(struct bankd_worker *worker, const Rspr
 	uint8_t rx_buf[1024];
 	DWORD rx_buf_len = sizeof(rx_buf);
 	RsproPDU_t *pdu_resp;
+	struct timespec start, end;
 	struct client_slot clslot;
 	struct bank_slot bslot;
 	int rc;
@@ -1041,6 +1237,7 @@ static int worker_handle_tpduModemToCard(struct bankd_worker *worker, const Rspr
 	                        worker->slot.slot_nr >= g_bankd->cfg.ki_proxy.virtual_slot_start &&
 	                        worker->slot.slot_nr <= g_bankd->cfg.ki_proxy.virtual_slot_end);
 	
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (g_bankd->cfg.ki_proxy.enabled && mdm2sim->data.size > 1 && 
 	    mdm2sim->data.buf[1] == 0x88 && is_virtual_slot) {
 		/* Route to KI proxy pool */
@@ -1053,6 +1250,11 @@ static int worker_handle_tpduModemToCard(struct bankd_worker *worker, const Rspr
 	}
 	if (rc < 0)
 		return rc;
+	/* account for the load reported to the server */
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	atomic_fetch_add(&g_bankd->load.apdus, 1);
+	atomic_fetch_add(&g_bankd->load.latency_us, (end.tv_sec - start.tv_sec) * 1000000 +
+						     (end.tv_nsec - start.tv_nsec) / 1000);
 
 	LOGW(worker, "Tx RSPRO tpduCardToModem(%s)\n", osmo_hexdump_nospc(rx_buf, rx_buf_len));
 	/* encode response PDU and send it */
@@ -1275,6 +1477,8 @@ static void *worker_main(void *arg)
 	g_worker->name = talloc_asprintf(g_worker->tall_ctx, "bankd-worker(%u)", g_worker->num);
 	pthread_setname_np(pthread_self(), g_worker->name);
 
+	slotmap_reader_register(g_worker->bankd->slotmaps, &g_worker->slotmap_reader);
+
 	/* push cleanup helper */
 	pthread_cleanup_push(&worker_cleanup, g_worker);
 
@@ -0,0 +1,120 @@
+/* Mock card driver for osmo-remsim-bankd
+ *
+ * Answers every APDU itself after a configurable delay, emulating the time a card takes.  This
+ * allows benchmarking bankd, server and clients without any card readers.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <osmocom/core/utils.h>
+
+#include "bankd.h"
+
+/* ATR of a sysmoUSIM-SJS1 */
+static const uint8_t mock_atr[] = {
+	0x3b, 0x9f, 0x96, 0x80, 0x1f, 0xc7, 0x80, 0x31, 0xa0, 0x73, 0xbe, 0x21,
+	0x13, 0x67, 0x43, 0x20, 0x07, 0x18, 0x00, 0x00, 0x01, 0xa5,
+};
+
+static int mock_get_atr(struct bankd_worker *worker)
+{
+	memcpy(worker->card.atr, mock_atr, sizeof(mock_atr));
+	worker->card.atr_len = sizeof(mock_atr);
+	return 0;
+}
+
+static int mock_open_card(struct bankd_worker *worker)
+{
+	LOGW(worker, "Opening mock card (%u us per APDU)\n", worker->bankd->cfg.mock_delay_us);
+	return mock_get_atr(worker);
+}
+
+static int mock_reset_card(struct bankd_worker *worker, bool cold_reset)
+{
+	LOGW(worker, "Resetting mock card (%s)\n", cold_reset ? "cold reset" : "warm reset");
+	return mock_get_atr(worker);
+}
+
+/* sleep for the emulated processing time; our thread gets signals about slotmap changes */
+static void mock_delay(unsigned int us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+		;
+}
+
+static int mock_transceive(struct bankd_worker *worker, const uint8_t *out, size_t out_len,
+			   uint8_t *in, size_t *in_len)
+{
+	size_t le = 0;
+
+	if (out_len < 4)
+		return -EINVAL;
+
+	mock_delay(worker->bankd->cfg.mock_delay_us);
+
+	switch (out[1]) {
+	case 0xb0:	/* READ BINARY */
+	case 0xb2:	/* READ RECORD */
+	case 0xc0:	/* GET RESPONSE */
+	case 0xca:	/* GET DATA */
+	case 0xf2:	/* STATUS */
+	case 0x12:	/* FETCH */
+		/* outgoing data: as many bytes as the terminal expects (P3) */
+		if (out_len == 5)
+			le = out[4] ? out[4] : 256;
+		if (le + 2 > *in_len)
+			return -ENOSPC;
+		memset(in, 0xff, le);
+		in[le] = 0x90;
+		in[le + 1] = 0x00;
+		break;
+	case 0x88:	/* RUN GSM ALGORITHM / AUTHENTICATE */
+		if (*in_len < 2)
+			return -ENOSPC;
+		/* response to be fetched via GET RESPONSE, as a T=0 card would do */
+		in[0] = 0x61;
+		in[1] = 0x10;
+		break;
+	default:
+		if (*in_len < 2)
+			return -ENOSPC;
+		in[0] = 0x90;
+		in[1] = 0x00;
+		break;
+	}
+	*in_len = le + 2;
+
+	return 0;
+}
+
+static void mock_cleanup(struct bankd_worker *worker)
+{
+}
+
+const struct bankd_driver_ops mock_driver_ops = {
+	.open_card = mock_open_card,
+	.reset_card = mock_reset_card,
+	.transceive = mock_transceive,
+	.cleanup = mock_cleanup,
+};
@@ -0,0 +1,339 @@
+/* Per-stage latency of the APDUs passing through a remsim-client
+ *
+ * Each C-APDU is timestamped when the frontend hands it to the main FSM, when it is encoded
+ * and queued towards the bankd, when the response arrives and is decoded, and when the
+ * frontend has delivered it to the modem.  The time between each of those points goes into
+ * a histogram per stage, so a slow APDU can be attributed to the client itself, the
+ * network plus bankd plus card, or the frontend/modem side.  Optionally, the most recent
+ * APDUs are kept in a ring buffer along with all their timestamps.
+ *
+ * Everything is exported on a local stream socket: a client sends the command "stats" to
+ * receive the histograms in the Prometheus text exposition format, or "trace" to receive the
+ * contents of the ring buffers, one APDU per line.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/socket.h>
+#include <osmocom/core/logging.h>
+
+#include "client.h"
+#include "apdu_trace.h"
+
+static const char *stage_names[_NUM_APDU_STG] = {
+	[APDU_STG_ENCODE]	= "encode",
+	[APDU_STG_QUEUE]	= "queue",
+	[APDU_STG_BANKD]	= "bankd",
+	[APDU_STG_DECODE]	= "decode",
+	[APDU_STG_DELIVER]	= "deliver",
+	[APDU_STG_TOTAL]	= "total",
+};
+
+/* all clients of this process */
+static LLIST_HEAD(g_traces);
+
+struct apdu_trace *apdu_trace_alloc(struct bankd_client *bc, unsigned int ring_len)
+{
+	struct apdu_trace *t = talloc_zero(bc, struct apdu_trace);
+
+	if (!t)
+		return NULL;
+	t->bc = bc;
+	if (ring_len) {
+		t->ring = talloc_zero_array(t, struct apdu_trace_rec, ring_len);
+		if (!t->ring) {
+			talloc_free(t);
+			return NULL;
+		}
+		t->ring_len = ring_len;
+	}
+	llist_add_tail(&t->list, &g_traces);
+	return t;
+}
+
+static uint32_t ts_diff_us(const struct timespec *later, const struct timespec *earlier)
+{
+	int64_t us = (later->tv_sec - earlier->tv_sec) * 1000000 +
+		     (later->tv_nsec - earlier->tv_nsec) / 1000;
+
+	return us > 0 ? us : 0;
+}
+
+static bool ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void hist_observe(struct apdu_hist *h, uint32_t us)
+{
+	unsigned int i;
+
+	for (i = 0; i < APDU_HIST_BUCKETS; i++) {
+		if (us <= (1U << i))
+			break;
+	}
+	h->buckets[i]++;
+	h->sum_us += us;
+	h->count++;
+	if (us > h->max_us)
+		h->max_us = us;
+}
+
+void apdu_trace_tx(struct apdu_trace *t, const struct timespec *modem, const uint8_t *apdu, size_t len,
+		   const struct rspro_server_conn *bankdc)
+{
+	struct apdu_trace_rec *rec = &t->cur;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->ts[APDU_TS_MODEM] = *modem;
+	/* the connection only updates these if it actually sent something */
+	if (ts_before(&bankdc->ts.tx_encoded, modem))
+		return;
+	rec->ts[APDU_TS_ENCODED] = bankdc->ts.tx_encoded;
+	rec->ts[APDU_TS_QUEUED] = bankdc->ts.tx_queued;
+	memcpy(rec->hdr, apdu, OSMO_MIN(len, sizeof(rec->hdr)));
+	t->in_flight = true;
+}
+
+void apdu_trace_rx(struct apdu_trace *t, const uint8_t *rapdu, size_t len,
+		   const struct rspro_server_conn *bankdc)
+{
+	struct apdu_trace_rec *rec = &t->cur;
+	unsigned int i;
+
+	if (!t->in_flight) {
+		t->unexpected++;
+		return;
+	}
+	t->in_flight = false;
+
+	rec->ts[APDU_TS_RECEIVED] = bankdc->ts.rx_received;
+	rec->ts[APDU_TS_DECODED] = bankdc->ts.rx_decoded;
+	clock_gettime(CLOCK_MONOTONIC, &rec->ts[APDU_TS_DELIVERED]);
+	if (len >= 2)
+		memcpy(rec->sw, rapdu + len - 2, 2);
+
+	for (i = 0; i < APDU_STG_TOTAL; i++)
+		hist_observe(&t->hist[i], ts_diff_us(&rec->ts[i + 1], &rec->ts[i]));
+	hist_observe(&t->hist[APDU_STG_TOTAL], ts_diff_us(&rec->ts[APDU_TS_DELIVERED],
+							  &rec->ts[APDU_TS_MODEM]));
+
+	if (t->ring_len)
+		t->ring[t->ring_total++ % t->ring_len] = *rec;
+}
+
+/***********************************************************************
+ * local stats socket
+ ***********************************************************************/
+
+static void client_label(char *out, size_t out_len, const struct bankd_client *bc)
+{
+	if (bc->srv_conn.clslot)
+		snprintf(out, out_len, "%lu:%lu", bc->srv_conn.clslot->clientId, bc->srv_conn.clslot->slotNr);
+	else
+		snprintf(out, out_len, "?");
+}
+
+static void write_stats(FILE *f)
+{
+	struct apdu_trace *t;
+	const struct apdu_hist *h;
+	char label[32];
+	uint64_t cum;
+	unsigned int i, j;
+
+	fprintf(f, "# HELP remsim_client_apdu_stage_seconds Time APDUs spent in each stage\n");
+	fprintf(f, "# TYPE remsim_client_apdu_stage_seconds histogram\n");
+	llist_for_each_entry(t, &g_traces, list) {
+		client_label(label, sizeof(label), t->bc);
+		for (i = 0; i < _NUM_APDU_STG; i++) {
+			h = &t->hist[i];
+			cum = 0;
+			for (j = 0; j < APDU_HIST_BUCKETS; j++) {
+				cum += h->buckets[j];
+				fprintf(f, "remsim_client_apdu_stage_seconds_bucket{client=\"%s\",stage=\"%s\","
+					"le=\"%g\"} %" PRIu64 "\n", label, stage_names[i], (1U << j) / 1e6, cum);
+			}
+			cum += h->buckets[j];
+			fprintf(f, "remsim_client_apdu_stage_seconds_bucket{client=\"%s\",stage=\"%s\","
+				"le=\"+Inf\"} %" PRIu64 "\n", label, stage_names[i], cum);
+			fprintf(f, "remsim_client_apdu_stage_seconds_sum{client=\"%s\",stage=\"%s\"} %.6f\n",
+				label, stage_names[i], h->sum_us / 1e6);
+			fprintf(f, "remsim_client_apdu_stage_seconds_count{client=\"%s\",stage=\"%s\"} %" PRIu64 "\n",
+				label, stage_names[i], cum);
+		}
+	}
+
+	fprintf(f, "# HELP remsim_client_apdu_stage_max_seconds Longest time an APDU spent in each stage\n");
+	fprintf(f, "# TYPE remsim_client_apdu_stage_max_seconds gauge\n");
+	llist_for_each_entry(t, &g_traces, list) {
+		client_label(label, sizeof(label), t->bc);
+		for (i = 0; i < _NUM_APDU_STG; i++)
+			fprintf(f, "remsim_client_apdu_stage_max_seconds{client=\"%s\",stage=\"%s\"} %.6f\n",
+				label, stage_names[i], t->hist[i].max_us / 1e6);
+	}
+
+	fprintf(f, "# HELP remsim_client_apdu_unexpected_total R-APDUs received without a C-APDU\n");
+	fprintf(f, "# TYPE remsim_client_apdu_unexpected_total counter\n");
+	llist_for_each_entry(t, &g_traces, list) {
+		client_label(label, sizeof(label), t->bc);
+		fprintf(f, "remsim_client_apdu_unexpected_total{client=\"%s\"} %lu\n", label, t->unexpected);
+	}
+}
+
+/* one line per APDU, oldest first; times in microseconds */
+static void write_trace(FILE *f)
+{
+	const struct apdu_trace_rec *rec;
+	struct apdu_trace *t;
+	char label[32];
+	unsigned long n;
+	unsigned int i;
+
+	llist_for_each_entry(t, &g_traces, list) {
+		client_label(label, sizeof(label), t->bc);
+		n = t->ring_total > t->ring_len ? t->ring_total - t->ring_len : 0;
+		for (; n < t->ring_total; n++) {
+			rec = &t->ring[n % t->ring_len];
+			fprintf(f, "%s t=%ld.%06ld hdr=%s sw=%02x%02x", label, (long) rec->ts[APDU_TS_MODEM].tv_sec,
+				rec->ts[APDU_TS_MODEM].tv_nsec / 1000, osmo_hexdump_nospc(rec->hdr, sizeof(rec->hdr)),
+				rec->sw[0], rec->sw[1]);
+			for (i = 0; i < APDU_STG_TOTAL; i++)
+				fprintf(f, " %s=%u", stage_names[i], ts_diff_us(&rec->ts[i + 1], &rec->ts[i]));
+			fprintf(f, " total=%u\n", ts_diff_us(&rec->ts[APDU_TS_DELIVERED], &rec->ts[APDU_TS_MODEM]));
+		}
+	}
+}
+
+struct stats_conn {
+	struct osmo_fd ofd;
+	char buf[64];
+	size_t len;
+	/* the response, and how much of it has been sent so far */
+	char *out;
+	size_t out_len;
+	size_t out_sent;
+};
+
+static void stats_conn_close(struct stats_conn *sc)
+{
+	osmo_fd_unregister(&sc->ofd);
+	close(sc->ofd.fd);
+	free(sc->out);
+	talloc_free(sc);
+}
+
+/* format the response to the command in sc->buf; it is sent as the socket becomes writable,
+ * so a reader which doesn't read never blocks our main loop */
+static int stats_conn_respond(struct stats_conn *sc)
+{
+	FILE *f;
+
+	f = open_memstream(&sc->out, &sc->out_len);
+	if (!f)
+		return -ENOMEM;
+	if (!strcmp(sc->buf, "stats") || !sc->buf[0])
+		write_stats(f);
+	else if (!strcmp(sc->buf, "trace"))
+		write_trace(f);
+	else
+		fprintf(f, "unknown command '%s'; use 'stats' or 'trace'\n", sc->buf);
+	if (fclose(f))
+		return -ENOMEM;
+
+	osmo_fd_read_disable(&sc->ofd);
+	osmo_fd_write_enable(&sc->ofd);
+	return 0;
+}
+
+static int stats_conn_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct stats_conn *sc = ofd->data;
+	char *nl;
+	int rc;
+
+	if (what & OSMO_FD_WRITE) {
+		rc = write(ofd->fd, sc->out + sc->out_sent, sc->out_len - sc->out_sent);
+		if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		if (rc > 0)
+			sc->out_sent += rc;
+		if (rc <= 0 || sc->out_sent == sc->out_len)
+			stats_conn_close(sc);
+		return 0;
+	}
+
+	rc = read(ofd->fd, sc->buf + sc->len, sizeof(sc->buf) - 1 - sc->len);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (rc <= 0) {
+		stats_conn_close(sc);
+		return 0;
+	}
+	sc->len += rc;
+	sc->buf[sc->len] = '\0';
+	nl = strpbrk(sc->buf, "\r\n");
+	if (!nl) {
+		if (sc->len == sizeof(sc->buf) - 1)
+			stats_conn_close(sc);
+		return 0;
+	}
+	*nl = '\0';
+
+	if (stats_conn_respond(sc) < 0)
+		stats_conn_close(sc);
+	return 0;
+}
+
+static int stats_accept_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct stats_conn *sc;
+	int fd;
+
+	fd = accept(ofd->fd, NULL, NULL);
+	if (fd < 0)
+		return 0;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	sc = talloc_zero(ofd->data, struct stats_conn);
+	if (!sc) {
+		close(fd);
+		return 0;
+	}
+	osmo_fd_setup(&sc->ofd, fd, OSMO_FD_READ, stats_conn_cb, sc, 0);
+	if (osmo_fd_register(&sc->ofd) < 0) {
+		close(fd);
+		talloc_free(sc);
+	}
+	return 0;
+}
+
+int apdu_trace_socket_open(void *ctx, const char *path)
+{
+	struct osmo_fd *ofd = talloc_zero(ctx, struct osmo_fd);
+	int rc;
+
+	if (!ofd)
+		return -ENOMEM;
+	/* a stale socket of a previous instance */
+	unlink(path);
+	osmo_fd_setup(ofd, -1, OSMO_FD_READ, stats_accept_cb, ctx, 0);
+	rc = osmo_sock_unix_init_ofd(ofd, SOCK_STREAM, 0, path, OSMO_SOCK_F_BIND);
+	if (rc < 0) {
+		LOGP(DMAIN, LOGL_ERROR, "Cannot open APDU stats socket %s (%d)\n", path, rc);
+		talloc_free(ofd);
+		return rc;
+	}
+	return 0;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <osmocom/core/linuxlist.h>
+
+struct bankd_client;
+struct rspro_server_conn;
+
+/* points in time an APDU passes on its way through the client */
+enum apdu_ts {
+	APDU_TS_MODEM,		/* the frontend handed us the C-APDU (MF_E_MDM_TPDU) */
+	APDU_TS_ENCODED,	/* encoded as RSPRO */
+	APDU_TS_QUEUED,		/* queued for sending to the bankd */
+	APDU_TS_RECEIVED,	/* the response was read from the bankd connection */
+	APDU_TS_DECODED,	/* the response was decoded */
+	APDU_TS_DELIVERED,	/* frontend_handle_card2modem() returned */
+	_NUM_APDU_TS
+};
+
+/* the time between two consecutive points, plus the total */
+enum apdu_stage {
+	APDU_STG_ENCODE,
+	APDU_STG_QUEUE,
+	APDU_STG_BANKD,		/* network, bankd and card */
+	APDU_STG_DECODE,
+	APDU_STG_DELIVER,
+	APDU_STG_TOTAL,
+	_NUM_APDU_STG
+};
+
+/* finite buckets of a histogram; bucket i counts durations up to 2^i microseconds */
+#define APDU_HIST_BUCKETS	24
+
+struct apdu_hist {
+	/* non-cumulative; the last one counts everything above 2^23 us */
+	uint64_t buckets[APDU_HIST_BUCKETS + 1];
+	uint64_t sum_us;
+	uint64_t count;
+	uint32_t max_us;
+};
+
+struct apdu_trace_rec {
+	struct timespec ts[_NUM_APDU_TS];
+	/* header of the C-APDU and status word of the R-APDU */
+	uint8_t hdr[5];
+	uint8_t sw[2];
+};
+
+/* latency statistics of one bankd_client; only used from its main loop */
+struct apdu_trace {
+	struct llist_head list;
+	struct bankd_client *bc;
+
+	/* the APDU waiting for its response */
+	struct apdu_trace_rec cur;
+	bool in_flight;
+	/* responses we didn't expect, e.g. after a reconnect */
+	unsigned long unexpected;
+
+	struct apdu_hist hist[_NUM_APDU_STG];
+
+	/* optional: the last ring_len APDUs */
+	struct apdu_trace_rec *ring;
+	unsigned int ring_len;
+	unsigned long ring_total;
+};
+
+struct apdu_trace *apdu_trace_alloc(struct bankd_client *bc, unsigned int ring_len);
+/* C-APDU was sent to the bankd; 'modem' is when the frontend handed it to us */
+void apdu_trace_tx(struct apdu_trace *t, const struct timespec *modem, const uint8_t *apdu, size_t len,
+		   const struct rspro_server_conn *bankdc);
+/* R-APDU was delivered to the frontend */
+void apdu_trace_rx(struct apdu_trace *t, const uint8_t *rapdu, size_t len,
+		   const struct rspro_server_conn *bankdc);
+
+/* serve the statistics of all clients on a local stream socket */
+int apdu_trace_socket_open(void *ctx, const char *path);
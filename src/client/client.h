@@ -1,5 +1,7 @@
 #pragma once
 
+#include <time.h>
+
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/fsm.h>
 #include <osmocom/rspro/RsproPDU.h>
@@ -8,6 +10,7 @@
 #include "rspro_client_fsm.h"
 #include "slotmap.h"
 #include "debug.h"
+#include "apdu_trace.h"
 
 /***********************************************************************
  * frontend interface
@@ -67,6 +70,13 @@ struct client_config {
 	bool keep_running;
 
 	char *event_script;
+	/* long-lived helper receiving events as JSON lines on its stdin */
+	char *event_coproc;
+
+	/* local socket exporting per-stage APDU latencies */
+	char *stats_socket;
+	/* number of recent APDUs to keep for tracing */
+	unsigned int apdu_trace_len;
 
 	struct {
 		uint8_t data[ATR_SIZE_MAX];
@@ -94,6 +104,9 @@ struct client_config {
 	} simtrace;
 };
 
+/* in-process alternative to the event script; called with the cause of every event */
+typedef void (*remsim_client_event_cb)(struct bankd_client *bc, const char *cause, void *data);
+
 struct bankd_client {
 	/* connection to the remsim-server (control) */
 	struct rspro_server_conn srv_conn;
@@ -111,6 +124,30 @@ struct bankd_client {
 	struct osmo_st2_cardem_inst *cardem;
 	struct frontend_phys_status last_status;
 	void *data;
+
+	remsim_client_event_cb event_cb;
+	void *event_cb_data;
+	/* per-stage APDU latencies; only if enabled in the config */
+	struct apdu_trace *apdu_trace;
+	/* the running event co-process, if any */
+	struct {
+		int fd;
+		struct timespec spawned;
+		/* frontend-specific members of each JSON line, see event_json_frontend() */
+		char *frontend;
+	} event_coproc;
+	/* several clients (slots) of one process sharing a single server connection */
+	struct {
+		/* the client owning the server connection we use, if it's not our own */
+		struct bankd_client *owner;
+		/* on the owner: the other clients sharing it; on those: our entry in it */
+		struct llist_head list;
+		struct llist_head entry;
+		/* remsim_client_establish() was called */
+		bool enabled;
+		/* our ConnectClientReq is waiting for its ConnectClientRes */
+		bool pending;
+	} shared_srvc;
 };
 
 #define srvc2bankd_client(srvc)		container_of(srvc, struct bankd_client, srv_conn)
@@ -119,7 +156,12 @@ struct bankd_client {
 struct client_config *client_config_init(void *ctx);
 struct bankd_client *remsim_client_create(void *ctx, const char *name, const char *software,
 					  struct client_config *cfg);
+struct bankd_client *remsim_client_create_slot(struct bankd_client *owner, const char *name,
+					       const char *software, struct client_config *cfg);
+void remsim_client_establish(struct bankd_client *bc);
+struct rspro_server_conn *remsim_client_srvc(struct bankd_client *bc);
 void remsim_client_set_clslot(struct bankd_client *bc, int client_id, int slot_nr);
+void remsim_client_set_event_cb(struct bankd_client *bc, remsim_client_event_cb cb, void *data);
 
 extern int client_user_main(struct bankd_client *g_client);
 
@@ -16,9 +16,17 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/logging.h>
@@ -38,6 +46,7 @@
 static char **build_script_env(struct bankd_client *bc, const char *cause)
 {
 	char **env = talloc_zero_size(bc, 256*sizeof(char *));
+	struct rspro_server_conn *srvc = remsim_client_srvc(bc);
 	int rc, i = 0;
 
 	if (!env)
@@ -46,9 +55,9 @@ static char **build_script_env(struct bankd_client *bc, const char *cause)
 	env[i++] = talloc_asprintf(env, "REMSIM_CLIENT_VERSION=%s", VERSION);
 
 	env[i++] = talloc_asprintf(env, "REMSIM_SERVER_ADDR=%s:%u",
-				   bc->srv_conn.server_host, bc->srv_conn.server_port);
+				   srvc->server_host, srvc->server_port);
 	env[i++] = talloc_asprintf(env, "REMSIM_SERVER_STATE=%s",
-				   osmo_fsm_inst_state_name(bc->srv_conn.fi));
+				   osmo_fsm_inst_state_name(srvc->fi));
 
 	env[i++] = talloc_asprintf(env, "REMSIM_BANKD_ADDR=%s:%u",
 				   bc->bankd_conn.server_host, bc->bankd_conn.server_port);
@@ -80,14 +89,236 @@ static char **build_script_env(struct bankd_client *bc, const char *cause)
 	return env;
 }
 
+/* append 'str' to 'out' as a JSON string; returns the new length or -ENOSPC */
+static int json_append_str(char *out, int len, size_t out_size, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	if (len + 1 >= out_size)
+		return -ENOSPC;
+	out[len++] = '"';
+	for (; *str; str++) {
+		/* worst case: \u00XX and the closing quote */
+		if (len + 7 >= out_size)
+			return -ENOSPC;
+		switch (*str) {
+		case '"':
+		case '\\':
+			out[len++] = '\\';
+			out[len++] = *str;
+			break;
+		default:
+			if ((unsigned char) *str < 0x20) {
+				len += sprintf(out + len, "\\u00%c%c", hex[*str >> 4], hex[*str & 0xf]);
+			} else
+				out[len++] = *str;
+			break;
+		}
+	}
+	out[len++] = '"';
+	return len;
+}
+
+/* append '"name":"<value>"' to 'out', preceded by a comma unless it's the first member */
+static int json_append_kv(char *out, int len, size_t out_size, const char *name, const char *fmt, ...)
+{
+	char value[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(value, sizeof(value), fmt, ap);
+	va_end(ap);
+
+	if (out[len - 1] != '{') {
+		if (len + 1 >= out_size)
+			return -ENOSPC;
+		out[len++] = ',';
+	}
+	len = json_append_str(out, len, out_size, name);
+	if (len < 0)
+		return len;
+	if (len + 1 >= out_size)
+		return -ENOSPC;
+	out[len++] = ':';
+	return json_append_str(out, len, out_size, value);
+}
+
+/* the frontend-specific part of the script environment as JSON members (with leading
+ * commas); it doesn't change at runtime, so we format it only once per co-process */
+static char *event_json_frontend(struct bankd_client *bc)
+{
+	char **env = talloc_zero_size(bc, 64*sizeof(char *));
+	char line[PIPE_BUF] = "{";
+	char name[64];
+	const char *eq;
+	char *ret = NULL;
+	int i, n, len = 1;
+
+	if (!env)
+		return NULL;
+	n = frontend_append_script_env(bc, env, 0, 64-1);
+	for (i = 0; i < n; i++) {
+		if (!env[i])
+			continue;
+		eq = strchr(env[i], '=');
+		if (!eq || eq - env[i] >= sizeof(name))
+			continue;
+		memcpy(name, env[i], eq - env[i]);
+		name[eq - env[i]] = '\0';
+		len = json_append_kv(line, len, sizeof(line), name, "%s", eq + 1);
+		if (len < 0)
+			goto out;
+	}
+	line[len] = '\0';
+	/* all members are preceded by a comma once appended to the common ones */
+	ret = talloc_asprintf(bc, "%s%s", len > 1 ? "," : "", line + 1);
+out:
+	talloc_free(env);
+	return ret;
+}
+
+/* one JSON object per line, with the same names and values as the script environment;
+ * shorter than PIPE_BUF, so each line is written atomically or not at all */
+static int event_json_line(struct bankd_client *bc, const char *cause, char *out, size_t out_size)
+{
+	struct rspro_server_conn *srvc = remsim_client_srvc(bc);
+	/* leave room for the closing brace and newline */
+	size_t size = out_size - 2;
+	int len = 0;
+
+	out[len++] = '{';
+	len = json_append_kv(out, len, size, "REMSIM_CLIENT_VERSION", "%s", VERSION);
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_SERVER_ADDR", "%s:%u",
+				     srvc->server_host, srvc->server_port);
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_SERVER_STATE", "%s",
+				     osmo_fsm_inst_state_name(srvc->fi));
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_BANKD_ADDR", "%s:%u",
+				     bc->bankd_conn.server_host, bc->bankd_conn.server_port);
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_BANKD_STATE", "%s",
+				     osmo_fsm_inst_state_name(bc->bankd_conn.fi));
+	if (len >= 0 && bc->srv_conn.clslot)
+		len = json_append_kv(out, len, size, "REMSIM_CLIENT_SLOT", "%lu:%lu",
+				     bc->srv_conn.clslot->clientId, bc->srv_conn.clslot->slotNr);
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_BANKD_SLOT", "%u:%u",
+				     bc->bankd_slot.bank_id, bc->bankd_slot.slot_nr);
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_SIM_VCC", "%u",
+				     bc->last_status.flags.vcc_present);
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_SIM_RST", "%u",
+				     bc->last_status.flags.reset_active);
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_SIM_CLK", "%u",
+				     bc->last_status.flags.clk_active);
+	if (len >= 0)
+		len = json_append_kv(out, len, size, "REMSIM_CAUSE", "%s", cause);
+	if (len < 0)
+		return len;
+
+	if (bc->event_coproc.frontend) {
+		size_t flen = strlen(bc->event_coproc.frontend);
+		if (len + flen >= size)
+			return -ENOSPC;
+		memcpy(out + len, bc->event_coproc.frontend, flen);
+		len += flen;
+	}
+	out[len++] = '}';
+	out[len++] = '\n';
+	return len;
+}
+
+/* don't re-spawn a failing event co-process more often than this */
+#define EVENT_COPROC_RESPAWN_S	1
+
+static int event_coproc_spawn(struct bankd_client *bc)
+{
+	struct timespec now;
+	int fds[2];
+	pid_t pid;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (bc->event_coproc.spawned.tv_sec &&
+	    now.tv_sec - bc->event_coproc.spawned.tv_sec < EVENT_COPROC_RESPAWN_S)
+		return -EAGAIN;
+	bc->event_coproc.spawned = now;
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return -errno;
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+	if (pid == 0) {
+		/* child: events arrive on stdin */
+		if (dup2(fds[0], STDIN_FILENO) < 0)
+			_exit(126);
+		/* don't keep our sockets, the modem or GPIOs open for as long as the helper runs */
+		osmo_close_all_fds_above(STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", bc->cfg->event_coproc, (char *) NULL);
+		_exit(127);
+	}
+	close(fds[0]);
+	/* never block the client on a slow helper */
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	bc->event_coproc.fd = fds[1];
+	if (!bc->event_coproc.frontend)
+		bc->event_coproc.frontend = event_json_frontend(bc);
+	LOGPFSML(bc->main_fi, LOGL_NOTICE, "Started event co-process '%s' (pid %d)\n",
+		 bc->cfg->event_coproc, (int) pid);
+	return 0;
+}
+
+static void event_coproc_send(struct bankd_client *bc, const char *cause)
+{
+	char line[PIPE_BUF];
+	int len, rc;
+
+	if (bc->event_coproc.fd < 0 && event_coproc_spawn(bc) < 0)
+		return;
+
+	len = event_json_line(bc, cause, line, sizeof(line));
+	if (len < 0) {
+		LOGPFSML(bc->main_fi, LOGL_ERROR, "Event too long for the event co-process\n");
+		return;
+	}
+
+	rc = write(bc->event_coproc.fd, line, len);
+	if (rc == len)
+		return;
+	if (rc < 0 && errno == EAGAIN) {
+		LOGPFSML(bc->main_fi, LOGL_ERROR, "Event co-process doesn't keep up; dropping event\n");
+		return;
+	}
+	/* it terminated; start it again with the next event */
+	LOGPFSML(bc->main_fi, LOGL_ERROR, "Event co-process is gone (%s)\n",
+		 rc < 0 ? strerror(errno) : "short write");
+	close(bc->event_coproc.fd);
+	bc->event_coproc.fd = -1;
+}
+
+/* tell the in-process hook, the event co-process and the event script about an event */
 static int call_script(struct bankd_client *bc, const char *cause)
 {
 	char **env, *cmd;
 	int rc;
 
+	if (bc->event_cb)
+		bc->event_cb(bc, cause, bc->event_cb_data);
+
+	if (bc->cfg->event_coproc)
+		event_coproc_send(bc, cause);
+
 	if (!bc->cfg->event_script)
 		return 0;
 
+	/* only the fork/exec path needs the environment as an array */
 	env = build_script_env(bc, cause);
 	if (!env)
 		return -ENOMEM;
@@ -97,13 +328,18 @@ static int call_script(struct bankd_client *bc, const char *cause)
 		talloc_free(env);
 		return -ENOMEM;
 	}
-
 	rc = osmo_system_nowait(cmd, osmo_environment_whitelist, env);
 	talloc_free(env);
 
 	return rc;
 }
 
+void remsim_client_set_event_cb(struct bankd_client *bc, remsim_client_event_cb cb, void *data)
+{
+	bc->event_cb = cb;
+	bc->event_cb_data = data;
+}
+
 
 /***********************************************************************/
 
@@ -231,6 +467,7 @@ static void main_st_operational(struct osmo_fsm_inst *fi, uint32_t event, void *
 	RsproPDU_t *resp;
 	BankSlot_t bslot;
 	SlotPhysStatus_t *phys_status;
+	struct timespec t_modem;
 
 	switch (event) {
 	case MF_E_BANKD_LOST:
@@ -258,7 +495,7 @@ static void main_st_operational(struct osmo_fsm_inst *fi, uint32_t event, void *
 		}
 		/* send response to server */
 		resp = rspro_gen_ConfigClientBankRes(ResultCode_ok);
-		server_conn_send_rspro(&bc->srv_conn, resp);
+		server_conn_send_rspro(remsim_client_srvc(bc), resp);
 		call_script(bc, "event-config-bankd");
 		break;
 	case MF_E_BANKD_TPDU:
@@ -271,6 +508,9 @@ static void main_st_operational(struct osmo_fsm_inst *fi, uint32_t event, void *
 		/* forward to modem/cardem (via API) */
 		frontend_handle_card2modem(bc, pdu_rx->msg.choice.tpduCardToModem.data.buf,
 					   pdu_rx->msg.choice.tpduCardToModem.data.size);
+		if (bc->apdu_trace)
+			apdu_trace_rx(bc->apdu_trace, pdu_rx->msg.choice.tpduCardToModem.data.buf,
+				      pdu_rx->msg.choice.tpduCardToModem.data.size, &bc->bankd_conn);
 		/* response happens indirectly via tpduModemToCard */
 		break;
 	case MF_E_BANKD_ATR:
@@ -318,7 +558,7 @@ static void main_st_operational(struct osmo_fsm_inst *fi, uint32_t event, void *
 						     pstatus->flags.clk_active,
 						     pstatus->flags.card_present);
 		server_conn_send_rspro(&bc->bankd_conn, resp);
-		if (!memcmp(&bc->last_status.flags, &pstatus->flags, sizeof(pstatus->flags)))
+		if (memcmp(&bc->last_status.flags, &pstatus->flags, sizeof(pstatus->flags)))
 			call_script(bc, "event-modem-status");
 		bc->last_status = *pstatus;
 		break;
@@ -331,11 +571,15 @@ static void main_st_operational(struct osmo_fsm_inst *fi, uint32_t event, void *
 	case MF_E_MDM_TPDU:
 		tpdu = data;
 		OSMO_ASSERT(tpdu);
+		if (bc->apdu_trace)
+			clock_gettime(CLOCK_MONOTONIC, &t_modem);
 		LOGPFSML(fi, LOGL_INFO, "Tx tpduModemToCard (%s)\n", osmo_hexdump_nospc(tpdu->buf, tpdu->len));
 		/* forward to bankd */
 		bank_slot2rspro(&bslot, &bc->bankd_slot);
 		resp = rspro_gen_TpduModem2Card(bc->srv_conn.clslot, &bslot, tpdu->buf, tpdu->len);
 		server_conn_send_rspro(&bc->bankd_conn, resp);
+		if (bc->apdu_trace)
+			apdu_trace_tx(bc->apdu_trace, &t_modem, tpdu->buf, tpdu->len, &bc->bankd_conn);
 		break;
 	default:
 		OSMO_ASSERT(0);
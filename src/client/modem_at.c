@@ -0,0 +1,456 @@
+/* Streaming AT command engine for the serial port of a modem
+ *
+ * Whatever the modem sends is appended to a ring buffer and assembled into lines, no matter
+ * how the bytes are spread across read() calls.  Commands are queued per priority and sent
+ * one at a time, as the AT command interface requires; the lines up to the final result code
+ * are the response to the command in flight.  Lines matching a registered prefix which no
+ * command is waiting for are unsolicited result codes (URC) and passed to their handler.
+ *
+ * A command that timed out may still be answered later.  So that answer isn't mistaken for
+ * the response to the next command, we wait for its final result code, or for a guard time,
+ * before sending the next one.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/logging.h>
+
+#include "debug.h"
+#include "modem_at.h"
+
+/* must be a power of two */
+#define AT_RX_RING_SIZE		4096
+/* long enough for +CSIM: 514,"<514 hex digits>" */
+#define AT_LINE_MAX		1100
+#define AT_RESP_LINES_MAX	16
+#define AT_QUEUE_MAX		32
+/* how long to wait for the late response to a command that timed out */
+#define AT_STALE_GUARD_MS	500
+
+struct at_cmd {
+	struct llist_head list;
+	/* including the terminating "\r" */
+	char *cmd;
+	char *resp_prefix;
+	unsigned int timeout_ms;
+	at_resp_cb cb;
+	void *data;
+	char *lines[AT_RESP_LINES_MAX];
+	unsigned int num_lines;
+};
+
+struct at_urc {
+	struct llist_head list;
+	char *prefix;
+	at_urc_cb cb;
+	void *data;
+};
+
+struct at_chan {
+	char *name;
+	struct osmo_fd ofd;
+
+	/* received bytes; head and tail run freely and are masked on access */
+	struct {
+		uint8_t buf[AT_RX_RING_SIZE];
+		unsigned int head;
+		unsigned int tail;
+	} rx;
+	/* the line being assembled */
+	char line[AT_LINE_MAX + 1];
+	unsigned int line_len;
+	bool line_overflow;
+
+	struct llist_head queue[_NUM_AT_PRIO];
+	unsigned int num_queued[_NUM_AT_PRIO];
+	/* the command in flight, and how much of it was written */
+	struct at_cmd *cur;
+	size_t tx_done;
+	/* timeout of 'cur', or guard time while 'stale' */
+	struct osmo_timer_list timer;
+	/* the last command timed out; its response may still arrive */
+	bool stale;
+
+	struct llist_head urcs;
+
+	at_close_cb close_cb;
+	void *close_cb_data;
+};
+
+static const struct value_string at_result_names[] = {
+	{ AT_RES_OK,		"OK" },
+	{ AT_RES_ERROR,		"ERROR" },
+	{ AT_RES_TIMEOUT,	"TIMEOUT" },
+	{ AT_RES_ABORTED,	"ABORTED" },
+	{ 0, NULL }
+};
+
+const char *at_result_name(enum at_result res)
+{
+	return get_value_string(at_result_names, res);
+}
+
+static void at_chan_next(struct at_chan *chan);
+
+static void at_cmd_complete(struct at_chan *chan, enum at_result res, const char *final)
+{
+	struct at_cmd *cmd = chan->cur;
+
+	chan->cur = NULL;
+	osmo_timer_del(&chan->timer);
+	if (chan->ofd.fd >= 0)
+		osmo_fd_write_disable(&chan->ofd);
+
+	if (final && cmd->num_lines < AT_RESP_LINES_MAX)
+		cmd->lines[cmd->num_lines++] = talloc_strdup(cmd, final);
+	cmd->cb(chan, res, (const char *const *) cmd->lines, cmd->num_lines, cmd->data);
+	talloc_free(cmd);
+
+	at_chan_next(chan);
+}
+
+static void at_chan_write(struct at_chan *chan)
+{
+	struct at_cmd *cmd = chan->cur;
+	size_t len;
+	ssize_t rc;
+
+	if (!cmd) {
+		osmo_fd_write_disable(&chan->ofd);
+		return;
+	}
+
+	len = strlen(cmd->cmd);
+	while (chan->tx_done < len) {
+		rc = write(chan->ofd.fd, cmd->cmd + chan->tx_done, len - chan->tx_done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				/* continue once the modem has drained its input */
+				osmo_fd_write_enable(&chan->ofd);
+				return;
+			}
+			LOGP(DMAIN, LOGL_ERROR, "%s: failed to write to modem: %s\n", chan->name, strerror(errno));
+			at_cmd_complete(chan, AT_RES_ERROR, NULL);
+			return;
+		}
+		chan->tx_done += rc;
+	}
+	osmo_fd_write_disable(&chan->ofd);
+}
+
+/* send the next queued command, highest priority first, unless one is still in flight */
+static void at_chan_next(struct at_chan *chan)
+{
+	struct at_cmd *cmd = NULL;
+	int prio;
+
+	if (chan->cur || chan->stale || chan->ofd.fd < 0)
+		return;
+
+	for (prio = 0; prio < _NUM_AT_PRIO; prio++) {
+		cmd = llist_first_entry_or_null(&chan->queue[prio], struct at_cmd, list);
+		if (cmd)
+			break;
+	}
+	if (!cmd)
+		return;
+
+	llist_del(&cmd->list);
+	chan->num_queued[prio]--;
+	chan->cur = cmd;
+	chan->tx_done = 0;
+	LOGP(DMAIN, LOGL_DEBUG, "%s: Tx %.*s\n", chan->name, (int) strlen(cmd->cmd) - 1, cmd->cmd);
+	osmo_timer_schedule(&chan->timer, cmd->timeout_ms / 1000, (cmd->timeout_ms % 1000) * 1000);
+	at_chan_write(chan);
+}
+
+static void at_chan_timer_cb(void *data)
+{
+	struct at_chan *chan = data;
+
+	if (chan->stale) {
+		LOGP(DMAIN, LOGL_NOTICE, "%s: no late response, resuming\n", chan->name);
+		chan->stale = false;
+		at_chan_next(chan);
+		return;
+	}
+
+	OSMO_ASSERT(chan->cur);
+	LOGP(DMAIN, LOGL_ERROR, "%s: timeout after %u ms waiting for the response to %.*s\n", chan->name,
+	     chan->cur->timeout_ms, (int) strlen(chan->cur->cmd) - 1, chan->cur->cmd);
+	/* don't let at_cmd_complete() send the next one yet */
+	chan->stale = true;
+	at_cmd_complete(chan, AT_RES_TIMEOUT, NULL);
+	osmo_timer_schedule(&chan->timer, 0, AT_STALE_GUARD_MS * 1000);
+}
+
+static bool is_final_error(const char *line)
+{
+	return !strcmp(line, "ERROR") || !strncmp(line, "+CME ERROR:", 11) ||
+	       !strncmp(line, "+CMS ERROR:", 11);
+}
+
+static bool is_echo(const struct at_cmd *cmd, const char *line)
+{
+	size_t len = strlen(cmd->cmd) - 1;
+
+	return strlen(line) == len && !strncmp(line, cmd->cmd, len);
+}
+
+static struct at_urc *at_urc_find(struct at_chan *chan, const char *line)
+{
+	struct at_urc *urc;
+
+	llist_for_each_entry(urc, &chan->urcs, list) {
+		if (!strncmp(line, urc->prefix, strlen(urc->prefix)))
+			return urc;
+	}
+	return NULL;
+}
+
+static void at_chan_rx_line(struct at_chan *chan, const char *line)
+{
+	struct at_cmd *cmd = chan->cur;
+	bool ok = !strcmp(line, "OK");
+	bool err = !ok && is_final_error(line);
+	struct at_urc *urc;
+
+	LOGP(DMAIN, LOGL_DEBUG, "%s: Rx %s\n", chan->name, line);
+
+	if (chan->stale && (ok || err)) {
+		LOGP(DMAIN, LOGL_NOTICE, "%s: late %s of the command that timed out\n", chan->name, line);
+		chan->stale = false;
+		osmo_timer_del(&chan->timer);
+		at_chan_next(chan);
+		return;
+	}
+
+	if (cmd) {
+		if (ok || err) {
+			at_cmd_complete(chan, ok ? AT_RES_OK : AT_RES_ERROR, err ? line : NULL);
+			return;
+		}
+		if (is_echo(cmd, line))
+			return;
+		if (cmd->resp_prefix && !strncmp(line, cmd->resp_prefix, strlen(cmd->resp_prefix))) {
+			if (cmd->num_lines < AT_RESP_LINES_MAX)
+				cmd->lines[cmd->num_lines++] = talloc_strdup(cmd, line);
+			return;
+		}
+	}
+
+	urc = at_urc_find(chan, line);
+	if (urc) {
+		urc->cb(chan, line, urc->data);
+		return;
+	}
+
+	if (cmd && !cmd->resp_prefix && cmd->num_lines < AT_RESP_LINES_MAX) {
+		cmd->lines[cmd->num_lines++] = talloc_strdup(cmd, line);
+		return;
+	}
+
+	LOGP(DMAIN, LOGL_DEBUG, "%s: ignoring %s line '%s'\n", chan->name,
+	     chan->stale ? "late" : "unsolicited", line);
+}
+
+/* split everything in the ring buffer into lines; a partial line is kept for the next read */
+static void at_chan_parse(struct at_chan *chan)
+{
+	char c;
+
+	while (chan->rx.tail != chan->rx.head) {
+		c = chan->rx.buf[chan->rx.tail++ & (AT_RX_RING_SIZE - 1)];
+		if (c == '\r' || c == '\n') {
+			if (chan->line_overflow)
+				LOGP(DMAIN, LOGL_ERROR, "%s: discarding line longer than %u\n", chan->name,
+				     AT_LINE_MAX);
+			else if (chan->line_len) {
+				chan->line[chan->line_len] = '\0';
+				at_chan_rx_line(chan, chan->line);
+			}
+			chan->line_len = 0;
+			chan->line_overflow = false;
+			continue;
+		}
+		if (chan->line_len >= AT_LINE_MAX) {
+			chan->line_overflow = true;
+			continue;
+		}
+		chan->line[chan->line_len++] = c;
+	}
+}
+
+static void at_chan_close(struct at_chan *chan)
+{
+	struct at_cmd *cmd;
+	int prio;
+
+	if (chan->ofd.fd >= 0) {
+		osmo_fd_unregister(&chan->ofd);
+		close(chan->ofd.fd);
+		chan->ofd.fd = -1;
+	}
+	osmo_timer_del(&chan->timer);
+	chan->stale = false;
+
+	if (chan->cur)
+		at_cmd_complete(chan, AT_RES_ABORTED, NULL);
+	for (prio = 0; prio < _NUM_AT_PRIO; prio++) {
+		while ((cmd = llist_first_entry_or_null(&chan->queue[prio], struct at_cmd, list))) {
+			llist_del(&cmd->list);
+			chan->num_queued[prio]--;
+			cmd->cb(chan, AT_RES_ABORTED, NULL, 0, cmd->data);
+			talloc_free(cmd);
+		}
+	}
+}
+
+static int at_chan_read(struct at_chan *chan)
+{
+	unsigned int off, space;
+	ssize_t rc;
+
+	do {
+		/* contiguous free space; at_chan_parse() leaves the ring empty */
+		off = chan->rx.head & (AT_RX_RING_SIZE - 1);
+		space = AT_RX_RING_SIZE - (chan->rx.head - chan->rx.tail);
+		if (space > AT_RX_RING_SIZE - off)
+			space = AT_RX_RING_SIZE - off;
+
+		rc = read(chan->ofd.fd, &chan->rx.buf[off], space);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			LOGP(DMAIN, LOGL_ERROR, "%s: failed to read from modem: %s\n", chan->name,
+			     strerror(errno));
+			return -errno;
+		}
+		if (rc == 0) {
+			LOGP(DMAIN, LOGL_NOTICE, "%s: modem device closed\n", chan->name);
+			return -EIO;
+		}
+		chan->rx.head += rc;
+		at_chan_parse(chan);
+	} while (rc == space);
+
+	return 0;
+}
+
+static int at_chan_fd_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct at_chan *chan = ofd->data;
+
+	if (what & OSMO_FD_READ) {
+		if (at_chan_read(chan) < 0) {
+			/* e.g. the USB modem went away; fail whatever is pending */
+			at_chan_close(chan);
+			/* may free chan */
+			if (chan->close_cb)
+				chan->close_cb(chan, chan->close_cb_data);
+			return 0;
+		}
+	}
+	if ((what & OSMO_FD_WRITE) && chan->ofd.fd >= 0)
+		at_chan_write(chan);
+
+	return 0;
+}
+
+struct at_chan *at_chan_alloc(void *ctx, int fd, const char *name)
+{
+	struct at_chan *chan = talloc_zero(ctx, struct at_chan);
+	int prio;
+
+	if (!chan)
+		return NULL;
+
+	chan->name = talloc_strdup(chan, name);
+	for (prio = 0; prio < _NUM_AT_PRIO; prio++)
+		INIT_LLIST_HEAD(&chan->queue[prio]);
+	INIT_LLIST_HEAD(&chan->urcs);
+	osmo_timer_setup(&chan->timer, at_chan_timer_cb, chan);
+
+	osmo_fd_setup(&chan->ofd, fd, OSMO_FD_READ, at_chan_fd_cb, chan, 0);
+	if (osmo_fd_register(&chan->ofd) < 0) {
+		LOGP(DMAIN, LOGL_ERROR, "%s: failed to register modem fd\n", name);
+		talloc_free(chan);
+		return NULL;
+	}
+
+	return chan;
+}
+
+void at_chan_free(struct at_chan *chan)
+{
+	at_chan_close(chan);
+	talloc_free(chan);
+}
+
+int at_chan_register_urc(struct at_chan *chan, const char *prefix, at_urc_cb cb, void *data)
+{
+	struct at_urc *urc = talloc_zero(chan, struct at_urc);
+
+	if (!urc)
+		return -ENOMEM;
+	urc->prefix = talloc_strdup(urc, prefix);
+	urc->cb = cb;
+	urc->data = data;
+	llist_add_tail(&urc->list, &chan->urcs);
+
+	return 0;
+}
+
+void at_chan_set_close_cb(struct at_chan *chan, at_close_cb cb, void *data)
+{
+	chan->close_cb = cb;
+	chan->close_cb_data = data;
+}
+
+int at_chan_submit(struct at_chan *chan, enum at_prio prio, const char *cmd, const char *resp_prefix,
+		   unsigned int timeout_ms, at_resp_cb cb, void *data)
+{
+	struct at_cmd *c;
+
+	OSMO_ASSERT(prio < _NUM_AT_PRIO);
+	OSMO_ASSERT(cb);
+
+	if (chan->ofd.fd < 0)
+		return -ENOTCONN;
+	if (chan->num_queued[prio] >= AT_QUEUE_MAX) {
+		LOGP(DMAIN, LOGL_ERROR, "%s: too many commands queued, dropping %s\n", chan->name, cmd);
+		return -ENOBUFS;
+	}
+
+	c = talloc_zero(chan, struct at_cmd);
+	if (!c)
+		return -ENOMEM;
+	c->cmd = talloc_asprintf(c, "%s\r", cmd);
+	if (resp_prefix)
+		c->resp_prefix = talloc_strdup(c, resp_prefix);
+	c->timeout_ms = timeout_ms;
+	c->cb = cb;
+	c->data = data;
+
+	llist_add_tail(&c->list, &chan->queue[prio]);
+	chan->num_queued[prio]++;
+	at_chan_next(chan);
+
+	return 0;
+}
+
+unsigned int at_chan_queued(const struct at_chan *chan, enum at_prio prio)
+{
+	return chan->num_queued[prio];
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+struct at_chan;
+
+/* commands of a higher priority (lower value) are sent first */
+enum at_prio {
+	AT_PRIO_APDU,		/* AT+CSIM; a modem is waiting for the response */
+	AT_PRIO_HOUSEKEEPING,	/* polling of signal strength and the like */
+	_NUM_AT_PRIO
+};
+
+enum at_result {
+	AT_RES_OK,
+	AT_RES_ERROR,		/* ERROR, +CME ERROR: or +CMS ERROR: */
+	AT_RES_TIMEOUT,
+	AT_RES_ABORTED,		/* the channel was closed */
+};
+
+/* the information response of a command (e.g. "+CSQ: 20,99"), followed by the final result
+ * code if it was an error */
+typedef void (*at_resp_cb)(struct at_chan *chan, enum at_result res, const char *const *lines,
+			   unsigned int num_lines, void *data);
+/* an unsolicited result code matching a registered prefix */
+typedef void (*at_urc_cb)(struct at_chan *chan, const char *line, void *data);
+/* the modem went away (EOF or read error); pending commands have been aborted already, and
+ * the channel may be freed from within the call-back */
+typedef void (*at_close_cb)(struct at_chan *chan, void *data);
+
+/* serve an AT command interface on an open, non-blocking file descriptor, which is closed
+ * along with the channel (or when the modem goes away); on failure, fd is left open */
+struct at_chan *at_chan_alloc(void *ctx, int fd, const char *name);
+void at_chan_free(struct at_chan *chan);
+
+int at_chan_register_urc(struct at_chan *chan, const char *prefix, at_urc_cb cb, void *data);
+void at_chan_set_close_cb(struct at_chan *chan, at_close_cb cb, void *data);
+
+/*! Queue a command ("AT..." without line termination).  'resp_prefix' (e.g. "+CSIM:")
+ *  selects the lines that are the information response; if NULL, all lines received while
+ *  the command is pending are.  The callback is called exactly once, unless the command
+ *  couldn't be queued at all. */
+int at_chan_submit(struct at_chan *chan, enum at_prio prio, const char *cmd, const char *resp_prefix,
+		   unsigned int timeout_ms, at_resp_cb cb, void *data);
+unsigned int at_chan_queued(const struct at_chan *chan, enum at_prio prio);
+
+const char *at_result_name(enum at_result res);
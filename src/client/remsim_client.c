@@ -30,6 +30,7 @@
 #include <osmocom/core/logging.h>
 
 #include "rspro_util.h"
+#include "asn1c_helpers.h"
 #include "client.h"
 #include "debug.h"
 
@@ -94,14 +95,88 @@ static int bankd_handle_rx(struct rspro_server_conn *bankdc, const RsproPDU_t *p
 	return 0;
 }
 
+/* send the ConnectClientReq of a client sharing the server connection of another one */
+static void shared_slot_connect(struct bankd_client *bc)
+{
+	struct rspro_server_conn *srvc = &bc->shared_srvc.owner->srv_conn;
+
+	bc->shared_srvc.pending = true;
+	server_conn_send_rspro(srvc, rspro_gen_ConnectClientReq(&bc->srv_conn.own_comp_id, bc->srv_conn.clslot));
+}
+
+/* the server connection of 'bc' was (re-)established: connect all clients sharing it */
+static void shared_slots_connect(struct bankd_client *bc)
+{
+	struct bankd_client *slot;
+
+	if (llist_empty(&bc->shared_srvc.list))
+		return;
+	if (bc->srv_conn.peer_version < RSPRO_VERSION_MULTISLOT) {
+		LOGPFSML(bc->srv_conn.fi, LOGL_ERROR, "Server doesn't support multiple client slots on one "
+			 "connection; only %lu:%lu will be served\n", bc->srv_conn.clslot->clientId,
+			 bc->srv_conn.clslot->slotNr);
+		return;
+	}
+
+	llist_for_each_entry(slot, &bc->shared_srvc.list, shared_srvc.entry) {
+		slot->shared_srvc.pending = false;
+		if (slot->shared_srvc.enabled)
+			shared_slot_connect(slot);
+	}
+}
+
+/* ConnectClientRes on an established connection: the server answers the ConnectClientReq of the
+ * slots sharing it in the order we sent them */
+static int shared_slot_connect_res(struct bankd_client *bc, const RsproPDU_t *pdu)
+{
+	struct bankd_client *slot;
+	e_ResultCode res = rspro_get_result(pdu);
+
+	llist_for_each_entry(slot, &bc->shared_srvc.list, shared_srvc.entry) {
+		if (!slot->shared_srvc.pending)
+			continue;
+		slot->shared_srvc.pending = false;
+		if (res != ResultCode_ok) {
+			LOGPFSML(slot->main_fi, LOGL_ERROR, "Rx RSPRO connectClientRes(result=%s) for %lu:%lu\n",
+				 asn_enum_name(&asn_DEF_ResultCode, res), slot->srv_conn.clslot->clientId,
+				 slot->srv_conn.clslot->slotNr);
+			return -1;
+		}
+		return osmo_fsm_inst_dispatch(slot->main_fi, MF_E_SRVC_CONNECTED, NULL);
+	}
+
+	LOGPFSML(bc->srv_conn.fi, LOGL_ERROR, "Rx RSPRO connectClientRes, but no slot is connecting\n");
+	return -1;
+}
+
+/* the client (slot) a PDU from the server is for */
+static struct bankd_client *shared_slot_by_clslot(struct bankd_client *bc, const ClientSlot_t *clslot)
+{
+	struct bankd_client *slot;
+
+	if (!clslot)
+		return bc;
+	if (clslot->clientId == bc->srv_conn.clslot->clientId && clslot->slotNr == bc->srv_conn.clslot->slotNr)
+		return bc;
+	llist_for_each_entry(slot, &bc->shared_srvc.list, shared_srvc.entry) {
+		if (clslot->clientId == slot->srv_conn.clslot->clientId &&
+		    clslot->slotNr == slot->srv_conn.clslot->slotNr)
+			return slot;
+	}
+	return NULL;
+}
+
 /* handle incoming messages from server */
 static int srvc_handle_rx(struct rspro_server_conn *srvc, const RsproPDU_t *pdu)
 {
 	struct bankd_client *bc = srvc2bankd_client(srvc);
+	struct bankd_client *slot;
 	RsproPDU_t  *resp;
 
 	switch (pdu->msg.present) {
 	case RsproPDUchoice_PR_connectClientRes:
+		if (server_conn_is_connected(srvc))
+			return shared_slot_connect_res(bc, pdu);
 		if (pdu->msg.choice.connectClientRes.identity.type != ComponentType_remsimServer) {
 			LOGPFSML(srvc->fi, LOGL_ERROR, "Server connection to a ComponentType(%ld) != RemsimServer? "
 				 "Check your IP/Port configuration\n",
@@ -112,6 +187,8 @@ static int srvc_handle_rx(struct rspro_server_conn *srvc, const RsproPDU_t *pdu)
 		/* Store 'identity' of server in srvc->peer_comp_id */
 		rspro_comp_id_retrieve(&srvc->peer_comp_id, &pdu->msg.choice.connectClientRes.identity);
 		osmo_fsm_inst_dispatch(srvc->fi, SRVC_E_CLIENT_CONN_RES, (void *) pdu);
+		if (server_conn_is_connected(srvc))
+			shared_slots_connect(bc);
 		break;
 	case RsproPDUchoice_PR_configClientIdReq:
 		/* store/set the clientID as instructed by the server */
@@ -126,7 +203,12 @@ static int srvc_handle_rx(struct rspro_server_conn *srvc, const RsproPDU_t *pdu)
 		server_conn_send_rspro(srvc, resp);
 		break;
 	case RsproPDUchoice_PR_configClientBankReq:
-		osmo_fsm_inst_dispatch(bc->main_fi, MF_E_SRVC_CONFIG_BANK, (void *) pdu);
+		slot = shared_slot_by_clslot(bc, pdu->msg.choice.configClientBankReq.clientSlot);
+		if (!slot) {
+			LOGPFSML(srvc->fi, LOGL_ERROR, "Rx RSPRO configClientBankReq for unknown client slot\n");
+			return -1;
+		}
+		osmo_fsm_inst_dispatch(slot->main_fi, MF_E_SRVC_CONFIG_BANK, (void *) pdu);
 		break;
 	default:
 		LOGPFSML(srvc->fi, LOGL_ERROR, "Unknown/Unsupported RSPRO PDU type: %s\n",
@@ -137,17 +219,21 @@ static int srvc_handle_rx(struct rspro_server_conn *srvc, const RsproPDU_t *pdu)
 	return 0;
 }
 
-struct bankd_client *remsim_client_create(void *ctx, const char *name, const char *software,
-					  struct client_config *cfg)
+/* everything but the server connection */
+static struct bankd_client *client_alloc(void *ctx, const char *name, const char *software,
+					 struct client_config *cfg)
 {
 	struct bankd_client *bc = talloc_zero(ctx, struct bankd_client);
-	struct rspro_server_conn *srvc, *bankdc;
+	struct rspro_server_conn *bankdc;
 	int rc;
 
 	if (!bc)
 		return NULL;
 
 	bc->cfg = cfg;
+	bc->event_coproc.fd = -1;
+	INIT_LLIST_HEAD(&bc->shared_srvc.list);
+	INIT_LLIST_HEAD(&bc->shared_srvc.entry);
 
 	bc->main_fi = main_fsm_alloc(bc, bc);
 	if (!bc->main_fi) {
@@ -157,15 +243,51 @@ struct bankd_client *remsim_client_create(void *ctx, const char *name, const cha
 
 	remsim_client_set_clslot(bc, cfg->client_id, cfg->client_slot);
 
+	if (cfg->stats_socket || cfg->apdu_trace_len) {
+		bc->apdu_trace = apdu_trace_alloc(bc, cfg->apdu_trace_len);
+		if (!bc->apdu_trace) {
+			LOGP(DMAIN, LOGL_FATAL, "Unable to allocate APDU trace\n");
+			exit(1);
+		}
+	}
+
+	bc->srv_conn.own_comp_id.type = ComponentType_remsimClient;
+	OSMO_STRLCPY_ARRAY(bc->srv_conn.own_comp_id.name, name);
+	OSMO_STRLCPY_ARRAY(bc->srv_conn.own_comp_id.software, software);
+	OSMO_STRLCPY_ARRAY(bc->srv_conn.own_comp_id.sw_version, PACKAGE_VERSION);
+
+	bankdc = &bc->bankd_conn;
+	/* server_host / server_port are configured from remsim-server */
+	bankdc->handle_rx = bankd_handle_rx;
+	memcpy(&bankdc->own_comp_id, &bc->srv_conn.own_comp_id, sizeof(bankdc->own_comp_id));
+	rc = server_conn_fsm_alloc(bc, bankdc);
+	if (rc < 0) {
+		LOGP(DMAIN, LOGL_FATAL, "Unable to connect bankd conn FSM: %s\n", strerror(errno));
+		exit(1);
+	}
+	osmo_fsm_inst_update_id(bankdc->fi, "bankd");
+	osmo_fsm_inst_change_parent(bankdc->fi, bc->main_fi, MF_E_BANKD_LOST);
+	bankdc->parent_conn_evt = MF_E_BANKD_CONNECTED;
+	bankdc->parent_disc_evt = MF_E_BANKD_LOST;
+
+	return bc;
+}
+
+struct bankd_client *remsim_client_create(void *ctx, const char *name, const char *software,
+					  struct client_config *cfg)
+{
+	struct bankd_client *bc = client_alloc(ctx, name, software, cfg);
+	struct rspro_server_conn *srvc;
+	int rc;
+
+	if (!bc)
+		return NULL;
+
 	/* create and [attempt to] establish connection to remsim-server */
 	srvc = &bc->srv_conn;
 	srvc->server_host = cfg->server_host;
 	srvc->server_port = cfg->server_port;
 	srvc->handle_rx = srvc_handle_rx;
-	srvc->own_comp_id.type = ComponentType_remsimClient;
-	OSMO_STRLCPY_ARRAY(srvc->own_comp_id.name, name);
-	OSMO_STRLCPY_ARRAY(srvc->own_comp_id.software, software);
-	OSMO_STRLCPY_ARRAY(srvc->own_comp_id.sw_version, PACKAGE_VERSION);
 
 	rc = server_conn_fsm_alloc(bc, srvc);
 	if (rc < 0) {
@@ -176,23 +298,59 @@ struct bankd_client *remsim_client_create(void *ctx, const char *name, const cha
 	srvc->parent_conn_evt = MF_E_SRVC_CONNECTED;
 	srvc->parent_disc_evt = MF_E_SRVC_LOST;
 
-	bankdc = &bc->bankd_conn;
-	/* server_host / server_port are configured from remsim-server */
-	bankdc->handle_rx = bankd_handle_rx;
-	memcpy(&bankdc->own_comp_id, &srvc->own_comp_id, sizeof(bankdc->own_comp_id));
-	rc = server_conn_fsm_alloc(bc, bankdc);
-	if (rc < 0) {
-		LOGP(DMAIN, LOGL_FATAL, "Unable to connect bankd conn FSM: %s\n", strerror(errno));
-		exit(1);
+	return bc;
+}
+
+/*! Create a client for a further slot, sharing the server connection of another client in the
+ *  same process.  Its bankd connection is its own.
+ *  \param[in] owner client created by remsim_client_create(), owning the server connection
+ *  \param[in] cfg configuration of the new client; client_id and client_slot must be set
+ *  \returns the new client, to be connected by remsim_client_establish() */
+struct bankd_client *remsim_client_create_slot(struct bankd_client *owner, const char *name,
+					       const char *software, struct client_config *cfg)
+{
+	struct bankd_client *bc;
+
+	OSMO_ASSERT(!owner->shared_srvc.owner);
+	if (cfg->client_id < 0 || cfg->client_slot < 0) {
+		LOGP(DMAIN, LOGL_ERROR, "A client sharing a server connection needs a client ID and slot\n");
+		return NULL;
 	}
-	osmo_fsm_inst_update_id(bankdc->fi, "bankd");
-	osmo_fsm_inst_change_parent(bankdc->fi, bc->main_fi, MF_E_BANKD_LOST);
-	bankdc->parent_conn_evt = MF_E_BANKD_CONNECTED;
-	bankdc->parent_disc_evt = MF_E_BANKD_LOST;
+
+	bc = client_alloc(owner, name, software, cfg);
+	if (!bc)
+		return NULL;
+	bc->shared_srvc.owner = owner;
+	llist_add_tail(&bc->shared_srvc.entry, &owner->shared_srvc.list);
 
 	return bc;
 }
 
+/*! Start connecting a client to the server; via the server connection it shares, if any */
+void remsim_client_establish(struct bankd_client *bc)
+{
+	struct bankd_client *owner = bc->shared_srvc.owner;
+
+	if (!owner) {
+		osmo_fsm_inst_dispatch(bc->srv_conn.fi, SRVC_E_ESTABLISH, NULL);
+		return;
+	}
+
+	bc->shared_srvc.enabled = true;
+	/* otherwise we're connected once the owner is */
+	if (server_conn_is_connected(&owner->srv_conn) && !bc->shared_srvc.pending &&
+	    owner->srv_conn.peer_version >= RSPRO_VERSION_MULTISLOT)
+		shared_slot_connect(bc);
+}
+
+/*! The server connection a client uses: its own, or the one it shares */
+struct rspro_server_conn *remsim_client_srvc(struct bankd_client *bc)
+{
+	if (bc->shared_srvc.owner)
+		return &bc->shared_srvc.owner->srv_conn;
+	return &bc->srv_conn;
+}
+
 void remsim_client_set_clslot(struct bankd_client *bc, int client_id, int slot_nr)
 {
 	if (!bc->srv_conn.clslot) {
@@ -35,6 +35,9 @@ static void printf_help()
 		"  -a --atr HEXSTRING         default ATR to simulate (until bankd overrides it)\n"
 		"  -r --atr-ignore-rspro      Ignore any ATR from bankd; use only ATR given by -a)\n"
 		"  -e --event-script <path>   event script to be called by client\n"
+		"  -E --event-coprocess CMD   long-lived helper to receive events as JSON lines on stdin\n"
+		"  -t --stats-socket PATH     export per-stage APDU latencies on a local socket\n"
+		"  -T --apdu-trace NR         keep the NR most recent APDUs for the stats socket\n"
 		"  -L --disable-color         Disable colors for logging to stderr\n"
 #ifdef SIMTRACE_SUPPORT
 		"  -Z --set-sim-presence <0-1> Define the presence pin behaviour (only supported on some boards)\n"
@@ -68,6 +71,9 @@ static void handle_options(struct client_config *cfg, int argc, char **argv)
 			{ "atr", 1, 0, 'a' },
 			{ "atr-ignore-rspro", 0, 0, 'r' },
 			{ "event-script", 1, 0, 'e' },
+			{ "event-coprocess", 1, 0, 'E' },
+			{ "stats-socket", 1, 0, 't' },
+			{ "apdu-trace", 1, 0, 'T' },
 			{" disable-color", 0, 0, 'L' },
 #ifdef USB_SUPPORT
 			{ "usb-vendor", 1, 0, 'V' },
@@ -81,7 +87,7 @@ static void handle_options(struct client_config *cfg, int argc, char **argv)
 			{ 0, 0, 0, 0 }
 		};
 
-		c = getopt_long(argc, argv, "hvd:i:p:c:n:a:re:L"
+		c = getopt_long(argc, argv, "hvd:i:p:c:n:a:re:E:t:T:L"
 #ifdef SIMTRACE_SUPPORT
 						"Z:"
 #endif
@@ -131,6 +137,15 @@ static void handle_options(struct client_config *cfg, int argc, char **argv)
 		case 'e':
 			osmo_talloc_replace_string(cfg, &cfg->event_script, optarg);
 			break;
+		case 'E':
+			osmo_talloc_replace_string(cfg, &cfg->event_coproc, optarg);
+			break;
+		case 't':
+			osmo_talloc_replace_string(cfg, &cfg->stats_socket, optarg);
+			break;
+		case 'T':
+			cfg->apdu_trace_len = atoi(optarg);
+			break;
 		case 'L':
 			log_set_use_color(osmo_stderr_target, 0);
 			break;
@@ -315,9 +330,14 @@ int main(int argc, char **argv)
 
 	g_client = remsim_client_create(g_tall_ctx, hostname, "remsim-client",cfg);
 
-	osmo_fsm_inst_dispatch(g_client->srv_conn.fi, SRVC_E_ESTABLISH, NULL);
+	remsim_client_establish(g_client);
+
+	if (cfg->stats_socket && apdu_trace_socket_open(g_tall_ctx, cfg->stats_socket) < 0)
+		exit(1);
 
 	signal(SIGUSR1, handle_sig_usr1);
+	/* an event co-process may go away at any time; we notice by EPIPE */
+	signal(SIGPIPE, SIG_IGN);
 
 	/* Silently (and portably) reap children. */
 	if (avoid_zombies() < 0) {
@@ -0,0 +1,750 @@
+/* Synthetic load generator for remsim-bankd
+ *
+ * Runs any number of virtual remsim-clients in one process and event loop.  Each of them
+ * registers with the remsim-server like a real client does, waits to be configured with its
+ * bankd slot, and then keeps issuing operations against the card, each followed by a think
+ * time, as a modem would.  An operation is a short sequence of APDUs:
+ *
+ *   read     SELECT MF, SELECT EF.ICCID, READ BINARY
+ *   auth     SELECT DF.GSM, RUN GSM ALGORITHM with a random RAND, GET RESPONSE
+ *   status   STATUS, as a modem polls the card
+ *
+ * The mix of operations is configurable by weight.  Every client has at most one APDU in
+ * flight; we measure the time until its response, and count responses with an error status
+ * word, responses which took longer than the timeout, and APDUs lost due to a broken
+ * connection.  Slotmaps for the clients have to be created via the REST interface of the
+ * server beforehand.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/fsm.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/application.h>
+
+#include "client.h"
+
+static void *g_tall_ctx;
+void __thread *talloc_asn1_ctx;
+int asn_debug;
+
+/***********************************************************************
+ * operations
+ ***********************************************************************/
+
+#define LG_MAX_APDUS	3
+
+struct lg_op {
+	const char *name;
+	/* C-APDUs as hex strings */
+	const char *apdus[LG_MAX_APDUS];
+	/* relative weight within the mix */
+	unsigned int weight;
+};
+
+static struct lg_op g_ops[] = {
+	{ "read", { "00a40004023f00", "00a40004022fe2", "00b000000a" }, 60 },
+	{ "auth", { "a0a40000027f20",
+		    "a088000010" "00000000000000000000000000000000",
+		    "a0c000000c" }, 10 },
+	{ "status", { "a0f2000016" }, 30 },
+};
+
+/* parsed form of g_ops[].apdus */
+static struct {
+	uint8_t buf[LG_MAX_APDUS][64];
+	size_t len[LG_MAX_APDUS];
+	unsigned int num;
+} g_op_apdus[ARRAY_SIZE(g_ops)];
+
+static unsigned int g_weight_sum;
+
+static int parse_ops(void)
+{
+	unsigned int i, j;
+	int rc;
+
+	g_weight_sum = 0;
+	for (i = 0; i < ARRAY_SIZE(g_ops); i++) {
+		for (j = 0; j < LG_MAX_APDUS && g_ops[i].apdus[j]; j++) {
+			rc = osmo_hexparse(g_ops[i].apdus[j], g_op_apdus[i].buf[j],
+					   sizeof(g_op_apdus[i].buf[j]));
+			OSMO_ASSERT(rc >= 4);
+			g_op_apdus[i].len[j] = rc;
+		}
+		g_op_apdus[i].num = j;
+		g_weight_sum += g_ops[i].weight;
+	}
+	return g_weight_sum ? 0 : -EINVAL;
+}
+
+/* parse a mix like "read=60,auth=10,status=30"; operations not given get weight 0 */
+static int parse_mix(const char *str)
+{
+	char *dup, *tok, *save = NULL, *eq;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(g_ops); i++)
+		g_ops[i].weight = 0;
+
+	dup = talloc_strdup(g_tall_ctx, str);
+	for (tok = strtok_r(dup, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if (!eq)
+			goto err;
+		*eq = '\0';
+		for (i = 0; i < ARRAY_SIZE(g_ops); i++) {
+			if (!strcmp(g_ops[i].name, tok))
+				break;
+		}
+		if (i == ARRAY_SIZE(g_ops) || atoi(eq + 1) < 0)
+			goto err;
+		g_ops[i].weight = atoi(eq + 1);
+	}
+	talloc_free(dup);
+	return 0;
+err:
+	talloc_free(dup);
+	return -EINVAL;
+}
+
+static unsigned int pick_op(void)
+{
+	unsigned int r = random() % g_weight_sum;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(g_ops); i++) {
+		if (r < g_ops[i].weight)
+			break;
+		r -= g_ops[i].weight;
+	}
+	return i;
+}
+
+/***********************************************************************
+ * virtual clients
+ ***********************************************************************/
+
+enum vclient_state {
+	VC_S_IDLE,		/* no card; not operational */
+	VC_S_THINK,		/* waiting before the next operation */
+	VC_S_WAIT_RAPDU,	/* waiting for the response to an APDU */
+	VC_S_STALLED,		/* the response timed out; waiting for it to arrive anyway */
+};
+
+struct vclient {
+	struct bankd_client *bc;
+	enum vclient_state state;
+	/* think time or response timeout, depending on the state */
+	struct osmo_timer_list timer;
+
+	/* current operation and the index of the APDU in flight */
+	unsigned int op;
+	unsigned int apdu;
+	struct timespec tx_time;
+
+	/* latencies of all APDUs after the warm-up, in microseconds */
+	uint32_t *samples;
+	size_t num_samples, samples_alloc;
+
+	unsigned long ops;
+	unsigned long apdus;
+	unsigned long sw_errors;
+	unsigned long timeouts;
+	unsigned long lost;
+	/* number of times we became operational */
+	unsigned long connects;
+};
+
+static struct {
+	const char *server_host;
+	int server_port;
+	int first_client_id;
+	int client_slot;
+	unsigned int num_clients;
+	unsigned int ramp_rate;
+	unsigned int think_ms;
+	unsigned int timeout_ms;
+	unsigned int duration;
+	unsigned int warmup;
+	unsigned int report_interval;
+	unsigned int seed;
+	bool per_client;
+	bool shared_srvc;
+} g_cfg = {
+	.server_host = "127.0.0.1",
+	.server_port = 9998,
+	.num_clients = 1,
+	.ramp_rate = 50,
+	.think_ms = 100,
+	.timeout_ms = 5000,
+	.report_interval = 1,
+};
+
+static struct vclient *g_vclients;
+static unsigned int g_num_started;
+static unsigned int g_num_operational;
+static struct timespec g_start_time;
+static bool g_measuring;
+static volatile sig_atomic_t g_stop;
+
+/* latencies within the current report interval, over all clients */
+static uint32_t *g_ival_samples;
+static size_t g_ival_num, g_ival_alloc;
+static unsigned long g_ival_errors;
+
+static int64_t ts_diff_us(const struct timespec *later, const struct timespec *earlier)
+{
+	return (later->tv_sec - earlier->tv_sec) * 1000000 + (later->tv_nsec - earlier->tv_nsec) / 1000;
+}
+
+static double elapsed_s(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ts_diff_us(&now, &g_start_time) / 1e6;
+}
+
+static void add_sample(uint32_t **samples, size_t *num, size_t *alloc, uint32_t us)
+{
+	if (*num == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 1024;
+		*samples = talloc_realloc(g_tall_ctx, *samples, uint32_t, *alloc);
+		OSMO_ASSERT(*samples);
+	}
+	(*samples)[(*num)++] = us;
+}
+
+static void vclient_record(struct vclient *vc, uint32_t us)
+{
+	if (!g_measuring)
+		return;
+	add_sample(&vc->samples, &vc->num_samples, &vc->samples_alloc, us);
+	add_sample(&g_ival_samples, &g_ival_num, &g_ival_alloc, us);
+}
+
+static void vclient_think(struct vclient *vc, unsigned int max_ms)
+{
+	/* uniformly distributed, so the mean is half the maximum */
+	unsigned int ms = max_ms ? random() % (max_ms + 1) : 0;
+
+	vc->state = VC_S_THINK;
+	osmo_timer_schedule(&vc->timer, ms / 1000, (ms % 1000) * 1000);
+}
+
+static void vclient_send_apdu(struct vclient *vc)
+{
+	struct frontend_tpdu ftpdu;
+	uint8_t buf[64];
+	unsigned int i;
+
+	ftpdu.len = g_op_apdus[vc->op].len[vc->apdu];
+	memcpy(buf, g_op_apdus[vc->op].buf[vc->apdu], ftpdu.len);
+	/* a fresh RAND for every authentication */
+	if (buf[1] == 0x88) {
+		for (i = 5; i < ftpdu.len; i++)
+			buf[i] = random();
+	}
+	ftpdu.buf = buf;
+
+	vc->state = VC_S_WAIT_RAPDU;
+	osmo_timer_schedule(&vc->timer, g_cfg.timeout_ms / 1000, (g_cfg.timeout_ms % 1000) * 1000);
+	clock_gettime(CLOCK_MONOTONIC, &vc->tx_time);
+	osmo_fsm_inst_dispatch(vc->bc->main_fi, MF_E_MDM_TPDU, &ftpdu);
+}
+
+static void vclient_timer_cb(void *data)
+{
+	struct vclient *vc = data;
+
+	switch (vc->state) {
+	case VC_S_THINK:
+		vc->op = pick_op();
+		vc->apdu = 0;
+		vclient_send_apdu(vc);
+		break;
+	case VC_S_WAIT_RAPDU:
+		LOGPFSML(vc->bc->main_fi, LOGL_ERROR, "No response to APDU within %u ms\n", g_cfg.timeout_ms);
+		vc->timeouts++;
+		g_ival_errors++;
+		/* we must not send another APDU before the card responded to this one */
+		vc->state = VC_S_STALLED;
+		break;
+	default:
+		break;
+	}
+}
+
+static bool sw_ok(const uint8_t *data, size_t len)
+{
+	if (len < 2)
+		return false;
+	switch (data[len - 2]) {
+	case 0x90:
+	case 0x91:
+	case 0x61:
+	case 0x9f:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/***********************************************************************
+ * frontend interface to remsim-client
+ ***********************************************************************/
+
+/* the main FSM requests a card insertion as it becomes operational */
+int frontend_request_card_insert(struct bankd_client *bc)
+{
+	struct vclient *vc = bc->data;
+
+	if (vc->state != VC_S_IDLE)
+		return 0;
+	vc->connects++;
+	g_num_operational++;
+	/* spread the first operations of all clients over one think time */
+	vclient_think(vc, g_cfg.think_ms * 2);
+	return 0;
+}
+
+int frontend_request_card_remove(struct bankd_client *bc)
+{
+	struct vclient *vc = bc->data;
+
+	if (vc->state == VC_S_IDLE)
+		return 0;
+	if (vc->state == VC_S_WAIT_RAPDU) {
+		vc->lost++;
+		g_ival_errors++;
+	}
+	osmo_timer_del(&vc->timer);
+	vc->state = VC_S_IDLE;
+	g_num_operational--;
+	return 0;
+}
+
+int frontend_request_sim_remote(struct bankd_client *bc)
+{
+	return 0;
+}
+
+int frontend_request_sim_local(struct bankd_client *bc)
+{
+	return 0;
+}
+
+int frontend_request_modem_reset(struct bankd_client *bc)
+{
+	return 0;
+}
+
+int frontend_handle_card2modem(struct bankd_client *bc, const uint8_t *data, size_t len)
+{
+	struct vclient *vc = bc->data;
+	struct timespec now;
+
+	switch (vc->state) {
+	case VC_S_WAIT_RAPDU:
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		osmo_timer_del(&vc->timer);
+		vclient_record(vc, ts_diff_us(&now, &vc->tx_time));
+		vc->apdus++;
+		break;
+	case VC_S_STALLED:
+		/* late response; already accounted for as a timeout */
+		break;
+	default:
+		LOGPFSML(bc->main_fi, LOGL_ERROR, "Unexpected R-APDU %s\n", osmo_hexdump_nospc(data, len));
+		return 0;
+	}
+
+	if (!sw_ok(data, len)) {
+		if (vc->state == VC_S_WAIT_RAPDU) {
+			vc->sw_errors++;
+			g_ival_errors++;
+		}
+		/* abandon the rest of the operation */
+		vc->apdu = g_op_apdus[vc->op].num;
+	} else
+		vc->apdu++;
+
+	if (vc->apdu < g_op_apdus[vc->op].num) {
+		vclient_send_apdu(vc);
+		return 0;
+	}
+	vc->ops++;
+	vclient_think(vc, g_cfg.think_ms * 2);
+	return 0;
+}
+
+int frontend_handle_set_atr(struct bankd_client *bc, const uint8_t *data, size_t len)
+{
+	return 0;
+}
+
+int frontend_handle_slot_status(struct bankd_client *bc, const SlotPhysStatus_t *sts)
+{
+	return 0;
+}
+
+int frontend_append_script_env(struct bankd_client *bc, char **env, int idx, size_t max_env)
+{
+	return idx;
+}
+
+/***********************************************************************
+ * reporting
+ ***********************************************************************/
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of sorted samples, in milliseconds */
+static double percentile_ms(const uint32_t *sorted, size_t num, double p)
+{
+	size_t rank;
+
+	if (!num)
+		return 0;
+	rank = p * num;
+	if (rank >= num)
+		rank = num - 1;
+	return sorted[rank] / 1000.0;
+}
+
+static void report_interval(void *data)
+{
+	struct osmo_timer_list *timer = data;
+
+	qsort(g_ival_samples, g_ival_num, sizeof(*g_ival_samples), cmp_u32);
+	printf("%7.1fs: %u/%u operational, %7.1f APDU/s, p50 %7.2f ms, p99 %7.2f ms, %lu errors\n",
+	       elapsed_s(), g_num_operational, g_cfg.num_clients,
+	       (double) g_ival_num / g_cfg.report_interval,
+	       percentile_ms(g_ival_samples, g_ival_num, 0.5),
+	       percentile_ms(g_ival_samples, g_ival_num, 0.99), g_ival_errors);
+	fflush(stdout);
+	g_ival_num = 0;
+	g_ival_errors = 0;
+
+	osmo_timer_schedule(timer, g_cfg.report_interval, 0);
+}
+
+static unsigned long report_final(double measured_s)
+{
+	unsigned long apdus = 0, ops = 0, sw_errors = 0, timeouts = 0, lost = 0, connects = 0;
+	uint32_t *all;
+	size_t num = 0;
+	unsigned int i;
+	struct vclient *vc;
+
+	for (i = 0; i < g_cfg.num_clients; i++)
+		num += g_vclients[i].num_samples;
+	all = talloc_array(g_tall_ctx, uint32_t, num ? num : 1);
+	OSMO_ASSERT(all);
+	num = 0;
+
+	if (g_cfg.per_client)
+		printf("\n%-12s %8s %8s %8s %8s %8s %5s %9s %9s %9s\n", "client", "ops", "APDUs",
+		       "sw-err", "timeout", "lost", "conn", "p50 ms", "p99 ms", "max ms");
+	for (i = 0; i < g_cfg.num_clients; i++) {
+		vc = &g_vclients[i];
+		qsort(vc->samples, vc->num_samples, sizeof(*vc->samples), cmp_u32);
+		if (g_cfg.per_client)
+			printf("C%05u:%-5u %8lu %8lu %8lu %8lu %8lu %5lu %9.2f %9.2f %9.2f\n",
+			       g_cfg.first_client_id + i, g_cfg.client_slot, vc->ops, vc->apdus,
+			       vc->sw_errors, vc->timeouts, vc->lost, vc->connects,
+			       percentile_ms(vc->samples, vc->num_samples, 0.5),
+			       percentile_ms(vc->samples, vc->num_samples, 0.99),
+			       percentile_ms(vc->samples, vc->num_samples, 1));
+		memcpy(all + num, vc->samples, vc->num_samples * sizeof(*all));
+		num += vc->num_samples;
+		ops += vc->ops;
+		apdus += vc->apdus;
+		sw_errors += vc->sw_errors;
+		timeouts += vc->timeouts;
+		lost += vc->lost;
+		connects += vc->connects;
+	}
+	qsort(all, num, sizeof(*all), cmp_u32);
+
+	printf("\n%u clients, %lu connects, %lu operations, %lu APDUs in %.1fs: %.1f APDU/s\n",
+	       g_cfg.num_clients, connects, ops, apdus, measured_s, measured_s > 0 ? num / measured_s : 0);
+	printf("latency: p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n",
+	       percentile_ms(all, num, 0.5), percentile_ms(all, num, 0.99),
+	       percentile_ms(all, num, 0.999), percentile_ms(all, num, 1));
+	printf("errors: %lu bad status words, %lu timeouts, %lu lost (%.3f%% of APDUs)\n",
+	       sw_errors, timeouts, lost,
+	       apdus + timeouts + lost ? 100.0 * (sw_errors + timeouts + lost) / (apdus + timeouts + lost) : 0);
+	talloc_free(all);
+	return apdus;
+}
+
+/***********************************************************************
+ * main
+ ***********************************************************************/
+
+static void start_clients(void *data)
+{
+	struct osmo_timer_list *timer = data;
+	/* the timer fires every 100ms */
+	unsigned int batch = g_cfg.ramp_rate ? OSMO_MAX(g_cfg.ramp_rate / 10, 1) : g_cfg.num_clients;
+	struct vclient *vc;
+
+	while (batch-- && g_num_started < g_cfg.num_clients) {
+		vc = &g_vclients[g_num_started++];
+		remsim_client_establish(vc->bc);
+	}
+	if (g_num_started < g_cfg.num_clients)
+		osmo_timer_schedule(timer, 0, 100000);
+}
+
+static void start_measuring(void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_cfg.num_clients; i++) {
+		g_vclients[i].ops = 0;
+		g_vclients[i].apdus = 0;
+		g_vclients[i].sw_errors = 0;
+		g_vclients[i].timeouts = 0;
+		g_vclients[i].lost = 0;
+	}
+	g_measuring = true;
+}
+
+static void stop_running(void *data)
+{
+	g_stop = 1;
+}
+
+static void handle_sig_stop(int signal)
+{
+	g_stop = 1;
+}
+
+static void print_help()
+{
+	printf( "Usage: osmo-remsim-client-loadgen [options]\n"
+		"  -h --help                  This text\n"
+		"  -d --debug option          Enable debug logging (e.g. DMAIN:DRSPRO)\n"
+		"  -i --server-ip A.B.C.D     remsim-server IP address (default: 127.0.0.1)\n"
+		"  -p --server-port 13245     remsim-server TCP port (default: 9998)\n"
+		"  -c --client-id <0-1023>    RSPRO ClientId of the first client (default: 0)\n"
+		"  -n --client-slot <0-1023>  RSPRO SlotNr of all clients (default: 0)\n"
+		"  -N --clients NR            Number of clients (default: 1)\n"
+		"  -R --ramp-rate NR          Connect at most NR clients per second; 0 = all at once (default: 50)\n"
+		"  -m --mix OP=WEIGHT,...     Weights of the operations read, auth and status\n"
+		"                             (default: read=60,auth=10,status=30)\n"
+		"  -t --think-time MS         Mean time between two operations of a client (default: 100)\n"
+		"  -W --timeout MS            Count responses slower than MS as timeouts (default: 5000)\n"
+		"  -D --duration SECS         Stop after SECS seconds; 0 = on SIGINT (default: 0)\n"
+		"  -w --warmup SECS           Don't count the first SECS seconds (default: 0)\n"
+		"  -r --report-interval SECS  Print a progress line every SECS seconds (default: 1)\n"
+		"  -s --seed NR               Seed of the random number generator (default: 0)\n"
+		"  -C --per-client            Report each client at the end\n"
+		"  -S --shared-connection     All clients share the server connection of the first one\n"
+		);
+}
+
+static void handle_options(int argc, char **argv)
+{
+	while (1) {
+		int option_index = 0, c;
+		static const struct option long_options[] = {
+			{ "help", 0, 0, 'h' },
+			{ "debug", 1, 0, 'd' },
+			{ "server-ip", 1, 0, 'i' },
+			{ "server-port", 1, 0, 'p' },
+			{ "client-id", 1, 0, 'c' },
+			{ "client-slot", 1, 0, 'n' },
+			{ "clients", 1, 0, 'N' },
+			{ "ramp-rate", 1, 0, 'R' },
+			{ "mix", 1, 0, 'm' },
+			{ "think-time", 1, 0, 't' },
+			{ "timeout", 1, 0, 'W' },
+			{ "duration", 1, 0, 'D' },
+			{ "warmup", 1, 0, 'w' },
+			{ "report-interval", 1, 0, 'r' },
+			{ "seed", 1, 0, 's' },
+			{ "per-client", 0, 0, 'C' },
+			{ "shared-connection", 0, 0, 'S' },
+			{ 0, 0, 0, 0 }
+		};
+
+		c = getopt_long(argc, argv, "hd:i:p:c:n:N:R:m:t:W:D:w:r:s:CS", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			print_help();
+			exit(0);
+			break;
+		case 'd':
+			log_parse_category_mask(osmo_stderr_target, optarg);
+			break;
+		case 'i':
+			g_cfg.server_host = optarg;
+			break;
+		case 'p':
+			g_cfg.server_port = atoi(optarg);
+			break;
+		case 'c':
+			g_cfg.first_client_id = atoi(optarg);
+			break;
+		case 'n':
+			g_cfg.client_slot = atoi(optarg);
+			break;
+		case 'N':
+			g_cfg.num_clients = atoi(optarg);
+			break;
+		case 'R':
+			g_cfg.ramp_rate = atoi(optarg);
+			break;
+		case 'm':
+			if (parse_mix(optarg) < 0) {
+				fprintf(stderr, "Invalid operation mix '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 't':
+			g_cfg.think_ms = atoi(optarg);
+			break;
+		case 'W':
+			g_cfg.timeout_ms = atoi(optarg);
+			break;
+		case 'D':
+			g_cfg.duration = atoi(optarg);
+			break;
+		case 'w':
+			g_cfg.warmup = atoi(optarg);
+			break;
+		case 'r':
+			g_cfg.report_interval = atoi(optarg);
+			break;
+		case 's':
+			g_cfg.seed = atoi(optarg);
+			break;
+		case 'C':
+			g_cfg.per_client = true;
+			break;
+		case 'S':
+			g_cfg.shared_srvc = true;
+			break;
+		default:
+			/* ignore */
+			break;
+		}
+	}
+
+	if (g_cfg.num_clients < 1 || g_cfg.first_client_id < 0 || g_cfg.client_slot < 0 ||
+	    g_cfg.first_client_id + g_cfg.num_clients > 1024 || g_cfg.client_slot > 1023) {
+		fprintf(stderr, "Client IDs / slot out of range 0..1023\n");
+		exit(2);
+	}
+	if (g_cfg.timeout_ms < 1 || g_cfg.report_interval < 1) {
+		fprintf(stderr, "Timeout and report interval must be positive\n");
+		exit(2);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct osmo_timer_list start_timer, report_timer, warmup_timer, stop_timer;
+	struct client_config *cfg;
+	struct vclient *vc;
+	char name[64];
+	unsigned int i;
+	double measured_s;
+	unsigned long apdus;
+
+	g_tall_ctx = talloc_named_const(NULL, 0, "global");
+	talloc_asn1_ctx = talloc_named_const(g_tall_ctx, 0, "asn1");
+	msgb_talloc_ctx_init(g_tall_ctx, 0);
+
+	osmo_init_logging2(g_tall_ctx, &log_info);
+	log_set_print_level(osmo_stderr_target, 1);
+	log_set_print_category(osmo_stderr_target, 1);
+	log_set_print_category_hex(osmo_stderr_target, 0);
+	osmo_fsm_log_addr(0);
+	/* the main FSM logs every APDU; keep quiet unless asked for */
+	log_set_category_filter(osmo_stderr_target, DMAIN, 1, LOGL_ERROR);
+	log_set_category_filter(osmo_stderr_target, DRSPRO, 1, LOGL_NOTICE);
+
+	handle_options(argc, argv);
+	if (parse_ops() < 0) {
+		fprintf(stderr, "Operation mix has no weight\n");
+		exit(2);
+	}
+	srandom(g_cfg.seed);
+
+	/* all clients share the configuration, except for their client ID */
+	cfg = client_config_init(g_tall_ctx);
+	OSMO_ASSERT(cfg);
+	osmo_talloc_replace_string(cfg, &cfg->server_host, g_cfg.server_host);
+	cfg->server_port = g_cfg.server_port;
+	cfg->client_slot = g_cfg.client_slot;
+
+	g_vclients = talloc_zero_array(g_tall_ctx, struct vclient, g_cfg.num_clients);
+	OSMO_ASSERT(g_vclients);
+	for (i = 0; i < g_cfg.num_clients; i++) {
+		vc = &g_vclients[i];
+		osmo_timer_setup(&vc->timer, vclient_timer_cb, vc);
+		snprintf(name, sizeof(name), "loadgen-%u", g_cfg.first_client_id + i);
+		cfg->client_id = g_cfg.first_client_id + i;
+		if (g_cfg.shared_srvc && i > 0)
+			vc->bc = remsim_client_create_slot(g_vclients[0].bc, name, "remsim-client-loadgen", cfg);
+		else
+			vc->bc = remsim_client_create(g_tall_ctx, name, "remsim-client-loadgen", cfg);
+		OSMO_ASSERT(vc->bc);
+		vc->bc->data = vc;
+		snprintf(name, sizeof(name), "C%u:%u", g_cfg.first_client_id + i, g_cfg.client_slot);
+		osmo_fsm_inst_update_id(vc->bc->main_fi, name);
+	}
+
+	signal(SIGINT, handle_sig_stop);
+	signal(SIGTERM, handle_sig_stop);
+
+	clock_gettime(CLOCK_MONOTONIC, &g_start_time);
+	osmo_timer_setup(&start_timer, start_clients, &start_timer);
+	start_clients(&start_timer);
+	osmo_timer_setup(&report_timer, report_interval, &report_timer);
+	osmo_timer_schedule(&report_timer, g_cfg.report_interval, 0);
+	osmo_timer_setup(&warmup_timer, start_measuring, NULL);
+	if (g_cfg.warmup)
+		osmo_timer_schedule(&warmup_timer, g_cfg.warmup, 0);
+	else
+		start_measuring(NULL);
+	osmo_timer_setup(&stop_timer, stop_running, NULL);
+	if (g_cfg.duration)
+		osmo_timer_schedule(&stop_timer, g_cfg.warmup + g_cfg.duration, 0);
+
+	asn_debug = 0;
+
+	while (!g_stop)
+		osmo_select_main(0);
+
+	measured_s = g_measuring ? elapsed_s() - g_cfg.warmup : 0;
+	apdus = report_final(measured_s);
+
+	exit(apdus ? 0 : 1);
+}
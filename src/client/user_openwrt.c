@@ -39,6 +39,7 @@
 
 #include "client.h"
 #include "debug.h"
+#include "modem_at.h"
 #ifdef ENABLE_IONMESH
 #include "ionmesh_integration.h"
 #endif
@@ -73,12 +74,20 @@
 #define ZBT_Z8102AX_5G2_POWER_GPIO 5
 #define ZBT_Z8102AX_PCIE_POWER_GPIO 3
 
+/* how long the modem may take to answer AT+CSIM and AT+CSQ */
+#define CSIM_TIMEOUT_MS 5000
+#define CSQ_TIMEOUT_MS 2000
+/* interval of attempts to (re-)open a modem device which is absent, e.g. during USB
+ * re-enumeration */
+#define MODEM_REOPEN_S 2
+
 /* Modem configuration for dual-modem setups */
 struct modem_config {
 	int sim_switch_gpio;
 	int reset_gpio;
 	char *device_path;
 	bool is_primary;  /* true = remsim modem, false = always-on IoT modem */
+	int client_slot;  /* remsim client slot of modem 2, if it is a remsim modem */
 };
 
 /* Statistics tracking */
@@ -110,6 +119,9 @@ struct openwrt_state {
 	bool dual_modem_mode;
 	struct modem_config modem1;  /* Primary remsim modem */
 	struct modem_config modem2;  /* Always-on IoT modem for connectivity */
+	/* state of the second remsim slot if modem 2 is a remsim modem as well; its client shares
+	 * the server connection of ours */
+	struct openwrt_state *modem2_slot;
 	
 	/* ATR buffer for SIM card */
 	uint8_t atr_buf[ATR_SIZE_MAX];
@@ -123,8 +135,11 @@ struct openwrt_state {
 #endif
 	
 	/* Modem communication */
-	struct osmo_fd modem_ofd;
-	bool modem_fd_registered;
+	struct at_chan *at;
+	/* an AT+CSQ is queued or waiting for its response */
+	bool csq_pending;
+	/* re-opens the modem device after it went away */
+	struct osmo_timer_list reopen_timer;
 	
 	/* Statistics and monitoring */
 	struct openwrt_stats stats;
@@ -140,6 +155,8 @@ static int openwrt_send_tpdu_to_modem(struct openwrt_state *os, const uint8_t *d
 static void openwrt_signal_timer_cb(void *data);
 static int openwrt_query_signal_strength(struct openwrt_state *os);
 static void openwrt_parse_csq_response(struct openwrt_state *os, const char *response);
+static void openwrt_csq_resp_cb(struct at_chan *chan, enum at_result res, const char *const *lines,
+				unsigned int num_lines, void *data);
 static void openwrt_print_statistics(struct openwrt_state *os);
 static void openwrt_handle_shutdown(int sig);
 static void openwrt_handle_print_stats(int sig);
@@ -389,7 +406,7 @@ int frontend_append_script_env(struct bankd_client *bc, char **env, int idx, siz
 		return idx;
 
 	if (os->modem_device) {
-		env[idx] = talloc_asprintf(bc, "OPENWRT_MODEM_DEVICE=%s", os->modem_device);
+		env[idx] = talloc_asprintf(env, "OPENWRT_MODEM_DEVICE=%s", os->modem_device);
 		if (env[idx])
 			idx++;
 	}
@@ -453,76 +470,55 @@ static int hex_str_to_bin(const char *hex_str, uint8_t *buf, size_t buf_len)
 	return len / 2;
 }
 
-/* Callback for modem file descriptor - handles responses from modem */
-static int modem_fd_cb(struct osmo_fd *ofd, unsigned int what)
+/* Response of the modem to AT+CSIM: +CSIM: <length>,"<response>" */
+static void openwrt_csim_resp_cb(struct at_chan *chan, enum at_result res, const char *const *lines,
+				 unsigned int num_lines, void *data)
 {
-	struct openwrt_state *os = ofd->data;
+	struct openwrt_state *os = data;
 	struct bankd_client *bc = os->bc;
-	char buf[2048];
-	int rc;
-	
-	if (!(what & OSMO_FD_READ))
-		return 0;
-	
-	rc = read(ofd->fd, buf, sizeof(buf) - 1);
-	if (rc < 0) {
-		LOGP(DMAIN, LOGL_ERROR, "Failed to read from modem: %s\n", strerror(errno));
-		return rc;
-	}
-	
-	if (rc == 0) {
-		LOGP(DMAIN, LOGL_NOTICE, "Modem device closed\n");
-		return 0;
-	}
-	
-	/* Ensure buffer is null-terminated, accounting for possible full read */
-	if (rc >= sizeof(buf)) {
-		rc = sizeof(buf) - 1;
+	int resp_len;
+	char hex_resp[1024];
+	uint8_t apdu_resp[512];
+	int parsed_len;
+
+	if (res != AT_RES_OK || num_lines < 1) {
+		LOGP(DMAIN, LOGL_ERROR, "AT+CSIM failed: %s%s%s\n", at_result_name(res),
+		     num_lines ? " " : "", num_lines ? lines[num_lines - 1] : "");
+		os->stats.errors++;
+		return;
 	}
-	buf[rc] = '\0';
-	
-	LOGP(DMAIN, LOGL_DEBUG, "Modem response: %s\n", buf);
-	
-	/* Parse AT+CSQ response for signal strength */
-	char *csq_start = strstr(buf, "+CSQ:");
-	if (csq_start) {
-		openwrt_parse_csq_response(os, csq_start);
+
+	/* Use limited width in sscanf to prevent buffer overflow */
+	if (sscanf(lines[0], "+CSIM: %d,\"%1023[^\"]\"", &resp_len, hex_resp) != 2) {
+		LOGP(DMAIN, LOGL_ERROR, "Unable to parse CSIM response: %s\n", lines[0]);
+		os->stats.errors++;
+		return;
 	}
-	
-	/* Parse AT+CSIM response: +CSIM: <length>,"<response>" */
-	char *csim_start = strstr(buf, "+CSIM:");
-	if (csim_start) {
-		int resp_len;
-		char hex_resp[1024];
-		
-		/* Use limited width in sscanf to prevent buffer overflow */
-		if (sscanf(csim_start, "+CSIM: %d,\"%1023[^\"]\"", &resp_len, hex_resp) == 2) {
-			uint8_t apdu_resp[512];
-			int parsed_len;
-			
-			LOGP(DMAIN, LOGL_DEBUG, "Parsed CSIM response: len=%d, data=%s\n", 
-			     resp_len, hex_resp);
-			
-			parsed_len = hex_str_to_bin(hex_resp, apdu_resp, sizeof(apdu_resp));
-			if (parsed_len > 0) {
-				struct frontend_tpdu ftpdu = {
-					.buf = apdu_resp,
-					.len = parsed_len
-				};
-				
-				LOGP(DMAIN, LOGL_INFO, "Forwarding APDU response from modem: %s\n",
-				     osmo_hexdump(apdu_resp, parsed_len));
-				
-				/* Track statistics */
-				os->stats.tpdus_received++;
-				
-				/* Forward APDU response to bankd via main FSM */
-				osmo_fsm_inst_dispatch(bc->main_fi, MF_E_MDM_TPDU, &ftpdu);
-			}
-		}
+
+	LOGP(DMAIN, LOGL_DEBUG, "Parsed CSIM response: len=%d, data=%s\n", resp_len, hex_resp);
+
+	parsed_len = hex_str_to_bin(hex_resp, apdu_resp, sizeof(apdu_resp));
+	if (parsed_len > 0) {
+		struct frontend_tpdu ftpdu = {
+			.buf = apdu_resp,
+			.len = parsed_len
+		};
+
+		LOGP(DMAIN, LOGL_INFO, "Forwarding APDU response from modem: %s\n",
+		     osmo_hexdump(apdu_resp, parsed_len));
+
+		/* Track statistics */
+		os->stats.tpdus_received++;
+
+		/* Forward APDU response to bankd via main FSM */
+		osmo_fsm_inst_dispatch(bc->main_fi, MF_E_MDM_TPDU, &ftpdu);
 	}
-	
-	return 0;
+}
+
+/* network registration URCs (+CREG/+CGREG/+CEREG), if the modem was told to send them */
+static void openwrt_reg_urc_cb(struct at_chan *chan, const char *line, void *data)
+{
+	LOGP(DMAIN, LOGL_INFO, "Modem network registration: %s\n", line);
 }
 
 static int openwrt_send_tpdu_to_modem(struct openwrt_state *os, const uint8_t *data, size_t len)
@@ -534,7 +530,7 @@ static int openwrt_send_tpdu_to_modem(struct openwrt_state *os, const uint8_t *d
 	
 	LOGP(DMAIN, LOGL_DEBUG, "Sending TPDU to modem: %s\n", osmo_hexdump(data, len));
 	
-	if (!os->modem_fd_registered) {
+	if (!os->at) {
 		LOGP(DMAIN, LOGL_ERROR, "Modem device not opened, cannot send APDU\n");
 		return -ENOTCONN;
 	}
@@ -549,7 +545,7 @@ static int openwrt_send_tpdu_to_modem(struct openwrt_state *os, const uint8_t *d
 	/* Build AT+CSIM command
 	 * Format: AT+CSIM=<length>,"<command>"
 	 * Length is the number of characters in the hex string */
-	at_cmd_len = snprintf(at_cmd, sizeof(at_cmd), "AT+CSIM=%zu,\"%s\"\r\n", len * 2, hex_data);
+	at_cmd_len = snprintf(at_cmd, sizeof(at_cmd), "AT+CSIM=%zu,\"%s\"", len * 2, hex_data);
 	
 	/* Free the hex string buffer */
 	talloc_free(hex_data);
@@ -561,31 +557,41 @@ static int openwrt_send_tpdu_to_modem(struct openwrt_state *os, const uint8_t *d
 		return -ENOSPC;
 	}
 	
-	LOGP(DMAIN, LOGL_DEBUG, "Sending AT command to modem: %s", at_cmd);
-	
-	/* Write with retry for partial writes */
-	size_t written = 0;
-	while (written < at_cmd_len) {
-		rc = write(os->modem_ofd.fd, at_cmd + written, at_cmd_len - written);
-		if (rc < 0) {
-			if (errno == EINTR || errno == EAGAIN) {
-				continue;  /* Retry on interrupt or would-block */
-			}
-			LOGP(DMAIN, LOGL_ERROR, "Failed to write to modem: %s\n", strerror(errno));
-			return -errno;
-		}
-		written += rc;
-	}
-	
-	if (written != at_cmd_len) {
-		LOGP(DMAIN, LOGL_ERROR, "Incomplete write to modem: %zu/%zu\n", written, at_cmd_len);
-		return -EIO;
+	/* ahead of any housekeeping; the response is handled by openwrt_csim_resp_cb() */
+	rc = at_chan_submit(os->at, AT_PRIO_APDU, at_cmd, "+CSIM:", CSIM_TIMEOUT_MS,
+			    openwrt_csim_resp_cb, os);
+	if (rc < 0) {
+		LOGP(DMAIN, LOGL_ERROR, "Failed to queue AT+CSIM: %s\n", strerror(-rc));
+		return rc;
 	}
-	
-	LOGP(DMAIN, LOGL_INFO, "Sent APDU to modem via AT+CSIM (length=%zu)\n", len);
+
+	LOGP(DMAIN, LOGL_INFO, "Queued APDU to modem via AT+CSIM (length=%zu)\n", len);
 	return 0;
 }
 
+static int openwrt_open_modem_device(struct openwrt_state *os);
+
+static void openwrt_modem_reopen_cb(void *data)
+{
+	struct openwrt_state *os = data;
+
+	if (openwrt_open_modem_device(os) < 0)
+		osmo_timer_schedule(&os->reopen_timer, MODEM_REOPEN_S, 0);
+}
+
+/* the modem device went away, e.g. the USB modem re-enumerates: keep trying to open it */
+static void openwrt_modem_closed_cb(struct at_chan *chan, void *data)
+{
+	struct openwrt_state *os = data;
+
+	LOGP(DMAIN, LOGL_ERROR, "Lost modem device %s; re-opening it every %u s\n",
+	     os->modem_device, MODEM_REOPEN_S);
+	at_chan_free(os->at);
+	os->at = NULL;
+	os->csq_pending = false;
+	osmo_timer_schedule(&os->reopen_timer, MODEM_REOPEN_S, 0);
+}
+
 static int openwrt_open_modem_device(struct openwrt_state *os)
 {
 	int fd;
@@ -604,24 +610,38 @@ static int openwrt_open_modem_device(struct openwrt_state *os)
 		return -errno;
 	}
 	
-	/* Set up the file descriptor for osmocom select loop */
-	osmo_fd_setup(&os->modem_ofd, fd, OSMO_FD_READ, modem_fd_cb, os, 0);
-	
-	if (osmo_fd_register(&os->modem_ofd) < 0) {
-		LOGP(DMAIN, LOGL_ERROR, "Failed to register modem fd with osmocom select\n");
-		/* Clean up the osmo_fd structure before closing */
-		memset(&os->modem_ofd, 0, sizeof(os->modem_ofd));
+	/* Serve the AT command interface from the osmocom select loop */
+	os->at = at_chan_alloc(os, fd, "modem");
+	if (!os->at) {
 		close(fd);
 		return -EIO;
 	}
-	
-	os->modem_fd_registered = true;
+	at_chan_register_urc(os->at, "+CREG:", openwrt_reg_urc_cb, os);
+	at_chan_register_urc(os->at, "+CGREG:", openwrt_reg_urc_cb, os);
+	at_chan_register_urc(os->at, "+CEREG:", openwrt_reg_urc_cb, os);
+	at_chan_set_close_cb(os->at, openwrt_modem_closed_cb, os);
+
 	LOGP(DMAIN, LOGL_INFO, "Modem device opened successfully: %s (fd=%d)\n",
 	     os->modem_device, fd);
 	
 	return 0;
 }
 
+/* Open modem device for APDU communication */
+static void openwrt_start_modem(struct openwrt_state *os)
+{
+	osmo_timer_setup(&os->reopen_timer, openwrt_modem_reopen_cb, os);
+	if (os->modem_device) {
+		int rc = openwrt_open_modem_device(os);
+		if (rc < 0) {
+			/* it may not have been enumerated yet */
+			LOGP(DMAIN, LOGL_NOTICE, "Failed to open modem device for APDU: %d; "
+			     "retrying every %u s\n", rc, MODEM_REOPEN_S);
+			osmo_timer_schedule(&os->reopen_timer, MODEM_REOPEN_S, 0);
+		}
+	}
+}
+
 static int openwrt_init_modem(struct openwrt_state *os)
 {
 	LOGP(DMAIN, LOGL_INFO, "Initializing OpenWRT modem interface\n");
@@ -650,12 +670,13 @@ static int openwrt_init_modem(struct openwrt_state *os)
 		LOGP(DMAIN, LOGL_INFO, "Modem 1 (remsim): %s (GPIO SIM:%d RST:%d)\n",
 		     os->modem1.device_path ? os->modem1.device_path : "not detected",
 		     os->modem1.sim_switch_gpio, os->modem1.reset_gpio);
-		LOGP(DMAIN, LOGL_INFO, "Modem 2 (IoT/heartbeat): %s (GPIO SIM:%d RST:%d)\n",
+		LOGP(DMAIN, LOGL_INFO, "Modem 2 (%s): %s (GPIO SIM:%d RST:%d)\n",
+		     os->modem2.is_primary ? "remsim" : "IoT/heartbeat",
 		     os->modem2.device_path ? os->modem2.device_path : "not detected",
 		     os->modem2.sim_switch_gpio, os->modem2.reset_gpio);
 		
 		/* Ensure IoT modem is using local SIM for connectivity */
-		if (os->modem2.sim_switch_gpio > 0) {
+		if (!os->modem2.is_primary && os->modem2.sim_switch_gpio > 0) {
 			gpio_export(os->modem2.sim_switch_gpio);
 			gpio_set_direction(os->modem2.sim_switch_gpio, "out");
 			gpio_set_value(os->modem2.sim_switch_gpio, 0);  /* 0 = local IoT SIM */
@@ -680,14 +701,51 @@ static int openwrt_init_modem(struct openwrt_state *os)
 		}
 	}
 
-	/* Open modem device for APDU communication */
-	if (os->modem_device) {
-		int rc = openwrt_open_modem_device(os);
-		if (rc < 0) {
-			LOGP(DMAIN, LOGL_NOTICE, "Failed to open modem device for APDU: %d\n", rc);
-			LOGP(DMAIN, LOGL_NOTICE, "APDU forwarding will be disabled\n");
-		}
+	openwrt_start_modem(os);
+
+	return 0;
+}
+
+/* Serve a second remsim slot on modem 2.  Its client has its own bankd connection and modem
+ * state, but shares the remsim-server connection of the first one (see
+ * remsim_client_create_slot()), all within our one select loop. */
+static int openwrt_create_modem2_slot(struct openwrt_state *os)
+{
+	struct bankd_client *bc;
+	struct client_config *cfg;
+	struct openwrt_state *os2;
+
+	/* same configuration, except for the client slot */
+	cfg = talloc_memdup(os, os->bc->cfg, sizeof(*cfg));
+	if (!cfg)
+		return -ENOMEM;
+	cfg->client_slot = os->modem2.client_slot;
+
+	bc = remsim_client_create_slot(os->bc, os->bc->srv_conn.own_comp_id.name, "remsim-client", cfg);
+	if (!bc) {
+		talloc_free(cfg);
+		return -EINVAL;
 	}
+	osmo_fsm_inst_update_id(bc->main_fi, "modem2");
+
+	os2 = talloc_zero(bc, struct openwrt_state);
+	if (!os2)
+		return -ENOMEM;
+	os2->bc = bc;
+	bc->data = os2;
+	os2->sim_switch_gpio = os->modem2.sim_switch_gpio;
+	os2->modem_reset_gpio = os->modem2.reset_gpio;
+	os2->modem_device = os->modem2.device_path;
+	os2->stats.start_time = time(NULL);
+	os2->signal_check_interval = os->signal_check_interval;
+	os2->signal_monitoring_enabled = os->signal_monitoring_enabled;
+	osmo_timer_setup(&os2->signal_timer, openwrt_signal_timer_cb, os2);
+	os->modem2_slot = os2;
+
+	LOGP(DMAIN, LOGL_INFO, "Modem 2 serves client slot %d over the shared server connection\n",
+	     cfg->client_slot);
+	openwrt_start_modem(os2);
+	remsim_client_establish(bc);
 
 	return 0;
 }
@@ -770,26 +828,47 @@ static void apply_zbt_z8102ax_config(struct openwrt_state *os)
 /* Query modem signal strength using AT+CSQ command */
 static int openwrt_query_signal_strength(struct openwrt_state *os)
 {
-	char at_cmd[] = "AT+CSQ\r\n";
 	int rc;
 	
-	if (!os->modem_fd_registered) {
+	if (!os->at) {
 		LOGP(DMAIN, LOGL_DEBUG, "Modem device not opened, skipping signal check\n");
 		return -ENOTCONN;
 	}
+
+	/* don't pile up queries behind a busy APDU stream */
+	if (os->csq_pending) {
+		LOGP(DMAIN, LOGL_DEBUG, "Previous signal strength query still pending\n");
+		return 0;
+	}
 	
 	LOGP(DMAIN, LOGL_DEBUG, "Querying modem signal strength\n");
 	
-	rc = write(os->modem_ofd.fd, at_cmd, strlen(at_cmd));
+	os->csq_pending = true;
+	rc = at_chan_submit(os->at, AT_PRIO_HOUSEKEEPING, "AT+CSQ", "+CSQ:", CSQ_TIMEOUT_MS,
+			    openwrt_csq_resp_cb, os);
 	if (rc < 0) {
-		LOGP(DMAIN, LOGL_ERROR, "Failed to query signal strength: %s\n", strerror(errno));
-		return -errno;
+		os->csq_pending = false;
+		LOGP(DMAIN, LOGL_ERROR, "Failed to query signal strength: %s\n", strerror(-rc));
+		return rc;
 	}
 	
-	/* Response will be handled by modem_fd_cb */
+	/* Response will be handled by openwrt_csq_resp_cb */
 	return 0;
 }
 
+static void openwrt_csq_resp_cb(struct at_chan *chan, enum at_result res, const char *const *lines,
+				unsigned int num_lines, void *data)
+{
+	struct openwrt_state *os = data;
+
+	os->csq_pending = false;
+	if (res != AT_RES_OK || num_lines < 1) {
+		LOGP(DMAIN, LOGL_NOTICE, "AT+CSQ failed: %s\n", at_result_name(res));
+		return;
+	}
+	openwrt_parse_csq_response(os, lines[0]);
+}
+
 /* Timer callback for periodic signal strength checks */
 static void openwrt_signal_timer_cb(void *data)
 {
@@ -866,6 +945,10 @@ static void openwrt_handle_shutdown(int sig)
 			LOGP(DMAIN, LOGL_INFO, "Switching back to local SIM before exit\n");
 			frontend_request_sim_local(g_os_for_signal->bc);
 		}
+		if (g_os_for_signal->modem2_slot) {
+			openwrt_print_statistics(g_os_for_signal->modem2_slot);
+			frontend_request_sim_local(g_os_for_signal->modem2_slot->bc);
+		}
 	}
 	
 	exit(0);
@@ -878,6 +961,8 @@ static void openwrt_handle_print_stats(int sig)
 	
 	if (g_os_for_signal) {
 		openwrt_print_statistics(g_os_for_signal);
+		if (g_os_for_signal->modem2_slot)
+			openwrt_print_statistics(g_os_for_signal->modem2_slot);
 	}
 }
 
@@ -964,13 +1049,20 @@ int client_user_main(struct bankd_client *g_client)
 		if (m2_dev) {
 			os->modem2.device_path = talloc_strdup(os, m2_dev);
 		}
+		/* Modem 2 may serve a second remsim slot instead */
+		char *m2_remsim = getenv("MODEM2_REMSIM");
+		if (m2_remsim && strcmp(m2_remsim, "1") == 0) {
+			os->modem2.is_primary = true;
+			char *m2_slot = getenv("MODEM2_CLIENT_SLOT");
+			os->modem2.client_slot = m2_slot ? atoi(m2_slot) : g_client->cfg->client_slot + 1;
+		}
 		
 		LOGP(DMAIN, LOGL_INFO, "Dual-modem configuration detected\n");
 		LOGP(DMAIN, LOGL_INFO, "  Modem 1 (remsim): GPIO SIM=%d RST=%d DEV=%s\n",
 		     os->modem1.sim_switch_gpio, os->modem1.reset_gpio,
 		     os->modem1.device_path ? os->modem1.device_path : "auto");
-		LOGP(DMAIN, LOGL_INFO, "  Modem 2 (IoT): GPIO SIM=%d RST=%d DEV=%s\n",
-		     os->modem2.sim_switch_gpio, os->modem2.reset_gpio,
+		LOGP(DMAIN, LOGL_INFO, "  Modem 2 (%s): GPIO SIM=%d RST=%d DEV=%s\n",
+		     os->modem2.is_primary ? "remsim" : "IoT", os->modem2.sim_switch_gpio, os->modem2.reset_gpio,
 		     os->modem2.device_path ? os->modem2.device_path : "auto");
 		
 		/* Copy modem1 settings to legacy variables for compatibility */
@@ -1091,12 +1183,20 @@ int client_user_main(struct bankd_client *g_client)
 	}
 #endif
 
+	if (os->dual_modem_mode && os->modem2.is_primary) {
+		int rc = openwrt_create_modem2_slot(os);
+		if (rc < 0)
+			LOGP(DMAIN, LOGL_ERROR, "Failed to set up the remsim slot of modem 2: %d\n", rc);
+	}
+
 	LOGP(DMAIN, LOGL_INFO, "OpenWRT client initialized (GPIO SIM: %d, GPIO Reset: %d)\n",
 	     os->sim_switch_gpio, os->modem_reset_gpio);
 
 	/* Start signal monitoring timer if enabled */
 	if (os->signal_monitoring_enabled && os->signal_check_interval > 0) {
 		osmo_timer_schedule(&os->signal_timer, os->signal_check_interval, 0);
+		if (os->modem2_slot)
+			osmo_timer_schedule(&os->modem2_slot->signal_timer, os->signal_check_interval, 0);
 	}
 
 	/* Statistics are printed on-demand via SIGUSR2 signal.
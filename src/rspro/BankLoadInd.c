@@ -0,0 +1,129 @@
+/*
+ * Generated by asn1c-0.9.28 (http://lionet.info/asn1c)
+ * From ASN.1 module "RSPRO"
+ * 	found in "../../asn1/RSPRO.asn"
+ */
+
+#include <osmocom/rspro/BankLoadInd.h>
+
+static int
+memb_apduRate_constraint_1(asn_TYPE_descriptor_t *td, const void *sptr,
+			asn_app_constraint_failed_f *ctfailcb, void *app_key) {
+	long value;
+	
+	if(!sptr) {
+		_ASN_CTFAIL(app_key, td, sptr,
+			"%s: value not given (%s:%d)",
+			td->name, __FILE__, __LINE__);
+		return -1;
+	}
+	
+	value = *(const long *)sptr;
+	
+	if((value >= 0l && value <= 2147483647l)) {
+		/* Constraint check succeeded */
+		return 0;
+	} else {
+		_ASN_CTFAIL(app_key, td, sptr,
+			"%s: constraint failed (%s:%d)",
+			td->name, __FILE__, __LINE__);
+		return -1;
+	}
+}
+
+static int
+memb_meanLatencyUs_constraint_1(asn_TYPE_descriptor_t *td, const void *sptr,
+			asn_app_constraint_failed_f *ctfailcb, void *app_key) {
+	long value;
+	
+	if(!sptr) {
+		_ASN_CTFAIL(app_key, td, sptr,
+			"%s: value not given (%s:%d)",
+			td->name, __FILE__, __LINE__);
+		return -1;
+	}
+	
+	value = *(const long *)sptr;
+	
+	if((value >= 0l && value <= 2147483647l)) {
+		/* Constraint check succeeded */
+		return 0;
+	} else {
+		_ASN_CTFAIL(app_key, td, sptr,
+			"%s: constraint failed (%s:%d)",
+			td->name, __FILE__, __LINE__);
+		return -1;
+	}
+}
+
+static asn_TYPE_member_t asn_MBR_BankLoadInd_1[] = {
+	{ ATF_NOFLAGS, 0, offsetof(struct BankLoadInd, activeSlots),
+		(ASN_TAG_CLASS_UNIVERSAL | (2 << 2)),
+		0,
+		&asn_DEF_SlotNumber,
+		0,	/* Defer constraints checking to the member type */
+		0,	/* PER is not compiled, use -gen-PER */
+		0,
+		"activeSlots"
+		},
+	{ ATF_NOFLAGS, 0, offsetof(struct BankLoadInd, apduRate),
+		(ASN_TAG_CLASS_UNIVERSAL | (2 << 2)),
+		0,
+		&asn_DEF_NativeInteger,
+		memb_apduRate_constraint_1,
+		0,	/* PER is not compiled, use -gen-PER */
+		0,
+		"apduRate"
+		},
+	{ ATF_NOFLAGS, 0, offsetof(struct BankLoadInd, meanLatencyUs),
+		(ASN_TAG_CLASS_UNIVERSAL | (2 << 2)),
+		0,
+		&asn_DEF_NativeInteger,
+		memb_meanLatencyUs_constraint_1,
+		0,	/* PER is not compiled, use -gen-PER */
+		0,
+		"meanLatencyUs"
+		},
+};
+static const ber_tlv_tag_t asn_DEF_BankLoadInd_tags_1[] = {
+	(ASN_TAG_CLASS_UNIVERSAL | (16 << 2))
+};
+static const asn_TYPE_tag2member_t asn_MAP_BankLoadInd_tag2el_1[] = {
+    { (ASN_TAG_CLASS_UNIVERSAL | (2 << 2)), 0, 0, 2 }, /* activeSlots */
+    { (ASN_TAG_CLASS_UNIVERSAL | (2 << 2)), 1, -1, 1 }, /* apduRate */
+    { (ASN_TAG_CLASS_UNIVERSAL | (2 << 2)), 2, -2, 0 } /* meanLatencyUs */
+};
+static asn_SEQUENCE_specifics_t asn_SPC_BankLoadInd_specs_1 = {
+	sizeof(struct BankLoadInd),
+	offsetof(struct BankLoadInd, _asn_ctx),
+	asn_MAP_BankLoadInd_tag2el_1,
+	3,	/* Count of tags in the map */
+	0, 0, 0,	/* Optional elements (not needed) */
+	2,	/* Start extensions */
+	4	/* Stop extensions */
+};
+asn_TYPE_descriptor_t asn_DEF_BankLoadInd = {
+	"BankLoadInd",
+	"BankLoadInd",
+	SEQUENCE_free,
+	SEQUENCE_print,
+	SEQUENCE_constraint,
+	SEQUENCE_decode_ber,
+	SEQUENCE_encode_der,
+	SEQUENCE_decode_xer,
+	SEQUENCE_encode_xer,
+	0, 0,	/* No UPER support, use "-gen-PER" to enable */
+	0, 0,	/* No APER support, use "-gen-PER" to enable */
+	0,	/* Use generic outmost tag fetcher */
+	asn_DEF_BankLoadInd_tags_1,
+	sizeof(asn_DEF_BankLoadInd_tags_1)
+		/sizeof(asn_DEF_BankLoadInd_tags_1[0]), /* 1 */
+	asn_DEF_BankLoadInd_tags_1,	/* Same as above */
+	sizeof(asn_DEF_BankLoadInd_tags_1)
+		/sizeof(asn_DEF_BankLoadInd_tags_1[0]), /* 1 */
+	0,	/* No PER visible constraints */
+	asn_MBR_BankLoadInd_1,
+	3,	/* Elements count */
+	&asn_SPC_BankLoadInd_specs_1	/* Additional specs */
+};
+
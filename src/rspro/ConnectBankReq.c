@@ -6,6 +6,31 @@
 
 #include <osmocom/rspro/ConnectBankReq.h>
 
+static int
+memb_mappingsDigest_constraint_1(asn_TYPE_descriptor_t *td, const void *sptr,
+			asn_app_constraint_failed_f *ctfailcb, void *app_key) {
+	long value;
+	
+	if(!sptr) {
+		_ASN_CTFAIL(app_key, td, sptr,
+			"%s: value not given (%s:%d)",
+			td->name, __FILE__, __LINE__);
+		return -1;
+	}
+	
+	value = *(const long *)sptr;
+	
+	if((value >= 0l && value <= 2147483647l)) {
+		/* Constraint check succeeded */
+		return 0;
+	} else {
+		_ASN_CTFAIL(app_key, td, sptr,
+			"%s: constraint failed (%s:%d)",
+			td->name, __FILE__, __LINE__);
+		return -1;
+	}
+}
+
 static asn_TYPE_member_t asn_MBR_ConnectBankReq_1[] = {
 	{ ATF_NOFLAGS, 0, offsetof(struct ConnectBankReq, identity),
 		(ASN_TAG_CLASS_UNIVERSAL | (16 << 2)),
@@ -34,23 +59,43 @@ static asn_TYPE_member_t asn_MBR_ConnectBankReq_1[] = {
 		0,
 		"numberOfSlots"
 		},
+	{ ATF_POINTER, 2, offsetof(struct ConnectBankReq, bankdEndpoint),
+		(ASN_TAG_CLASS_UNIVERSAL | (16 << 2)),
+		0,
+		&asn_DEF_IpPort,
+		0,	/* Defer constraints checking to the member type */
+		0,	/* PER is not compiled, use -gen-PER */
+		0,
+		"bankdEndpoint"
+		},
+	{ ATF_POINTER, 1, offsetof(struct ConnectBankReq, mappingsDigest),
+		(ASN_TAG_CLASS_UNIVERSAL | (2 << 2)),
+		0,
+		&asn_DEF_NativeInteger,
+		memb_mappingsDigest_constraint_1,
+		0,	/* PER is not compiled, use -gen-PER */
+		0,
+		"mappingsDigest"
+		},
 };
 static const ber_tlv_tag_t asn_DEF_ConnectBankReq_tags_1[] = {
 	(ASN_TAG_CLASS_UNIVERSAL | (16 << 2))
 };
 static const asn_TYPE_tag2member_t asn_MAP_ConnectBankReq_tag2el_1[] = {
-    { (ASN_TAG_CLASS_UNIVERSAL | (2 << 2)), 1, 0, 1 }, /* bankId */
-    { (ASN_TAG_CLASS_UNIVERSAL | (2 << 2)), 2, -1, 0 }, /* numberOfSlots */
-    { (ASN_TAG_CLASS_UNIVERSAL | (16 << 2)), 0, 0, 0 } /* identity */
+    { (ASN_TAG_CLASS_UNIVERSAL | (2 << 2)), 1, 0, 2 }, /* bankId */
+    { (ASN_TAG_CLASS_UNIVERSAL | (2 << 2)), 2, -1, 1 }, /* numberOfSlots */
+    { (ASN_TAG_CLASS_UNIVERSAL | (2 << 2)), 4, -2, 0 }, /* mappingsDigest */
+    { (ASN_TAG_CLASS_UNIVERSAL | (16 << 2)), 0, 0, 1 }, /* identity */
+    { (ASN_TAG_CLASS_UNIVERSAL | (16 << 2)), 3, -1, 0 } /* bankdEndpoint */
 };
 static asn_SEQUENCE_specifics_t asn_SPC_ConnectBankReq_specs_1 = {
 	sizeof(struct ConnectBankReq),
 	offsetof(struct ConnectBankReq, _asn_ctx),
 	asn_MAP_ConnectBankReq_tag2el_1,
-	3,	/* Count of tags in the map */
+	5,	/* Count of tags in the map */
 	0, 0, 0,	/* Optional elements (not needed) */
 	2,	/* Start extensions */
-	4	/* Stop extensions */
+	6	/* Stop extensions */
 };
 asn_TYPE_descriptor_t asn_DEF_ConnectBankReq = {
 	"ConnectBankReq",
@@ -73,7 +118,7 @@ asn_TYPE_descriptor_t asn_DEF_ConnectBankReq = {
 		/sizeof(asn_DEF_ConnectBankReq_tags_1[0]), /* 1 */
 	0,	/* No PER visible constraints */
 	asn_MBR_ConnectBankReq_1,
-	3,	/* Elements count */
+	5,	/* Elements count */
 	&asn_SPC_ConnectBankReq_specs_1	/* Additional specs */
 };
 
@@ -196,6 +196,15 @@ static asn_TYPE_member_t asn_MBR_RsproPDUchoice_1[] = {
 		0,
 		"bankSlotStatusInd"
 		},
+	{ ATF_NOFLAGS, 0, offsetof(struct RsproPDUchoice, choice.bankLoadInd),
+		(ASN_TAG_CLASS_CONTEXT | (21 << 2)),
+		-1,	/* IMPLICIT tag at current level */
+		&asn_DEF_BankLoadInd,
+		0,	/* Defer constraints checking to the member type */
+		0,	/* PER is not compiled, use -gen-PER */
+		0,
+		"bankLoadInd"
+		},
 };
 static const asn_TYPE_tag2member_t asn_MAP_RsproPDUchoice_tag2el_1[] = {
     { (ASN_TAG_CLASS_CONTEXT | (0 << 2)), 0, 0, 0 }, /* connectBankReq */
@@ -218,7 +227,8 @@ static const asn_TYPE_tag2member_t asn_MAP_RsproPDUchoice_tag2el_1[] = {
     { (ASN_TAG_CLASS_CONTEXT | (17 << 2)), 10, 0, 0 }, /* configClientBankReq */
     { (ASN_TAG_CLASS_CONTEXT | (18 << 2)), 11, 0, 0 }, /* configClientBankRes */
     { (ASN_TAG_CLASS_CONTEXT | (19 << 2)), 13, 0, 0 }, /* resetStateReq */
-    { (ASN_TAG_CLASS_CONTEXT | (20 << 2)), 14, 0, 0 } /* resetStateRes */
+    { (ASN_TAG_CLASS_CONTEXT | (20 << 2)), 14, 0, 0 }, /* resetStateRes */
+    { (ASN_TAG_CLASS_CONTEXT | (21 << 2)), 21, 0, 0 } /* bankLoadInd */
 };
 static asn_CHOICE_specifics_t asn_SPC_RsproPDUchoice_specs_1 = {
 	sizeof(struct RsproPDUchoice),
@@ -226,7 +236,7 @@ static asn_CHOICE_specifics_t asn_SPC_RsproPDUchoice_specs_1 = {
 	offsetof(struct RsproPDUchoice, present),
 	sizeof(((struct RsproPDUchoice *)0)->present),
 	asn_MAP_RsproPDUchoice_tag2el_1,
-	21,	/* Count of tags in the map */
+	22,	/* Count of tags in the map */
 	0,
 	21	/* Extensions start */
 };
@@ -249,7 +259,7 @@ asn_TYPE_descriptor_t asn_DEF_RsproPDUchoice = {
 	0,	/* No tags (count) */
 	0,	/* No PER visible constraints */
 	asn_MBR_RsproPDUchoice_1,
-	21,	/* Elements count */
+	22,	/* Elements count */
 	&asn_SPC_RsproPDUchoice_specs_1	/* Additional specs */
 };
 
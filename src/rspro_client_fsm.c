@@ -18,9 +18,11 @@
 
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <talloc.h>
 
@@ -42,24 +44,12 @@
 #define T1_WAIT_CLIENT_CONN_RES		10
 #define T2_RECONNECT			10
 
-static const int k_reestablish_delay_s[] = {
-	0, 0, 0,                            // 3 immediate retries
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1, 1, 1,       // 1 Hz for 30 seconds
-	2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-	2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-	2, 2, 2, 2, 2, 2, 2, 2, 2, 2,       // 1/2 hz for 1 minute
-	4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-	4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-	4, 4, 4, 4, 4, 4, 4, 4, 4, 4,       // 1/4 Hz for 2 minutes
-	8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-	8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-	8, 8, 8, 8, 8, 8, 8, 8, 8, 8,       // 1/8 Hz for 4 minutes
-	16,                                 // 1/16 Hz thereafter
-};
-
-#define REESTABLISH_DELAY_COUNT ARRAY_SIZE(k_reestablish_delay_s)
+/* exponential back-off for re-establishing the connection: the maximum delay doubles with each
+ * failed attempt, starting at REESTABLISH_BASE_MS and saturating at REESTABLISH_MAX_MS.  The
+ * actual delay is random between zero and that maximum, so that a crowd of clients which lost
+ * their server at the same time doesn't come back in lockstep */
+#define REESTABLISH_BASE_MS	250
+#define REESTABLISH_MAX_MS	16000
 
 /***********************************************************************
  * client-side FSM for a RSPRO connection to remsim-server
@@ -82,7 +72,7 @@ static void push_and_send(struct osmo_stream_cli *cli, struct msgb *msg_tx)
 	/* msg_tx is now queued and will be freed. */
 }
 
-static int cli_conn_send_rspro(struct osmo_stream_cli *cli, RsproPDU_t *rspro)
+static int cli_conn_send_rspro(struct rspro_server_conn *srvc, RsproPDU_t *rspro)
 {
 	struct msgb *msg = rspro_enc_msg(rspro);
 	if (!msg) {
@@ -91,14 +81,16 @@ static int cli_conn_send_rspro(struct osmo_stream_cli *cli, RsproPDU_t *rspro)
 		ASN_STRUCT_FREE(asn_DEF_RsproPDU, rspro);
 		return -1;
 	}
-	push_and_send(cli, msg);
+	clock_gettime(CLOCK_MONOTONIC, &srvc->ts.tx_encoded);
+	push_and_send(srvc->conn, msg);
+	clock_gettime(CLOCK_MONOTONIC, &srvc->ts.tx_queued);
 	return 0;
 }
 
 static int _server_conn_send_rspro(struct rspro_server_conn *srvc, RsproPDU_t *rspro)
 {
 	LOGPFSML(srvc->fi, LOGL_DEBUG, "Tx RSPRO %s\n", rspro_msgt_name(rspro));
-	return cli_conn_send_rspro(srvc->conn, rspro);
+	return cli_conn_send_rspro(srvc, rspro);
 }
 
 int server_conn_send_rspro(struct rspro_server_conn *srvc, RsproPDU_t *rspro)
@@ -128,6 +120,70 @@ enum server_conn_fsm_state {
 	SRVC_ST_REESTABLISH,
 };
 
+/* has the server accepted our ConnectClientReq/ConnectBankReq on the current connection? */
+bool server_conn_is_connected(const struct rspro_server_conn *srvc)
+{
+	return srvc->fi && srvc->fi->state == SRVC_ST_CONNECTED;
+}
+
+/*! Transmit multiple RSPRO PDUs, coalesced into as few batch frames as possible.
+ *  Only permitted if the peer negotiated batch support (see handle_rx_batch).
+ *  \param[in] srvc server connection
+ *  \param[in] pdus array of PDUs; all of them are freed by this function
+ *  \param[in] num_pdus number of elements in pdus
+ *  \returns 0 on success; negative on error */
+int server_conn_send_rspro_batch(struct rspro_server_conn *srvc, RsproPDU_t **pdus, unsigned int num_pdus)
+{
+	struct msgb *msg = NULL;
+	unsigned int i, num_in_msg = 0;
+	int rc = 0;
+
+	if (srvc->fi->state != SRVC_ST_CONNECTED) {
+		LOGPFSML(srvc->fi, LOGL_ERROR, "Cannot transmit RSPRO batch in state %s\n",
+			 osmo_fsm_inst_state_name(srvc->fi));
+		rc = -EPERM;
+		goto out_free;
+	}
+
+	for (i = 0; i < num_pdus; i++) {
+		if (!pdus[i])
+			continue;
+		LOGPFSML(srvc->fi, LOGL_DEBUG, "Tx RSPRO %s (batched)\n", rspro_msgt_name(pdus[i]));
+		if (msg && num_in_msg < RSPRO_BATCH_MAX_PDUS && rspro_batch_append(msg, pdus[i]) == 0) {
+			pdus[i] = NULL;
+			num_in_msg++;
+			continue;
+		}
+		/* current frame is full (or there is none yet): send it and start a new one */
+		if (msg)
+			push_and_send(srvc->conn, msg);
+		msg = rspro_batch_alloc();
+		if (!msg) {
+			rc = -ENOMEM;
+			goto out_free;
+		}
+		if (rspro_batch_append(msg, pdus[i]) < 0) {
+			LOGPFSML(srvc->fi, LOGL_ERROR, "Error encoding RSPRO: %s\n", rspro_msgt_name(pdus[i]));
+			msgb_free(msg);
+			rc = -EINVAL;
+			goto out_free;
+		}
+		pdus[i] = NULL;
+		num_in_msg = 1;
+	}
+	if (msg)
+		push_and_send(srvc->conn, msg);
+
+	return 0;
+
+out_free:
+	for (i = 0; i < num_pdus; i++) {
+		if (pdus[i])
+			ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdus[i]);
+	}
+	return rc;
+}
+
 static const struct value_string server_conn_fsm_event_names[] = {
 	OSMO_VALUE_STRING(SRVC_E_ESTABLISH),
 	OSMO_VALUE_STRING(SRVC_E_DISCONNECT),
@@ -223,8 +279,9 @@ static int srvc_read_cb(struct osmo_stream_cli *cli, int res, struct msgb *msg)
 {
 	enum ipaccess_proto ipa_proto = osmo_ipa_msgb_cb_proto(msg);
 	struct rspro_server_conn *srvc = osmo_stream_cli_get_data(cli);
+	RsproPDU_t *pdus[RSPRO_BATCH_MAX_PDUS];
 	RsproPDU_t *pdu;
-	int rc;
+	int i, num, rc;
 
 	if (res <= 0) {
 		LOGPFSML(srvc->fi, LOGL_NOTICE, "failed reading from socket: %d\n", res);
@@ -252,12 +309,29 @@ static int srvc_read_cb(struct osmo_stream_cli *cli, int res, struct msgb *msg)
 	case IPAC_PROTO_OSMO:
 		switch (osmo_ipa_msgb_cb_proto_ext(msg)) {
 		case IPAC_PROTO_EXT_RSPRO:
+			clock_gettime(CLOCK_MONOTONIC, &srvc->ts.rx_received);
 			LOGPFSML(srvc->fi, LOGL_DEBUG, "Received RSPRO %s\n", msgb_hexdump(msg));
+			if (srvc->handle_rx_batch) {
+				num = rspro_dec_msg_batch(msg, pdus, ARRAY_SIZE(pdus));
+				if (num <= 0) {
+					rc = -EIO;
+					break;
+				}
+				clock_gettime(CLOCK_MONOTONIC, &srvc->ts.rx_decoded);
+				if (num == 1)
+					rc = srvc->handle_rx(srvc, pdus[0]);
+				else
+					rc = srvc->handle_rx_batch(srvc, (const RsproPDU_t **) pdus, num);
+				for (i = 0; i < num; i++)
+					ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdus[i]);
+				break;
+			}
 			pdu = rspro_dec_msg(msg);
 			if (!pdu) {
 				rc = -EIO;
 				break;
 			}
+			clock_gettime(CLOCK_MONOTONIC, &srvc->ts.rx_decoded);
 			rc = srvc->handle_rx(srvc, pdu);
 			ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdu);
 			break;
@@ -285,35 +359,45 @@ static int64_t get_monotonic_ms(void)
 	return ((1000LL * t.tv_sec) + (t.tv_nsec / 1000000));
 }
 
+/* random number in [0, max] */
+static int64_t reestablish_jitter_ms(int64_t max)
+{
+	uint32_t rnd;
+
+	if (osmo_get_rand_id((uint8_t *) &rnd, sizeof(rnd)) < 0)
+		rnd = random();
+	return rnd % (max + 1);
+}
+
 static void srvc_do_reestablish(struct osmo_fsm_inst *fi)
 {
 	struct rspro_server_conn *srvc = (struct rspro_server_conn *) fi->priv;
+	const int64_t now_ms = get_monotonic_ms();
+	const int64_t since_last_ms = now_ms - srvc->reestablish_last_ms;
 
-	const int64_t since_last_ms = get_monotonic_ms() - srvc->reestablish_last_ms;
-
-	/* reset delay loop if it has been > 2x the longest timeout since our last attempt;
+	/* reset the back-off if it has been > 2x the longest timeout since our last attempt;
 	 * this lets us revert to rapid reconnect behavior for a good connection */
-	const int64_t reset_ms = 2*1000*(OSMO_MAX(OSMO_MAX(T1_WAIT_CLIENT_CONN_RES, T2_RECONNECT),
-		k_reestablish_delay_s[REESTABLISH_DELAY_COUNT-1]));
+	const int64_t reset_ms = 2 * OSMO_MAX(1000 * OSMO_MAX(T1_WAIT_CLIENT_CONN_RES, T2_RECONNECT),
+					      REESTABLISH_MAX_MS);
 
 	if (since_last_ms > reset_ms) {
-		srvc->reestablish_delay_idx = 0;
+		srvc->reestablish_attempt = 0;
+		srvc->reestablish_start_ms = now_ms;
 		LOGPFSML(fi, LOGL_DEBUG, "->REESTABLISH_DELAY reset; %" PRId64 "ms since last attempt\n",
 			since_last_ms);
 	}
 
-	/* determine if we need to delay reestablishment */
-	const int64_t need_ms = (int64_t) k_reestablish_delay_s[srvc->reestablish_delay_idx] * 1000;
-	int64_t delay_ms = need_ms - since_last_ms;
+	/* the shift saturates long before it could overflow */
+	const int64_t max_ms = REESTABLISH_BASE_MS << OSMO_MIN(srvc->reestablish_attempt, 16);
+	int64_t delay_ms = reestablish_jitter_ms(OSMO_MIN(max_ms, REESTABLISH_MAX_MS));
 
-	if (delay_ms > 0) {
-		LOGPFSML(fi, LOGL_DEBUG, "->REESTABLISH_DELAY delay %" PRId64 "ms; %" PRId64 "ms since last attempt [step %zu/%zu@%ds]\n",
-			delay_ms, since_last_ms, srvc->reestablish_delay_idx, (REESTABLISH_DELAY_COUNT-1),
-			k_reestablish_delay_s[srvc->reestablish_delay_idx]);
-	} else {
-		/* cheat and always use a minimum delay of 1ms to ensure a fsm timeout is triggered */
+	LOGPFSML(fi, LOGL_DEBUG, "->REESTABLISH_DELAY delay %" PRId64 "ms; %" PRId64 "ms since last attempt "
+		 "[attempt %u, up to %" PRId64 "ms]\n", delay_ms, since_last_ms, srvc->reestablish_attempt,
+		 OSMO_MIN(max_ms, REESTABLISH_MAX_MS));
+
+	/* cheat and always use a minimum delay of 1ms to ensure a fsm timeout is triggered */
+	if (delay_ms < 1)
 		delay_ms = 1;
-	}
 
 	osmo_fsm_inst_state_chg_ms(fi, SRVC_ST_REESTABLISH_DELAY, delay_ms, 3);
 }
@@ -338,7 +422,13 @@ static void srvc_st_established_onenter(struct osmo_fsm_inst *fi, uint32_t prev_
 		pdu = rspro_gen_ConnectClientReq(&srvc->own_comp_id, srvc->clslot);
 	else
 		pdu = rspro_gen_ConnectBankReq(&srvc->own_comp_id, srvc->bankd.bank_id,
-					       srvc->bankd.num_slots);
+					       srvc->bankd.num_slots,
+					       srvc->bankd.endpoint.af != AF_UNSPEC ?
+							&srvc->bankd.endpoint : NULL,
+					       srvc->bankd.maps_digest ? srvc->bankd.maps_digest(srvc) : -1);
+	/* announce that we can process batch frames */
+	if (pdu && srvc->handle_rx_batch)
+		pdu->version = RSPRO_VERSION_BATCH;
 	_server_conn_send_rspro(srvc, pdu);
 }
 
@@ -361,6 +451,9 @@ static void srvc_st_established(struct osmo_fsm_inst *fi, uint32_t event, void *
 				 asn_enum_name(&asn_DEF_ResultCode, res));
 			osmo_stream_cli_close(srvc->conn);
 		} else {
+			srvc->peer_version = pdu->version;
+			LOGPFSML(fi, LOGL_NOTICE, "Connected to server after %u attempts in %" PRId64 "ms\n",
+				 srvc->reestablish_attempt, get_monotonic_ms() - srvc->reestablish_start_ms);
 			/* somehow notify the main code? */
 			osmo_fsm_inst_state_chg(fi, SRVC_ST_CONNECTED, 0, 0);
 		}
@@ -430,10 +523,7 @@ static void srvc_st_reestablish_delay_onenter(struct osmo_fsm_inst *fi, uint32_t
 		srvc->conn = NULL;
 	}
 
-	/* saturate timeout at last (longest) entry */
-	if (srvc->reestablish_delay_idx < REESTABLISH_DELAY_COUNT-1) {
-		srvc->reestablish_delay_idx++;
-	}
+	srvc->reestablish_attempt++;
 }
 
 static void srvc_st_reestablish_delay(struct osmo_fsm_inst *fi, uint32_t event, void *data)
@@ -526,9 +616,10 @@ static void srvc_allstate_action(struct osmo_fsm_inst *fi, uint32_t event, void
 
 	switch (event) {
 	case SRVC_E_ESTABLISH:
-		/* reset delay connect immediately on our first connection */
-		srvc->reestablish_delay_idx = 0;
+		/* reset the back-off on our first connection */
+		srvc->reestablish_attempt = 0;
 		srvc->reestablish_last_ms = 0;
+		srvc->reestablish_start_ms = get_monotonic_ms();
 		srvc_do_reestablish(fi);
 		break;
 	case SRVC_E_DISCONNECT:
@@ -627,7 +718,7 @@ int server_conn_fsm_alloc(void *ctx, struct rspro_server_conn *srvc)
 		return -1;
 
 	srvc->fi = fi;
-	srvc->reestablish_delay_idx = 0;
+	srvc->reestablish_attempt = 0;
 	srvc->reestablish_last_ms = 0;
 
 	return 0;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <time.h>
+
 #include <osmocom/core/fsm.h>
 #include <osmocom/gsm/ipa.h>
 #include <osmocom/netif/stream.h>
@@ -24,12 +26,16 @@ struct rspro_server_conn {
 	struct osmo_fsm_inst *fi;
 	struct osmo_ipa_ka_fsm_inst *ka_fi;
 	int (*handle_rx)(struct rspro_server_conn *conn, const RsproPDU_t *pdu);
+	/* optional; if set, batch frames are negotiated and passed here as a whole */
+	int (*handle_rx_batch)(struct rspro_server_conn *conn, const RsproPDU_t **pdus, unsigned int num_pdus);
 
-	/* index into k_reestablish_delay[] for this connection */
-	size_t reestablish_delay_idx;
+	/* number of re-establish attempts since we lost the connection */
+	unsigned int reestablish_attempt;
 
 	/* timestamp of last re-establish attempt, in milliseconds */
 	int64_t reestablish_last_ms;
+	/* timestamp at which we (first) tried to [re-]establish the connection, in milliseconds */
+	int64_t reestablish_start_ms;
 
 	/* IPA protocol identity */
 	struct ipaccess_unit ipa_dev;
@@ -38,10 +44,20 @@ struct rspro_server_conn {
 	struct app_comp_id own_comp_id;
 	/* remote component ID */
 	struct app_comp_id peer_comp_id;
+	/* RSPRO version of the peer's ConnectClientRes/ConnectBankRes */
+	long peer_version;
 
 	/* client id and slot number */
 	ClientSlot_t *clslot;
 
+	/* CLOCK_MONOTONIC times of the last PDU we sent and received, for latency tracing */
+	struct {
+		struct timespec tx_encoded;
+		struct timespec tx_queued;
+		struct timespec rx_received;
+		struct timespec rx_decoded;
+	} ts;
+
 	/* configuration */
 	char *server_host;
 	uint16_t server_port;
@@ -54,8 +70,14 @@ struct rspro_server_conn {
 	struct {
 		uint16_t bank_id;
 		uint16_t num_slots;
+		/* where clients shall connect to us; AF_UNSPEC to leave it to the server */
+		struct rspro_endpoint endpoint;
+		/* optional: digest over our current mappings, see slotmap_digest() */
+		int64_t (*maps_digest)(struct rspro_server_conn *srvc);
 	} bankd;
 };
 
 int server_conn_send_rspro(struct rspro_server_conn *srvc, RsproPDU_t *rspro);
+bool server_conn_is_connected(const struct rspro_server_conn *srvc);
+int server_conn_send_rspro_batch(struct rspro_server_conn *srvc, RsproPDU_t **pdus, unsigned int num_pdus);
 int server_conn_fsm_alloc(void *ctx, struct rspro_server_conn *srvc);
@@ -17,6 +17,10 @@
  */
 
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -94,6 +98,75 @@ RsproPDU_t *rspro_dec_msg(struct msgb *msg)
 	return pdu;
 }
 
+/*! Allocate a message buffer for a batch frame. */
+struct msgb *rspro_batch_alloc(void)
+{
+	struct msgb *msg = msgb_alloc_headroom(RSPRO_BATCH_MAX_LEN + 8, 8, "RSPRO batch");
+
+	if (msg)
+		msg->l2h = msg->data;
+	return msg;
+}
+
+/*! BER-Encode an RSPRO message and append it to a batch frame.
+ *  \param[in] msg batch frame allocated by rspro_batch_alloc()
+ *  \param[in] pdu Structure describing RSPRO PDU. Is freed by this function on success
+ *  \returns 0 on success; -ENOSPC if it doesn't fit (or cannot be encoded at all)
+ */
+int rspro_batch_append(struct msgb *msg, RsproPDU_t *pdu)
+{
+	asn_enc_rval_t rval;
+
+	rval = der_encode_to_buffer(&asn_DEF_RsproPDU, pdu, msg->tail, msgb_tailroom(msg));
+	if (rval.encoded < 0)
+		return -ENOSPC;
+	msgb_put(msg, rval.encoded);
+
+	ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdu);
+
+	return 0;
+}
+
+/*! Decode all RSPRO PDUs contained in one (batch) frame.
+ *  \param[in] msg message buffer containing the frame; caller must free it
+ *  \param[out] pdus caller-allocated array receiving the decoded PDUs; caller must free them
+ *  \param[in] max_pdus number of elements in pdus
+ *  \returns number of decoded PDUs; negative on error
+ */
+int rspro_dec_msg_batch(struct msgb *msg, RsproPDU_t **pdus, unsigned int max_pdus)
+{
+	const uint8_t *cur = msgb_l2(msg);
+	size_t remain = msgb_l2len(msg);
+	unsigned int i, num = 0;
+	asn_dec_rval_t rval;
+
+	LOGP(DRSPRO, LOGL_DEBUG, "decoding %s\n", msgb_hexdump(msg));
+	while (remain > 0) {
+		RsproPDU_t *pdu = NULL;
+
+		if (num >= max_pdus) {
+			LOGP(DRSPRO, LOGL_ERROR, "Batch contains more than %u PDUs\n", max_pdus);
+			goto err;
+		}
+		rval = ber_decode(NULL, &asn_DEF_RsproPDU, (void **) &pdu, cur, remain);
+		if (rval.code != RC_OK || rval.consumed == 0) {
+			LOGP(DRSPRO, LOGL_ERROR, "Failed to decode PDU %u of batch: %d. Consumed %zu of %zu bytes\n",
+				num, rval.code, rval.consumed, remain);
+			ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdu);
+			goto err;
+		}
+		pdus[num++] = pdu;
+		cur += rval.consumed;
+		remain -= rval.consumed;
+	}
+
+	return num;
+err:
+	for (i = 0; i < num; i++)
+		ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdus[i]);
+	return -EIO;
+}
+
 static void fill_comp_id(ComponentIdentity_t *out, const struct app_comp_id *in)
 {
 	out->type = in->type;
@@ -155,17 +228,120 @@ const char *rspro_IpAddr2str(const IpAddress_t *in)
 	}
 }
 
-static void fill_ip4_port(IpPort_t *out, uint32_t ip, uint16_t port)
+bool rspro_endpoint_equals(const struct rspro_endpoint *a, const struct rspro_endpoint *b)
+{
+	if (a->af != b->af || a->port != b->port)
+		return false;
+	switch (a->af) {
+	case AF_INET:
+		return !memcmp(a->addr, b->addr, 4);
+	case AF_INET6:
+		return !memcmp(a->addr, b->addr, 16);
+	default:
+		return true;
+	}
+}
+
+/* is the address the wildcard one (0.0.0.0 / ::), i.e. "use whatever the peer connected from"? */
+bool rspro_endpoint_addr_is_any(const struct rspro_endpoint *ep)
+{
+	static const uint8_t zero[16];
+
+	switch (ep->af) {
+	case AF_INET:
+		return !memcmp(ep->addr, zero, 4);
+	case AF_INET6:
+		return !memcmp(ep->addr, zero, 16);
+	default:
+		return true;
+	}
+}
+
+int rspro_endpoint_from_str(struct rspro_endpoint *out, const char *ip, uint16_t port)
 {
-	uint32_t ip_n = htonl(ip);
-	out->ip.present = IpAddress_PR_ipv4;
-	OCTET_STRING_fromBuf(&out->ip.choice.ipv4, (const char *) &ip_n, 4);
+	memset(out, 0, sizeof(*out));
+	if (inet_pton(AF_INET, ip, out->addr) == 1)
+		out->af = AF_INET;
+	else if (inet_pton(AF_INET6, ip, out->addr) == 1)
+		out->af = AF_INET6;
+	else
+		return -EINVAL;
 	out->port = port;
+	return 0;
+}
+
+const char *rspro_endpoint_name(const struct rspro_endpoint *ep)
+{
+	static char buf[INET6_ADDRSTRLEN + 8];
+	char addr[INET6_ADDRSTRLEN];
+
+	switch (ep->af) {
+	case AF_INET:
+		inet_ntop(AF_INET, ep->addr, addr, sizeof(addr));
+		snprintf(buf, sizeof(buf), "%s:%u", addr, ep->port);
+		break;
+	case AF_INET6:
+		inet_ntop(AF_INET6, ep->addr, addr, sizeof(addr));
+		snprintf(buf, sizeof(buf), "[%s]:%u", addr, ep->port);
+		break;
+	default:
+		return "none";
+	}
+	return buf;
+}
+
+int rspro2endpoint(struct rspro_endpoint *out, const IpPort_t *in)
+{
+	memset(out, 0, sizeof(*out));
+	switch (in->ip.present) {
+	case IpAddress_PR_ipv4:
+		if (in->ip.choice.ipv4.size != 4)
+			return -EINVAL;
+		out->af = AF_INET;
+		memcpy(out->addr, in->ip.choice.ipv4.buf, 4);
+		break;
+	case IpAddress_PR_ipv6:
+		if (in->ip.choice.ipv6.size != 16)
+			return -EINVAL;
+		out->af = AF_INET6;
+		memcpy(out->addr, in->ip.choice.ipv6.buf, 16);
+		break;
+	default:
+		return -EINVAL;
+	}
+	out->port = in->port;
+	return 0;
 }
 
+/* AF_UNSPEC is encoded as 0.0.0.0:0 */
+static void fill_ip_port(IpPort_t *out, const struct rspro_endpoint *ep)
+{
+	static const uint8_t zero[4];
 
+	switch (ep->af) {
+	case AF_INET6:
+		out->ip.present = IpAddress_PR_ipv6;
+		OCTET_STRING_fromBuf(&out->ip.choice.ipv6, (const char *) ep->addr, 16);
+		break;
+	case AF_INET:
+		out->ip.present = IpAddress_PR_ipv4;
+		OCTET_STRING_fromBuf(&out->ip.choice.ipv4, (const char *) ep->addr, 4);
+		break;
+	default:
+		out->ip.present = IpAddress_PR_ipv4;
+		OCTET_STRING_fromBuf(&out->ip.choice.ipv4, (const char *) zero, 4);
+		out->port = 0;
+		return;
+	}
+	out->port = ep->port;
+}
+
+
+/* endpoint: where clients shall connect to this bankd; NULL to let the server assume
+ * the source address of our connection and the default port */
 RsproPDU_t *rspro_gen_ConnectBankReq(const struct app_comp_id *a_cid,
-					uint16_t bank_id, uint16_t num_slots)
+					uint16_t bank_id, uint16_t num_slots,
+					const struct rspro_endpoint *endpoint, int64_t maps_digest)
 {
 	RsproPDU_t *pdu = CALLOC(1, sizeof(*pdu));
 	if (!pdu)
@@ -175,6 +351,24 @@ RsproPDU_t *rspro_gen_ConnectBankReq(const struct app_comp_id *a_cid,
 	fill_comp_id(&pdu->msg.choice.connectBankReq.identity, a_cid);
 	pdu->msg.choice.connectBankReq.bankId = bank_id;
 	pdu->msg.choice.connectBankReq.numberOfSlots = num_slots;
+	if (endpoint) {
+		pdu->msg.choice.connectBankReq.bankdEndpoint =
+			CALLOC(1, sizeof(*pdu->msg.choice.connectBankReq.bankdEndpoint));
+		if (!pdu->msg.choice.connectBankReq.bankdEndpoint) {
+			ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdu);
+			return NULL;
+		}
+		fill_ip_port(pdu->msg.choice.connectBankReq.bankdEndpoint, endpoint);
+	}
+	if (maps_digest >= 0) {
+		pdu->msg.choice.connectBankReq.mappingsDigest =
+			CALLOC(1, sizeof(*pdu->msg.choice.connectBankReq.mappingsDigest));
+		if (!pdu->msg.choice.connectBankReq.mappingsDigest) {
+			ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdu);
+			return NULL;
+		}
+		*pdu->msg.choice.connectBankReq.mappingsDigest = maps_digest & 0x7fffffff;
+	}
 
 	return pdu;
 }
@@ -294,7 +488,8 @@ RsproPDU_t *rspro_gen_ConfigClientIdRes(e_ResultCode res)
 	return pdu;
 }
 
-RsproPDU_t *rspro_gen_ConfigClientBankReq(const BankSlot_t *bank, uint32_t ip, uint16_t port)
+RsproPDU_t *rspro_gen_ConfigClientBankReq(const BankSlot_t *bank, const struct rspro_endpoint *bankd,
+					  const ClientSlot_t *client)
 {
 	RsproPDU_t *pdu = CALLOC(1, sizeof(*pdu));
 	if (!pdu)
@@ -302,7 +497,9 @@ RsproPDU_t *rspro_gen_ConfigClientBankReq(const BankSlot_t *bank, uint32_t ip, u
 	pdu->version = 2;
 	pdu->msg.present = RsproPDUchoice_PR_configClientBankReq;
 	pdu->msg.choice.configClientBankReq.bankSlot = *bank;
-	fill_ip4_port(&pdu->msg.choice.configClientBankReq.bankd, ip, port);
+	fill_ip_port(&pdu->msg.choice.configClientBankReq.bankd, bankd);
+	if (client)
+		ASN_ALLOC_COPY(pdu->msg.choice.configClientBankReq.clientSlot, client);
 
 	return pdu;
 }
@@ -421,6 +618,20 @@ RsproPDU_t *rspro_gen_BankSlotStatusInd(const BankSlot_t *bank, const ClientSlot
 	return pdu;
 }
 
+RsproPDU_t *rspro_gen_BankLoadInd(uint16_t active_slots, uint32_t apdu_rate, uint32_t mean_latency_us)
+{
+	RsproPDU_t *pdu = CALLOC(1, sizeof(*pdu));
+	if (!pdu)
+		return NULL;
+	pdu->version = 2;
+	pdu->msg.present = RsproPDUchoice_PR_bankLoadInd;
+	pdu->msg.choice.bankLoadInd.activeSlots = active_slots;
+	pdu->msg.choice.bankLoadInd.apduRate = OSMO_MIN(apdu_rate, INT32_MAX);
+	pdu->msg.choice.bankLoadInd.meanLatencyUs = OSMO_MIN(mean_latency_us, INT32_MAX);
+
+	return pdu;
+}
+
 RsproPDU_t *rspro_gen_ClientSlotStatusInd(const ClientSlot_t *client, const BankSlot_t *bank,
 					  bool rst_active, int vcc_present, int clk_active,
 					  int card_present)
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #include <osmocom/core/msgb.h>
 #include <osmocom/rspro/RsproPDU.h>
 #include <osmocom/rspro/ComponentType.h>
@@ -17,13 +20,46 @@ struct app_comp_id {
 	char fw_version[MAX_NAME_LEN+1];
 };
 
+/* RSPRO version from which on a peer accepts batch frames, i.e. IPA frames containing
+ * multiple concatenated RsproPDUs.  Announced in the version of ConnectBankReq */
+#define RSPRO_VERSION_BATCH	3
+/* RSPRO version from which on a server accepts BankLoadInd.  Announced in the version of
+ * ConnectBankRes */
+#define RSPRO_VERSION_LOAD	4
+/* RSPRO version from which on a server accepts further ConnectClientReq for other client slots
+ * on an established client connection.  Announced in the version of ConnectClientRes */
+#define RSPRO_VERSION_MULTISLOT	5
+/* maximum payload size and number of PDUs within one batch frame */
+#define RSPRO_BATCH_MAX_LEN	4000
+#define RSPRO_BATCH_MAX_PDUS	256
+
+/* a transport address as carried in an RSPRO IpPort */
+struct rspro_endpoint {
+	/* AF_INET or AF_INET6; AF_UNSPEC if there is none */
+	int af;
+	/* address in network byte order; 4 or 16 bytes used depending on af */
+	uint8_t addr[16];
+	uint16_t port;
+};
+
+bool rspro_endpoint_equals(const struct rspro_endpoint *a, const struct rspro_endpoint *b);
+bool rspro_endpoint_addr_is_any(const struct rspro_endpoint *ep);
+int rspro_endpoint_from_str(struct rspro_endpoint *out, const char *ip, uint16_t port);
+const char *rspro_endpoint_name(const struct rspro_endpoint *ep);
+int rspro2endpoint(struct rspro_endpoint *out, const IpPort_t *in);
+
 const char *rspro_msgt_name(const RsproPDU_t *pdu);
 
 struct msgb *rspro_msgb_alloc(void);
 struct msgb *rspro_enc_msg(RsproPDU_t *pdu);
 RsproPDU_t *rspro_dec_msg(struct msgb *msg);
+struct msgb *rspro_batch_alloc(void);
+int rspro_batch_append(struct msgb *msg, RsproPDU_t *pdu);
+int rspro_dec_msg_batch(struct msgb *msg, RsproPDU_t **pdus, unsigned int max_pdus);
+/* maps_digest is omitted if negative */
 RsproPDU_t *rspro_gen_ConnectBankReq(const struct app_comp_id *a_cid,
-					uint16_t bank_id, uint16_t num_slots);
+					uint16_t bank_id, uint16_t num_slots,
+					const struct rspro_endpoint *endpoint, int64_t maps_digest);
 RsproPDU_t *rspro_gen_ConnectBankRes(const struct app_comp_id *a_cid, e_ResultCode res);
 RsproPDU_t *rspro_gen_ConnectClientReq(const struct app_comp_id *a_cid, const ClientSlot_t *client);
 RsproPDU_t *rspro_gen_ConnectClientRes(const struct app_comp_id *a_cid, e_ResultCode res);
@@ -33,7 +69,8 @@ RsproPDU_t *rspro_gen_RemoveMappingReq(const ClientSlot_t *client, const BankSlo
 RsproPDU_t *rspro_gen_RemoveMappingRes(e_ResultCode res);
 RsproPDU_t *rspro_gen_ConfigClientIdReq(const ClientSlot_t *client);
 RsproPDU_t *rspro_gen_ConfigClientIdRes(e_ResultCode res);
-RsproPDU_t *rspro_gen_ConfigClientBankReq(const BankSlot_t *bank, uint32_t ip, uint16_t port);
+RsproPDU_t *rspro_gen_ConfigClientBankReq(const BankSlot_t *bank, const struct rspro_endpoint *bankd,
+					  const ClientSlot_t *client);
 RsproPDU_t *rspro_gen_ConfigClientBankRes(e_ResultCode res);
 RsproPDU_t *rspro_gen_SetAtrReq(uint16_t client_id, uint16_t slot_nr, const uint8_t *atr,
 				unsigned int atr_len);
@@ -45,6 +82,7 @@ RsproPDU_t *rspro_gen_TpduCard2Modem(const BankSlot_t *bank, const ClientSlot_t
 RsproPDU_t *rspro_gen_BankSlotStatusInd(const BankSlot_t *bank, const ClientSlot_t *client,
 					bool rst_active, int vcc_present, int clk_active,
 					int card_present);
+RsproPDU_t *rspro_gen_BankLoadInd(uint16_t active_slots, uint32_t apdu_rate, uint32_t mean_latency_us);
 RsproPDU_t *rspro_gen_ClientSlotStatusInd(const ClientSlot_t *client, const BankSlot_t *bank,
 					  bool rst_active, int vcc_present, int clk_active,
 					  int card_present);
@@ -0,0 +1,270 @@
+/* Metrics of the remsim-server in the Prometheus text exposition format
+ *
+ * Slotmaps carry the time they entered each state.  Whenever a map changes its state (or is
+ * finally freed), the time spent in the previous state is added to the histogram of that
+ * transition, so we know how long provisioning a map to its bankd takes, and where the time
+ * is spent.  Along with that we report the number of slotmaps per state, the number of RSPRO
+ * connections per FSM state, and the PDUs received and sent per bankd and client slot.  The
+ * latter are labelled by bank_id / client_id:slot_nr rather than by connection, so
+ * reconnecting peers don't add new series.
+ *
+ * Histograms are updated by whichever thread changes a map, and read by the REST threads
+ * without any locking.  A scrape may thus see a histogram whose count is off by one from the
+ * sum of its buckets, which Prometheus tolerates.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/fsm.h>
+
+#include "slotmap.h"
+#include "rspro_server.h"
+#include "state_snapshot.h"
+#include "metrics.h"
+
+/* upper bounds of the buckets in microseconds, from 100us to one minute */
+static const uint64_t g_bucket_us[LATENCY_HIST_BUCKETS] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 30000000, 60000000,
+};
+
+/* pseudo-state of a freed map, as the target of a transition */
+#define SLMAP_S_GONE	SLMAP_S_NUM
+
+/* time spent in a state before moving on to another one (or being removed) */
+static struct latency_hist g_transitions[SLMAP_S_NUM][SLMAP_S_NUM + 1];
+/* from creation (or re-attaching to a bankd) until the bankd acknowledged the map */
+static struct latency_hist g_provision;
+/* from the deletion request until the bankd confirmed it */
+static struct latency_hist g_teardown;
+
+void latency_hist_observe(struct latency_hist *h, uint64_t us)
+{
+	unsigned int i;
+
+	for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+		if (us <= g_bucket_us[i])
+			break;
+	}
+	atomic_fetch_add(&h->buckets[i], 1);
+	atomic_fetch_add(&h->sum_us, us);
+	atomic_fetch_add(&h->count, 1);
+}
+
+static uint64_t ts_diff_us(const struct timespec *later, const struct timespec *earlier)
+{
+	int64_t us = (later->tv_sec - earlier->tv_sec) * 1000000 +
+		     (later->tv_nsec - earlier->tv_nsec) / 1000;
+
+	return us > 0 ? us : 0;
+}
+
+static bool ts_isset(const struct timespec *ts)
+{
+	return ts->tv_sec || ts->tv_nsec;
+}
+
+void metrics_slotmap_transition(const struct slot_mapping *map, bool freed)
+{
+	struct timespec now;
+
+	if (freed) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		latency_hist_observe(&g_transitions[map->state][SLMAP_S_GONE],
+				     ts_diff_us(&now, &map->entered[map->state]));
+		if ((map->state == SLMAP_S_DELETE_REQ || map->state == SLMAP_S_DELETING) &&
+		    ts_isset(&map->entered[SLMAP_S_DELETE_REQ]))
+			latency_hist_observe(&g_teardown, ts_diff_us(&now, &map->entered[SLMAP_S_DELETE_REQ]));
+		return;
+	}
+
+	latency_hist_observe(&g_transitions[map->prev_state][map->state],
+			     ts_diff_us(&map->entered[map->state], &map->entered[map->prev_state]));
+	if (map->state == SLMAP_S_ACTIVE && map->prev_state == SLMAP_S_UNACKNOWLEDGED)
+		latency_hist_observe(&g_provision, ts_diff_us(&map->entered[SLMAP_S_ACTIVE],
+							      &map->entered[SLMAP_S_NEW]));
+}
+
+static void hist_write(FILE *f, const char *name, const char *labels, const struct latency_hist *h)
+{
+	const char *sep = labels[0] ? "," : "";
+	unsigned long cum = 0;
+	unsigned int i;
+
+	for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+		cum += atomic_load(&h->buckets[i]);
+		fprintf(f, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep, g_bucket_us[i] / 1e6, cum);
+	}
+	cum += atomic_load(&h->buckets[i]);
+	fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, cum);
+	if (labels[0]) {
+		fprintf(f, "%s_sum{%s} %.6f\n", name, labels, atomic_load(&h->sum_us) / 1e6);
+		fprintf(f, "%s_count{%s} %lu\n", name, labels, cum);
+	} else {
+		fprintf(f, "%s_sum %.6f\n", name, atomic_load(&h->sum_us) / 1e6);
+		fprintf(f, "%s_count %lu\n", name, cum);
+	}
+}
+
+static void write_slotmap_metrics(FILE *f)
+{
+	unsigned long num[SLMAP_S_NUM] = { 0 };
+	struct state_snapshot *snap;
+	const struct snap_chunk *chunk;
+	char labels[64];
+	unsigned int i, j;
+
+	fprintf(f, "# HELP remsim_slotmap_transition_seconds Time a slotmap spent in a state before "
+		"moving to the next one\n");
+	fprintf(f, "# TYPE remsim_slotmap_transition_seconds histogram\n");
+	for (i = 0; i < SLMAP_S_NUM; i++) {
+		for (j = 0; j <= SLMAP_S_NUM; j++) {
+			/* only report transitions which ever happened */
+			if (!atomic_load(&g_transitions[i][j].count))
+				continue;
+			snprintf(labels, sizeof(labels), "from=\"%s\",to=\"%s\"", slotmap_state_name(i),
+				 j == SLMAP_S_GONE ? "GONE" : slotmap_state_name(j));
+			hist_write(f, "remsim_slotmap_transition_seconds", labels, &g_transitions[i][j]);
+		}
+	}
+
+	fprintf(f, "# HELP remsim_slotmap_provision_seconds Time from creating a slotmap until its "
+		"bankd acknowledged it\n");
+	fprintf(f, "# TYPE remsim_slotmap_provision_seconds histogram\n");
+	hist_write(f, "remsim_slotmap_provision_seconds", "", &g_provision);
+	fprintf(f, "# HELP remsim_slotmap_teardown_seconds Time from requesting the deletion of a "
+		"slotmap until it was gone\n");
+	fprintf(f, "# TYPE remsim_slotmap_teardown_seconds histogram\n");
+	hist_write(f, "remsim_slotmap_teardown_seconds", "", &g_teardown);
+
+	snap = state_snapshot_get();
+	if (!snap)
+		return;
+	for (i = 0; i < SNAP_NUM_CHUNKS; i++) {
+		chunk = snap->slotmaps[i];
+		if (!chunk)
+			continue;
+		for (j = 0; j < chunk->num; j++)
+			num[chunk->maps[j].state]++;
+	}
+	state_snapshot_put(snap);
+
+	fprintf(f, "# HELP remsim_slotmaps Number of slotmaps per state\n");
+	fprintf(f, "# TYPE remsim_slotmaps gauge\n");
+	for (i = 0; i < SLMAP_S_NUM; i++)
+		fprintf(f, "remsim_slotmaps{state=\"%s\"} %lu\n", slotmap_state_name(i), num[i]);
+}
+
+/* what we report about each connection, copied while holding srv->rwlock */
+struct conn_metrics {
+	/* bank_id or client_id and slot_nr, if the connection is on srv->banks or srv->clients */
+	uint16_t id;
+	uint16_t slot_nr;
+	const char *state;
+	unsigned long rx_pdus;
+	unsigned long tx_pdus;
+};
+
+static unsigned int _copy_conn_metrics(struct conn_metrics *out, struct llist_head *list,
+				       struct rspro_server *srv)
+{
+	struct rspro_client_conn *conn;
+	unsigned int num = 0;
+
+	llist_for_each_entry(conn, list, list) {
+		if (conn->fi)
+			out[num].state = osmo_fsm_inst_state_name(conn->fi);
+		if (list == &srv->banks) {
+			out[num].id = conn->bank.bank_id;
+		} else if (list == &srv->clients) {
+			out[num].id = conn->client.slot.client_id;
+			out[num].slot_nr = conn->client.slot.slot_nr;
+		}
+		out[num].rx_pdus = atomic_load(&conn->rx_pdus);
+		out[num].tx_pdus = atomic_load(&conn->tx_pdus);
+		num++;
+	}
+	return num;
+}
+
+static void write_conn_counter(FILE *f, const char *name, const struct conn_metrics *c, bool bank,
+			       unsigned long val)
+{
+	if (bank)
+		fprintf(f, "%s{bank_id=\"%u\"} %lu\n", name, c->id, val);
+	else
+		fprintf(f, "%s{client_id=\"%u\",slot_nr=\"%u\"} %lu\n", name, c->id, c->slot_nr, val);
+}
+
+static void write_conn_metrics(FILE *f, struct rspro_server *srv)
+{
+	/* FSM state names and the number of connections in them */
+	struct {
+		const char *name;
+		unsigned long num;
+	} states[16];
+	unsigned int i, j, num, num_states = 0, num_unlisted, num_clients;
+	struct conn_metrics *conns;
+
+	/* only copy under the lock, so we never delay the RSPRO threads by formatting */
+	pthread_rwlock_rdlock(&srv->rwlock);
+	num = llist_count(&srv->connections) + llist_count(&srv->clients) + llist_count(&srv->banks);
+	conns = calloc(num ? num : 1, sizeof(*conns));
+	if (!conns) {
+		pthread_rwlock_unlock(&srv->rwlock);
+		return;
+	}
+	num_unlisted = _copy_conn_metrics(conns, &srv->connections, srv);
+	num = num_unlisted;
+	num += _copy_conn_metrics(conns + num, &srv->clients, srv);
+	num_clients = num;
+	num += _copy_conn_metrics(conns + num, &srv->banks, srv);
+	pthread_rwlock_unlock(&srv->rwlock);
+
+	for (i = 0; i < num; i++) {
+		if (!conns[i].state)
+			continue;
+		for (j = 0; j < num_states; j++) {
+			if (!strcmp(states[j].name, conns[i].state))
+				break;
+		}
+		if (j == num_states) {
+			if (num_states == ARRAY_SIZE(states))
+				continue;
+			states[num_states].name = conns[i].state;
+			states[num_states++].num = 0;
+		}
+		states[j].num++;
+	}
+
+	fprintf(f, "# HELP remsim_rspro_connections Number of RSPRO connections per FSM state\n");
+	fprintf(f, "# TYPE remsim_rspro_connections gauge\n");
+	for (j = 0; j < num_states; j++)
+		fprintf(f, "remsim_rspro_connections{state=\"%s\"} %lu\n", states[j].name, states[j].num);
+
+	/* connections which haven't identified themselves yet are not reported */
+	fprintf(f, "# HELP remsim_rspro_rx_pdus_total RSPRO PDUs received per client slot or bankd\n");
+	fprintf(f, "# TYPE remsim_rspro_rx_pdus_total counter\n");
+	for (i = num_unlisted; i < num; i++)
+		write_conn_counter(f, "remsim_rspro_rx_pdus_total", &conns[i], i >= num_clients,
+				   conns[i].rx_pdus);
+	fprintf(f, "# HELP remsim_rspro_tx_pdus_total RSPRO PDUs sent per client slot or bankd\n");
+	fprintf(f, "# TYPE remsim_rspro_tx_pdus_total counter\n");
+	for (i = num_unlisted; i < num; i++)
+		write_conn_counter(f, "remsim_rspro_tx_pdus_total", &conns[i], i >= num_clients,
+				   conns[i].tx_pdus);
+
+	free(conns);
+}
+
+void metrics_write(FILE *f, struct rspro_server *srv)
+{
+	write_slotmap_metrics(f);
+	write_conn_metrics(f, srv);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "slotmap.h"
+
+struct rspro_server;
+
+/* number of finite buckets of a latency histogram, see metrics.c for their bounds */
+#define LATENCY_HIST_BUCKETS	18
+
+/* histogram of latencies; may be updated by any thread */
+struct latency_hist {
+	/* non-cumulative; the last one counts everything above the largest bound */
+	atomic_ulong buckets[LATENCY_HIST_BUCKETS + 1];
+	atomic_ulong sum_us;
+	atomic_ulong count;
+};
+
+void latency_hist_observe(struct latency_hist *h, uint64_t us);
+
+/* account for a state change of a slotmap, or it being freed; slotmaps->transition_cb */
+void metrics_slotmap_transition(const struct slot_mapping *map, bool freed);
+
+/* write all metrics in the Prometheus text exposition format; any thread */
+void metrics_write(FILE *f, struct rspro_server *srv);
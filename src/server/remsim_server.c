@@ -1,11 +1,11 @@
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
+#include <errno.h>
 
 #define _GNU_SOURCE
 #include <getopt.h>
 
-#include <sys/eventfd.h>
-
 #include <osmocom/core/utils.h>
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/logging.h>
@@ -17,12 +17,47 @@
 #include "slotmap.h"
 #include "rest_api.h"
 #include "rspro_server.h"
+#include "sim_pool.h"
+#include "state_log.h"
+#include "state_snapshot.h"
+#include "replication.h"
+#include "metrics.h"
 
 struct rspro_server *g_rps;
 void *g_tall_ctx;
 __thread void *talloc_asn1_ctx;
 
-struct osmo_fd g_event_ofd;
+/* provisioning parameters from the command line; 0 means 'use default' */
+static int g_max_inflight;
+static int g_op_timeout_s;
+static int g_op_max_retries = -1;
+/* file name of the persistent slotmap snapshot; NULL means 'don't persist' */
+static const char *g_state_file;
+/* number of RSPRO I/O threads, including the main thread */
+static int g_io_threads = 1;
+static int g_accept_rate = -1;
+static int g_config_rate = -1;
+/* active/standby replication: port to serve standby servers on (0 = none), and the primary
+ * server to follow if we are a standby */
+static int g_repl_port;
+static char *g_standby_of;
+static int g_standby_port = REPL_DEFAULT_PORT;
+static int g_failover_timeout_ms = 3000;
+static const char *g_takeover_script;
+static void *g_rest_ctx;
+static struct replication *g_repl;
+
+/* slotmaps->change_cb: called with slotmaps->rwlock held for writing */
+static void slotmap_changed(const struct slot_mapping *map, bool removed)
+{
+	state_log_slotmap(map, removed);
+	_sim_pools_slotmap_changed(g_rps->pools, map, removed);
+}
+
+static uint64_t pool_bank_load(uint16_t bank_id)
+{
+	return bankd_load_permille(g_rps, bank_id);
+}
 
 static void handle_sig_usr1(int signal)
 {
@@ -37,6 +72,17 @@ static void print_help()
 		"  -V --version             Print version of the program\n"
 		"  -d --debug option        Enable debug logging (e.g. DMAIN:DST2)\n"
 		"  -L --disable-color       Disable colors for logging to stderr\n"
+		"  -w --max-inflight NR     Maximum unacknowledged slotmap requests per bankd (default: 128)\n"
+		"  -t --map-timeout SECS    Re-transmit unacknowledged slotmap requests after SECS (default: 10)\n"
+		"  -r --map-retries NR      Drop bankd connection after NR unanswered re-transmissions (default: 3)\n"
+		"  -s --state-file PATH     Persist slotmaps in PATH (plus PATH.journal) and restore them on start\n"
+		"  -T --io-threads NR       Serve RSPRO connections in NR threads (default: 1)\n"
+		"  -a --accept-rate NR      Accept at most NR new connections per second; 0 = unlimited (default: 500)\n"
+		"  -c --config-rate NR      Configure at most NR clients per second; 0 = unlimited (default: 500)\n"
+		"  -R --repl-port PORT      Replicate our state to standby servers connecting to PORT\n"
+		"  -S --standby-of HOST[:PORT]  Run as standby of the primary server at HOST (default port: 9996)\n"
+		"  -F --failover-timeout MS Take over after the primary was silent for MS (default: 3000)\n"
+		"  -X --takeover-script CMD Run CMD before taking over, e.g. to move a virtual IP address\n"
 		);
 }
 
@@ -49,10 +95,22 @@ static void handle_options(int argc, char **argv)
 			{ "version", 0, 0, 'V' },
 			{ "debug", 1, 0, 'd' },
 			{ "disable-color", 0, 0, 'L' },
+			{ "max-inflight", 1, 0, 'w' },
+			{ "map-timeout", 1, 0, 't' },
+			{ "map-retries", 1, 0, 'r' },
+			{ "state-file", 1, 0, 's' },
+			{ "io-threads", 1, 0, 'T' },
+			{ "accept-rate", 1, 0, 'a' },
+			{ "config-rate", 1, 0, 'c' },
+			{ "repl-port", 1, 0, 'R' },
+			{ "standby-of", 1, 0, 'S' },
+			{ "failover-timeout", 1, 0, 'F' },
+			{ "takeover-script", 1, 0, 'X' },
 			{ 0, 0, 0, 0 }
 		};
+		char *colon;
 
-		c = getopt_long(argc, argv, "hVd:L", long_options, &option_index);
+		c = getopt_long(argc, argv, "hVd:Lw:t:r:s:T:a:c:R:S:F:X:", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -71,6 +129,93 @@ static void handle_options(int argc, char **argv)
 		case 'L':
 			log_set_use_color(osmo_stderr_target, 0);
 			break;
+		case 'w':
+			g_max_inflight = atoi(optarg);
+			if (g_max_inflight < 1) {
+				fprintf(stderr, "Invalid maximum number of in-flight requests '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 't':
+			g_op_timeout_s = atoi(optarg);
+			if (g_op_timeout_s < 1) {
+				fprintf(stderr, "Invalid slotmap request timeout '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'r':
+			g_op_max_retries = atoi(optarg);
+			if (g_op_max_retries < 0) {
+				fprintf(stderr, "Invalid number of slotmap request retries '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 's':
+			g_state_file = optarg;
+			break;
+		case 'T':
+			g_io_threads = atoi(optarg);
+			if (g_io_threads < 1 || g_io_threads > RSPRO_MAX_SHARDS) {
+				fprintf(stderr, "Invalid number of I/O threads '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'a':
+			g_accept_rate = atoi(optarg);
+			if (g_accept_rate < 0) {
+				fprintf(stderr, "Invalid rate of new connections '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'c':
+			g_config_rate = atoi(optarg);
+			if (g_config_rate < 0) {
+				fprintf(stderr, "Invalid rate of client configurations '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'R':
+			g_repl_port = atoi(optarg);
+			if (g_repl_port < 1 || g_repl_port > 65535) {
+				fprintf(stderr, "Invalid replication port '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'S':
+			/* HOST, HOST:PORT, IPV6, or [IPV6]:PORT */
+			g_standby_of = optarg;
+			colon = strrchr(optarg, ':');
+			if (optarg[0] == '[') {
+				g_standby_of = optarg + 1;
+				colon = strchr(optarg, ']');
+				if (!colon) {
+					fprintf(stderr, "Invalid primary server '%s'\n", optarg);
+					exit(2);
+				}
+				*colon++ = '\0';
+				if (*colon != ':')
+					colon = NULL;
+			} else if (colon && strchr(optarg, ':') != colon)
+				colon = NULL;
+			if (colon) {
+				*colon = '\0';
+				g_standby_port = atoi(colon + 1);
+				if (g_standby_port < 1 || g_standby_port > 65535) {
+					fprintf(stderr, "Invalid port of primary server '%s'\n", colon + 1);
+					exit(2);
+				}
+			}
+			break;
+		case 'F':
+			g_failover_timeout_ms = atoi(optarg);
+			if (g_failover_timeout_ms < 100) {
+				fprintf(stderr, "Invalid failover timeout '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'X':
+			g_takeover_script = optarg;
+			break;
 		default:
 			/* ignore */
 			break;
@@ -83,10 +228,40 @@ static void handle_options(int argc, char **argv)
 	}
 }
 
+/* start serving RSPRO and REST, and replicating to standby servers if configured */
+static int serve(struct rspro_server *srv)
+{
+	int rc;
+
+	rc = rspro_server_listen(srv);
+	if (rc < 0)
+		return rc;
+	/* REST readers only ever see published snapshots; make sure there is one */
+	state_snapshot_publish(srv);
+	rc = rest_api_init(g_rest_ctx, 9997);
+	if (rc < 0)
+		return rc;
+	if (g_repl_port) {
+		g_repl = replication_primary_create(g_tall_ctx, srv, "0.0.0.0", g_repl_port);
+		if (!g_repl)
+			return -EIO;
+	}
+	return 0;
+}
+
+/* we are a standby server and the primary has failed */
+static void promote(struct rspro_server *srv)
+{
+	if (serve(srv) < 0) {
+		LOGP(DMAIN, LOGL_FATAL, "Cannot take over as primary server\n");
+		exit(1);
+	}
+}
+
 int main(int argc, char **argv)
 {
+	struct replication *standby;
 	char hostname[256];
-	void *talloc_rest_ctx;
 	int rc;
 
 	if (gethostname(hostname, sizeof(hostname)) < 0)
@@ -94,8 +269,7 @@ int main(int argc, char **argv)
 
 	g_tall_ctx = talloc_named_const(NULL, 0, "global");
 	talloc_asn1_ctx = talloc_named_const(g_tall_ctx, 0, "asn1");
-	talloc_rest_ctx = talloc_named_const(g_tall_ctx, 0, "rest");
-	msgb_talloc_ctx_init(g_tall_ctx, 0);
+	g_rest_ctx = talloc_named_const(g_tall_ctx, 0, "rest");
 
 	osmo_init_logging2(g_tall_ctx, &log_info);
 	log_set_print_level(osmo_stderr_target, 1);
@@ -107,12 +281,39 @@ int main(int argc, char **argv)
 
 	handle_options(argc, argv);
 
+	/* talloc isn't thread-safe: with several I/O threads, msgbs must not share a parent */
+	if (g_io_threads == 1)
+		msgb_talloc_ctx_init(g_tall_ctx, 0);
+
 	g_rps = rspro_server_create(g_tall_ctx, "0.0.0.0", 9998);
 	if (!g_rps)
 		exit(1);
 	g_rps->slotmaps = slotmap_init(g_rps);
 	if (!g_rps->slotmaps)
 		goto out_rspro;
+	g_rps->pools = sim_pools_init(g_rps->slotmaps);
+	if (!g_rps->pools)
+		goto out_slotmaps;
+	g_rps->pools->bank_load_cb = pool_bank_load;
+	if (g_max_inflight)
+		g_rps->cfg.max_inflight = g_max_inflight;
+	if (g_op_timeout_s)
+		g_rps->cfg.op_timeout_s = g_op_timeout_s;
+	if (g_op_max_retries >= 0)
+		g_rps->cfg.op_max_retries = g_op_max_retries;
+	if (g_accept_rate >= 0)
+		g_rps->cfg.accept_rate = g_accept_rate;
+	if (g_config_rate >= 0)
+		g_rps->cfg.config_rate = g_config_rate;
+	if (g_state_file) {
+		g_rps->store = slotmap_store_open(g_rps, g_rps->slotmaps, g_state_file);
+		if (!g_rps->store)
+			goto out_slotmaps;
+	}
+	/* report all further slotmap changes to REST watchers and SIM pools */
+	state_log_init();
+	g_rps->slotmaps->change_cb = slotmap_changed;
+	g_rps->slotmaps->transition_cb = metrics_slotmap_transition;
 
 	g_rps->comp_id.type = ComponentType_remsimServer;
 	OSMO_STRLCPY_ARRAY(g_rps->comp_id.name, hostname);
@@ -120,33 +321,39 @@ int main(int argc, char **argv)
 	OSMO_STRLCPY_ARRAY(g_rps->comp_id.sw_version, PACKAGE_VERSION);
 	/* FIXME: other members of app_comp_id */
 
-	rc = eventfd(0, 0);
+	rc = rspro_server_start_shards(g_rps, g_io_threads);
 	if (rc < 0)
 		goto out_rps;
-	osmo_fd_setup(&g_event_ofd, rc, OSMO_FD_READ, event_fd_cb, g_rps, 0);
-	rc = osmo_fd_register(&g_event_ofd);
-	if (rc < 0)
-		goto out_eventfd;
 
 	signal(SIGUSR1, handle_sig_usr1);
 
-	rc = rest_api_init(talloc_rest_ctx, 9997);
-	if (rc < 0)
-		goto out_unregister;
+	if (g_standby_of) {
+		/* serve nothing until we take over */
+		standby = replication_standby_create(g_tall_ctx, g_rps, g_standby_of, g_standby_port,
+						     g_failover_timeout_ms, g_takeover_script, promote);
+		if (!standby)
+			goto out_rps;
+	} else {
+		rc = serve(g_rps);
+		if (rc < 0)
+			goto out_rps;
+	}
 
 	while (1) {
 		osmo_select_main(0);
+		/* publish whatever RSPRO processing changed, and replicate it */
+		state_snapshot_publish(g_rps);
+		replication_flush(g_repl);
 	}
 
 	rest_api_fini();
+	slotmap_store_close(g_rps->store);
 
 	exit(0);
 
-out_unregister:
-	osmo_fd_unregister(&g_event_ofd);
-out_eventfd:
-	close(g_event_ofd.fd);
 out_rps:
+	slotmap_store_close(g_rps->store);
+out_slotmaps:
 	talloc_free(g_rps->slotmaps);
 out_rspro:
 	rspro_server_destroy(g_rps);
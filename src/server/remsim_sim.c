@@ -0,0 +1,1269 @@
+/* In-process scale simulator for the remsim-server
+ *
+ * Runs the RSPRO server on the loopback interface in the main thread (plus any number of I/O
+ * threads), and drives it with thousands of synthetic clients and bankds from a separate
+ * thread.  The synthetic peers speak just enough RSPRO to be provisioned: they connect,
+ * acknowledge the slotmaps and bankd configurations they are sent, and answer keep-alives.
+ *
+ * What happens is described by a scenario file, one command per line:
+ *
+ *   banks N SLOTS        connect N more bankds with SLOTS slots each
+ *   clients N [RATE]     connect N more clients, at most RATE per second (default: unlimited)
+ *   maps N               map N unmapped clients to free bankd slots
+ *   unmap N              delete N random slotmaps
+ *   replace N            swap the bankd slots of N random mapped clients, by replacing the
+ *                        entire table as a PUT via REST would
+ *   churn clients|banks N  drop N random connections, which then reconnect
+ *   reset                delete all slotmaps, as a global reset via REST would
+ *   sleep MS             let MS milliseconds pass
+ *   wait [SECS]          wait until everything converged (default timeout: 60s)
+ *
+ * Each 'wait' reports the time it took for the server state to converge with the commands
+ * since the previous 'wait', along with the CPU time the server spent, its memory use and
+ * the contention on the slotmaps lock.  The state has converged once all peers are
+ * connected, every slotmap is ACTIVE, each bankd holds exactly the maps it should, and each
+ * mapped client was told its bankd slot.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <getopt.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/fsm.h>
+#include <osmocom/core/application.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/gsm/ipa.h>
+#include <osmocom/gsm/protocol/ipaccess.h>
+
+#include "debug.h"
+#include "rspro_util.h"
+#include "slotmap.h"
+#include "rspro_server.h"
+#include "sim_pool.h"
+#include "state_log.h"
+#include "state_snapshot.h"
+#include "metrics.h"
+
+struct rspro_server *g_rps;
+void *g_tall_ctx;
+__thread void *talloc_asn1_ctx;
+
+/* delay before a peer whose connection was lost or rejected connects again */
+#define RECONNECT_DELAY_US	100000
+/* how often we check whether the state has converged */
+#define CONVERGE_CHECK_US	10000
+/* bankd_id is also the index into srv->warm_endpoints and the snapshot chunks */
+#define SIM_MAX_BANKS		RSPRO_NUM_BANK_IDS
+#define SIM_MAX_CLIENTS		65536
+/* marks a handle as referring to a bankd rather than a client */
+#define HANDLE_BANK		0x80000000
+
+static int g_port = 19998;
+static int g_io_threads = 1;
+static int g_max_inflight;
+static int g_accept_rate = -1;
+static int g_config_rate = -1;
+static const char *g_metrics_file;
+static const char *g_scenario_file;
+
+enum sim_cmd {
+	SIM_CMD_BANKS,
+	SIM_CMD_CLIENTS,
+	SIM_CMD_MAPS,
+	SIM_CMD_UNMAP,
+	SIM_CMD_REPLACE,
+	SIM_CMD_CHURN_CLIENTS,
+	SIM_CMD_CHURN_BANKS,
+	SIM_CMD_RESET,
+	SIM_CMD_SLEEP,
+	SIM_CMD_WAIT,
+};
+
+struct sim_step {
+	enum sim_cmd cmd;
+	unsigned int arg[2];
+	char text[64];
+};
+
+struct sim_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+enum peer_state {
+	/* not (yet) connected */
+	PEER_S_IDLE,
+	/* on the queue of peers waiting to connect */
+	PEER_S_QUEUED,
+	/* connected, ConnectClientReq / ConnectBankReq sent */
+	PEER_S_WAIT_RES,
+	/* accepted by the server */
+	PEER_S_UP,
+};
+
+struct sim_peer {
+	enum peer_state state;
+	int fd;
+	uint16_t id;
+	/* not to be connected before this time */
+	uint64_t due_us;
+	struct sim_buf rx;
+	struct sim_buf tx;
+	union {
+		struct {
+			uint16_t num_slots;
+			/* slots the server told us to map, and the slots the scenario mapped */
+			uint8_t *mapped;
+			uint8_t *assigned;
+			unsigned int num_mapped;
+		} bank;
+		struct {
+			/* bank slot we were sent in ConfigClientBankReq */
+			bool configured;
+			struct bank_slot bank;
+			/* bank slot the scenario mapped us to */
+			bool assigned;
+			struct bank_slot expect;
+		} client;
+	};
+};
+
+/* all state of the simulator thread */
+static struct {
+	struct sockaddr_in addr;
+	int epfd;
+
+	struct sim_peer banks[SIM_MAX_BANKS];
+	unsigned int num_banks;
+	struct sim_peer *clients;
+	unsigned int num_clients;
+	/* number of slotmaps the scenario created and didn't delete yet */
+	unsigned int num_maps;
+	/* bankd at which to start looking for a free slot */
+	unsigned int next_bank;
+
+	/* handles of peers waiting to connect, oldest first */
+	uint32_t queue[SIM_MAX_BANKS + SIM_MAX_CLIENTS];
+	unsigned int queue_head;
+	unsigned int queue_len;
+	/* connections per second; 0 = unlimited */
+	unsigned int rate;
+	double tokens;
+	uint64_t tokens_last_us;
+
+	/* connections lost or rejected */
+	unsigned int num_lost;
+	struct app_comp_id client_id;
+	struct app_comp_id bank_id;
+	struct rspro_endpoint bankd_endpoint;
+} g_sim;
+
+static volatile bool g_stop;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/***********************************************************************
+ * commands executed in the main thread
+ ***********************************************************************/
+
+/* slotmaps to be created or deleted by the main thread */
+struct maps_cmd {
+	const struct bank_slot *bank;
+	const struct client_slot *client;
+	unsigned int num;
+	bool del;
+	/* number of maps which could not be created, or were not found */
+	unsigned int failed;
+};
+
+static void cmd_maps(struct rspro_server *srv, void *data)
+{
+	struct maps_cmd *cmd = data;
+	struct slot_mapping *map;
+	unsigned int i;
+
+	slotmaps_wrlock(srv->slotmaps);
+	for (i = 0; i < cmd->num; i++) {
+		if (cmd->del) {
+			map = _slotmap_by_bank(srv->slotmaps, &cmd->bank[i]);
+			if (map)
+				_slotmap_mark_deleted(srv, map);
+			else
+				cmd->failed++;
+			continue;
+		}
+		map = _slotmap_add(srv->slotmaps, &cmd->bank[i], &cmd->client[i]);
+		if (map)
+			_slotmap_attach_bankd(srv, map);
+		else
+			cmd->failed++;
+	}
+	slotmaps_unlock(srv->slotmaps);
+}
+
+/* table replacement to be executed by the main thread */
+struct replace_cmd {
+	struct slotmap_replace r;
+	int rc;
+};
+
+static void cmd_replace(struct rspro_server *srv, void *data)
+{
+	struct replace_cmd *cmd = data;
+
+	slotmaps_wrlock(srv->slotmaps);
+	cmd->rc = _slotmaps_replace(srv, &cmd->r);
+	slotmaps_unlock(srv->slotmaps);
+}
+
+static void cmd_reset(struct rspro_server *srv, void *data)
+{
+	struct slot_mapping *map, *map2;
+
+	slotmaps_wrlock(srv->slotmaps);
+	llist_for_each_entry_safe(map, map2, &srv->slotmaps->mappings, list)
+		_slotmap_mark_deleted(srv, map);
+	slotmaps_unlock(srv->slotmaps);
+}
+
+static void cmd_stop(struct rspro_server *srv, void *data)
+{
+	g_stop = true;
+}
+
+/***********************************************************************
+ * synthetic peers
+ ***********************************************************************/
+
+static struct sim_peer *peer_by_handle(uint32_t handle)
+{
+	if (handle & HANDLE_BANK)
+		return &g_sim.banks[handle & ~HANDLE_BANK];
+	return &g_sim.clients[handle];
+}
+
+static bool handle_is_bank(uint32_t handle)
+{
+	return handle & HANDLE_BANK;
+}
+
+static void buf_append(struct sim_buf *b, const uint8_t *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = b->size ? b->size * 2 : 512;
+		while (b->size < b->len + len)
+			b->size *= 2;
+		b->data = realloc(b->data, b->size);
+		OSMO_ASSERT(b->data);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void buf_consume(struct sim_buf *b, size_t len)
+{
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+static void peer_send(struct sim_peer *peer, RsproPDU_t *pdu, long tag)
+{
+	struct msgb *msg;
+
+	OSMO_ASSERT(pdu);
+	pdu->tag = tag;
+	msg = rspro_enc_msg(pdu);
+	OSMO_ASSERT(msg);
+	ipa_prepend_header_ext(msg, IPAC_PROTO_EXT_RSPRO);
+	ipa_prepend_header(msg, IPAC_PROTO_OSMO);
+	buf_append(&peer->tx, msgb_data(msg), msgb_length(msg));
+	msgb_free(msg);
+}
+
+static int peer_flush(struct sim_peer *peer)
+{
+	ssize_t rc;
+
+	while (peer->tx.len) {
+		rc = send(peer->fd, peer->tx.data, peer->tx.len, MSG_NOSIGNAL);
+		if (rc < 0)
+			return errno == EAGAIN ? 0 : -errno;
+		buf_consume(&peer->tx, rc);
+	}
+	return 0;
+}
+
+static void peer_enqueue(uint32_t handle, uint64_t due_us)
+{
+	struct sim_peer *peer = peer_by_handle(handle);
+
+	peer->state = PEER_S_QUEUED;
+	peer->due_us = due_us;
+	g_sim.queue[(g_sim.queue_head + g_sim.queue_len) % ARRAY_SIZE(g_sim.queue)] = handle;
+	g_sim.queue_len++;
+}
+
+/* close the connection of a peer and have it connect again later */
+static void peer_reset(uint32_t handle, uint64_t delay_us)
+{
+	struct sim_peer *peer = peer_by_handle(handle);
+
+	if (peer->fd >= 0)
+		close(peer->fd);
+	peer->fd = -1;
+	peer->rx.len = peer->tx.len = 0;
+	if (handle_is_bank(handle)) {
+		memset(peer->bank.mapped, 0, peer->bank.num_slots);
+		peer->bank.num_mapped = 0;
+	} else
+		peer->client.configured = false;
+	peer_enqueue(handle, now_us() + delay_us);
+}
+
+static void peer_lost(uint32_t handle)
+{
+	g_sim.num_lost++;
+	peer_reset(handle, RECONNECT_DELAY_US);
+}
+
+static void peer_connect(uint32_t handle)
+{
+	struct sim_peer *peer = peer_by_handle(handle);
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLET,
+		.data.u32 = handle,
+	};
+	ClientSlot_t clslot;
+	RsproPDU_t *pdu;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+		peer_lost(handle);
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ((connect(fd, (struct sockaddr *) &g_sim.addr, sizeof(g_sim.addr)) < 0 && errno != EINPROGRESS) ||
+	    epoll_ctl(g_sim.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		peer_lost(handle);
+		return;
+	}
+	peer->fd = fd;
+	peer->state = PEER_S_WAIT_RES;
+
+	/* sent as soon as the connection is established */
+	if (handle_is_bank(handle)) {
+		pdu = rspro_gen_ConnectBankReq(&g_sim.bank_id, peer->id, peer->bank.num_slots,
+					       &g_sim.bankd_endpoint, -1);
+		OSMO_ASSERT(pdu);
+		pdu->version = RSPRO_VERSION_BATCH;
+	} else {
+		clslot.clientId = peer->id;
+		clslot.slotNr = 0;
+		pdu = rspro_gen_ConnectClientReq(&g_sim.client_id, &clslot);
+	}
+	peer_send(peer, pdu, 0);
+}
+
+/* connect queued peers, as far as they are due and the rate permits */
+static void queue_run(void)
+{
+	uint64_t now = now_us();
+	struct sim_peer *peer;
+	uint32_t handle;
+
+	if (g_sim.rate) {
+		g_sim.tokens += (now - g_sim.tokens_last_us) * g_sim.rate / 1e6;
+		/* allow bursts of 100ms worth of connections */
+		if (g_sim.tokens > g_sim.rate / 10 + 1)
+			g_sim.tokens = g_sim.rate / 10 + 1;
+	}
+	g_sim.tokens_last_us = now;
+
+	while (g_sim.queue_len) {
+		handle = g_sim.queue[g_sim.queue_head];
+		peer = peer_by_handle(handle);
+		if (peer->due_us > now)
+			break;
+		if (g_sim.rate && !handle_is_bank(handle)) {
+			if (g_sim.tokens < 1)
+				break;
+			g_sim.tokens--;
+		}
+		g_sim.queue_head = (g_sim.queue_head + 1) % ARRAY_SIZE(g_sim.queue);
+		g_sim.queue_len--;
+		peer_connect(handle);
+	}
+}
+
+static int peer_rx_rspro(struct sim_peer *peer, const RsproPDU_t *pdu)
+{
+	const BankSlot_t *bslot;
+
+	switch (pdu->msg.present) {
+	case RsproPDUchoice_PR_connectClientRes:
+		if (pdu->msg.choice.connectClientRes.result != ResultCode_ok)
+			return -1;
+		peer->state = PEER_S_UP;
+		break;
+	case RsproPDUchoice_PR_connectBankRes:
+		if (pdu->msg.choice.connectBankRes.result != ResultCode_ok)
+			return -1;
+		peer->state = PEER_S_UP;
+		break;
+	case RsproPDUchoice_PR_configClientBankReq:
+		bslot = &pdu->msg.choice.configClientBankReq.bankSlot;
+		peer->client.bank.bank_id = bslot->bankId;
+		peer->client.bank.slot_nr = bslot->slotNr;
+		peer->client.configured = true;
+		peer_send(peer, rspro_gen_ConfigClientBankRes(ResultCode_ok), pdu->tag);
+		break;
+	case RsproPDUchoice_PR_createMappingReq:
+		bslot = &pdu->msg.choice.createMappingReq.bank;
+		if (bslot->slotNr < peer->bank.num_slots && !peer->bank.mapped[bslot->slotNr]) {
+			peer->bank.mapped[bslot->slotNr] = 1;
+			peer->bank.num_mapped++;
+		}
+		peer_send(peer, rspro_gen_CreateMappingRes(ResultCode_ok), pdu->tag);
+		break;
+	case RsproPDUchoice_PR_removeMappingReq:
+		bslot = &pdu->msg.choice.removeMappingReq.bank;
+		if (bslot->slotNr < peer->bank.num_slots && peer->bank.mapped[bslot->slotNr]) {
+			peer->bank.mapped[bslot->slotNr] = 0;
+			peer->bank.num_mapped--;
+		}
+		peer_send(peer, rspro_gen_RemoveMappingRes(ResultCode_ok), pdu->tag);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int peer_rx_frame(struct sim_peer *peer, uint8_t proto, const uint8_t *data, unsigned int len)
+{
+	static const uint8_t pong[] = { 0, 1, IPAC_PROTO_IPACCESS, IPAC_MSGT_PONG };
+	RsproPDU_t *pdus[RSPRO_BATCH_MAX_PDUS];
+	struct msgb *msg;
+	int i, num, rc = 0;
+
+	if (proto == IPAC_PROTO_IPACCESS) {
+		/* keep-alive of the server */
+		if (len >= 1 && data[0] == IPAC_MSGT_PING)
+			buf_append(&peer->tx, pong, sizeof(pong));
+		return 0;
+	}
+	if (proto != IPAC_PROTO_OSMO || len < 2 || data[0] != IPAC_PROTO_EXT_RSPRO)
+		return 0;
+
+	msg = msgb_alloc(len, "sim rx");
+	OSMO_ASSERT(msg);
+	msg->l2h = msgb_put(msg, len - 1);
+	memcpy(msg->l2h, data + 1, len - 1);
+	num = rspro_dec_msg_batch(msg, pdus, ARRAY_SIZE(pdus));
+	msgb_free(msg);
+	if (num < 0)
+		return num;
+
+	for (i = 0; i < num; i++) {
+		if (!rc)
+			rc = peer_rx_rspro(peer, pdus[i]);
+		ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdus[i]);
+	}
+	return rc;
+}
+
+static int peer_read(struct sim_peer *peer)
+{
+	unsigned int flen;
+	ssize_t rc;
+
+	while (1) {
+		if (peer->rx.size - peer->rx.len < 4096) {
+			peer->rx.size = peer->rx.size ? peer->rx.size * 2 : 4096;
+			peer->rx.data = realloc(peer->rx.data, peer->rx.size);
+			OSMO_ASSERT(peer->rx.data);
+		}
+		rc = recv(peer->fd, peer->rx.data + peer->rx.len, peer->rx.size - peer->rx.len, 0);
+		if (rc == 0)
+			return -ECONNRESET;
+		if (rc < 0) {
+			if (errno == EAGAIN)
+				break;
+			return -errno;
+		}
+		peer->rx.len += rc;
+	}
+
+	/* IPA frames: 16 bit length, 8 bit protocol, payload */
+	while (peer->rx.len >= 3) {
+		flen = (peer->rx.data[0] << 8) | peer->rx.data[1];
+		if (peer->rx.len < 3 + flen)
+			break;
+		rc = peer_rx_frame(peer, peer->rx.data[2], peer->rx.data + 3, flen);
+		if (rc < 0)
+			return rc;
+		buf_consume(&peer->rx, 3 + flen);
+	}
+	return 0;
+}
+
+static void peer_event(uint32_t handle, uint32_t events)
+{
+	struct sim_peer *peer = peer_by_handle(handle);
+
+	if (peer->fd < 0)
+		return;
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		peer_lost(handle);
+		return;
+	}
+	if ((events & EPOLLIN) && peer_read(peer) < 0) {
+		peer_lost(handle);
+		return;
+	}
+	if (peer_flush(peer) < 0)
+		peer_lost(handle);
+}
+
+static void sim_poll(int timeout_ms)
+{
+	struct epoll_event evs[256];
+	int i, num;
+
+	num = epoll_wait(g_sim.epfd, evs, ARRAY_SIZE(evs), timeout_ms);
+	for (i = 0; i < num; i++)
+		peer_event(evs[i].data.u32, evs[i].events);
+	queue_run();
+}
+
+/***********************************************************************
+ * scenario
+ ***********************************************************************/
+
+static bool sim_converged(void)
+{
+	unsigned int i, j, num_maps = 0;
+	struct state_snapshot *snap;
+	const struct snap_chunk *chunk;
+	struct sim_peer *peer;
+	bool ok = true;
+
+	for (i = 0; i < g_sim.num_banks; i++) {
+		peer = &g_sim.banks[i];
+		if (peer->state != PEER_S_UP ||
+		    memcmp(peer->bank.mapped, peer->bank.assigned, peer->bank.num_slots))
+			return false;
+	}
+	for (i = 0; i < g_sim.num_clients; i++) {
+		peer = &g_sim.clients[i];
+		if (peer->state != PEER_S_UP)
+			return false;
+		if (peer->client.assigned && (!peer->client.configured ||
+		    !bank_slot_equals(&peer->client.bank, &peer->client.expect)))
+			return false;
+	}
+
+	snap = state_snapshot_get();
+	if (!snap)
+		return false;
+	for (i = 0; i < SNAP_NUM_CHUNKS && ok; i++) {
+		chunk = snap->slotmaps[i];
+		if (!chunk)
+			continue;
+		for (j = 0; j < chunk->num; j++) {
+			if (chunk->maps[j].state != SLMAP_S_ACTIVE) {
+				ok = false;
+				break;
+			}
+		}
+		num_maps += chunk->num;
+	}
+	state_snapshot_put(snap);
+
+	return ok && num_maps == g_sim.num_maps;
+}
+
+static void sim_add_banks(unsigned int num, unsigned int num_slots)
+{
+	struct sim_peer *peer;
+	unsigned int i;
+
+	for (i = 0; i < num && g_sim.num_banks < SIM_MAX_BANKS; i++) {
+		peer = &g_sim.banks[g_sim.num_banks];
+		peer->fd = -1;
+		peer->id = g_sim.num_banks;
+		peer->bank.num_slots = num_slots;
+		peer->bank.mapped = calloc(num_slots, 1);
+		peer->bank.assigned = calloc(num_slots, 1);
+		OSMO_ASSERT(peer->bank.mapped && peer->bank.assigned);
+		peer_enqueue(HANDLE_BANK | g_sim.num_banks++, 0);
+	}
+	g_sim.rate = 0;
+}
+
+static void sim_add_clients(unsigned int num, unsigned int rate)
+{
+	struct sim_peer *peer;
+	unsigned int i;
+
+	for (i = 0; i < num && g_sim.num_clients < SIM_MAX_CLIENTS; i++) {
+		peer = &g_sim.clients[g_sim.num_clients];
+		peer->fd = -1;
+		peer->id = g_sim.num_clients;
+		peer_enqueue(g_sim.num_clients++, 0);
+	}
+	g_sim.rate = rate;
+	g_sim.tokens = 0;
+}
+
+/* find a free slot of any bankd, starting with the one after the previously used one */
+static bool sim_alloc_bank_slot(struct bank_slot *out)
+{
+	struct sim_peer *peer;
+	unsigned int i, j;
+
+	for (i = 0; i < g_sim.num_banks; i++) {
+		peer = &g_sim.banks[(g_sim.next_bank + i) % g_sim.num_banks];
+		for (j = 0; j < peer->bank.num_slots; j++) {
+			if (peer->bank.assigned[j])
+				continue;
+			peer->bank.assigned[j] = 1;
+			out->bank_id = peer->id;
+			out->slot_nr = j;
+			g_sim.next_bank = (g_sim.next_bank + i + 1) % g_sim.num_banks;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* hand the slotmaps over to the main thread in chunks, so it keeps serving RSPRO meanwhile */
+static void sim_exec_maps(struct bank_slot *bank, struct client_slot *client, unsigned int num, bool del)
+{
+	struct maps_cmd cmd = {
+		.del = del,
+	};
+	unsigned int i;
+
+	for (i = 0; i < num; i += cmd.num) {
+		cmd.bank = bank + i;
+		cmd.client = client + i;
+		cmd.num = OSMO_MIN(num - i, 256);
+		rspro_server_exec(g_rps, cmd_maps, &cmd);
+	}
+	if (cmd.failed)
+		fprintf(stderr, "%u slotmaps could not be %s\n", cmd.failed, del ? "deleted" : "created");
+}
+
+static void sim_add_maps(unsigned int num)
+{
+	struct bank_slot *bank = calloc(num ? num : 1, sizeof(*bank));
+	struct client_slot *client = calloc(num ? num : 1, sizeof(*client));
+	struct sim_peer *peer;
+	unsigned int i, n = 0;
+
+	OSMO_ASSERT(bank && client);
+	for (i = 0; i < g_sim.num_clients && n < num; i++) {
+		peer = &g_sim.clients[i];
+		if (peer->client.assigned)
+			continue;
+		if (!sim_alloc_bank_slot(&peer->client.expect))
+			break;
+		peer->client.assigned = true;
+		bank[n] = peer->client.expect;
+		client[n].client_id = peer->id;
+		client[n].slot_nr = 0;
+		n++;
+	}
+	if (n < num)
+		fprintf(stderr, "Only %u of %u slotmaps possible, out of clients or bankd slots\n", n, num);
+	g_sim.num_maps += n;
+	sim_exec_maps(bank, client, n, false);
+	free(bank);
+	free(client);
+}
+
+static void sim_del_maps(unsigned int num)
+{
+	struct bank_slot *bank = calloc(num ? num : 1, sizeof(*bank));
+	unsigned int i, n = 0, start;
+	struct sim_peer *peer;
+
+	OSMO_ASSERT(bank);
+	/* start at a random client, so repeated 'unmap' don't always hit the same bankds */
+	start = random();
+	for (i = 0; i < g_sim.num_clients && n < num; i++) {
+		peer = &g_sim.clients[(start + i) % g_sim.num_clients];
+		if (!peer->client.assigned)
+			continue;
+		peer->client.assigned = false;
+		g_sim.banks[peer->client.expect.bank_id].bank.assigned[peer->client.expect.slot_nr] = 0;
+		bank[n++] = peer->client.expect;
+	}
+	g_sim.num_maps -= n;
+	sim_exec_maps(bank, NULL, n, true);
+	free(bank);
+}
+
+static bool sim_wait(uint64_t until_us, bool converge);
+
+static void sim_replace(unsigned int num)
+{
+	struct bulk_slotmap *items = calloc(g_sim.num_maps ? g_sim.num_maps : 1, sizeof(*items));
+	struct bulk_slotmap **sorted = calloc(g_sim.num_maps ? g_sim.num_maps : 1, sizeof(*sorted));
+	struct replace_cmd cmd;
+	struct sim_peer *peer, *prev = NULL;
+	struct bank_slot tmp;
+	unsigned int i, n = 0, start, retries = 0, failed = 0;
+
+	OSMO_ASSERT(items && sorted);
+	/* swap the bankd slots of pairs of clients, so that every bank slot of a deleted map
+	 * is re-used by a created one */
+	start = random();
+	for (i = 0; i < g_sim.num_clients && n + 1 < num; i++) {
+		peer = &g_sim.clients[(start + i) % g_sim.num_clients];
+		if (!peer->client.assigned)
+			continue;
+		if (!prev) {
+			prev = peer;
+			continue;
+		}
+		tmp = prev->client.expect;
+		prev->client.expect = peer->client.expect;
+		peer->client.expect = tmp;
+		prev = NULL;
+		n += 2;
+	}
+
+	n = 0;
+	for (i = 0; i < g_sim.num_clients; i++) {
+		peer = &g_sim.clients[i];
+		if (!peer->client.assigned)
+			continue;
+		items[n].bank = peer->client.expect;
+		items[n].client.client_id = peer->id;
+		items[n].client.slot_nr = 0;
+		sorted[n] = &items[n];
+		n++;
+	}
+	qsort(sorted, n, sizeof(*sorted), bulk_slotmap_cmp);
+
+	/* the server refuses while maps to be deleted are still being created */
+	while (1) {
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.r.items = items;
+		cmd.r.num_items = n;
+		cmd.r.sorted = sorted;
+		cmd.r.num_sorted = n;
+		rspro_server_exec(g_rps, cmd_replace, &cmd);
+		if (cmd.rc != -EBUSY)
+			break;
+		retries++;
+		sim_wait(now_us() + 10000, false);
+	}
+	if (retries)
+		fprintf(stderr, "Table replacement deferred %u times while slotmaps were created\n", retries);
+	for (i = 0; i < n; i++) {
+		if (items[i].status != 200 && items[i].status != 201)
+			failed++;
+	}
+	if (failed)
+		fprintf(stderr, "%u slotmaps could not be replaced\n", failed);
+	free(items);
+	free(sorted);
+}
+
+static void sim_reset(void)
+{
+	unsigned int i;
+
+	rspro_server_exec(g_rps, cmd_reset, NULL);
+	for (i = 0; i < g_sim.num_banks; i++)
+		memset(g_sim.banks[i].bank.assigned, 0, g_sim.banks[i].bank.num_slots);
+	for (i = 0; i < g_sim.num_clients; i++)
+		g_sim.clients[i].client.assigned = false;
+	g_sim.num_maps = 0;
+}
+
+static void sim_churn(bool banks, unsigned int num)
+{
+	unsigned int total = banks ? g_sim.num_banks : g_sim.num_clients;
+	unsigned int i, n = 0, idx, start = random();
+	struct sim_peer *peer;
+
+	for (i = 0; i < total && n < num; i++) {
+		idx = (start + i) % total;
+		peer = banks ? &g_sim.banks[idx] : &g_sim.clients[idx];
+		if (peer->state != PEER_S_UP)
+			continue;
+		peer_reset(banks ? HANDLE_BANK | idx : idx, 0);
+		n++;
+	}
+}
+
+/* resource usage at the start of a reported interval */
+struct sim_usage {
+	uint64_t wall_us;
+	struct timeval proc_utime, proc_stime;
+	struct timeval self_utime, self_stime;
+	unsigned long lock_acquired, lock_contended, lock_wait_us;
+	unsigned int num_lost;
+};
+
+static double tv_secs(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void sim_usage_get(struct sim_usage *u)
+{
+	struct rusage ru;
+
+	u->wall_us = now_us();
+	getrusage(RUSAGE_SELF, &ru);
+	u->proc_utime = ru.ru_utime;
+	u->proc_stime = ru.ru_stime;
+	getrusage(RUSAGE_THREAD, &ru);
+	u->self_utime = ru.ru_utime;
+	u->self_stime = ru.ru_stime;
+	u->lock_acquired = atomic_load(&g_slotmap_lock_stats.acquired);
+	u->lock_contended = atomic_load(&g_slotmap_lock_stats.contended);
+	u->lock_wait_us = atomic_load(&g_slotmap_lock_stats.wait_us);
+	u->num_lost = g_sim.num_lost;
+}
+
+static unsigned long rss_kb(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* the CPU time of the simulator thread itself is not accounted to the server */
+static void sim_report(const char *what, bool converged, const struct sim_usage *start)
+{
+	struct sim_usage end;
+	struct rusage ru;
+	double utime, stime;
+
+	sim_usage_get(&end);
+	getrusage(RUSAGE_SELF, &ru);
+	utime = tv_secs(&end.proc_utime) - tv_secs(&start->proc_utime) -
+		(tv_secs(&end.self_utime) - tv_secs(&start->self_utime));
+	stime = tv_secs(&end.proc_stime) - tv_secs(&start->proc_stime) -
+		(tv_secs(&end.self_stime) - tv_secs(&start->self_stime));
+
+	printf("%s: %s after %.3fs; server cpu %.2fs user %.2fs sys; rss %lu kB (max %ld kB); "
+	       "slotmap lock %lu acquired, %lu contended, %.1f ms waiting; %u connections lost\n",
+	       what, converged ? "converged" : "NOT converged", (end.wall_us - start->wall_us) / 1e6,
+	       utime, stime, rss_kb(), ru.ru_maxrss, end.lock_acquired - start->lock_acquired,
+	       end.lock_contended - start->lock_contended,
+	       (end.lock_wait_us - start->lock_wait_us) / 1e3, end.num_lost - start->num_lost);
+	fflush(stdout);
+}
+
+/* poll until the given time, or until the state converged if requested */
+static bool sim_wait(uint64_t until_us, bool converge)
+{
+	uint64_t now, last_check = 0;
+
+	while (1) {
+		now = now_us();
+		if (converge && now - last_check >= CONVERGE_CHECK_US) {
+			if (sim_converged())
+				return true;
+			last_check = now;
+		}
+		if (now >= until_us)
+			return !converge;
+		sim_poll(OSMO_MIN((until_us - now) / 1000, CONVERGE_CHECK_US / 1000) + 1);
+	}
+}
+
+struct sim_args {
+	struct sim_step *steps;
+	unsigned int num_steps;
+	int rc;
+};
+
+static void *sim_thread(void *arg)
+{
+	struct sim_args *args = arg;
+	struct sim_usage start;
+	char what[128] = "";
+	struct sim_step *step;
+	unsigned int i;
+	bool converged;
+
+	talloc_asn1_ctx = talloc_named_const(NULL, 0, "sim_asn1");
+	g_sim.epfd = epoll_create1(0);
+	OSMO_ASSERT(g_sim.epfd >= 0);
+	g_sim.clients = calloc(SIM_MAX_CLIENTS, sizeof(*g_sim.clients));
+	OSMO_ASSERT(g_sim.clients);
+	g_sim.tokens_last_us = now_us();
+
+	sim_usage_get(&start);
+	for (i = 0; i < args->num_steps; i++) {
+		step = &args->steps[i];
+		if (step->cmd != SIM_CMD_WAIT && step->cmd != SIM_CMD_SLEEP) {
+			if (what[0])
+				osmo_strlcpy(what + strlen(what), "; ", sizeof(what) - strlen(what));
+			osmo_strlcpy(what + strlen(what), step->text, sizeof(what) - strlen(what));
+		}
+
+		switch (step->cmd) {
+		case SIM_CMD_BANKS:
+			sim_add_banks(step->arg[0], step->arg[1]);
+			break;
+		case SIM_CMD_CLIENTS:
+			sim_add_clients(step->arg[0], step->arg[1]);
+			break;
+		case SIM_CMD_MAPS:
+			sim_add_maps(step->arg[0]);
+			break;
+		case SIM_CMD_UNMAP:
+			sim_del_maps(step->arg[0]);
+			break;
+		case SIM_CMD_REPLACE:
+			sim_replace(step->arg[0]);
+			break;
+		case SIM_CMD_CHURN_CLIENTS:
+			sim_churn(false, step->arg[0]);
+			break;
+		case SIM_CMD_CHURN_BANKS:
+			sim_churn(true, step->arg[0]);
+			break;
+		case SIM_CMD_RESET:
+			sim_reset();
+			break;
+		case SIM_CMD_SLEEP:
+			sim_wait(now_us() + step->arg[0] * 1000ULL, false);
+			break;
+		case SIM_CMD_WAIT:
+			converged = sim_wait(now_us() + step->arg[0] * 1000000ULL, true);
+			sim_report(what[0] ? what : "idle", converged, &start);
+			if (!converged)
+				args->rc = 1;
+			what[0] = '\0';
+			sim_usage_get(&start);
+			break;
+		}
+	}
+
+	rspro_server_exec(g_rps, cmd_stop, NULL);
+	return NULL;
+}
+
+static int parse_scenario(const char *path, struct sim_step **steps_out, unsigned int *num_out)
+{
+	struct sim_step *steps = NULL, *step;
+	unsigned int num = 0, lineno = 0;
+	char line[256], word[32], *hash;
+	unsigned int a, b;
+	int n;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Cannot open scenario '%s': %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+		n = sscanf(line, "%31s %u %u", word, &a, &b);
+		if (n <= 0)
+			continue;
+
+		steps = realloc(steps, (num + 1) * sizeof(*steps));
+		OSMO_ASSERT(steps);
+		step = &steps[num++];
+		memset(step, 0, sizeof(*step));
+
+		if (!strcmp(word, "banks") && n == 3 && a && b) {
+			step->cmd = SIM_CMD_BANKS;
+			step->arg[0] = a;
+			step->arg[1] = b;
+		} else if (!strcmp(word, "clients") && n >= 2 && a) {
+			step->cmd = SIM_CMD_CLIENTS;
+			step->arg[0] = a;
+			step->arg[1] = n == 3 ? b : 0;
+		} else if (!strcmp(word, "maps") && n == 2) {
+			step->cmd = SIM_CMD_MAPS;
+			step->arg[0] = a;
+		} else if (!strcmp(word, "unmap") && n == 2) {
+			step->cmd = SIM_CMD_UNMAP;
+			step->arg[0] = a;
+		} else if (!strcmp(word, "replace") && n == 2) {
+			step->cmd = SIM_CMD_REPLACE;
+			step->arg[0] = a;
+		} else if (!strcmp(word, "churn") && sscanf(line, "%*s %31s %u", word, &a) == 2 &&
+			   (!strcmp(word, "clients") || !strcmp(word, "banks"))) {
+			step->cmd = !strcmp(word, "banks") ? SIM_CMD_CHURN_BANKS : SIM_CMD_CHURN_CLIENTS;
+			step->arg[0] = a;
+		} else if (!strcmp(word, "reset") && n == 1) {
+			step->cmd = SIM_CMD_RESET;
+		} else if (!strcmp(word, "sleep") && n == 2) {
+			step->cmd = SIM_CMD_SLEEP;
+			step->arg[0] = a;
+		} else if (!strcmp(word, "wait") && n <= 2) {
+			step->cmd = SIM_CMD_WAIT;
+			step->arg[0] = n == 2 ? a : 60;
+		} else {
+			fprintf(stderr, "%s:%u: invalid command\n", path, lineno);
+			fclose(f);
+			free(steps);
+			return -EINVAL;
+		}
+		/* for the report; without the trailing newline */
+		line[strcspn(line, "\r\n")] = '\0';
+		OSMO_STRLCPY_ARRAY(step->text, line);
+	}
+	fclose(f);
+
+	*steps_out = steps;
+	*num_out = num;
+	return 0;
+}
+
+/***********************************************************************
+ * main thread
+ ***********************************************************************/
+
+/* slotmaps->change_cb: called with slotmaps->rwlock held for writing */
+static void slotmap_changed(const struct slot_mapping *map, bool removed)
+{
+	state_log_slotmap(map, removed);
+	_sim_pools_slotmap_changed(g_rps->pools, map, removed);
+}
+
+static void print_help()
+{
+	printf( "Usage: osmo-remsim-server-sim [options] SCENARIO\n"
+		"  -h --help                This text\n"
+		"  -d --debug option        Enable debug logging (e.g. DMAIN:DST2)\n"
+		"  -p --port PORT           Serve RSPRO on 127.0.0.1:PORT (default: 19998)\n"
+		"  -T --io-threads NR       Serve RSPRO connections in NR threads (default: 1)\n"
+		"  -w --max-inflight NR     Maximum unacknowledged slotmap requests per bankd (default: 128)\n"
+		"  -a --accept-rate NR      Accept at most NR new connections per second; 0 = unlimited (default: 500)\n"
+		"  -c --config-rate NR      Configure at most NR clients per second; 0 = unlimited (default: 500)\n"
+		"  -m --metrics PATH        Write the metrics of the server to PATH at the end\n"
+		);
+}
+
+static void handle_options(int argc, char **argv)
+{
+	while (1) {
+		int option_index = 0, c;
+		static struct option long_options[] = {
+			{ "help", 0, 0, 'h' },
+			{ "debug", 1, 0, 'd' },
+			{ "port", 1, 0, 'p' },
+			{ "io-threads", 1, 0, 'T' },
+			{ "max-inflight", 1, 0, 'w' },
+			{ "accept-rate", 1, 0, 'a' },
+			{ "config-rate", 1, 0, 'c' },
+			{ "metrics", 1, 0, 'm' },
+			{ 0, 0, 0, 0 }
+		};
+
+		c = getopt_long(argc, argv, "hd:p:T:w:a:c:m:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			print_help();
+			exit(0);
+			break;
+		case 'd':
+			log_parse_category_mask(osmo_stderr_target, optarg);
+			break;
+		case 'p':
+			g_port = atoi(optarg);
+			if (g_port < 1 || g_port > 65535) {
+				fprintf(stderr, "Invalid port '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'T':
+			g_io_threads = atoi(optarg);
+			if (g_io_threads < 1 || g_io_threads > RSPRO_MAX_SHARDS) {
+				fprintf(stderr, "Invalid number of I/O threads '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'w':
+			g_max_inflight = atoi(optarg);
+			if (g_max_inflight < 1) {
+				fprintf(stderr, "Invalid maximum number of in-flight requests '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'a':
+			g_accept_rate = atoi(optarg);
+			if (g_accept_rate < 0) {
+				fprintf(stderr, "Invalid rate of new connections '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'c':
+			g_config_rate = atoi(optarg);
+			if (g_config_rate < 0) {
+				fprintf(stderr, "Invalid rate of client configurations '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'm':
+			g_metrics_file = optarg;
+			break;
+		default:
+			/* ignore */
+			break;
+		}
+	}
+
+	if (argc != optind + 1) {
+		print_help();
+		exit(2);
+	}
+	g_scenario_file = argv[optind];
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_args args = {};
+	struct rlimit rlim;
+	pthread_t thread;
+	FILE *f;
+	int rc;
+
+	g_tall_ctx = talloc_named_const(NULL, 0, "global");
+	talloc_asn1_ctx = talloc_named_const(g_tall_ctx, 0, "asn1");
+
+	osmo_init_logging2(g_tall_ctx, &log_info);
+	log_set_print_level(osmo_stderr_target, 1);
+	log_set_print_category(osmo_stderr_target, 1);
+	log_set_print_category_hex(osmo_stderr_target, 0);
+	osmo_fsm_log_addr(0);
+	log_set_print_tid(osmo_stderr_target, 1);
+	log_enable_multithread();
+	/* thousands of peers make anything below NOTICE useless, unless asked for */
+	log_set_log_level(osmo_stderr_target, LOGL_NOTICE);
+
+	handle_options(argc, argv);
+
+	if (parse_scenario(g_scenario_file, &args.steps, &args.num_steps) < 0)
+		exit(2);
+
+	/* two file descriptors per peer; the server's and our own */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	g_sim.addr.sin_family = AF_INET;
+	g_sim.addr.sin_port = htons(g_port);
+	g_sim.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	g_sim.client_id.type = ComponentType_remsimClient;
+	OSMO_STRLCPY_ARRAY(g_sim.client_id.name, "sim-client");
+	OSMO_STRLCPY_ARRAY(g_sim.client_id.software, "remsim-server-sim");
+	OSMO_STRLCPY_ARRAY(g_sim.client_id.sw_version, PACKAGE_VERSION);
+	g_sim.bank_id = g_sim.client_id;
+	g_sim.bank_id.type = ComponentType_remsimBankd;
+	OSMO_STRLCPY_ARRAY(g_sim.bank_id.name, "sim-bankd");
+	rspro_endpoint_from_str(&g_sim.bankd_endpoint, "127.0.0.1", 9999);
+
+	g_rps = rspro_server_create(g_tall_ctx, "127.0.0.1", g_port);
+	if (!g_rps)
+		exit(1);
+	g_rps->slotmaps = slotmap_init(g_rps);
+	if (!g_rps->slotmaps)
+		exit(1);
+	g_rps->pools = sim_pools_init(g_rps->slotmaps);
+	if (!g_rps->pools)
+		exit(1);
+	if (g_max_inflight)
+		g_rps->cfg.max_inflight = g_max_inflight;
+	if (g_accept_rate >= 0)
+		g_rps->cfg.accept_rate = g_accept_rate;
+	if (g_config_rate >= 0)
+		g_rps->cfg.config_rate = g_config_rate;
+	state_log_init();
+	g_rps->slotmaps->change_cb = slotmap_changed;
+	g_rps->slotmaps->transition_cb = metrics_slotmap_transition;
+
+	g_rps->comp_id.type = ComponentType_remsimServer;
+	OSMO_STRLCPY_ARRAY(g_rps->comp_id.name, "sim-server");
+	OSMO_STRLCPY_ARRAY(g_rps->comp_id.software, "remsim-server");
+	OSMO_STRLCPY_ARRAY(g_rps->comp_id.sw_version, PACKAGE_VERSION);
+
+	rc = rspro_server_start_shards(g_rps, g_io_threads);
+	if (rc < 0)
+		exit(1);
+	rc = rspro_server_listen(g_rps);
+	if (rc < 0)
+		exit(1);
+	state_snapshot_publish(g_rps);
+
+	rc = pthread_create(&thread, NULL, sim_thread, &args);
+	if (rc != 0) {
+		fprintf(stderr, "Cannot start simulator thread: %s\n", strerror(rc));
+		exit(1);
+	}
+
+	while (!g_stop) {
+		osmo_select_main(0);
+		state_snapshot_publish(g_rps);
+	}
+	pthread_join(thread, NULL);
+
+	if (g_metrics_file) {
+		f = fopen(g_metrics_file, "w");
+		if (f) {
+			metrics_write(f, g_rps);
+			fclose(f);
+		} else
+			fprintf(stderr, "Cannot write metrics to '%s': %s\n", g_metrics_file, strerror(errno));
+	}
+
+	exit(args.rc);
+}
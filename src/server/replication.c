@@ -0,0 +1,801 @@
+/* Active/standby replication of the remsim-server state
+ *
+ * The primary server streams its slotmaps and the endpoints of its bankds to any number of
+ * standby servers: first a complete copy taken from the current state snapshot, then each
+ * change recorded in the state log, plus a heartbeat every second.  Replication is
+ * asynchronous, i.e. the primary never waits for a standby.  If the state log has wrapped
+ * before a slow standby caught up, it is sent a complete copy again.
+ *
+ * A standby server applies all of that to its own slotmap table (and state file, if any), but
+ * neither listens for RSPRO nor for REST.  Once the primary has been silent for the failover
+ * timeout, it runs the takeover script (e.g. to move a virtual IP address to itself) and is
+ * promoted to serve RSPRO and REST.  Maps which were ACTIVE at the primary are kept 'warm':
+ * clients are directed to their bankd right away, and bankds re-connecting with exactly those
+ * maps (as indicated by the mappingsDigest of their ConnectBankReq) are not re-provisioned.
+ *
+ * Everything here runs in the main thread.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/osmo_io.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/exec.h>
+#include <osmocom/core/socket.h>
+#include <osmocom/netif/stream.h>
+
+#include "debug.h"
+#include "slotmap.h"
+#include "rspro_server.h"
+#include "state_log.h"
+#include "state_snapshot.h"
+#include "replication.h"
+
+#define REPL_MAGIC		0x52535250	/* "RSRP" */
+#define REPL_VERSION		1
+#define REPL_MSGB_SIZE		4096
+#define REPL_HEARTBEAT_S	1
+/* messages queued to a standby before it is considered not to keep up; a complete copy of a
+ * table of RSPRO_NUM_BANK_IDS banks with 1024 slots each fits */
+#define REPL_TX_QUEUE_MAX	8192
+
+enum repl_rec_type {
+	REPL_REC_HEARTBEAT,
+	REPL_REC_HELLO,
+	REPL_REC_SNAPSHOT_START,
+	REPL_REC_SNAPSHOT_END,
+	REPL_REC_MAP,
+	REPL_REC_MAP_DEL,
+	REPL_REC_BANK,
+	REPL_REC_BANK_DEL,
+};
+
+/* REPL_REC_MAP: the map is ACTIVE at its bankd */
+#define REPL_F_ACTIVE		0x01
+
+/* all records have the same size, all fields are in network byte order */
+struct repl_rec {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t reserved;
+	union {
+		struct {
+			uint32_t magic;
+			uint32_t version;
+		} hello;
+		struct {
+			uint16_t bank_id;
+			uint16_t bank_slot;
+			uint16_t client_id;
+			uint16_t client_slot;
+		} map;
+		struct {
+			uint16_t bank_id;
+			uint16_t num_slots;
+			uint16_t port;
+			/* 4, 6 or 0 if none */
+			uint8_t ip_version;
+			uint8_t reserved;
+			uint8_t addr[16];
+		} bank;
+	} u;
+} __attribute__((packed));
+
+/* a standby server connected to us */
+struct repl_peer {
+	/* in replication->peers */
+	struct llist_head list;
+	struct replication *repl;
+	struct osmo_stream_srv *conn;
+	char name[64];
+	/* revision of the state log up to which the peer has been sent all changes */
+	uint64_t rev;
+	/* records not yet handed to the socket */
+	struct msgb *tx;
+	/* a record could not be queued; the connection is reset, so the standby re-syncs */
+	bool failed;
+};
+
+struct replication {
+	struct rspro_server *srv;
+
+	/* primary */
+	struct osmo_stream_srv_link *link;
+	struct llist_head peers;
+	struct osmo_timer_list heartbeat_timer;
+
+	/* standby */
+	struct osmo_stream_cli *cli;
+	struct osmo_timer_list failover_timer;
+	unsigned int failover_timeout_ms;
+	const char *takeover_script;
+	void (*promote_cb)(struct rspro_server *srv);
+	/* the takeover script runs asynchronously; its exit is signalled via takeover_ofd */
+	pid_t takeover_pid;
+	struct osmo_fd takeover_ofd;
+	struct timespec failover_start;
+	/* we have received at least one complete copy of the primary's state */
+	bool synced;
+	/* while receiving a complete copy: ids of the maps received so far, and the banks;
+	 * anything else is deleted at its end */
+	bool in_snapshot;
+	uint32_t *seen;
+	unsigned int num_seen;
+	unsigned int max_seen;
+	bool banks_seen[RSPRO_NUM_BANK_IDS];
+};
+
+static struct state_log_entry g_repl_log[256];
+
+/***********************************************************************
+ * primary
+ ***********************************************************************/
+
+static void peer_tx_flush(struct repl_peer *peer)
+{
+	if (!peer->tx || peer->failed)
+		return;
+	if (osmo_iofd_txqueue_len(osmo_stream_srv_get_iofd(peer->conn)) >= REPL_TX_QUEUE_MAX) {
+		LOGP(DMAIN, LOGL_ERROR, "Replication: standby %s doesn't keep up; resetting it\n",
+		     peer->name);
+		peer->failed = true;
+		return;
+	}
+	osmo_stream_srv_send(peer->conn, peer->tx);
+	peer->tx = NULL;
+}
+
+/* a standby that missed a record must not continue from the next one; reset its connection
+ * (which frees peer), so it re-connects and receives a complete copy again */
+static void peer_reset_failed(struct repl_peer *peer)
+{
+	if (peer->failed)
+		osmo_stream_srv_destroy(peer->conn);
+}
+
+static struct repl_rec *peer_tx_rec(struct repl_peer *peer, enum repl_rec_type type)
+{
+	struct repl_rec *rec;
+
+	if (peer->tx && msgb_tailroom(peer->tx) < sizeof(*rec))
+		peer_tx_flush(peer);
+	if (peer->failed)
+		return NULL;
+	if (!peer->tx) {
+		peer->tx = msgb_alloc(REPL_MSGB_SIZE, "replication");
+		if (!peer->tx) {
+			LOGP(DMAIN, LOGL_ERROR, "Replication: out of memory for standby %s; "
+			     "resetting it\n", peer->name);
+			peer->failed = true;
+			return NULL;
+		}
+	}
+	rec = (struct repl_rec *) msgb_put(peer->tx, sizeof(*rec));
+	memset(rec, 0, sizeof(*rec));
+	rec->type = type;
+	return rec;
+}
+
+static void peer_tx_map(struct repl_peer *peer, const struct bank_slot *bank, const struct client_slot *client,
+			enum slot_mapping_state state, bool removed)
+{
+	struct repl_rec *rec = peer_tx_rec(peer, removed ? REPL_REC_MAP_DEL : REPL_REC_MAP);
+
+	if (!rec)
+		return;
+	if (state == SLMAP_S_ACTIVE)
+		rec->flags |= REPL_F_ACTIVE;
+	rec->u.map.bank_id = htons(bank->bank_id);
+	rec->u.map.bank_slot = htons(bank->slot_nr);
+	rec->u.map.client_id = htons(client->client_id);
+	rec->u.map.client_slot = htons(client->slot_nr);
+}
+
+static void peer_tx_bank(struct repl_peer *peer, uint16_t bank_id, uint16_t num_slots,
+			 const struct rspro_endpoint *endpoint, bool removed)
+{
+	struct repl_rec *rec = peer_tx_rec(peer, removed ? REPL_REC_BANK_DEL : REPL_REC_BANK);
+
+	if (!rec)
+		return;
+	rec->u.bank.bank_id = htons(bank_id);
+	rec->u.bank.num_slots = htons(num_slots);
+	rec->u.bank.port = htons(endpoint->port);
+	switch (endpoint->af) {
+	case AF_INET:
+		rec->u.bank.ip_version = 4;
+		memcpy(rec->u.bank.addr, endpoint->addr, 4);
+		break;
+	case AF_INET6:
+		rec->u.bank.ip_version = 6;
+		memcpy(rec->u.bank.addr, endpoint->addr, 16);
+		break;
+	}
+}
+
+/* send a complete copy of our state, as of the most recent snapshot */
+static void peer_tx_snapshot(struct repl_peer *peer)
+{
+	struct state_snapshot *snap = state_snapshot_get();
+	struct snap_slotmap *row;
+	unsigned int i, j;
+
+	peer_tx_rec(peer, REPL_REC_SNAPSHOT_START);
+	for (i = 0; i < snap->num_banks; i++)
+		peer_tx_bank(peer, snap->banks[i].bank_id, snap->banks[i].num_slots, &snap->banks[i].endpoint, false);
+	for (i = 0; i < SNAP_NUM_CHUNKS; i++) {
+		if (!snap->slotmaps[i])
+			continue;
+		for (j = 0; j < snap->slotmaps[i]->num; j++) {
+			row = &snap->slotmaps[i]->maps[j];
+			peer_tx_map(peer, &row->bank, &row->client, row->state, false);
+		}
+	}
+	peer_tx_rec(peer, REPL_REC_SNAPSHOT_END);
+	peer->rev = snap->rev;
+
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: sent %u slotmaps and %u banks to standby %s\n",
+	     snap->num_slotmaps, snap->num_banks, peer->name);
+	state_snapshot_put(snap);
+}
+
+static void peer_tx_changes(struct repl_peer *peer)
+{
+	const struct state_log_entry *e;
+	uint64_t rev;
+	int i, num;
+
+	do {
+		num = state_log_get(peer->rev, g_repl_log, ARRAY_SIZE(g_repl_log), 0, &rev);
+		if (num == -ESTALE) {
+			LOGP(DMAIN, LOGL_NOTICE, "Replication: standby %s fell behind; re-sending all state\n",
+			     peer->name);
+			peer_tx_snapshot(peer);
+			return;
+		}
+		for (i = 0; i < num; i++) {
+			e = &g_repl_log[i];
+			switch (e->type) {
+			case STATE_LOG_SLOTMAP:
+				peer_tx_map(peer, &e->u.slotmap.bank, &e->u.slotmap.client, e->u.slotmap.state,
+					    e->removed);
+				break;
+			case STATE_LOG_BANK:
+				peer_tx_bank(peer, e->u.bank.bank_id, e->u.bank.num_slots, &e->u.bank.endpoint,
+					     e->removed);
+				break;
+			case STATE_LOG_CLIENT:
+				/* clients re-connect to whichever server is primary */
+				break;
+			}
+		}
+		peer->rev = rev;
+	} while (num == ARRAY_SIZE(g_repl_log));
+}
+
+void replication_flush(struct replication *repl)
+{
+	struct repl_peer *peer, *peer2;
+
+	if (!repl || !repl->link)
+		return;
+
+	llist_for_each_entry_safe(peer, peer2, &repl->peers, list) {
+		peer_tx_changes(peer);
+		peer_tx_flush(peer);
+		peer_reset_failed(peer);
+	}
+}
+
+static void heartbeat_timer_cb(void *data)
+{
+	struct replication *repl = data;
+	struct repl_peer *peer, *peer2;
+
+	replication_flush(repl);
+	llist_for_each_entry_safe(peer, peer2, &repl->peers, list) {
+		peer_tx_rec(peer, REPL_REC_HEARTBEAT);
+		peer_tx_flush(peer);
+		peer_reset_failed(peer);
+	}
+	osmo_timer_schedule(&repl->heartbeat_timer, REPL_HEARTBEAT_S, 0);
+}
+
+/* standbys don't send us anything, but we need to notice them going away */
+static int peer_read_cb(struct osmo_stream_srv *conn, int res, struct msgb *msg)
+{
+	msgb_free(msg);
+	if (res <= 0) {
+		osmo_stream_srv_destroy(conn);
+		return -EBADF;
+	}
+	return 0;
+}
+
+static int peer_closed_cb(struct osmo_stream_srv *conn)
+{
+	struct repl_peer *peer = osmo_stream_srv_get_data(conn);
+
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: standby %s disconnected\n", peer->name);
+	llist_del(&peer->list);
+	if (peer->tx)
+		msgb_free(peer->tx);
+	talloc_free(peer);
+	return 0;
+}
+
+static int peer_accept_cb(struct osmo_stream_srv_link *link, int fd)
+{
+	struct replication *repl = osmo_stream_srv_link_get_data(link);
+	char ip[INET6_ADDRSTRLEN], port[6];
+	struct repl_peer *peer;
+	struct repl_rec *rec;
+
+	peer = talloc_zero(repl, struct repl_peer);
+	if (!peer) {
+		close(fd);
+		return -ENOMEM;
+	}
+	peer->repl = repl;
+	osmo_sock_get_ip_and_port(fd, ip, sizeof(ip), port, sizeof(port), false);
+	snprintf(peer->name, sizeof(peer->name), "%s:%s", ip, port);
+
+	peer->conn = osmo_stream_srv_create2(repl, link, fd, peer);
+	if (!peer->conn) {
+		talloc_free(peer);
+		close(fd);
+		return -ENOMEM;
+	}
+	osmo_stream_srv_set_read_cb(peer->conn, peer_read_cb);
+	osmo_stream_srv_set_closed_cb(peer->conn, peer_closed_cb);
+	/* we detect a standby not keeping up ourselves, rather than osmo_io dropping messages */
+	osmo_iofd_set_txqueue_max_length(osmo_stream_srv_get_iofd(peer->conn), REPL_TX_QUEUE_MAX + 1);
+	llist_add_tail(&peer->list, &repl->peers);
+
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: standby %s connected\n", peer->name);
+
+	rec = peer_tx_rec(peer, REPL_REC_HELLO);
+	if (rec) {
+		rec->u.hello.magic = htonl(REPL_MAGIC);
+		rec->u.hello.version = htonl(REPL_VERSION);
+	}
+	peer_tx_snapshot(peer);
+	peer_tx_flush(peer);
+	peer_reset_failed(peer);
+
+	return 0;
+}
+
+struct replication *replication_primary_create(void *ctx, struct rspro_server *srv, const char *host,
+					       uint16_t port)
+{
+	struct replication *repl = talloc_zero(ctx, struct replication);
+	if (!repl)
+		return NULL;
+
+	repl->srv = srv;
+	INIT_LLIST_HEAD(&repl->peers);
+
+	repl->link = osmo_stream_srv_link_create(repl);
+	if (!repl->link)
+		goto out_free;
+	osmo_stream_srv_link_set_proto(repl->link, IPPROTO_TCP);
+	osmo_stream_srv_link_set_addr(repl->link, host);
+	osmo_stream_srv_link_set_port(repl->link, port);
+	osmo_stream_srv_link_set_data(repl->link, repl);
+	osmo_stream_srv_link_set_nodelay(repl->link, true);
+	osmo_stream_srv_link_set_accept_cb(repl->link, peer_accept_cb);
+	if (osmo_stream_srv_link_open(repl->link) < 0) {
+		LOGP(DMAIN, LOGL_ERROR, "Replication: cannot listen on %s:%u\n", host, port);
+		goto out_link;
+	}
+
+	osmo_timer_setup(&repl->heartbeat_timer, heartbeat_timer_cb, repl);
+	osmo_timer_schedule(&repl->heartbeat_timer, REPL_HEARTBEAT_S, 0);
+
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: serving standby servers on %s:%u\n", host, port);
+	return repl;
+
+out_link:
+	osmo_stream_srv_link_destroy(repl->link);
+out_free:
+	talloc_free(repl);
+	return NULL;
+}
+
+/***********************************************************************
+ * standby
+ ***********************************************************************/
+
+/* caller must hold slotmaps->rwlock for writing */
+static void _standby_map_del(struct replication *repl, struct slot_mapping *map)
+{
+	_slotmap_store_del(repl->srv->store, map);
+	_slotmap_del(repl->srv->slotmaps, map);
+}
+
+static void standby_seen(struct replication *repl, uint32_t id)
+{
+	unsigned int max = repl->max_seen ? repl->max_seen * 2 : 1024;
+	uint32_t *seen;
+
+	if (repl->num_seen == repl->max_seen) {
+		seen = talloc_realloc(repl, repl->seen, uint32_t, max);
+		if (!seen)
+			return;
+		repl->seen = seen;
+		repl->max_seen = max;
+	}
+	repl->seen[repl->num_seen++] = id;
+}
+
+static int u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void standby_apply_map(struct replication *repl, const struct repl_rec *rec)
+{
+	struct slotmaps *maps = repl->srv->slotmaps;
+	struct slot_mapping *map, *other;
+	struct bank_slot bank = {
+		.bank_id = ntohs(rec->u.map.bank_id),
+		.slot_nr = ntohs(rec->u.map.bank_slot),
+	};
+	struct client_slot client = {
+		.client_id = ntohs(rec->u.map.client_id),
+		.slot_nr = ntohs(rec->u.map.client_slot),
+	};
+
+	/* the REST interface refuses those, so this can only be a broken active server */
+	if (bank.bank_id >= RSPRO_NUM_BANK_IDS) {
+		LOGP(DMAIN, LOGL_ERROR, "Replication: ignoring slotmap of invalid bank %u\n", bank.bank_id);
+		return;
+	}
+
+	slotmaps_wrlock(maps);
+	map = _slotmap_by_bank(maps, &bank);
+	if (map && (rec->type == REPL_REC_MAP_DEL || !client_slot_equals(&map->client, &client))) {
+		_standby_map_del(repl, map);
+		map = NULL;
+	}
+	if (rec->type == REPL_REC_MAP) {
+		other = _slotmap_by_client(maps, &client);
+		if (other && other != map)
+			_standby_map_del(repl, other);
+		if (!map) {
+			map = _slotmap_add(maps, &bank, &client);
+			if (map)
+				_slotmap_store_add(repl->srv->store, map);
+		}
+		if (map) {
+			map->warm = rec->flags & REPL_F_ACTIVE;
+			if (repl->in_snapshot)
+				standby_seen(repl, slotmap_get_id(map));
+		}
+	}
+	slotmaps_unlock(maps);
+}
+
+static void standby_apply_bank(struct replication *repl, const struct repl_rec *rec)
+{
+	struct rspro_endpoint endpoint = { .af = AF_UNSPEC };
+	uint16_t bank_id = ntohs(rec->u.bank.bank_id);
+
+	if (bank_id >= RSPRO_NUM_BANK_IDS)
+		return;
+
+	if (rec->type == REPL_REC_BANK) {
+		endpoint.port = ntohs(rec->u.bank.port);
+		switch (rec->u.bank.ip_version) {
+		case 4:
+			endpoint.af = AF_INET;
+			memcpy(endpoint.addr, rec->u.bank.addr, 4);
+			break;
+		case 6:
+			endpoint.af = AF_INET6;
+			memcpy(endpoint.addr, rec->u.bank.addr, 16);
+			break;
+		}
+		if (repl->in_snapshot)
+			repl->banks_seen[bank_id] = true;
+	}
+
+	pthread_rwlock_wrlock(&repl->srv->rwlock);
+	repl->srv->warm_endpoints[bank_id] = endpoint;
+	pthread_rwlock_unlock(&repl->srv->rwlock);
+}
+
+/* a complete copy of the primary's state was received: drop what it didn't contain */
+static void standby_snapshot_end(struct replication *repl)
+{
+	struct slotmaps *maps = repl->srv->slotmaps;
+	struct slot_mapping *map, *map2;
+	unsigned int i, num_dropped = 0;
+	uint32_t id;
+
+	qsort(repl->seen, repl->num_seen, sizeof(repl->seen[0]), u32_cmp);
+	slotmaps_wrlock(maps);
+	llist_for_each_entry_safe(map, map2, &maps->mappings, list) {
+		id = slotmap_get_id(map);
+		if (!bsearch(&id, repl->seen, repl->num_seen, sizeof(repl->seen[0]), u32_cmp)) {
+			_standby_map_del(repl, map);
+			num_dropped++;
+		}
+	}
+	slotmaps_unlock(maps);
+
+	pthread_rwlock_wrlock(&repl->srv->rwlock);
+	for (i = 0; i < RSPRO_NUM_BANK_IDS; i++) {
+		if (!repl->banks_seen[i])
+			repl->srv->warm_endpoints[i].af = AF_UNSPEC;
+	}
+	pthread_rwlock_unlock(&repl->srv->rwlock);
+
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: in sync with primary server; %u slotmaps, %u dropped\n",
+	     repl->num_seen, num_dropped);
+	repl->in_snapshot = false;
+	repl->synced = true;
+}
+
+static void failover_schedule(struct replication *repl)
+{
+	osmo_timer_schedule(&repl->failover_timer, repl->failover_timeout_ms / 1000,
+			    (repl->failover_timeout_ms % 1000) * 1000);
+}
+
+static void standby_promote(struct replication *repl)
+{
+	struct timespec end;
+
+	osmo_timer_del(&repl->failover_timer);
+	osmo_stream_cli_destroy(repl->cli);
+	repl->cli = NULL;
+	slotmap_store_sync(repl->srv->store);
+	repl->promote_cb(repl->srv);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: promoted to primary server in %ldms\n",
+	     (end.tv_sec - repl->failover_start.tv_sec) * 1000 +
+	     (end.tv_nsec - repl->failover_start.tv_nsec) / 1000000);
+}
+
+/* the SIGCHLD handler can't know the replication instance; there is only one per process */
+static int g_sigchld_fd = -1;
+
+static void sigchld_handler(int signal)
+{
+	uint64_t one = 1;
+	int saved_errno = errno;
+
+	if (write(g_sigchld_fd, &one, sizeof(one)) < 0) {
+		/* the counter can't overflow before we read it; nothing to do */
+	}
+	errno = saved_errno;
+}
+
+static int takeover_ofd_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct replication *repl = ofd->data;
+	uint64_t val;
+	int status, rc;
+
+	if (read(ofd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -errno;
+	if (!repl->takeover_pid)
+		return 0;
+
+	/* any SIGCHLD may have woken us; only our script is of interest */
+	rc = waitpid(repl->takeover_pid, &status, WNOHANG);
+	if (rc == 0 || (rc < 0 && errno == EINTR))
+		return 0;
+	repl->takeover_pid = 0;
+
+	if (rc > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		standby_promote(repl);
+		return 0;
+	}
+
+	/* the script is also where the old primary would be fenced; don't risk two primaries
+	 * if it failed */
+	if (rc < 0)
+		LOGP(DMAIN, LOGL_ERROR, "Replication: cannot wait for takeover script '%s': %s; "
+		     "retrying in %ums\n", repl->takeover_script, strerror(errno), repl->failover_timeout_ms);
+	else
+		LOGP(DMAIN, LOGL_ERROR, "Replication: takeover script '%s' failed (%d); retrying "
+		     "in %ums\n", repl->takeover_script,
+		     WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+		     repl->failover_timeout_ms);
+	failover_schedule(repl);
+	return 0;
+}
+
+static void failover_timer_cb(void *data)
+{
+	struct replication *repl = data;
+	pid_t pid;
+
+	/* the primary may have been heard of again while the script is running */
+	if (repl->takeover_pid)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &repl->failover_start);
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: primary server silent for %ums; taking over\n",
+	     repl->failover_timeout_ms);
+
+	if (!repl->takeover_script) {
+		standby_promote(repl);
+		return;
+	}
+
+	/* don't block the main loop, and with it replication, while the script runs */
+	pid = fork();
+	if (pid < 0) {
+		LOGP(DMAIN, LOGL_ERROR, "Replication: cannot start takeover script '%s': %s; retrying "
+		     "in %ums\n", repl->takeover_script, strerror(errno), repl->failover_timeout_ms);
+		failover_schedule(repl);
+		return;
+	}
+	if (pid == 0) {
+		/* don't keep our sockets open for as long as the script runs */
+		osmo_close_all_fds_above(STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", repl->takeover_script, (char *) NULL);
+		_exit(127);
+	}
+	repl->takeover_pid = pid;
+	LOGP(DMAIN, LOGL_INFO, "Replication: started takeover script '%s' (pid %d)\n",
+	     repl->takeover_script, (int) pid);
+}
+
+static int standby_segmentation_cb(struct msgb *msg)
+{
+	return sizeof(struct repl_rec);
+}
+
+static int standby_read_cb(struct osmo_stream_cli *cli, int res, struct msgb *msg)
+{
+	struct replication *repl = osmo_stream_cli_get_data(cli);
+	const struct repl_rec *rec;
+
+	if (res <= 0 || msgb_length(msg) != sizeof(*rec))
+		goto err;
+	rec = (const struct repl_rec *) msgb_data(msg);
+
+	switch (rec->type) {
+	case REPL_REC_HEARTBEAT:
+		slotmap_store_sync(repl->srv->store);
+		break;
+	case REPL_REC_HELLO:
+		if (ntohl(rec->u.hello.magic) != REPL_MAGIC || ntohl(rec->u.hello.version) != REPL_VERSION) {
+			LOGP(DMAIN, LOGL_ERROR, "Replication: primary server speaks an unknown protocol\n");
+			goto err;
+		}
+		break;
+	case REPL_REC_SNAPSHOT_START:
+		repl->in_snapshot = true;
+		repl->num_seen = 0;
+		memset(repl->banks_seen, 0, sizeof(repl->banks_seen));
+		break;
+	case REPL_REC_SNAPSHOT_END:
+		standby_snapshot_end(repl);
+		slotmap_store_sync(repl->srv->store);
+		break;
+	case REPL_REC_MAP:
+	case REPL_REC_MAP_DEL:
+		standby_apply_map(repl, rec);
+		break;
+	case REPL_REC_BANK:
+	case REPL_REC_BANK_DEL:
+		standby_apply_bank(repl, rec);
+		break;
+	default:
+		/* ignore unknown records, for compatibility with newer primaries */
+		break;
+	}
+	msgb_free(msg);
+
+	/* the primary is alive */
+	if (repl->synced)
+		failover_schedule(repl);
+	return 0;
+
+err:
+	msgb_free(msg);
+	/* anything received after the last complete copy is kept; the primary sends a new one
+	 * once we're back */
+	repl->in_snapshot = false;
+	osmo_stream_cli_reconnect(cli);
+	return -EBADF;
+}
+
+static int standby_connect_cb(struct osmo_stream_cli *cli)
+{
+	struct replication *repl = osmo_stream_cli_get_data(cli);
+
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: connected to primary server\n");
+	repl->in_snapshot = false;
+	return 0;
+}
+
+struct replication *replication_standby_create(void *ctx, struct rspro_server *srv, const char *host,
+					       uint16_t port, unsigned int failover_timeout_ms,
+					       const char *takeover_script,
+					       void (*promote_cb)(struct rspro_server *srv))
+{
+	struct replication *repl = talloc_zero(ctx, struct replication);
+	if (!repl)
+		return NULL;
+
+	repl->srv = srv;
+	INIT_LLIST_HEAD(&repl->peers);
+	repl->failover_timeout_ms = failover_timeout_ms;
+	repl->takeover_script = takeover_script;
+	repl->promote_cb = promote_cb;
+	osmo_timer_setup(&repl->failover_timer, failover_timer_cb, repl);
+
+	repl->cli = osmo_stream_cli_create(repl);
+	if (!repl->cli) {
+		talloc_free(repl);
+		return NULL;
+	}
+	osmo_stream_cli_set_name(repl->cli, "replication");
+	osmo_stream_cli_set_data(repl->cli, repl);
+	osmo_stream_cli_set_addr(repl->cli, host);
+	osmo_stream_cli_set_port(repl->cli, port);
+	osmo_stream_cli_set_proto(repl->cli, IPPROTO_TCP);
+	osmo_stream_cli_set_nodelay(repl->cli, true);
+	osmo_stream_cli_set_reconnect_timeout(repl->cli, 1);
+	osmo_stream_cli_set_segmentation_cb(repl->cli, standby_segmentation_cb);
+	osmo_stream_cli_set_connect_cb(repl->cli, standby_connect_cb);
+	osmo_stream_cli_set_read_cb2(repl->cli, standby_read_cb);
+	if (osmo_stream_cli_open(repl->cli) < 0)
+		goto out_cli;
+
+	if (takeover_script) {
+		struct sigaction sa = {
+			.sa_handler = sigchld_handler,
+			.sa_flags = SA_RESTART | SA_NOCLDSTOP,
+		};
+		int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if (fd < 0)
+			goto out_cli;
+		osmo_fd_setup(&repl->takeover_ofd, fd, OSMO_FD_READ, takeover_ofd_cb, repl, 0);
+		if (osmo_fd_register(&repl->takeover_ofd) < 0) {
+			close(fd);
+			goto out_cli;
+		}
+		g_sigchld_fd = fd;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGCHLD, &sa, NULL);
+	}
+
+	LOGP(DMAIN, LOGL_NOTICE, "Replication: standby of primary server %s:%u; taking over after %ums "
+	     "of silence\n", host, port, failover_timeout_ms);
+	return repl;
+
+out_cli:
+	osmo_stream_cli_destroy(repl->cli);
+	talloc_free(repl);
+	return NULL;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+
+struct rspro_server;
+struct replication;
+
+#define REPL_DEFAULT_PORT	9996
+
+/* primary: serve standby servers connecting to host:port */
+struct replication *replication_primary_create(void *ctx, struct rspro_server *srv, const char *host,
+					       uint16_t port);
+
+/* standby: follow the primary at host:port.  If it is silent for failover_timeout_ms after we
+ * have received a complete copy of its state, run takeover_script (if any) and call
+ * promote_cb, which is expected to start serving RSPRO and REST */
+struct replication *replication_standby_create(void *ctx, struct rspro_server *srv, const char *host,
+					       uint16_t port, unsigned int failover_timeout_ms,
+					       const char *takeover_script,
+					       void (*promote_cb)(struct rspro_server *srv));
+
+/* main thread: send all state changes made since the last call to the standby servers.  To be
+ * called after each main loop iteration; repl may be NULL */
+void replication_flush(struct replication *repl);
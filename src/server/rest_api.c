@@ -1,6 +1,10 @@
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <time.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <ctype.h>
 #include <pthread.h>
 
 #include <jansson.h>
@@ -16,6 +20,10 @@
 #include "rest_api.h"
 #include "slotmap.h"
 #include "rspro_server.h"
+#include "state_log.h"
+#include "state_snapshot.h"
+#include "sim_pool.h"
+#include "metrics.h"
 
 static json_t *comp_id2json(const struct app_comp_id *comp_id)
 {
@@ -45,23 +53,23 @@ static json_t *comp_id2json(const struct app_comp_id *comp_id)
 	return ret;
 }
 
-static json_t *client2json(const struct rspro_client_conn *conn)
+static json_t *client2json(const struct snap_conn *conn)
 {
 	json_t *ret = json_object();
 
-	json_object_set_new(ret, "peer", json_string(conn->fi->id));
-	json_object_set_new(ret, "state", json_string(osmo_fsm_inst_state_name(conn->fi)));
+	json_object_set_new(ret, "peer", json_string(conn->peer));
+	json_object_set_new(ret, "state", json_string(conn->state ? conn->state : ""));
 	/* FIXME: only in the right state */
 	json_object_set_new(ret, "component_id", comp_id2json(&conn->comp_id));
 
 	return ret;
 }
 
-static json_t *bank2json(const struct rspro_client_conn *conn)
+static json_t *bank2json(const struct snap_conn *conn)
 {
 	json_t *ret = client2json(conn);
-	json_object_set_new(ret, "bankId", json_integer(conn->bank.bank_id));
-	json_object_set_new(ret, "numberOfSlots", json_integer(conn->bank.num_slots));
+	json_object_set_new(ret, "bankId", json_integer(conn->bank_id));
+	json_object_set_new(ret, "numberOfSlots", json_integer(conn->num_slots));
 	return ret;
 }
 
@@ -86,7 +94,7 @@ static int json2bank_slot(struct bank_slot *bslot, json_t *in)
 		return -EINVAL;
 	bslot->bank_id = json_integer_value(jbank_id);
 	bslot->slot_nr = json_integer_value(jslot_nr);
-	if (bslot->bank_id > 1023 || bslot->slot_nr > 1023)
+	if (bslot->bank_id >= RSPRO_NUM_BANK_IDS || bslot->slot_nr > 1023)
 		return -EINVAL;
 	return 0;
 }
@@ -117,7 +125,7 @@ static int json2client_slot(struct client_slot *cslot, json_t *in)
 	return 0;
 }
 
-static json_t *slotmap2json(const struct slot_mapping *slotmap)
+static json_t *slotmap2json(const struct snap_slotmap *slotmap)
 {
 	json_t *ret = json_object();
 	json_object_set_new(ret, "bank", bank_slot2json(&slotmap->bank));
@@ -153,31 +161,615 @@ static int api_cb_rest_ctr_get(const struct _u_request *req, struct _u_response
 	return U_CALLBACK_CONTINUE;
 }
 
-static int api_cb_banks_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
+/* Prometheus scrape endpoint; outside of PREFIX, where scrapers look by default */
+static int api_cb_metrics_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
 {
-	struct rspro_client_conn *conn;
-	json_t *json_body = json_object();
-	json_t *json_banks = json_array();
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	/* talloc is not thread-safe, so don't use it here */
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		ulfius_set_empty_body_response(resp, 500);
+		return U_CALLBACK_COMPLETE;
+	}
+	metrics_write(f, g_rps);
+	fclose(f);
+
+	u_map_put(resp->map_header, "Content-Type", "text/plain; version=0.0.4");
+	ulfius_set_binary_body_response(resp, 200, buf, len);
+	free(buf);
+	return U_CALLBACK_COMPLETE;
+}
+
+/***********************************************************************
+ * watching for changes: revisions, delta queries and Server-Sent Events
+ ***********************************************************************/
+
+/* maximum time a long-poll request may wait for changes */
+#define WATCH_MAX_WAIT_S	60
+/* interval of keep-alive comments on an idle event stream */
+#define SSE_KEEPALIVE_S		15
+#define SSE_BLOCK_SIZE		4096
+
+static const char *state_log_type_names[] = {
+	[STATE_LOG_SLOTMAP] = "slotmap",
+	[STATE_LOG_BANK] = "bank",
+	[STATE_LOG_CLIENT] = "client",
+};
+
+/* key identifying the object an entry refers to, among the entries of the same type */
+static uint32_t state_log_key(const struct state_log_entry *e)
+{
+	switch (e->type) {
+	case STATE_LOG_SLOTMAP:
+		return (e->u.slotmap.bank.bank_id << 16) | e->u.slotmap.bank.slot_nr;
+	case STATE_LOG_BANK:
+		return e->u.bank.bank_id;
+	case STATE_LOG_CLIENT:
+	default:
+		return (e->u.client.client_id << 16) | e->u.client.slot_nr;
+	}
+}
+
+static json_t *state_log_entry2json(const struct state_log_entry *e)
+{
+	json_t *ret;
+
+	switch (e->type) {
+	case STATE_LOG_SLOTMAP:
+		ret = json_object();
+		json_object_set_new(ret, "id", json_integer(state_log_key(e)));
+		json_object_set_new(ret, "bank", bank_slot2json(&e->u.slotmap.bank));
+		json_object_set_new(ret, "client", client_slot2json(&e->u.slotmap.client));
+		if (!e->removed)
+			json_object_set_new(ret, "state", json_string(slotmap_state_name(e->u.slotmap.state)));
+		return ret;
+	case STATE_LOG_BANK:
+		ret = json_object();
+		json_object_set_new(ret, "bankId", json_integer(e->u.bank.bank_id));
+		json_object_set_new(ret, "numberOfSlots", json_integer(e->u.bank.num_slots));
+		return ret;
+	case STATE_LOG_CLIENT:
+	default:
+		return client_slot2json(&e->u.client);
+	}
+}
+
+/* order by key, and the most recent change of each key first */
+static int state_log_entry_cmp(const void *a, const void *b)
+{
+	const struct state_log_entry *ea = *(const struct state_log_entry **) a;
+	const struct state_log_entry *eb = *(const struct state_log_entry **) b;
+	uint32_t ka = state_log_key(ea), kb = state_log_key(eb);
+
+	if (ka != kb)
+		return ka < kb ? -1 : 1;
+	return ea->rev > eb->rev ? -1 : ea->rev < eb->rev;
+}
 
-	pthread_rwlock_rdlock(&g_rps->rwlock);
-	llist_for_each_entry(conn, &g_rps->banks, list) {
-		json_array_append_new(json_banks, bank2json(conn));
+/* parse the optional ?since=REV&wait=SECS of a request.
+ * Returns 1 if 'since' was given; 0 if not; negative on invalid parameters */
+static int watch_params(const struct _u_request *req, uint64_t *since, int *wait_s)
+{
+	const char *since_str = u_map_get(req->map_url, "since");
+	const char *wait_str = u_map_get(req->map_url, "wait");
+	unsigned long wait;
+	char *end;
+
+	*wait_s = 0;
+	if (!since_str)
+		return 0;
+
+	errno = 0;
+	*since = strtoull(since_str, &end, 10);
+	if (errno || end == since_str || *end)
+		return -EINVAL;
+
+	if (wait_str) {
+		wait = strtoul(wait_str, &end, 10);
+		if (end == wait_str || *end || wait > WATCH_MAX_WAIT_S)
+			return -EINVAL;
+		*wait_s = wait;
 	}
-	pthread_rwlock_unlock(&g_rps->rwlock);
+	return 1;
+}
 
-	json_object_set_new(json_body, "banks", json_banks);
+/* respond to a delta query: all objects of given type changed since the given revision,
+ * each with its most recent state.  Waits up to wait_s seconds for a change if there is none */
+static int api_respond_delta(struct _u_response *resp, const char *name, enum state_log_type type,
+			     uint64_t since, int wait_s)
+{
+	struct state_log_entry *log, **sorted;
+	json_t *json_body, *json_changed, *json_deleted;
+	unsigned int num_sorted = 0, i;
+	uint64_t rev;
+	int num;
+
+	/* talloc is not thread-safe, so don't use it here */
+	log = calloc(STATE_LOG_SIZE, sizeof(*log));
+	sorted = calloc(STATE_LOG_SIZE, sizeof(*sorted));
+	if (!log || !sorted) {
+		free(log);
+		free(sorted);
+		ulfius_set_empty_body_response(resp, 500);
+		return U_CALLBACK_COMPLETE;
+	}
+
+	num = state_log_get(since, log, STATE_LOG_SIZE, wait_s * 1000, &rev);
+	json_body = json_object();
+	json_object_set_new(json_body, "revision", json_integer(rev));
+	if (num < 0) {
+		/* too old (or from the future): the client has to re-read the full state */
+		ulfius_set_json_body_response(resp, 410, json_body);
+		goto out;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (log[i].type == type)
+			sorted[num_sorted++] = &log[i];
+	}
+	qsort(sorted, num_sorted, sizeof(*sorted), state_log_entry_cmp);
+
+	json_changed = json_array();
+	json_deleted = json_array();
+	for (i = 0; i < num_sorted; i++) {
+		/* only the first (most recent) change of each object counts */
+		if (i > 0 && state_log_key(sorted[i]) == state_log_key(sorted[i - 1]))
+			continue;
+		if (sorted[i]->removed)
+			json_array_append_new(json_deleted, state_log_entry2json(sorted[i]));
+		else
+			json_array_append_new(json_changed, state_log_entry2json(sorted[i]));
+	}
+	json_object_set_new(json_body, name, json_changed);
+	json_object_set_new(json_body, "deleted", json_deleted);
 	ulfius_set_json_body_response(resp, 200, json_body);
+
+out:
 	json_decref(json_body);
+	free(sorted);
+	free(log);
+	return U_CALLBACK_COMPLETE;
+}
 
+struct sse_stream {
+	/* revision of the last change sent to the client */
+	uint64_t rev;
+	struct state_log_entry log[64];
+};
+
+/* called by the HTTP server (in the thread of this connection) whenever it can send more */
+static ssize_t sse_stream_cb(void *data, uint64_t offset, char *out_buf, size_t max)
+{
+	struct sse_stream *sse = data;
+	size_t len = 0, json_len;
+	uint64_t rev;
+	json_t *jev;
+	int i, num, n;
+
+	num = state_log_get(sse->rev, sse->log, ARRAY_SIZE(sse->log), SSE_KEEPALIVE_S * 1000, &rev);
+	if (num < 0) {
+		/* we fell too far behind: the client has to re-read the full state */
+		sse->rev = rev;
+		return snprintf(out_buf, max, "event: reset\ndata: {\"revision\": %" PRIu64 "}\n\n", rev);
+	}
+	if (num == 0)
+		return snprintf(out_buf, max, ": keep-alive\n\n");
+
+	for (i = 0; i < num; i++) {
+		n = snprintf(out_buf + len, max - len, "id: %" PRIu64 "\nevent: %s\ndata: ", sse->log[i].rev,
+			     state_log_type_names[sse->log[i].type]);
+		if (n < 0 || (size_t) n >= max - len)
+			break;
+		jev = state_log_entry2json(&sse->log[i]);
+		json_object_set_new(jev, "removed", json_boolean(sse->log[i].removed));
+		json_len = json_dumpb(jev, out_buf + len + n, max - len - n, JSON_COMPACT);
+		json_decref(jev);
+		/* leave anything not fitting completely for the next call */
+		if (len + n + json_len + 2 > max)
+			break;
+		len += n + json_len;
+		out_buf[len++] = '\n';
+		out_buf[len++] = '\n';
+		sse->rev = sse->log[i].rev;
+	}
+
+	if (len == 0) {
+		/* the first change alone doesn't fit into a block; rather than stalling on it
+		 * forever, skip it and make the client re-read the full state */
+		LOGP(DREST, LOGL_NOTICE, "SSE: change %" PRIu64 " exceeds %zu bytes, sending reset\n",
+		     sse->log[0].rev, max);
+		sse->rev = sse->log[0].rev;
+		return snprintf(out_buf, max, "event: reset\ndata: {\"revision\": %" PRIu64 "}\n\n",
+				sse->rev);
+	}
+
+	return len;
+}
+
+/* stream all changes as Server-Sent Events, starting after ?since or the Last-Event-ID */
+static int api_cb_events_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	const char *last_id = u_map_get(req->map_header, "Last-Event-ID");
+	struct sse_stream *sse;
+	uint64_t since;
+	int wait_s, rc;
+	char *end;
+
+	rc = watch_params(req, &since, &wait_s);
+	if (rc < 0)
+		goto err;
+	if (rc == 0 && last_id) {
+		errno = 0;
+		since = strtoull(last_id, &end, 10);
+		if (errno || end == last_id || *end)
+			goto err;
+	} else if (rc == 0)
+		since = state_log_rev();
+
+	sse = calloc(1, sizeof(*sse));
+	if (!sse) {
+		ulfius_set_empty_body_response(resp, 500);
+		return U_CALLBACK_COMPLETE;
+	}
+	sse->rev = since;
+
+	u_map_put(resp->map_header, "Content-Type", "text/event-stream");
+	u_map_put(resp->map_header, "Cache-Control", "no-cache");
+	ulfius_set_stream_response(resp, 200, sse_stream_cb, free, U_STREAM_SIZE_UNKNOWN, SSE_BLOCK_SIZE, sse);
 	return U_CALLBACK_COMPLETE;
+err:
+	ulfius_set_empty_body_response(resp, 400);
+	return U_CALLBACK_COMPLETE;
+}
+
+/***********************************************************************
+ * listing: pagination and streaming of (potentially large) lists
+ ***********************************************************************/
+
+/* Lists are read from the most recent state snapshot, which requires no locking, and the
+ * JSON is generated row by row while the HTTP response is being sent.  This avoids
+ * building the whole JSON tree in memory. */
+
+#define LIST_STREAM_BLOCK_SIZE	16384
+/* maximum number of entries per page */
+#define LIST_MAX_LIMIT		10000
+
+/* parameters of list requests: ?cursor=KEY&limit=N plus the filters bank_id, client_id and
+ * state.  Lists are ordered by key (slotmap id, bankId or clientId << 16 | slotNr), and only
+ * entries with a key above the cursor are returned */
+struct list_params {
+	bool has_cursor;
+	uint32_t cursor;
+	/* maximum number of entries to return; 0 for all */
+	size_t limit;
+	/* filters; -1 if not given */
+	int bank_id;
+	int client_id;
+	int state;
+};
+
+/* parse an optional unsigned integer URL parameter.
+ * Returns 1 if present; 0 if not; negative if invalid */
+static int url_param_ul(const struct _u_request *req, const char *name, unsigned long max,
+			unsigned long *out)
+{
+	const char *str = u_map_get(req->map_url, name);
+	char *end;
+
+	if (!str)
+		return 0;
+	errno = 0;
+	*out = strtoul(str, &end, 10);
+	if (errno || end == str || *end || *out > max)
+		return -EINVAL;
+	return 1;
+}
+
+static int list_params(const struct _u_request *req, struct list_params *lp)
+{
+	const char *state_str = u_map_get(req->map_url, "state");
+	unsigned long val;
+	int rc;
+
+	memset(lp, 0, sizeof(*lp));
+	lp->bank_id = lp->client_id = lp->state = -1;
+
+	rc = url_param_ul(req, "cursor", UINT32_MAX, &val);
+	if (rc < 0)
+		return rc;
+	lp->has_cursor = rc;
+	lp->cursor = val;
+
+	rc = url_param_ul(req, "limit", LIST_MAX_LIMIT, &val);
+	if (rc < 0 || (rc > 0 && val == 0))
+		return -EINVAL;
+	if (rc > 0)
+		lp->limit = val;
+
+	rc = url_param_ul(req, "bank_id", 1023, &val);
+	if (rc < 0)
+		return rc;
+	if (rc > 0)
+		lp->bank_id = val;
+
+	rc = url_param_ul(req, "client_id", 1023, &val);
+	if (rc < 0)
+		return rc;
+	if (rc > 0)
+		lp->client_id = val;
+
+	if (state_str) {
+		lp->state = get_string_value(slot_map_state_name, state_str);
+		if (lp->state < 0)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+struct list_stream {
+	/* member name of the list in the JSON object */
+	const char *name;
+	struct state_snapshot *snap;
+	struct list_params lp;
+	/* return the next row matching lp as JSON, along with its key; NULL at the end */
+	json_t *(*next_row)(struct list_stream *ls, uint32_t *key);
+	/* position in the snapshot: chunk (slotmaps only) and index */
+	unsigned int chunk;
+	unsigned int idx;
+	/* row that didn't fit into the previous block */
+	json_t *pending;
+	uint32_t pending_key;
+	/* number of rows sent, and the key of the last one */
+	size_t count;
+	uint32_t last_key;
+	/* the limit was reached with more rows left; the client continues after last_key */
+	bool truncated;
+	/* progress of the response */
+	enum {
+		LIST_ST_HEAD,
+		LIST_ST_ROWS,
+		LIST_ST_TAIL,
+		LIST_ST_DONE,
+	} stage;
+};
+
+/* position ls->idx on the first of the given connections after the cursor */
+static void list_seek_conns(struct list_stream *ls, const struct snap_conn *conns, unsigned int num)
+{
+	if (!ls->lp.has_cursor)
+		ls->idx = 0;
+	else if (ls->lp.cursor == UINT32_MAX)
+		ls->idx = num;
+	else
+		ls->idx = snap_lower_bound(conns, num, sizeof(*conns), ls->lp.cursor + 1);
+}
+
+static json_t *banks_next_row(struct list_stream *ls, uint32_t *key)
+{
+	const struct snap_conn *conn;
+
+	while (ls->idx < ls->snap->num_banks) {
+		conn = &ls->snap->banks[ls->idx++];
+		if (ls->lp.bank_id >= 0 && conn->bank_id != ls->lp.bank_id)
+			continue;
+		*key = conn->key;
+		return bank2json(conn);
+	}
+	return NULL;
+}
+
+static json_t *clients_next_row(struct list_stream *ls, uint32_t *key)
+{
+	const struct snap_conn *conn;
+
+	while (ls->idx < ls->snap->num_clients) {
+		conn = &ls->snap->clients[ls->idx++];
+		if (ls->lp.client_id >= 0 && conn->client.client_id != ls->lp.client_id)
+			continue;
+		*key = conn->key;
+		return client2json(conn);
+	}
+	return NULL;
+}
+
+static json_t *slotmaps_next_row(struct list_stream *ls, uint32_t *key)
+{
+	const struct snap_chunk *chunk;
+	const struct snap_slotmap *map;
+
+	while (ls->chunk < SNAP_NUM_CHUNKS) {
+		chunk = ls->snap->slotmaps[ls->chunk];
+		if (!chunk || ls->idx >= chunk->num) {
+			/* the slotmaps of a bank are all in one chunk */
+			if (ls->lp.bank_id >= 0)
+				ls->chunk = SNAP_NUM_CHUNKS;
+			else
+				ls->chunk++;
+			ls->idx = 0;
+			continue;
+		}
+		map = &chunk->maps[ls->idx++];
+		if (ls->lp.client_id >= 0 && map->client.client_id != ls->lp.client_id)
+			continue;
+		if (ls->lp.state >= 0 && map->state != ls->lp.state)
+			continue;
+		*key = map->key;
+		return slotmap2json(map);
+	}
+	return NULL;
+}
+
+/* position the stream on the first slotmap after the cursor */
+static void list_seek_slotmaps(struct list_stream *ls)
+{
+	const struct snap_chunk *chunk;
+	uint32_t start;
+
+	ls->chunk = ls->lp.bank_id >= 0 ? ls->lp.bank_id : 0;
+	ls->idx = 0;
+	if (!ls->lp.has_cursor)
+		return;
+	if (ls->lp.cursor == UINT32_MAX) {
+		ls->chunk = SNAP_NUM_CHUNKS;
+		return;
+	}
+
+	start = ls->lp.cursor + 1;
+	if ((start >> 16) < ls->chunk)
+		return;
+	if (ls->lp.bank_id >= 0 && (start >> 16) > ls->chunk) {
+		ls->chunk = SNAP_NUM_CHUNKS;
+		return;
+	}
+	ls->chunk = start >> 16;
+	chunk = ls->chunk < SNAP_NUM_CHUNKS ? ls->snap->slotmaps[ls->chunk] : NULL;
+	if (chunk)
+		ls->idx = snap_lower_bound(chunk->maps, chunk->num, sizeof(chunk->maps[0]), start);
+}
+
+static void list_stream_free(void *data)
+{
+	struct list_stream *ls = data;
+
+	json_decref(ls->pending);
+	state_snapshot_put(ls->snap);
+	free(ls);
+}
+
+/* called by the HTTP server (in the thread of this connection) whenever it can send more */
+static ssize_t list_stream_cb(void *data, uint64_t offset, char *out_buf, size_t max)
+{
+	struct list_stream *ls = data;
+	size_t len = 0, sep, json_len;
+	uint32_t key;
+	json_t *jrow;
+	int n;
+
+	switch (ls->stage) {
+	case LIST_ST_HEAD:
+		ls->stage = LIST_ST_ROWS;
+		n = snprintf(out_buf, max, "{\"revision\": %" PRIu64 ", \"%s\": [", ls->snap->rev, ls->name);
+		return n < 0 || n >= max ? U_STREAM_ERROR : n;
+	case LIST_ST_ROWS:
+		while (!ls->lp.limit || ls->count < ls->lp.limit) {
+			if (ls->pending) {
+				jrow = ls->pending;
+				key = ls->pending_key;
+				ls->pending = NULL;
+			} else {
+				jrow = ls->next_row(ls, &key);
+				if (!jrow)
+					break;
+			}
+			sep = ls->count ? 1 : 0;
+			json_len = 0;
+			if (len + sep < max)
+				json_len = json_dumpb(jrow, out_buf + len + sep, max - len - sep, JSON_COMPACT);
+			if (json_len == 0 || len + sep + json_len > max) {
+				/* leave it for the next call */
+				ls->pending = jrow;
+				ls->pending_key = key;
+				break;
+			}
+			json_decref(jrow);
+			if (sep)
+				out_buf[len] = ',';
+			len += sep + json_len;
+			ls->count++;
+			ls->last_key = key;
+		}
+		if (len > 0)
+			return len;
+		/* a single row larger than a whole block */
+		if (ls->pending)
+			return U_STREAM_ERROR;
+		/* all rows sent; are there more beyond the limit? */
+		if (ls->lp.limit && ls->count == ls->lp.limit) {
+			jrow = ls->next_row(ls, &key);
+			if (jrow) {
+				json_decref(jrow);
+				ls->truncated = true;
+			}
+		}
+		ls->stage = LIST_ST_TAIL;
+		/* fall-through */
+	case LIST_ST_TAIL:
+		ls->stage = LIST_ST_DONE;
+		if (ls->truncated)
+			n = snprintf(out_buf, max, "], \"next\": %" PRIu32 "}", ls->last_key);
+		else
+			n = snprintf(out_buf, max, "]}");
+		return n < 0 || n >= max ? U_STREAM_ERROR : n;
+	case LIST_ST_DONE:
+	default:
+		return U_STREAM_END;
+	}
+}
+
+/* parse the list parameters and start streaming the list from the most recent snapshot */
+static int api_respond_list(const struct _u_request *req, struct _u_response *resp, const char *name,
+			    json_t *(*next_row)(struct list_stream *ls, uint32_t *key))
+{
+	struct list_stream *ls;
+
+	/* talloc is not thread-safe, so don't use it here */
+	ls = calloc(1, sizeof(*ls));
+	if (!ls) {
+		ulfius_set_empty_body_response(resp, 500);
+		return U_CALLBACK_COMPLETE;
+	}
+	if (list_params(req, &ls->lp) < 0) {
+		free(ls);
+		ulfius_set_empty_body_response(resp, 400);
+		return U_CALLBACK_COMPLETE;
+	}
+	ls->snap = state_snapshot_get();
+	if (!ls->snap) {
+		free(ls);
+		ulfius_set_empty_body_response(resp, 503);
+		return U_CALLBACK_COMPLETE;
+	}
+	ls->name = name;
+	ls->next_row = next_row;
+
+	if (next_row == banks_next_row)
+		list_seek_conns(ls, ls->snap->banks, ls->snap->num_banks);
+	else if (next_row == clients_next_row)
+		list_seek_conns(ls, ls->snap->clients, ls->snap->num_clients);
+	else
+		list_seek_slotmaps(ls);
+
+	u_map_put(resp->map_header, "Content-Type", "application/json");
+	ulfius_set_stream_response(resp, 200, list_stream_cb, list_stream_free, U_STREAM_SIZE_UNKNOWN,
+				   LIST_STREAM_BLOCK_SIZE, ls);
+	return U_CALLBACK_COMPLETE;
+}
+
+static int api_cb_banks_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	uint64_t since;
+	int wait_s, rc;
+
+	rc = watch_params(req, &since, &wait_s);
+	if (rc < 0) {
+		ulfius_set_empty_body_response(resp, 400);
+		return U_CALLBACK_COMPLETE;
+	} else if (rc > 0)
+		return api_respond_delta(resp, "banks", STATE_LOG_BANK, since, wait_s);
+
+	return api_respond_list(req, resp, "banks", banks_next_row);
 }
 
 static int api_cb_bank_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
 {
 	const char *bank_id_str = u_map_get(req->map_url, "bank_id");
-	struct rspro_client_conn *conn;
+	struct state_snapshot *snap;
 	json_t *json_body = NULL;
 	unsigned long bank_id;
+	unsigned int i;
 	int status;
 
 	if (!bank_id_str) {
@@ -191,14 +783,15 @@ static int api_cb_bank_get(const struct _u_request *req, struct _u_response *res
 		goto out_err;
 	}
 
-	pthread_rwlock_rdlock(&g_rps->rwlock);
-	llist_for_each_entry(conn, &g_rps->banks, list) {
-		if (conn->bank.bank_id == bank_id) {
-			json_body = bank2json(conn);
-			break;
-		}
+	snap = state_snapshot_get();
+	if (!snap) {
+		status = 503;
+		goto out_err;
 	}
-	pthread_rwlock_unlock(&g_rps->rwlock);
+	i = snap_lower_bound(snap->banks, snap->num_banks, sizeof(snap->banks[0]), bank_id);
+	if (i < snap->num_banks && snap->banks[i].bank_id == bank_id)
+		json_body = bank2json(&snap->banks[i]);
+	state_snapshot_put(snap);
 
 	if (json_body) {
 		ulfius_set_json_body_response(resp, 200, json_body);
@@ -217,29 +810,26 @@ out_err:
 
 static int api_cb_clients_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
 {
-	struct rspro_client_conn *conn;
-	json_t *json_body = json_object();
-	json_t *json_clients = json_array();
+	uint64_t since;
+	int wait_s, rc;
 
-	pthread_rwlock_rdlock(&g_rps->rwlock);
-	llist_for_each_entry(conn, &g_rps->clients, list) {
-		json_array_append_new(json_clients, client2json(conn));
-	}
-	pthread_rwlock_unlock(&g_rps->rwlock);
+	rc = watch_params(req, &since, &wait_s);
+	if (rc < 0) {
+		ulfius_set_empty_body_response(resp, 400);
+		return U_CALLBACK_COMPLETE;
+	} else if (rc > 0)
+		return api_respond_delta(resp, "clients", STATE_LOG_CLIENT, since, wait_s);
 
-	json_object_set_new(json_body, "clients", json_clients);
-	ulfius_set_json_body_response(resp, 200, json_body);
-	json_decref(json_body);
-
-	return U_CALLBACK_COMPLETE;
+	return api_respond_list(req, resp, "clients", clients_next_row);
 }
 
 static int api_cb_client_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
 {
 	const char *client_id_str = u_map_get(req->map_url, "client_id");
-	struct rspro_client_conn *conn;
+	struct state_snapshot *snap;
 	json_t *json_body = NULL;
 	unsigned long client_id;
+	unsigned int i;
 	int status;
 
 	if (!client_id_str) {
@@ -253,14 +843,16 @@ static int api_cb_client_get(const struct _u_request *req, struct _u_response *r
 		goto out_err;
 	}
 
-	pthread_rwlock_rdlock(&g_rps->rwlock);
-	llist_for_each_entry(conn, &g_rps->clients, list) {
-		if (conn->bank.bank_id == client_id) { /* FIXME */
-			json_body = client2json(conn);
-			break;
-		}
+	snap = state_snapshot_get();
+	if (!snap) {
+		status = 503;
+		goto out_err;
 	}
-	pthread_rwlock_unlock(&g_rps->rwlock);
+	/* the connection of the lowest slot of this client */
+	i = snap_lower_bound(snap->clients, snap->num_clients, sizeof(snap->clients[0]), client_id << 16);
+	if (i < snap->num_clients && snap->clients[i].client.client_id == client_id)
+		json_body = client2json(&snap->clients[i]);
+	state_snapshot_put(snap);
 
 	if (json_body) {
 		ulfius_set_json_body_response(resp, 200, json_body);
@@ -278,40 +870,53 @@ out_err:
 
 static int api_cb_slotmaps_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
 {
-	struct slot_mapping *map;
-	json_t *json_body = json_object();
-	json_t *json_maps = json_array();
+	uint64_t since;
+	int wait_s, rc;
 
-	slotmaps_rdlock(g_rps->slotmaps);
-	llist_for_each_entry(map, &g_rps->slotmaps->mappings, list) {
-		json_array_append_new(json_maps, slotmap2json(map));
-	}
-	slotmaps_unlock(g_rps->slotmaps);
+	rc = watch_params(req, &since, &wait_s);
+	if (rc < 0) {
+		ulfius_set_empty_body_response(resp, 400);
+		return U_CALLBACK_COMPLETE;
+	} else if (rc > 0)
+		return api_respond_delta(resp, "slotmaps", STATE_LOG_SLOTMAP, since, wait_s);
 
-	json_object_set_new(json_body, "slotmaps", json_maps);
-	ulfius_set_json_body_response(resp, 200, json_body);
-	json_decref(json_body);
-
-	return U_CALLBACK_COMPLETE;
+	return api_respond_list(req, resp, "slotmaps", slotmaps_next_row);
 }
 
-extern struct osmo_fd g_event_ofd;
-/* trigger our main thread select() loop */
-static void trigger_main_thread_via_eventfd(void)
+/***********************************************************************
+ * changes: executed by the main thread on behalf of the REST threads
+ ***********************************************************************/
+
+/* a single slotmap operation */
+struct slotmap_cmd {
+	struct bank_slot bank;
+	struct client_slot client;
+	uint32_t id;
+	/* HTTP status of the result */
+	int status;
+};
+
+static void cmd_slotmap_create(struct rspro_server *srv, void *data)
 {
-	uint64_t one = 1;
-	int rc;
+	struct slotmap_cmd *cmd = data;
+	struct slot_mapping *map;
+
+	slotmaps_wrlock(srv->slotmaps);
+	map = _slotmap_add(srv->slotmaps, &cmd->bank, &cmd->client);
+	if (map) {
+		_slotmap_store_add(srv->store, map);
+		/* check if any already-connected bankd matches this new map. If yes, associate it */
+		_slotmap_attach_bankd(srv, map);
+	}
+	slotmaps_unlock(srv->slotmaps);
 
-	rc = write(g_event_ofd.fd, &one, sizeof(one));
-	if (rc < 8)
-		LOGP(DREST, LOGL_ERROR, "Error writing to eventfd(): %d\n", rc);
+	cmd->status = map ? 201 : 400;
 }
 
 static int api_cb_slotmaps_post(const struct _u_request *req, struct _u_response *resp, void *user_data)
 {
-	struct rspro_server *srv = g_rps;
-	struct slot_mapping slotmap, *map;
-	struct rspro_client_conn *conn;
+	struct slotmap_cmd cmd = {};
+	struct slot_mapping slotmap;
 	json_error_t json_err;
 	json_t *json_req = NULL;
 	int rc;
@@ -325,25 +930,15 @@ static int api_cb_slotmaps_post(const struct _u_request *req, struct _u_response
 	rc = json2slotmap(&slotmap, json_req);
 	if (rc < 0)
 		goto err;
-	map = slotmap_add(g_rps->slotmaps, &slotmap.bank, &slotmap.client);
-	if (!map) {
+	cmd.bank = slotmap.bank;
+	cmd.client = slotmap.client;
+	rspro_server_exec(g_rps, cmd_slotmap_create, &cmd);
+	if (cmd.status != 201) {
 		LOGP(DREST, LOGL_NOTICE, "REST: Cannot add slotmap\n");
 		goto err;
 	}
-	slotmap_state_change(map, SLMAP_S_NEW, NULL);
-
-	/* check if any already-connected bankd matches this new map. If yes, associate it */
-	pthread_rwlock_rdlock(&srv->rwlock);
-	llist_for_each_entry(conn, &srv->banks, list) {
-		if (conn->bank.bank_id == slotmap.bank.bank_id) {
-			slotmap_state_change(map, SLMAP_S_NEW, &conn->bank.maps_new);
-			/* Notify the conn FSM about some new maps being available */
-			trigger_main_thread_via_eventfd();
-			break;
-		}
-	}
-	pthread_rwlock_unlock(&srv->rwlock);
 
+	slotmap_store_sync(g_rps->store);
 
 	json_decref(json_req);
 	ulfius_set_empty_body_response(resp, 201);
@@ -355,53 +950,24 @@ err:
 	return U_CALLBACK_COMPLETE;
 }
 
-/* caller is holding a write lock on slotmaps->rwlock */
-static void _slotmap_mark_deleted(struct slot_mapping *map)
-{
-	struct rspro_client_conn *conn = bankd_conn_by_id(g_rps, map->bank.bank_id);
-
-	/* delete map from global list to ensure it's not found by further lookups,
-	 * particularly in case somebody wants to create a new map for the same bank/slot */
-	llist_del(&map->list);
-	/* safely initialize list head to avoid trouble when del_slotmap() does another llist_del() */
-	INIT_LLIST_HEAD(&map->list);
-
-	switch (map->state) {
-	case SLMAP_S_NEW:
-		/* new map, not yet sent to bank: we can remove it immediately */
-		/* delete from bank list (if any) */
-		llist_del(&map->bank_list);
-		/* safely initialize list head to avoid trouble when del_slotmap() does another llist_del() */
-		INIT_LLIST_HEAD(&map->bank_list);
-		_slotmap_del(map->maps, map);
-		break;
-	case SLMAP_S_UNACKNOWLEDGED:
-		/* map has been sent to bank already, but wasn't acknowledged yet */
-		/* FIXME: what to do now? If we keep it unchanged, it will not be deleted.  If we
-		 * move it to DELETE_REQ, */
-		break;
-	case SLMAP_S_ACTIVE:
-		/* map is fully active. Need to move it to DELETE_REQ state + trigger rspro thread,
-		 * so the deletion can propagate to the bankd */
-		_slotmap_state_change(map, SLMAP_S_DELETE_REQ, &conn->bank.maps_delreq);
-		trigger_main_thread_via_eventfd();
-		break;
-	case SLMAP_S_DELETE_REQ:
-		/* REST had already requested deletion, but RSPRO thread hasn't issued the delete
-		 * command to the bankd yet: Do nothing */
-		break;
-	case SLMAP_S_DELETING:
-		/* we had already requested deletion of this map previously: Do nothing */
-		break;
-	default:
-		OSMO_ASSERT(0);
-	}
+static void cmd_slotmap_delete(struct rspro_server *srv, void *data)
+{
+	struct slotmap_cmd *cmd = data;
+	struct slot_mapping *map;
+
+	slotmaps_wrlock(srv->slotmaps);
+	map = _slotmap_by_id(srv->slotmaps, cmd->id);
+	if (map)
+		_slotmap_mark_deleted(srv, map);
+	slotmaps_unlock(srv->slotmaps);
+
+	cmd->status = map ? 200 : 404;
 }
 
 static int api_cb_slotmaps_del(const struct _u_request *req, struct _u_response *resp, void *user_data)
 {
 	const char *slotmap_id_str = u_map_get(req->map_url, "slotmap_id");
-	struct slot_mapping *map;
+	struct slotmap_cmd cmd = {};
 	int status = 404;
 	unsigned long map_id;
 
@@ -415,16 +981,15 @@ static int api_cb_slotmaps_del(const struct _u_request *req, struct _u_response
 		goto err;
 	}
 
-	slotmaps_wrlock(g_rps->slotmaps);
-	llist_for_each_entry(map, &g_rps->slotmaps->mappings, list) {
-		if (slotmap_get_id(map) == map_id) {
-			_slotmap_mark_deleted(map);
-			status = 200;
-			break;
-		}
+	if (map_id > UINT32_MAX) {
+		status = 400;
+		goto err;
 	}
-	slotmaps_unlock(g_rps->slotmaps);
-	trigger_main_thread_via_eventfd();
+
+	cmd.id = map_id;
+	rspro_server_exec(g_rps, cmd_slotmap_delete, &cmd);
+	status = cmd.status;
+	slotmap_store_sync(g_rps->store);
 
 
 	ulfius_set_empty_body_response(resp, status);
@@ -434,24 +999,773 @@ err:
 	return U_CALLBACK_COMPLETE;
 }
 
-static int api_cb_global_reset_post(const struct _u_request *req, struct _u_response *resp, void *user_data)
+static void cmd_global_reset(struct rspro_server *srv, void *data)
 {
 	struct slot_mapping *map, *map2;
 
-	LOGP(DMAIN, LOGL_NOTICE, "Global RESET from REST API\n");
-
 	/* mark all slot mappings as deleted */
-	slotmaps_wrlock(g_rps->slotmaps);
-	llist_for_each_entry_safe(map, map2, &g_rps->slotmaps->mappings, list) {
-		_slotmap_mark_deleted(map);
+	slotmaps_wrlock(srv->slotmaps);
+	llist_for_each_entry_safe(map, map2, &srv->slotmaps->mappings, list) {
+		_slotmap_mark_deleted(srv, map);
 	}
-	slotmaps_unlock(g_rps->slotmaps);
-	trigger_main_thread_via_eventfd();
+	slotmaps_unlock(srv->slotmaps);
+}
+
+static int api_cb_global_reset_post(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	LOGP(DMAIN, LOGL_NOTICE, "Global RESET from REST API\n");
+
+	rspro_server_exec(g_rps, cmd_global_reset, NULL);
+	slotmap_store_sync(g_rps->store);
 
 	ulfius_set_empty_body_response(resp, 200);
 	return U_CALLBACK_COMPLETE;
 }
 
+/***********************************************************************
+ * bulk slotmap operations
+ ***********************************************************************/
+
+/* parse a JSON array of slotmaps. Invalid entries are marked with status 400 */
+static struct bulk_slotmap *json2bulk_slotmaps(json_t *in, size_t *num)
+{
+	struct bulk_slotmap *items;
+	struct slot_mapping slotmap;
+	json_t *jmap;
+	size_t i;
+
+	*num = in ? json_array_size(in) : 0;
+	items = calloc(*num ? *num : 1, sizeof(*items));
+	if (!items)
+		return NULL;
+
+	json_array_foreach(in, i, jmap) {
+		if (json2slotmap(&slotmap, jmap) < 0) {
+			items[i].status = 400;
+			continue;
+		}
+		items[i].bank = slotmap.bank;
+		items[i].client = slotmap.client;
+	}
+	return items;
+}
+
+/* parse a JSON array of slotmap identifiers. Invalid entries are marked with status 400 */
+static struct bulk_slotmap *json2bulk_ids(json_t *in, size_t *num)
+{
+	struct bulk_slotmap *items;
+	json_int_t id;
+	json_t *jid;
+	size_t i;
+
+	*num = in ? json_array_size(in) : 0;
+	items = calloc(*num ? *num : 1, sizeof(*items));
+	if (!items)
+		return NULL;
+
+	json_array_foreach(in, i, jid) {
+		if (!json_is_integer(jid)) {
+			items[i].status = 400;
+			continue;
+		}
+		id = json_integer_value(jid);
+		if (id < 0 || id > UINT32_MAX) {
+			items[i].status = 400;
+			continue;
+		}
+		items[i].bank.bank_id = id >> 16;
+		items[i].bank.slot_nr = id & 0xffff;
+	}
+	return items;
+}
+
+static json_t *bulk_slotmaps2json(const struct bulk_slotmap *items, size_t num)
+{
+	json_t *ret = json_array();
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		json_t *jitem = json_object();
+		if (items[i].status != 400)
+			json_object_set_new(jitem, "id", json_integer(bulk_slotmap_id(&items[i])));
+		json_object_set_new(jitem, "status", json_integer(items[i].status));
+		json_array_append_new(ret, jitem);
+	}
+	return ret;
+}
+
+static int64_t elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+struct batch_cmd {
+	struct bulk_slotmap *creates;
+	size_t num_creates;
+	struct bulk_slotmap *deletes;
+	size_t num_deletes;
+	unsigned int num_created;
+	unsigned int num_deleted;
+};
+
+static void cmd_slotmaps_batch(struct rspro_server *srv, void *data)
+{
+	struct batch_cmd *cmd = data;
+	struct slot_mapping *map;
+	struct timespec start;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	slotmaps_wrlock(srv->slotmaps);
+	/* deletions first, so their bank/client slots can be re-used by the creations */
+	for (i = 0; i < cmd->num_deletes; i++) {
+		if (cmd->deletes[i].status)
+			continue;
+		map = _slotmap_by_bank(srv->slotmaps, &cmd->deletes[i].bank);
+		if (!map) {
+			cmd->deletes[i].status = 404;
+			continue;
+		}
+		_slotmap_mark_deleted(srv, map);
+		cmd->deletes[i].status = 200;
+		cmd->num_deleted++;
+	}
+	cmd->num_created = _bulk_create(srv, cmd->creates, cmd->num_creates);
+	slotmaps_unlock(srv->slotmaps);
+
+	LOGP(DREST, LOGL_INFO, "REST: batch created %u and deleted %u slotmaps; lock held for %" PRId64 " us\n",
+	     cmd->num_created, cmd->num_deleted, elapsed_us(&start));
+}
+
+/* apply a list of creations + deletions in one go */
+static int api_cb_slotmaps_batch_post(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	struct rspro_server *srv = g_rps;
+	struct batch_cmd cmd = {};
+	json_t *json_req = NULL, *jcreate, *jdelete, *json_body;
+	json_error_t json_err;
+
+	json_req = ulfius_get_json_body_request(req, &json_err);
+	if (!json_req || !json_is_object(json_req)) {
+		LOGP(DREST, LOGL_NOTICE, "REST: No JSON Body\n");
+		goto err;
+	}
+	jcreate = json_object_get(json_req, "create");
+	jdelete = json_object_get(json_req, "delete");
+	if ((jcreate && !json_is_array(jcreate)) || (jdelete && !json_is_array(jdelete)))
+		goto err;
+
+	cmd.creates = json2bulk_slotmaps(jcreate, &cmd.num_creates);
+	cmd.deletes = json2bulk_ids(jdelete, &cmd.num_deletes);
+	if (!cmd.creates || !cmd.deletes)
+		goto err;
+
+	rspro_server_exec(srv, cmd_slotmaps_batch, &cmd);
+	if (cmd.num_created || cmd.num_deleted)
+		slotmap_store_sync(srv->store);
+
+	json_body = json_object();
+	json_object_set_new(json_body, "create", bulk_slotmaps2json(cmd.creates, cmd.num_creates));
+	json_object_set_new(json_body, "delete", bulk_slotmaps2json(cmd.deletes, cmd.num_deletes));
+	ulfius_set_json_body_response(resp, 200, json_body);
+	json_decref(json_body);
+
+	free(cmd.creates);
+	free(cmd.deletes);
+	json_decref(json_req);
+	return U_CALLBACK_COMPLETE;
+err:
+	free(cmd.creates);
+	free(cmd.deletes);
+	json_decref(json_req);
+	ulfius_set_empty_body_response(resp, 400);
+	return U_CALLBACK_COMPLETE;
+}
+
+struct put_cmd {
+	struct slotmap_replace r;
+	/* ids of the deleted maps */
+	json_t *json_deleted;
+	int rc;
+};
+
+static void put_deleted_cb(const struct slot_mapping *map, void *data)
+{
+	struct put_cmd *cmd = data;
+
+	json_array_append_new(cmd->json_deleted, json_integer(slotmap_get_id(map)));
+}
+
+static void cmd_slotmaps_put(struct rspro_server *srv, void *data)
+{
+	struct put_cmd *cmd = data;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	slotmaps_wrlock(srv->slotmaps);
+	cmd->rc = _slotmaps_replace(srv, &cmd->r);
+	slotmaps_unlock(srv->slotmaps);
+
+	if (cmd->rc < 0)
+		return;
+	LOGP(DREST, LOGL_INFO, "REST: table replace created %u and deleted %u slotmaps; lock held for %"
+	     PRId64 " us\n", cmd->r.num_created, cmd->r.num_deleted, elapsed_us(&start));
+}
+
+/* replace the entire slotmap table with the one given */
+static int api_cb_slotmaps_put(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	struct rspro_server *srv = g_rps;
+	struct put_cmd cmd = {};
+	json_t *json_req = NULL, *jmaps, *json_body;
+	json_error_t json_err;
+	int status = 400;
+	size_t i;
+
+	json_req = ulfius_get_json_body_request(req, &json_err);
+	if (!json_req || !json_is_object(json_req)) {
+		LOGP(DREST, LOGL_NOTICE, "REST: No JSON Body\n");
+		goto err;
+	}
+	jmaps = json_object_get(json_req, "slotmaps");
+	if (!jmaps || !json_is_array(jmaps))
+		goto err;
+
+	cmd.r.items = json2bulk_slotmaps(jmaps, &cmd.r.num_items);
+	cmd.r.sorted = calloc(cmd.r.num_items ? cmd.r.num_items : 1, sizeof(*cmd.r.sorted));
+	if (!cmd.r.items || !cmd.r.sorted)
+		goto err;
+	/* sorted index of the valid entries, to find them by id */
+	for (i = 0; i < cmd.r.num_items; i++) {
+		if (cmd.r.items[i].status == 0)
+			cmd.r.sorted[cmd.r.num_sorted++] = &cmd.r.items[i];
+	}
+	qsort(cmd.r.sorted, cmd.r.num_sorted, sizeof(*cmd.r.sorted), bulk_slotmap_cmp);
+
+	cmd.json_deleted = json_array();
+	cmd.r.deleted_cb = put_deleted_cb;
+	cmd.r.data = &cmd;
+
+	rspro_server_exec(srv, cmd_slotmaps_put, &cmd);
+	if (cmd.rc == -EBUSY) {
+		LOGP(DREST, LOGL_NOTICE, "REST: table replace would delete slotmaps still being created; "
+		     "rejecting\n");
+		json_decref(cmd.json_deleted);
+		status = 409;
+		goto err;
+	}
+	if (cmd.r.num_created || cmd.r.num_deleted)
+		slotmap_store_sync(srv->store);
+
+	json_body = json_object();
+	json_object_set_new(json_body, "slotmaps", bulk_slotmaps2json(cmd.r.items, cmd.r.num_items));
+	json_object_set_new(json_body, "deleted", cmd.json_deleted);
+	ulfius_set_json_body_response(resp, 200, json_body);
+	json_decref(json_body);
+
+	free(cmd.r.sorted);
+	free(cmd.r.items);
+	json_decref(json_req);
+	return U_CALLBACK_COMPLETE;
+err:
+	free(cmd.r.sorted);
+	free(cmd.r.items);
+	json_decref(json_req);
+	ulfius_set_empty_body_response(resp, status);
+	return U_CALLBACK_COMPLETE;
+}
+
+/***********************************************************************
+ * SIM pools
+ ***********************************************************************/
+
+/* maximum number of slot ranges per pool */
+#define POOL_MAX_RANGES	1024
+
+static json_t *sim_pool2json(struct sim_pool *pool)
+{
+	unsigned long allocs = atomic_load(&pool->stats.allocs);
+	unsigned int num_free = atomic_load(&pool->num_free);
+	json_t *ret = json_object();
+	json_t *jslots = json_array();
+	json_t *jbanks = json_array();
+	json_t *jrange, *jauto, *jlatency, *jbank;
+	uint64_t load;
+	unsigned int i;
+
+	json_object_set_new(ret, "name", json_string(pool->name));
+	for (i = 0; i < pool->num_ranges; i++) {
+		jrange = json_object();
+		json_object_set_new(jrange, "bankId", json_integer(pool->ranges[i].bank_id));
+		json_object_set_new(jrange, "firstSlot", json_integer(pool->ranges[i].first_slot));
+		json_object_set_new(jrange, "count", json_integer(pool->ranges[i].num_slots));
+		json_array_append_new(jslots, jrange);
+	}
+	json_object_set_new(ret, "slots", jslots);
+	if (pool->auto_first_client >= 0) {
+		jauto = json_object();
+		json_object_set_new(jauto, "first", json_integer(pool->auto_first_client));
+		json_object_set_new(jauto, "last", json_integer(pool->auto_last_client));
+		json_object_set_new(ret, "autoClients", jauto);
+	}
+
+	json_object_set_new(ret, "size", json_integer(pool->num_slots));
+	json_object_set_new(ret, "free", json_integer(num_free));
+	json_object_set_new(ret, "used", json_integer(pool->num_slots - num_free));
+	json_object_set_new(ret, "utilization",
+			    json_real(pool->num_slots ? (double) (pool->num_slots - num_free) / pool->num_slots : 0));
+	json_object_set_new(ret, "allocations", json_integer(allocs));
+	json_object_set_new(ret, "failures", json_integer(atomic_load(&pool->stats.failures)));
+	jlatency = json_object();
+	json_object_set_new(jlatency, "avg",
+			    json_integer(allocs ? atomic_load(&pool->stats.latency_us_total) / allocs : 0));
+	json_object_set_new(jlatency, "max", json_integer(atomic_load(&pool->stats.latency_us_max)));
+	json_object_set_new(ret, "allocLatencyUs", jlatency);
+
+	for (i = 0; i < pool->num_banks; i++) {
+		jbank = json_object();
+		load = _sim_pool_bank_load(pool, &pool->banks[i]);
+		json_object_set_new(jbank, "bankId", json_integer(pool->banks[i].bank_id));
+		json_object_set_new(jbank, "size", json_integer(pool->banks[i].num_slots));
+		json_object_set_new(jbank, "free", json_integer(atomic_load(&pool->banks[i].num_free)));
+		/* null if the bankd is not connected */
+		json_object_set_new(jbank, "load", load == UINT64_MAX ? json_null() : json_integer(load));
+		json_array_append_new(jbanks, jbank);
+	}
+	json_object_set_new(ret, "banks", jbanks);
+
+	return ret;
+}
+
+/* pool names are part of the URL; keep them simple */
+static bool pool_name_valid(const char *name)
+{
+	size_t i, len = name ? strlen(name) : 0;
+
+	if (len == 0 || len >= SIM_POOL_NAME_LEN)
+		return false;
+	for (i = 0; i < len; i++) {
+		if (!isalnum((unsigned char) name[i]) && !strchr("-_.", name[i]))
+			return false;
+	}
+	return true;
+}
+
+/* a single SIM pool operation */
+struct pool_cmd {
+	const char *name;
+	struct sim_pool_range *ranges;
+	unsigned int num_ranges;
+	int auto_first_client;
+	int auto_last_client;
+	/* client to allocate a slot for, and the slotmap allocated */
+	struct client_slot client;
+	struct timespec start;
+	struct snap_slotmap map;
+	/* maximum number of slotmaps to move when rebalancing, and how many were moved */
+	unsigned int max_moves;
+	unsigned int num_moved;
+	/* HTTP status of the result */
+	int status;
+};
+
+static int json2pool_cmd(struct pool_cmd *cmd, json_t *in)
+{
+	json_t *jslots, *jrange, *jauto, *jfirst, *jlast, *jbank_id, *jcount;
+	json_int_t bank_id, first, count;
+	size_t i;
+
+	if (!json_is_object(in))
+		return -EINVAL;
+	jslots = json_object_get(in, "slots");
+	if (!json_is_array(jslots) || json_array_size(jslots) > POOL_MAX_RANGES)
+		return -EINVAL;
+
+	cmd->ranges = calloc(json_array_size(jslots) ? json_array_size(jslots) : 1, sizeof(*cmd->ranges));
+	if (!cmd->ranges)
+		return -ENOMEM;
+	json_array_foreach(jslots, i, jrange) {
+		jbank_id = json_object_get(jrange, "bankId");
+		jfirst = json_object_get(jrange, "firstSlot");
+		jcount = json_object_get(jrange, "count");
+		if (!json_is_integer(jbank_id) || !json_is_integer(jfirst) || !json_is_integer(jcount))
+			return -EINVAL;
+		bank_id = json_integer_value(jbank_id);
+		first = json_integer_value(jfirst);
+		count = json_integer_value(jcount);
+		if (bank_id < 0 || bank_id > 1023 || first < 0 || count < 1 || first + count > 1024)
+			return -EINVAL;
+		cmd->ranges[i].bank_id = bank_id;
+		cmd->ranges[i].first_slot = first;
+		cmd->ranges[i].num_slots = count;
+	}
+	cmd->num_ranges = json_array_size(jslots);
+
+	cmd->auto_first_client = cmd->auto_last_client = -1;
+	jauto = json_object_get(in, "autoClients");
+	if (!jauto)
+		return 0;
+	jfirst = json_object_get(jauto, "first");
+	jlast = json_object_get(jauto, "last");
+	if (!json_is_integer(jfirst) || !json_is_integer(jlast))
+		return -EINVAL;
+	first = json_integer_value(jfirst);
+	count = json_integer_value(jlast);
+	if (first < 0 || first > count || count > 1023)
+		return -EINVAL;
+	cmd->auto_first_client = first;
+	cmd->auto_last_client = count;
+
+	return 0;
+}
+
+static int api_cb_pools_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	struct sim_pools *pools = g_rps->pools;
+	json_t *json_body = json_object();
+	json_t *jpools = json_array();
+	struct sim_pool *pool;
+
+	pthread_rwlock_rdlock(&pools->rwlock);
+	llist_for_each_entry(pool, &pools->pools, list)
+		json_array_append_new(jpools, sim_pool2json(pool));
+	pthread_rwlock_unlock(&pools->rwlock);
+
+	json_object_set_new(json_body, "pools", jpools);
+	ulfius_set_json_body_response(resp, 200, json_body);
+	json_decref(json_body);
+
+	return U_CALLBACK_COMPLETE;
+}
+
+static int api_cb_pool_get(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	const char *name = u_map_get(req->map_url, "name");
+	struct sim_pools *pools = g_rps->pools;
+	json_t *json_body = NULL;
+	struct sim_pool *pool;
+
+	if (!pool_name_valid(name)) {
+		ulfius_set_empty_body_response(resp, 400);
+		return U_CALLBACK_COMPLETE;
+	}
+
+	pthread_rwlock_rdlock(&pools->rwlock);
+	pool = _sim_pool_by_name(pools, name);
+	if (pool)
+		json_body = sim_pool2json(pool);
+	pthread_rwlock_unlock(&pools->rwlock);
+
+	if (json_body) {
+		ulfius_set_json_body_response(resp, 200, json_body);
+		json_decref(json_body);
+	} else
+		ulfius_set_empty_body_response(resp, 404);
+
+	return U_CALLBACK_COMPLETE;
+}
+
+static void cmd_pool_put(struct rspro_server *srv, void *data)
+{
+	struct pool_cmd *cmd = data;
+	bool exists;
+	int rc;
+
+	slotmaps_wrlock(srv->slotmaps);
+	exists = _sim_pool_by_name(srv->pools, cmd->name) != NULL;
+	rc = _sim_pool_create(srv->pools, cmd->name, cmd->ranges, cmd->num_ranges,
+			      cmd->auto_first_client, cmd->auto_last_client);
+	slotmaps_unlock(srv->slotmaps);
+
+	if (rc == -EBUSY)
+		cmd->status = 409;
+	else if (rc < 0)
+		cmd->status = 500;
+	else
+		cmd->status = exists ? 200 : 201;
+}
+
+/* create a SIM pool, or replace the one of the same name */
+static int api_cb_pool_put(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	struct pool_cmd cmd = { .name = u_map_get(req->map_url, "name") };
+	json_t *json_req = NULL;
+	json_error_t json_err;
+	int status = 400;
+
+	if (!pool_name_valid(cmd.name))
+		goto out;
+	json_req = ulfius_get_json_body_request(req, &json_err);
+	if (!json_req) {
+		LOGP(DREST, LOGL_NOTICE, "REST: No JSON Body\n");
+		goto out;
+	}
+	if (json2pool_cmd(&cmd, json_req) < 0)
+		goto out;
+
+	rspro_server_exec(g_rps, cmd_pool_put, &cmd);
+	status = cmd.status;
+	if (status == 409)
+		LOGP(DREST, LOGL_NOTICE, "REST: SIM pool '%s' overlaps with another pool\n", cmd.name);
+out:
+	free(cmd.ranges);
+	json_decref(json_req);
+	ulfius_set_empty_body_response(resp, status);
+	return U_CALLBACK_COMPLETE;
+}
+
+static void cmd_pool_delete(struct rspro_server *srv, void *data)
+{
+	struct pool_cmd *cmd = data;
+	struct sim_pool *pool;
+
+	slotmaps_wrlock(srv->slotmaps);
+	pool = _sim_pool_by_name(srv->pools, cmd->name);
+	if (pool)
+		_sim_pool_del(srv->pools, pool);
+	slotmaps_unlock(srv->slotmaps);
+
+	cmd->status = pool ? 200 : 404;
+}
+
+/* remove a SIM pool; the slotmaps allocated from it are kept */
+static int api_cb_pool_del(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	struct pool_cmd cmd = { .name = u_map_get(req->map_url, "name") };
+
+	if (!pool_name_valid(cmd.name)) {
+		ulfius_set_empty_body_response(resp, 400);
+		return U_CALLBACK_COMPLETE;
+	}
+
+	rspro_server_exec(g_rps, cmd_pool_delete, &cmd);
+
+	ulfius_set_empty_body_response(resp, cmd.status);
+	return U_CALLBACK_COMPLETE;
+}
+
+static void cmd_pool_alloc(struct rspro_server *srv, void *data)
+{
+	struct pool_cmd *cmd = data;
+	struct slot_mapping *map = NULL;
+	struct sim_pool *pool;
+
+	slotmaps_wrlock(srv->slotmaps);
+	pool = _sim_pool_by_name(srv->pools, cmd->name);
+	if (!pool)
+		cmd->status = 404;
+	else if (_slotmap_by_client(srv->slotmaps, &cmd->client))
+		cmd->status = 409;
+	else if (!(map = _sim_pool_alloc(pool, &cmd->client, &cmd->start)))
+		cmd->status = 503;
+	else {
+		_slotmap_store_add(srv->store, map);
+		_slotmap_attach_bankd(srv, map);
+		cmd->map.key = slotmap_get_id(map);
+		cmd->map.bank = map->bank;
+		cmd->map.client = map->client;
+		cmd->map.state = map->state;
+		cmd->status = 201;
+	}
+	slotmaps_unlock(srv->slotmaps);
+}
+
+/* allocate a slotmap for the given client with any free slot of the pool */
+static int api_cb_pool_alloc_post(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	struct pool_cmd cmd = { .name = u_map_get(req->map_url, "name") };
+	json_t *json_req = NULL, *json_body;
+	json_error_t json_err;
+	int status = 400;
+
+	clock_gettime(CLOCK_MONOTONIC, &cmd.start);
+	if (!pool_name_valid(cmd.name))
+		goto err;
+	json_req = ulfius_get_json_body_request(req, &json_err);
+	if (!json_req || !json_is_object(json_req)) {
+		LOGP(DREST, LOGL_NOTICE, "REST: No JSON Body\n");
+		goto err;
+	}
+	if (json2client_slot(&cmd.client, json_object_get(json_req, "client")) < 0)
+		goto err;
+
+	rspro_server_exec(g_rps, cmd_pool_alloc, &cmd);
+	status = cmd.status;
+	if (status != 201) {
+		LOGP(DREST, LOGL_NOTICE, "REST: Cannot allocate slot of SIM pool '%s' for C(%u:%u): %d\n",
+		     cmd.name, cmd.client.client_id, cmd.client.slot_nr, status);
+		goto err;
+	}
+	slotmap_store_sync(g_rps->store);
+	LOGP(DREST, LOGL_INFO, "REST: allocated B(%u:%u) of SIM pool '%s' for C(%u:%u) in %" PRId64 " us\n",
+	     cmd.map.bank.bank_id, cmd.map.bank.slot_nr, cmd.name, cmd.client.client_id,
+	     cmd.client.slot_nr, elapsed_us(&cmd.start));
+
+	json_body = slotmap2json(&cmd.map);
+	ulfius_set_json_body_response(resp, 201, json_body);
+	json_decref(json_body);
+	json_decref(json_req);
+	return U_CALLBACK_COMPLETE;
+err:
+	json_decref(json_req);
+	ulfius_set_empty_body_response(resp, status);
+	return U_CALLBACK_COMPLETE;
+}
+
+/* default for the number of slotmaps moved by one rebalance request */
+#define POOL_REBALANCE_DEFAULT	16
+
+/* the bank of the pool with the highest load which has a connected bankd and slots in use */
+static struct sim_pool_bank *pool_hottest_bank(struct sim_pool *pool, uint64_t *load_out)
+{
+	struct sim_pool_bank *ret = NULL;
+	uint64_t load;
+	unsigned int i;
+
+	for (i = 0; i < pool->num_banks; i++) {
+		if (atomic_load(&pool->banks[i].num_free) == pool->banks[i].num_slots)
+			continue;
+		load = _sim_pool_bank_load(pool, &pool->banks[i]);
+		if (load == UINT64_MAX)
+			continue;
+		if (!ret || load > *load_out) {
+			ret = &pool->banks[i];
+			*load_out = load;
+		}
+	}
+	return ret;
+}
+
+/* the bank of the pool with the lowest load which has a connected bankd and free slots */
+static struct sim_pool_bank *pool_coolest_bank(struct sim_pool *pool, uint64_t *load_out)
+{
+	struct sim_pool_bank *ret = NULL;
+	uint64_t load;
+	unsigned int i;
+
+	for (i = 0; i < pool->num_banks; i++) {
+		if (!atomic_load(&pool->banks[i].num_free))
+			continue;
+		load = _sim_pool_bank_load(pool, &pool->banks[i]);
+		if (load == UINT64_MAX)
+			continue;
+		if (!ret || load < *load_out) {
+			ret = &pool->banks[i];
+			*load_out = load;
+		}
+	}
+	return ret;
+}
+
+/* a slotmap of the given bank of the pool which can be moved without disrupting a client: its
+ * client is not connected, and the map is not waiting for the bankd.  We don't know about
+ * the traffic of individual slotmaps, so this is what 'idle' means */
+static struct slot_mapping *_pool_idle_map(struct rspro_server *srv, struct sim_pool *pool,
+					   struct sim_pool_bank *pbank)
+{
+	struct sim_pool_slot *slot;
+	struct slot_mapping *map;
+	unsigned int i;
+	bool connected;
+
+	for (i = 0; i < pool->num_slots; i++) {
+		slot = &pool->slots[i];
+		if (slot->pbank != pbank || slot->free)
+			continue;
+		map = _slotmap_by_bank(srv->slotmaps, &slot->bank);
+		if (!map || (map->state != SLMAP_S_NEW && map->state != SLMAP_S_ACTIVE))
+			continue;
+		pthread_rwlock_rdlock(&srv->rwlock);
+		connected = _client_conn_by_slot(srv, &map->client) != NULL;
+		pthread_rwlock_unlock(&srv->rwlock);
+		if (!connected)
+			return map;
+	}
+	return NULL;
+}
+
+static void cmd_pool_rebalance(struct rspro_server *srv, void *data)
+{
+	struct pool_cmd *cmd = data;
+	struct sim_pool_bank *hot, *cool;
+	struct slot_mapping *map;
+	struct client_slot client;
+	uint64_t hot_load, cool_load;
+	struct sim_pool *pool;
+
+	slotmaps_wrlock(srv->slotmaps);
+	pool = _sim_pool_by_name(srv->pools, cmd->name);
+	if (!pool) {
+		slotmaps_unlock(srv->slotmaps);
+		cmd->status = 404;
+		return;
+	}
+
+	while (cmd->num_moved < cmd->max_moves) {
+		hot = pool_hottest_bank(pool, &hot_load);
+		cool = pool_coolest_bank(pool, &cool_load);
+		if (!hot || !cool || hot == cool)
+			break;
+		/* stop once moving one more map would just reverse the imbalance */
+		if (hot_load <= cool_load + 1000 / hot->num_slots + 1000 / cool->num_slots)
+			break;
+		map = _pool_idle_map(srv, pool, hot);
+		if (!map)
+			break;
+
+		client = map->client;
+		LOGP(DREST, LOGL_INFO, "REST: moving C(%u:%u) of SIM pool '%s' off B%u (load %" PRIu64
+		     ") to B%u (load %" PRIu64 ")\n", client.client_id, client.slot_nr, pool->name,
+		     hot->bank_id, hot_load, cool->bank_id, cool_load);
+		_slotmap_mark_deleted(srv, map);
+		map = _sim_pool_alloc(pool, &client, &cmd->start);
+		if (!map)
+			break;
+		_slotmap_store_add(srv->store, map);
+		_slotmap_attach_bankd(srv, map);
+		cmd->num_moved++;
+	}
+	slotmaps_unlock(srv->slotmaps);
+
+	cmd->status = 200;
+}
+
+/* move idle slotmaps of the pool from its most to its least loaded banks */
+static int api_cb_pool_rebalance_post(const struct _u_request *req, struct _u_response *resp, void *user_data)
+{
+	struct pool_cmd cmd = { .name = u_map_get(req->map_url, "name") };
+	json_t *json_body;
+	unsigned long val;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &cmd.start);
+	rc = url_param_ul(req, "max", UINT16_MAX, &val);
+	if (!pool_name_valid(cmd.name) || rc < 0) {
+		ulfius_set_empty_body_response(resp, 400);
+		return U_CALLBACK_COMPLETE;
+	}
+	cmd.max_moves = rc > 0 ? val : POOL_REBALANCE_DEFAULT;
+
+	rspro_server_exec(g_rps, cmd_pool_rebalance, &cmd);
+	if (cmd.status != 200) {
+		ulfius_set_empty_body_response(resp, cmd.status);
+		return U_CALLBACK_COMPLETE;
+	}
+	if (cmd.num_moved)
+		slotmap_store_sync(g_rps->store);
+	LOGP(DREST, LOGL_INFO, "REST: moved %u slotmaps of SIM pool '%s' in %" PRId64 " us\n",
+	     cmd.num_moved, cmd.name, elapsed_us(&cmd.start));
+
+	json_body = json_object();
+	json_object_set_new(json_body, "moved", json_integer(cmd.num_moved));
+	ulfius_set_json_body_response(resp, 200, json_body);
+	json_decref(json_body);
+	return U_CALLBACK_COMPLETE;
+}
+
 static const struct _u_endpoint api_endpoints[] = {
 	/* get the current restart counter */
 	{ "GET",  PREFIX, "/restart-counter", 0, &api_cb_rest_ctr_get, NULL },
@@ -464,8 +1778,21 @@ static const struct _u_endpoint api_endpoints[] = {
 	/* get a list of mappings */
 	{ "GET",  PREFIX, "/slotmaps", 0, &api_cb_slotmaps_get, NULL },
 	{ "POST",  PREFIX, "/slotmaps", 0, &api_cb_slotmaps_post, NULL },
+	{ "PUT",  PREFIX, "/slotmaps", 0, &api_cb_slotmaps_put, NULL },
+	{ "POST",  PREFIX, "/slotmaps:batch", 0, &api_cb_slotmaps_batch_post, NULL },
 	{ "DELETE",  PREFIX, "/slotmaps/:slotmap_id", 0, &api_cb_slotmaps_del, NULL },
 	{ "POST",  PREFIX, "/global-reset", 0, &api_cb_global_reset_post, NULL },
+	/* SIM pools and allocation of slotmaps from them */
+	{ "GET",  PREFIX, "/pools", 0, &api_cb_pools_get, NULL },
+	{ "GET",  PREFIX, "/pools/:name", 0, &api_cb_pool_get, NULL },
+	{ "PUT",  PREFIX, "/pools/:name", 0, &api_cb_pool_put, NULL },
+	{ "DELETE",  PREFIX, "/pools/:name", 0, &api_cb_pool_del, NULL },
+	{ "POST",  PREFIX, "/pools/:name/allocate", 0, &api_cb_pool_alloc_post, NULL },
+	{ "POST",  PREFIX, "/pools/:name/rebalance", 0, &api_cb_pool_rebalance_post, NULL },
+	/* stream of state changes (Server-Sent Events) */
+	{ "GET",  PREFIX, "/events", 0, &api_cb_events_get, NULL },
+	/* metrics in the Prometheus text format */
+	{ "GET",  NULL, "/metrics", 0, &api_cb_metrics_get, NULL },
 };
 
 static struct _u_instance g_instance;
@@ -1,10 +1,17 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
 
 #include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hashtable.h>
 #include <osmocom/core/select.h>
 #include <osmocom/core/fsm.h>
 #include <osmocom/core/logging.h>
@@ -17,18 +24,41 @@
 #include "debug.h"
 #include "rspro_util.h"
 #include "rspro_server.h"
+#include "state_log.h"
+#include "state_snapshot.h"
 
 #define S(x)	(1 << (x))
 
+/* not exported by libosmocore headers */
+extern int osmo_ctx_init(const char *id);
+
+extern __thread void *talloc_asn1_ctx;
+
+/* the shard whose thread we are running in */
+static __thread struct rspro_shard *g_cur_shard;
+
+/* serializes allocation and release of IPA keep-alive FSM instances, which all shards share */
+static pthread_mutex_t g_ka_fsm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint32_t client_slot_key(const struct client_slot *cslot)
+{
+	return (cslot->client_id << 16) | cslot->slot_nr;
+}
+
 static RsproPDU_t *slotmap2CreateMappingReq(const struct slot_mapping *slotmap)
 {
 	ClientSlot_t clslot;
 	BankSlot_t bslot;
 
+	RsproPDU_t *pdu;
+
 	client_slot2rspro(&clslot, &slotmap->client);
 	bank_slot2rspro(&bslot, &slotmap->bank);
 
-	return rspro_gen_CreateMappingReq(&clslot, &bslot);
+	pdu = rspro_gen_CreateMappingReq(&clslot, &bslot);
+	if (pdu)
+		pdu->tag = slotmap->op.tag;
+	return pdu;
 }
 
 static RsproPDU_t *slotmap2RemoveMappingReq(const struct slot_mapping *slotmap)
@@ -36,20 +66,58 @@ static RsproPDU_t *slotmap2RemoveMappingReq(const struct slot_mapping *slotmap)
 	ClientSlot_t clslot;
 	BankSlot_t bslot;
 
+	RsproPDU_t *pdu;
+
 	client_slot2rspro(&clslot, &slotmap->client);
 	bank_slot2rspro(&bslot, &slotmap->bank);
 
-	return rspro_gen_RemoveMappingReq(&clslot, &bslot);
+	pdu = rspro_gen_RemoveMappingReq(&clslot, &bslot);
+	if (pdu)
+		pdu->tag = slotmap->op.tag;
+	return pdu;
 }
 
 
+/* the IPA connection carrying the PDUs of a client slot; NULL while it's being torn down */
+static struct osmo_stream_srv *client_conn_peer(const struct rspro_client_conn *conn)
+{
+	if (conn->client.trunk)
+		return conn->client.trunk->peer;
+	return conn->peer;
+}
+
+/* transmit the batch frame assembled so far, if any */
+static void client_conn_flush(struct rspro_client_conn *conn)
+{
+	struct msgb *msg_tx = conn->bank.tx_batch;
+
+	if (!msg_tx)
+		return;
+	conn->bank.tx_batch = NULL;
+	LOGPFSML(conn->fi, LOGL_DEBUG, "Tx RSPRO batch of %u PDUs\n", conn->bank.tx_batch_num);
+	conn->bank.tx_batch_num = 0;
+
+	ipa_prepend_header_ext(msg_tx, IPAC_PROTO_EXT_RSPRO);
+	ipa_prepend_header(msg_tx, IPAC_PROTO_OSMO);
+	osmo_stream_srv_send(conn->peer, msg_tx);
+}
+
 static void client_conn_send(struct rspro_client_conn *conn, RsproPDU_t *pdu)
 {
+	struct osmo_stream_srv *peer = client_conn_peer(conn);
+
+	/* don't let anything overtake PDUs that are already queued in a batch */
+	client_conn_flush(conn);
+
 	if (!pdu) {
 		LOGPFSML(conn->fi, LOGL_ERROR, "Attempt to transmit NULL\n");
 		osmo_log_backtrace(DMAIN, LOGL_ERROR);
 		return;
 	}
+	if (!peer) {
+		ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdu);
+		return;
+	}
 	LOGPFSML(conn->fi, LOGL_DEBUG, "Tx RSPRO %s\n", rspro_msgt_name(pdu));
 
 	struct msgb *msg_tx = rspro_enc_msg(pdu);
@@ -61,7 +129,340 @@ static void client_conn_send(struct rspro_client_conn *conn, RsproPDU_t *pdu)
 	}
 	ipa_prepend_header_ext(msg_tx, IPAC_PROTO_EXT_RSPRO);
 	ipa_prepend_header(msg_tx, IPAC_PROTO_OSMO);
-	osmo_stream_srv_send(conn->peer, msg_tx);
+	osmo_stream_srv_send(peer, msg_tx);
+	atomic_fetch_add(&conn->tx_pdus, 1);
+}
+
+/* queue a PDU for transmission to a bankd; coalesced into batch frames if the bankd supports
+ * them, in which case the caller must call client_conn_flush() before returning to the main loop */
+static void client_conn_send_batched(struct rspro_client_conn *conn, RsproPDU_t *pdu)
+{
+	if (!conn->bank.batch || !pdu) {
+		client_conn_send(conn, pdu);
+		return;
+	}
+	LOGPFSML(conn->fi, LOGL_DEBUG, "Tx RSPRO %s (batched)\n", rspro_msgt_name(pdu));
+
+	if (conn->bank.tx_batch && conn->bank.tx_batch_num < RSPRO_BATCH_MAX_PDUS &&
+	    rspro_batch_append(conn->bank.tx_batch, pdu) == 0) {
+		conn->bank.tx_batch_num++;
+		atomic_fetch_add(&conn->tx_pdus, 1);
+		return;
+	}
+
+	/* current frame is full (or there is none yet): send it and start a new one */
+	client_conn_flush(conn);
+	conn->bank.tx_batch = rspro_batch_alloc();
+	if (!conn->bank.tx_batch || rspro_batch_append(conn->bank.tx_batch, pdu) < 0) {
+		LOGPFSML(conn->fi, LOGL_ERROR, "Error encoding RSPRO %s\n", rspro_msgt_name(pdu));
+		osmo_log_backtrace(DMAIN, LOGL_ERROR);
+		ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdu);
+		return;
+	}
+	conn->bank.tx_batch_num = 1;
+	atomic_fetch_add(&conn->tx_pdus, 1);
+}
+
+/***********************************************************************
+ * messages between shards
+ ***********************************************************************/
+
+enum shard_msg_type {
+	SHARD_MSG_ACCEPT,	/* serve a newly accepted connection */
+	SHARD_MSG_CL_BANKD,	/* update the bankd configuration of a client */
+	SHARD_MSG_POOL_ALLOC,	/* allocate a slot from a SIM pool for a client (main thread) */
+	SHARD_MSG_STOP,		/* close all connections and terminate the thread */
+};
+
+struct shard_msg {
+	struct llist_head list;
+	enum shard_msg_type type;
+	union {
+		/* SHARD_MSG_ACCEPT */
+		int fd;
+		/* SHARD_MSG_CL_BANKD */
+		struct {
+			struct client_slot client;
+			struct bank_slot bank;
+			struct rspro_endpoint endpoint;
+			bool active;
+		} cl_bankd;
+		/* SHARD_MSG_POOL_ALLOC */
+		struct {
+			struct client_slot client;
+			struct timespec start;
+		} pool_alloc;
+	} u;
+};
+
+static void shard_wakeup(struct rspro_shard *shard)
+{
+	uint64_t one = 1;
+	int rc;
+
+	rc = write(shard->event_ofd.fd, &one, sizeof(one));
+	if (rc < 8)
+		LOGP(DMAIN, LOGL_ERROR, "Error writing to eventfd(): %d\n", rc);
+}
+
+/* hand over a message to the thread of another shard. Messages are malloc()ed, as talloc is
+ * not thread-safe; the receiving shard free()s them */
+static void shard_post(struct rspro_shard *shard, struct shard_msg *msg)
+{
+	pthread_mutex_lock(&shard->mutex);
+	llist_add_tail(&msg->list, &shard->msgq);
+	pthread_mutex_unlock(&shard->mutex);
+	shard_wakeup(shard);
+}
+
+/***********************************************************************
+ * pacing of new connections and client configurations
+ *
+ * After a restart of the server (or of a bankd), all clients come back at
+ * about the same time.  Rather than serving all of them at once, which
+ * starves keep-alives and makes everybody time out, we defer whatever
+ * exceeds the configured rate, and serve it as tokens become available.
+ ***********************************************************************/
+
+static int64_t timespec_diff_ms(const struct timespec *later, const struct timespec *earlier)
+{
+	return (later->tv_sec - earlier->tv_sec) * 1000 + (later->tv_nsec - earlier->tv_nsec) / 1000000;
+}
+
+static void pacer_init(struct pacer *p, unsigned int rate, void (*cb)(void *data), void *data)
+{
+	p->rate = rate;
+	p->milli_tokens = (uint64_t) rate * 1000;
+	clock_gettime(CLOCK_MONOTONIC, &p->last);
+	osmo_timer_setup(&p->timer, cb, data);
+}
+
+/* take a token, if there is one.  Returns 0 if so, or else the milliseconds until the next one
+ * will be available */
+static unsigned int pacer_take(struct pacer *p)
+{
+	struct timespec now;
+	int64_t ms;
+
+	if (!p->rate)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = timespec_diff_ms(&now, &p->last);
+	if (ms > 0) {
+		p->milli_tokens = OSMO_MIN(p->milli_tokens + ms * p->rate, (uint64_t) p->rate * 1000);
+		p->last = now;
+	}
+	if (p->milli_tokens >= 1000) {
+		p->milli_tokens -= 1000;
+		return 0;
+	}
+	return (1000 - p->milli_tokens + p->rate - 1) / p->rate;
+}
+
+/* account for a deferred operation; returns true if it starts a new backlog */
+static bool pacer_defer(struct pacer *p)
+{
+	bool first = !p->num;
+
+	if (first) {
+		clock_gettime(CLOCK_MONOTONIC, &p->backlog_start);
+		p->backlog_total = 0;
+	}
+	p->num++;
+	p->backlog_total++;
+	return first;
+}
+
+static void pacer_wait(struct pacer *p, unsigned int ms)
+{
+	osmo_timer_schedule(&p->timer, ms / 1000, (ms % 1000) * 1000);
+}
+
+/* milliseconds since the start of the current backlog */
+static int64_t pacer_backlog_ms(const struct pacer *p)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_diff_ms(&now, &p->backlog_start);
+}
+
+/***********************************************************************
+ * outstanding map operations towards a bankd, correlated by OperationTag
+ ***********************************************************************/
+
+static uint32_t alloc_op_tag(struct rspro_server *srv)
+{
+	/* OperationTag is INTEGER(0..2147483647); we never use 0, as that's what peers
+	 * send back if they don't echo the tag of the request */
+	return atomic_fetch_add(&srv->next_tag, 1) % 0x7fffffff + 1;
+}
+
+/* caller must hold slotmaps write lock */
+static void _map_op_start(struct rspro_client_conn *conn, struct slot_mapping *map)
+{
+	/* first operation of a new provisioning run? */
+	if (conn->bank.num_inflight == 0 && conn->bank.push_ops == 0)
+		clock_gettime(CLOCK_MONOTONIC, &conn->bank.push_start);
+
+	map->op.tag = alloc_op_tag(conn->srv);
+	map->op.retries = 0;
+	clock_gettime(CLOCK_MONOTONIC, &map->op.sent);
+	hash_add(conn->bank.pending_ops, &map->op.hnode, map->op.tag);
+	conn->bank.num_inflight++;
+
+	if (!osmo_timer_pending(&conn->bank.op_timer))
+		osmo_timer_schedule(&conn->bank.op_timer, conn->srv->cfg.op_timeout_s, 0);
+}
+
+/* caller must hold slotmaps write lock */
+static void _map_op_done(struct rspro_client_conn *conn, struct slot_mapping *map)
+{
+	hash_del(&map->op.hnode);
+	map->op.tag = 0;
+	OSMO_ASSERT(conn->bank.num_inflight > 0);
+	conn->bank.num_inflight--;
+	conn->bank.push_ops++;
+}
+
+/* resolve the map of a Create/RemoveMappingRes; caller must hold slotmaps lock */
+static struct slot_mapping *_map_op_find(struct rspro_client_conn *conn, long tag,
+					 struct llist_head *fallback_list)
+{
+	struct slot_mapping *map;
+
+	/* a bankd not echoing the OperationTag responds in order of the requests */
+	if (tag == 0)
+		return llist_first_entry_or_null(fallback_list, struct slot_mapping, bank_list);
+
+	hash_for_each_possible(conn->bank.pending_ops, map, op.hnode, tag) {
+		if (map->op.tag == tag)
+			return map;
+	}
+	return NULL;
+}
+
+/* was the map removed from the table (via _slotmap_mark_deleted()) while a request for it
+ * was outstanding?  caller must hold slotmaps lock */
+static bool _slotmap_unlinked(const struct slot_mapping *map)
+{
+	return llist_empty(&map->list);
+}
+
+/* send pending remove + create requests within the in-flight window; caller must hold
+ * slotmaps write lock */
+static void _push_pending_maps(struct rspro_client_conn *conn)
+{
+	struct slot_mapping *map, *map2;
+
+	/* send any pending delete requests first, as they may free bank slots for new maps */
+	llist_for_each_entry_safe(map, map2, &conn->bank.maps_delreq, bank_list) {
+		if (conn->bank.num_inflight >= conn->srv->cfg.max_inflight)
+			return;
+		_map_op_start(conn, map);
+		client_conn_send_batched(conn, slotmap2RemoveMappingReq(map));
+		_slotmap_state_change(map, SLMAP_S_DELETING, &conn->bank.maps_deleting);
+	}
+	/* send any pending create requests */
+	llist_for_each_entry_safe(map, map2, &conn->bank.maps_new, bank_list) {
+		if (conn->bank.num_inflight >= conn->srv->cfg.max_inflight)
+			return;
+		_map_op_start(conn, map);
+		client_conn_send_batched(conn, slotmap2CreateMappingReq(map));
+		_slotmap_state_change(map, SLMAP_S_UNACKNOWLEDGED, &conn->bank.maps_unack);
+	}
+}
+
+/* log the duration of a provisioning run once it has completed; caller must hold slotmaps lock */
+static void _check_push_complete(struct rspro_client_conn *conn)
+{
+	struct timespec now;
+
+	if (conn->bank.num_inflight || !conn->bank.push_ops ||
+	    !llist_empty(&conn->bank.maps_new) || !llist_empty(&conn->bank.maps_delreq))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	LOGPFSML(conn->fi, LOGL_INFO, "Provisioned %u slotmap operations in %" PRId64 " ms\n",
+		 conn->bank.push_ops, timespec_diff_ms(&now, &conn->bank.push_start));
+	conn->bank.push_ops = 0;
+}
+
+/* re-transmit expired requests of given list; returns false if we have to give up */
+static bool _map_ops_retransmit(struct rspro_client_conn *conn, struct llist_head *list,
+				const struct timespec *now)
+{
+	struct slot_mapping *map, *map2;
+	char mapname[64];
+
+	/* re-transmit in place: the lists stay in the order of the original requests, which is
+	 * how responses without an OperationTag are matched (see _map_op_find()) */
+	llist_for_each_entry_safe(map, map2, list, bank_list) {
+		if (timespec_diff_ms(now, &map->op.sent) < conn->srv->cfg.op_timeout_s * 1000)
+			continue;
+		if (map->op.retries >= conn->srv->cfg.op_max_retries) {
+			LOGPFSML(conn->fi, LOGL_ERROR, "Slot Map %s: no response to tag=%u after %u "
+				 "re-transmissions\n", slotmap_name(mapname, sizeof(mapname), map),
+				 map->op.tag, map->op.retries);
+			return false;
+		}
+		map->op.retries++;
+		map->op.sent = *now;
+		LOGPFSML(conn->fi, LOGL_NOTICE, "Slot Map %s: re-transmitting tag=%u (%u/%u)\n",
+			 slotmap_name(mapname, sizeof(mapname), map), map->op.tag,
+			 map->op.retries, conn->srv->cfg.op_max_retries);
+		if (map->state == SLMAP_S_UNACKNOWLEDGED)
+			client_conn_send_batched(conn, slotmap2CreateMappingReq(map));
+		else
+			client_conn_send_batched(conn, slotmap2RemoveMappingReq(map));
+	}
+	return true;
+}
+
+/* the request of given list (re-)transmitted least recently, if older than 'oldest' */
+static struct slot_mapping *_map_ops_oldest(struct llist_head *list, struct slot_mapping *oldest)
+{
+	struct slot_mapping *map;
+
+	llist_for_each_entry(map, list, bank_list) {
+		if (!oldest || timespec_diff_ms(&oldest->op.sent, &map->op.sent) > 0)
+			oldest = map;
+	}
+	return oldest;
+}
+
+static void map_op_timer_cb(void *data)
+{
+	struct rspro_client_conn *conn = data;
+	struct slotmaps *slotmaps = conn->srv->slotmaps;
+	struct slot_mapping *oldest;
+	struct timespec now;
+	int64_t next_ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	slotmaps_wrlock(slotmaps);
+	if (!_map_ops_retransmit(conn, &conn->bank.maps_unack, &now) ||
+	    !_map_ops_retransmit(conn, &conn->bank.maps_deleting, &now)) {
+		slotmaps_unlock(slotmaps);
+		LOGPFSML(conn->fi, LOGL_ERROR, "Bankd doesn't respond to slotmap requests; "
+			 "dropping connection\n");
+		osmo_fsm_inst_term(conn->fi, OSMO_FSM_TERM_ERROR, NULL);
+		return;
+	}
+
+	/* re-arm the timer for the oldest remaining request, if any */
+	oldest = _map_ops_oldest(&conn->bank.maps_unack, NULL);
+	oldest = _map_ops_oldest(&conn->bank.maps_deleting, oldest);
+	if (oldest) {
+		next_ms = conn->srv->cfg.op_timeout_s * 1000 - timespec_diff_ms(&now, &oldest->op.sent);
+		if (next_ms < 0)
+			next_ms = 0;
+		osmo_timer_schedule(&conn->bank.op_timer, next_ms / 1000, (next_ms % 1000) * 1000);
+	}
+	slotmaps_unlock(slotmaps);
+	client_conn_flush(conn);
 }
 
 
@@ -70,6 +471,7 @@ static void client_conn_send(struct rspro_client_conn *conn, RsproPDU_t *pdu)
  ***********************************************************************/
 
 static void rspro_client_conn_destroy(struct rspro_client_conn *conn);
+struct osmo_fsm_inst *server_client_fsm_alloc(void *ctx, struct rspro_client_conn *conn);
 
 enum remsim_server_client_fsm_state {
 	CLNTC_ST_INIT,
@@ -91,6 +493,7 @@ enum remsim_server_client_event {
 	CLNTC_E_CONFIG_CL_RES,	/* ConfigClientRes received */
 	CLNTC_E_PUSH,		/* drain maps_new or maps_delreq */
 	CLNTC_E_CL_CFG_BANKD,	/* send [new] ConfigConfigBankReq */
+	CLNTC_E_BANK_LOAD_IND,	/* BankLoadInd received */
 };
 
 static const struct value_string server_client_event_names[] = {
@@ -104,6 +507,7 @@ static const struct value_string server_client_event_names[] = {
 	OSMO_VALUE_STRING(CLNTC_E_CONFIG_CL_RES),
 	OSMO_VALUE_STRING(CLNTC_E_PUSH),
 	OSMO_VALUE_STRING(CLNTC_E_CL_CFG_BANKD),
+	OSMO_VALUE_STRING(CLNTC_E_BANK_LOAD_IND),
 	{ 0, NULL }
 };
 
@@ -118,6 +522,42 @@ static void clnt_st_init(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 	}
 }
 
+/* a connection on the clients/banks lists changed as far as the REST interface is concerned */
+static void conns_changed(struct rspro_server *srv)
+{
+	atomic_fetch_add(&srv->conns_rev, 1);
+}
+
+/* Determine once per connection where clients shall connect to the given bankd: its advertised
+ * endpoint, or - if it didn't advertise one, or only a port - the address it connected from */
+static int bankd_resolve_endpoint(struct rspro_client_conn *conn, const IpPort_t *adv,
+				  const char *peer_ip)
+{
+	struct rspro_endpoint *ep = &conn->bank.endpoint;
+	struct rspro_endpoint peer;
+	int rc;
+
+	if (adv) {
+		rc = rspro2endpoint(ep, adv);
+		if (rc < 0)
+			return rc;
+		if (!rspro_endpoint_addr_is_any(ep))
+			return 0;
+	}
+
+	rc = rspro_endpoint_from_str(&peer, peer_ip, adv ? ep->port : 9999);
+	if (rc < 0)
+		return rc;
+	/* clients may well be IPv4-only; don't hand them v4-mapped addresses of a dual-stack socket */
+	if (peer.af == AF_INET6 && IN6_IS_ADDR_V4MAPPED((struct in6_addr *) peer.addr)) {
+		peer.af = AF_INET;
+		memmove(peer.addr, peer.addr + 12, 4);
+		memset(peer.addr + 4, 0, 12);
+	}
+	*ep = peer;
+	return 0;
+}
+
 static void clnt_st_established(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
 	struct rspro_client_conn *conn = fi->priv;
@@ -126,13 +566,8 @@ static void clnt_st_established(struct osmo_fsm_inst *fi, uint32_t event, void *
 	const ConnectClientReq_t *cclreq = NULL;
 	const ConnectBankReq_t *cbreq = NULL;
 	RsproPDU_t *resp = NULL;
-	char ip_str[INET6_ADDRSTRLEN];
-	char port_str[6];
-	int fd = osmo_stream_srv_get_fd(conn->peer);
-
-	/* remote IP and port */
-	osmo_sock_get_ip_and_port(fd, ip_str, sizeof(ip_str),
-				  port_str, sizeof(port_str), false);
+	const char *ip_str = conn->remote_ip;
+	const char *port_str = conn->remote_port;
 
 	switch (event) {
 	case CLNTC_E_CLIENT_CONN:
@@ -163,25 +598,28 @@ static void clnt_st_established(struct osmo_fsm_inst *fi, uint32_t event, void *
 			rspro2client_slot(&conn->client.slot, cclreq->clientSlot);
 			osmo_fsm_inst_update_id_f(fi, "C%u:%u", conn->client.slot.client_id,
 						  conn->client.slot.slot_nr);
-			osmo_ipa_ka_fsm_set_id(conn->ka_fi, fi->id);
-			LOGPFSML(fi, LOGL_INFO, "Client connected from %s:%s\n", ip_str, port_str);
-
-			/* check for unique-ness */
-			previous_conn = client_conn_by_slot(conn->srv, &conn->client.slot);
+			if (conn->ka_fi)
+				osmo_ipa_ka_fsm_set_id(conn->ka_fi, fi->id);
+			if (conn->client.trunk)
+				LOGPFSML(fi, LOGL_INFO, "Client connected from %s:%s via %s\n", ip_str, port_str,
+					 conn->client.trunk->fi->id);
+			else
+				LOGPFSML(fi, LOGL_INFO, "Client connected from %s:%s\n", ip_str, port_str);
+
+			/* check for unique-ness; under the same lock as the reparenting below, as
+			 * another shard may be processing a ConnectClientReq for the same slot */
+			pthread_rwlock_wrlock(&conn->srv->rwlock);
+			previous_conn = _client_conn_by_slot(conn->srv, &conn->client.slot);
 			if (previous_conn && previous_conn != conn) {
 				/* we're dropping the current (new) connection as we don't really know which
 				 * is the "right" one. Dropping the new gives the old connection time to
 				 * timeout, or to continue to operate.  If we were to drop the old
 				 * connection, this could interrupt a perfectly working connection and opens
 				 * some kind of DoS. */
-				char prev_ip_str[INET6_ADDRSTRLEN];
-				char prev_port_str[6];
-				int prev_fd = osmo_stream_srv_get_fd(previous_conn->peer);
-				osmo_sock_get_ip_and_port(prev_fd, prev_ip_str, sizeof(prev_ip_str),
-							  prev_port_str, sizeof(prev_port_str), false);
 				LOGPFSML(fi, LOGL_ERROR, "New client connection from %s:%s, but we already "
 					 "have a connection from %s:%s. Dropping new connection.\n",
-					 ip_str, port_str, prev_ip_str, prev_port_str);
+					 ip_str, port_str, previous_conn->remote_ip, previous_conn->remote_port);
+				pthread_rwlock_unlock(&conn->srv->rwlock);
 				resp = rspro_gen_ConnectClientRes(&conn->srv->comp_id, ResultCode_identityInUse);
 				client_conn_send(conn, resp);
 				osmo_fsm_inst_state_chg(fi, CLNTC_ST_REJECTED, 1, 2);
@@ -189,14 +627,23 @@ static void clnt_st_established(struct osmo_fsm_inst *fi, uint32_t event, void *
 			}
 
 			/* reparent us from srv->connections to srv->clients */
-			pthread_rwlock_wrlock(&conn->srv->rwlock);
 			llist_del(&conn->list);
 			llist_add_tail(&conn->list, &conn->srv->clients);
+			hash_add(conn->srv->clients_by_slot, &conn->hnode_slot,
+				 client_slot_key(&conn->client.slot));
+			hash_add(conn->srv->clients_by_id, &conn->hnode_id, conn->client.slot.client_id);
+			conn->listed = true;
+			state_log_client(&conn->client.slot, false);
 			pthread_rwlock_unlock(&conn->srv->rwlock);
 
+			/* the version tells the client it may connect further slots over this connection */
 			resp = rspro_gen_ConnectClientRes(&conn->srv->comp_id, ResultCode_ok);
+			if (resp)
+				resp->version = RSPRO_VERSION_MULTISLOT;
 			client_conn_send(conn, resp);
 			osmo_fsm_inst_state_chg(fi, CLNTC_ST_CONNECTED_CLIENT, 0, 0);
+			/* only now that the connection is listed and in its final state */
+			conns_changed(conn->srv);
 		}
 		break;
 	case CLNTC_E_BANK_CONN:
@@ -210,24 +657,31 @@ static void clnt_st_established(struct osmo_fsm_inst *fi, uint32_t event, void *
 		}
 		conn->bank.bank_id = cbreq->bankId;
 		conn->bank.num_slots = cbreq->numberOfSlots;
+		conn->bank.batch = pdu->version >= RSPRO_VERSION_BATCH;
+		conn->bank.maps_digest = cbreq->mappingsDigest ? *cbreq->mappingsDigest : -1;
 		osmo_fsm_inst_update_id_f(fi, "B%u", conn->bank.bank_id);
 		osmo_ipa_ka_fsm_set_id(conn->ka_fi, fi->id);
 
-		LOGPFSML(fi, LOGL_INFO, "Bankd connected from %s:%s\n", ip_str, port_str);
-		if (!strncmp(ip_str, "127.", 4)) {
-			LOGPFSML(fi, LOGL_NOTICE, "Bankd connected from %s (localhost). "
+		LOGPFSML(fi, LOGL_INFO, "Bankd connected from %s:%s%s\n", ip_str, port_str,
+			 conn->bank.batch ? " (supports batch frames)" : "");
+		if (bankd_resolve_endpoint(conn, cbreq->bankdEndpoint, ip_str) < 0) {
+			LOGPFSML(fi, LOGL_ERROR, "ConnectBankReq with invalid bankdEndpoint\n");
+			osmo_fsm_inst_term(fi, OSMO_FSM_TERM_ERROR, NULL);
+			return;
+		}
+		LOGPFSML(fi, LOGL_INFO, "Clients will be directed to %s\n",
+			 rspro_endpoint_name(&conn->bank.endpoint));
+		if (conn->bank.endpoint.af == AF_INET && conn->bank.endpoint.addr[0] == 127) {
+			LOGPFSML(fi, LOGL_NOTICE, "Bankd is reachable at %s (localhost). "
 				"This only works if your clients also all are on localhost, "
-				"as they must be able to reach the bankd!\n", ip_str);
+				"as they must be able to reach the bankd!\n",
+				rspro_endpoint_name(&conn->bank.endpoint));
 		}
 
-		/* check for unique-ness */
-		previous_conn = bankd_conn_by_id(conn->srv, conn->bank.bank_id);
+		/* check for unique-ness, see above */
+		pthread_rwlock_wrlock(&conn->srv->rwlock);
+		previous_conn = _bankd_conn_by_id(conn->srv, conn->bank.bank_id);
 		if (previous_conn && previous_conn != conn) {
-			char prev_ip_str[INET6_ADDRSTRLEN];
-			char prev_port_str[6];
-			int prev_fd = osmo_stream_srv_get_fd(previous_conn->peer);
-			osmo_sock_get_ip_and_port(prev_fd, prev_ip_str, sizeof(prev_ip_str),
-							prev_port_str, sizeof(prev_port_str), false);
 			/* we're dropping the current (new) connection as we don't really know which
 			 * is the "right" one. Dropping the new gives the old connection time to
 			 * timeout, or to continue to operate.  If we were to drop the old
@@ -235,7 +689,8 @@ static void clnt_st_established(struct osmo_fsm_inst *fi, uint32_t event, void *
 			 * some kind of DoS. */
 			LOGPFSML(fi, LOGL_ERROR, "New bankd connection from %s:%s, but we already "
 				 "have a connection from %s:%s. Dropping new connection.\n",
-				 ip_str, port_str, prev_ip_str, prev_port_str);
+				 ip_str, port_str, previous_conn->remote_ip, previous_conn->remote_port);
+			pthread_rwlock_unlock(&conn->srv->rwlock);
 			resp = rspro_gen_ConnectBankRes(&conn->srv->comp_id, ResultCode_identityInUse);
 			client_conn_send(conn, resp);
 			osmo_fsm_inst_state_chg(fi, CLNTC_ST_REJECTED, 1, 2);
@@ -243,17 +698,22 @@ static void clnt_st_established(struct osmo_fsm_inst *fi, uint32_t event, void *
 		}
 
 		/* reparent us from srv->connections to srv->banks */
-		pthread_rwlock_wrlock(&conn->srv->rwlock);
 		llist_del(&conn->list);
 		llist_add_tail(&conn->list, &conn->srv->banks);
+		hash_add(conn->srv->banks_by_id, &conn->hnode_id, conn->bank.bank_id);
+		conn->listed = true;
+		state_log_bank(conn->bank.bank_id, conn->bank.num_slots, &conn->bank.endpoint, false);
 		pthread_rwlock_unlock(&conn->srv->rwlock);
 
-		/* send response to bank first */
+		/* send response to bank first; the version tells it we understand BankLoadInd */
 		resp = rspro_gen_ConnectBankRes(&conn->srv->comp_id, ResultCode_ok);
+		if (resp)
+			resp->version = RSPRO_VERSION_LOAD;
 		client_conn_send(conn, resp);
 
 		/* the state change will associate any pre-existing slotmaps */
 		osmo_fsm_inst_state_chg(fi, CLNTC_ST_CONNECTED_BANKD, 0, 0);
+		conns_changed(conn->srv);
 
 		osmo_fsm_inst_dispatch(fi, CLNTC_E_PUSH, NULL);
 		break;
@@ -273,7 +733,116 @@ static void clnt_st_wait_cl_conf_res(struct osmo_fsm_inst *fi, uint32_t event, v
 	}
 }
 
+static void client_conn_send_cfg(struct rspro_client_conn *conn)
+{
+	ClientSlot_t clslot;
+	BankSlot_t bslot;
+	RsproPDU_t *tx;
+
+	bank_slot2rspro(&bslot, &conn->client.bankd.slot);
+	if (conn->client.trunk) {
+		/* tell the client which of the slots on its connection this is for */
+		client_slot2rspro(&clslot, &conn->client.slot);
+		tx = rspro_gen_ConfigClientBankReq(&bslot, &conn->client.bankd.endpoint, &clslot);
+	} else
+		tx = rspro_gen_ConfigClientBankReq(&bslot, &conn->client.bankd.endpoint, NULL);
+	client_conn_send(conn, tx);
+}
+
+static void client_conn_cfg_dequeue(struct rspro_client_conn *conn)
+{
+	if (!conn->client.cfg_queued)
+		return;
+	llist_del(&conn->client.cfg_list);
+	conn->client.cfg_queued = false;
+	conn->shard->cfg_pacer.num--;
+}
+
+/* send as many of the deferred client configurations of a shard as the rate permits */
+static void cfg_pacer_run(void *data)
+{
+	struct rspro_shard *shard = data;
+	struct rspro_client_conn *conn;
+	unsigned int wait_ms;
+
+	while (shard->cfg_pacer.num) {
+		wait_ms = pacer_take(&shard->cfg_pacer);
+		if (wait_ms) {
+			pacer_wait(&shard->cfg_pacer, wait_ms);
+			return;
+		}
+		conn = llist_first_entry_or_null(&shard->cfg_active, struct rspro_client_conn, client.cfg_list);
+		if (!conn)
+			conn = llist_first_entry(&shard->cfg_other, struct rspro_client_conn, client.cfg_list);
+		client_conn_cfg_dequeue(conn);
+		/* always the most recent configuration, even if it changed while waiting */
+		client_conn_send_cfg(conn);
+	}
+
+	LOGP(DMAIN, LOGL_NOTICE, "Shard %u: backlog of %u client configurations sent in %" PRId64 " ms\n",
+	     shard->nr, shard->cfg_pacer.backlog_total, pacer_backlog_ms(&shard->cfg_pacer));
+}
+
+/* send the bankd configuration to a client, unless we are sending too many of them at once.
+ * 'active' is true if the bankd has acknowledged the client's slotmap */
+static void client_conn_pace_cfg(struct rspro_client_conn *conn, bool active)
+{
+	struct rspro_shard *shard = conn->shard;
+
+	if (conn->client.cfg_queued) {
+		/* whatever is current will be sent once it's its turn; but may jump the queue now */
+		if (active && !conn->client.cfg_active) {
+			llist_del(&conn->client.cfg_list);
+			llist_add_tail(&conn->client.cfg_list, &shard->cfg_active);
+			conn->client.cfg_active = true;
+		}
+		return;
+	}
+
+	if (!shard->cfg_pacer.num && !pacer_take(&shard->cfg_pacer)) {
+		client_conn_send_cfg(conn);
+		return;
+	}
+
+	if (pacer_defer(&shard->cfg_pacer))
+		LOGP(DMAIN, LOGL_NOTICE, "Shard %u: pacing client configurations at %u/s\n",
+		     shard->nr, shard->cfg_pacer.rate);
+	llist_add_tail(&conn->client.cfg_list, active ? &shard->cfg_active : &shard->cfg_other);
+	conn->client.cfg_queued = true;
+	conn->client.cfg_active = active;
+	if (!osmo_timer_pending(&shard->cfg_pacer.timer))
+		cfg_pacer_run(shard);
+}
+
+/* update the bankd configuration of a client connection of our own shard */
+static void client_conn_set_bankd(struct rspro_client_conn *conn, const struct bank_slot *bank,
+				  const struct rspro_endpoint *endpoint, bool active)
+{
+	bool changed = false;
+
+	if (!bank_slot_equals(&conn->client.bankd.slot, bank)) {
+		LOGPFSML(conn->fi, LOGL_NOTICE, "BankSlot has changed B%u:%u -> B%u:%u\n",
+			conn->client.bankd.slot.bank_id, conn->client.bankd.slot.slot_nr,
+			bank->bank_id, bank->slot_nr);
+		conn->client.bankd.slot = *bank;
+		changed = true;
+	}
+
+	/* determine if IP/port of bankd have changed */
+	if (!rspro_endpoint_equals(&conn->client.bankd.endpoint, endpoint)) {
+		LOGPFSML(conn->fi, LOGL_NOTICE, "Bankd IP/Port changed to %s\n",
+			 rspro_endpoint_name(endpoint));
+		conn->client.bankd.endpoint = *endpoint;
+		changed = true;
+	}
+
+	/* update the client with new bankd information, if any changes were made */
+	if (changed)
+		osmo_fsm_inst_dispatch(conn->fi, CLNTC_E_CL_CFG_BANKD, &active);
+}
+
 /*! find a connected client (if any) for given slotmap and update its Bankd configuration.
+ * The client may be served by another shard, in which case the update is handed over to it.
  * \param[in] map slotmap whose client connection shall be updated
  * \param[in] srv rspro_server on which we operate
  * \param[in] bankd_conn bankd connection serving the map (may be NULL if not known)
@@ -281,65 +850,69 @@ static void clnt_st_wait_cl_conf_res(struct osmo_fsm_inst *fi, uint32_t event, v
 static void _update_client_for_slotmap(struct slot_mapping *map, struct rspro_server *srv,
 					struct rspro_client_conn *bankd_conn)
 {
+	struct rspro_endpoint endpoint = { .af = AF_UNSPEC };
 	struct rspro_client_conn *conn;
-	char ip_str[INET6_ADDRSTRLEN];
-	char port_str[6];
-	uint32_t bankd_ip;
-	int bankd_port;
-	bool changed = false;
-	int rc;
+	struct shard_msg *msg;
+	bool active;
 
 	OSMO_ASSERT(map);
 	OSMO_ASSERT(srv);
 
-	conn = client_conn_by_slot(srv, &map->client);
-	if (!conn)
-		LOGP(DMAIN, LOGL_DEBUG, "%s\n", __func__);
-	else
-		LOGPFSML(conn->fi, LOGL_DEBUG, "%s\n", __func__);
+	LOGP(DMAIN, LOGL_DEBUG, "%s\n", __func__);
 
-	if (!conn)
+	pthread_rwlock_rdlock(&srv->rwlock);
+	/* if caller didn't provide bankd_conn, resolve it from map */
+	if (!bankd_conn)
+		bankd_conn = _bankd_conn_by_id(srv, map->bank.bank_id);
+	if (map->state != SLMAP_S_DELETING && bankd_conn)
+		endpoint = bankd_conn->bank.endpoint;
+	else if (map->warm && map->bank.bank_id < RSPRO_NUM_BANK_IDS)
+		endpoint = srv->warm_endpoints[map->bank.bank_id];
+	active = map->state == SLMAP_S_ACTIVE || map->warm;
+
+	conn = _client_conn_by_slot(srv, &map->client);
+	if (!conn) {
+		pthread_rwlock_unlock(&srv->rwlock);
 		return;
-
-	if (!bank_slot_equals(&conn->client.bankd.slot, &map->bank)) {
-		LOGPFSML(conn->fi, LOGL_NOTICE, "BankSlot has changed B%u:%u -> B%u:%u\n",
-			conn->client.bankd.slot.bank_id, conn->client.bankd.slot.slot_nr,
-			map->bank.bank_id, map->bank.slot_nr);
-		conn->client.bankd.slot = map->bank;
-		changed = true;
 	}
 
-	/* if caller didn't provide bankd_conn, resolve it from map */
-	if (!bankd_conn)
-		bankd_conn = bankd_conn_by_id(srv, map->bank.bank_id);
-	if (map->state == SLMAP_S_DELETING || !bankd_conn) {
-		bankd_ip = 0;
-		bankd_port = 0;
-	} else {
-		/* obtain IP and port of bankd */
-		rc = osmo_sock_get_ip_and_port(osmo_stream_srv_get_fd(bankd_conn->peer),
-					       ip_str, sizeof(ip_str),
-					       port_str, sizeof(port_str), false);
-		if (rc < 0) {
-			LOGPFSML(bankd_conn->fi, LOGL_ERROR, "Error during getpeername\n");
-			return;
-		}
-		bankd_ip = ntohl(inet_addr(ip_str));
-		bankd_port = 9999; /* TODO: configurable */
+	if (conn->shard == g_cur_shard) {
+		/* only our own thread could destroy the connection */
+		pthread_rwlock_unlock(&srv->rwlock);
+		client_conn_set_bankd(conn, &map->bank, &endpoint, active);
+		return;
 	}
 
-	/* determine if IP/port of bankd have changed */
-	if (conn->client.bankd.port != bankd_port || conn->client.bankd.ip != bankd_ip) {
-		struct in_addr ia = { .s_addr = bankd_ip };
-		LOGPFSML(conn->fi, LOGL_NOTICE, "Bankd IP/Port changed to %s:%u\n", inet_ntoa(ia), bankd_port);
-		conn->client.bankd.ip = bankd_ip;
-		conn->client.bankd.port = bankd_port;
-		changed = true;
+	msg = calloc(1, sizeof(*msg));
+	if (!msg) {
+		pthread_rwlock_unlock(&srv->rwlock);
+		LOGP(DMAIN, LOGL_ERROR, "Out of memory; cannot update bankd configuration\n");
+		return;
 	}
+	msg->type = SHARD_MSG_CL_BANKD;
+	msg->u.cl_bankd.client = map->client;
+	msg->u.cl_bankd.bank = map->bank;
+	msg->u.cl_bankd.endpoint = endpoint;
+	msg->u.cl_bankd.active = active;
+	shard_post(conn->shard, msg);
+	pthread_rwlock_unlock(&srv->rwlock);
+}
 
-	/* update the client with new bankd information, if any changes were made */
-	if (changed)
-		osmo_fsm_inst_dispatch(conn->fi, CLNTC_E_CL_CFG_BANKD, NULL);
+/* have the main thread allocate a slot of the client's SIM pool; the client is configured once
+ * the bankd has acknowledged the new map */
+static void request_pool_alloc(struct rspro_client_conn *conn)
+{
+	struct shard_msg *msg;
+
+	msg = calloc(1, sizeof(*msg));
+	if (!msg) {
+		LOGPFSML(conn->fi, LOGL_ERROR, "Out of memory; cannot allocate a SIM pool slot\n");
+		return;
+	}
+	msg->type = SHARD_MSG_POOL_ALLOC;
+	msg->u.pool_alloc.client = conn->client.slot;
+	clock_gettime(CLOCK_MONOTONIC, &msg->u.pool_alloc.start);
+	shard_post(conn->srv->shards[0], msg);
 }
 
 static void clnt_st_connected_client_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
@@ -352,12 +925,11 @@ static void clnt_st_connected_client_onenter(struct osmo_fsm_inst *fi, uint32_t
 
 	/* check for an existing slotmap for this client/slot */
 	slotmaps_rdlock(slotmaps);
-	llist_for_each_entry(map, &slotmaps->mappings, list) {
-		if (client_slot_equals(&map->client, &conn->client.slot)) {
-			_update_client_for_slotmap(map, conn->srv, NULL);
-			break;
-		}
-	}
+	map = _slotmap_by_client(slotmaps, &conn->client.slot);
+	if (map)
+		_update_client_for_slotmap(map, conn->srv, NULL);
+	else if (_sim_pool_for_client(conn->srv->pools, conn->client.slot.client_id))
+		request_pool_alloc(conn);
 	slotmaps_unlock(slotmaps);
 #if 0
 	ClientSlot_t clslot;
@@ -373,31 +945,114 @@ static void clnt_st_connected_client_onenter(struct osmo_fsm_inst *fi, uint32_t
 static void clnt_st_connected_bankd_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
 {
 	struct rspro_client_conn *conn = fi->priv;
-	struct slotmaps *slotmaps = conn->srv->slotmaps;
+	struct rspro_server *srv = conn->srv;
+	struct slotmaps *slotmaps = srv->slotmaps;
+	unsigned int num_warm = 0;
 	struct slot_mapping *map;
+	uint32_t digest = 0;
+	bool keep_warm;
+
+	LOGPFSML(fi, LOGL_DEBUG, "Associating pre-existing slotmaps (if any)\n");
+	slotmaps_wrlock(slotmaps);
+	/* after taking over from another server, the maps it had provisioned can be kept as they
+	 * are if the bankd still has exactly those */
+	llist_for_each_entry(map, &slotmaps->mappings, list) {
+		if (map->bank.bank_id == conn->bank.bank_id && map->warm) {
+			digest += slotmap_digest(map);
+			num_warm++;
+		}
+	}
+	keep_warm = num_warm && conn->bank.maps_digest == (digest & 0x7fffffff);
+	if (num_warm) {
+		LOGPFSML(fi, LOGL_NOTICE, "%s %u slotmaps provisioned by the previous server\n",
+			 keep_warm ? "Keeping" : "Bankd has different maps; re-provisioning", num_warm);
+	}
+
+	/* Link all known mappings to this new bank */
+	llist_for_each_entry(map, &slotmaps->mappings, list) {
+		if (map->bank.bank_id != conn->bank.bank_id)
+			continue;
+		if (keep_warm && map->warm) {
+			map->warm = false;
+			_slotmap_state_change(map, SLMAP_S_ACTIVE, &conn->bank.maps_active);
+			_update_client_for_slotmap(map, srv, conn);
+		} else {
+			map->warm = false;
+			_slotmap_state_change(map, SLMAP_S_NEW, &conn->bank.maps_new);
+		}
+	}
+	slotmaps_unlock(slotmaps);
+
+	if (conn->bank.bank_id < RSPRO_NUM_BANK_IDS) {
+		pthread_rwlock_wrlock(&srv->rwlock);
+		srv->warm_endpoints[conn->bank.bank_id].af = AF_UNSPEC;
+		pthread_rwlock_unlock(&srv->rwlock);
+	}
+}
+
+/* a client that is already connected connects a further one of its slots over the same connection
+ * (the "trunk").  The slot gets a client connection of its own, without a peer, which goes through
+ * the same states as one of a separate TCP connection */
+static void client_conn_add_slot(struct rspro_client_conn *trunk, const RsproPDU_t *pdu)
+{
+	struct rspro_shard *shard = trunk->shard;
+	struct rspro_client_conn *conn;
+
+	if (!pdu->msg.choice.connectClientReq.clientSlot) {
+		LOGPFSML(trunk->fi, LOGL_ERROR, "ConnectClientReq for a further slot without ClientSlot\n");
+		client_conn_send(trunk, rspro_gen_ConnectClientRes(&trunk->srv->comp_id,
+								   ResultCode_illegalClientId));
+		return;
+	}
+
+	conn = talloc_zero(shard->ctx, struct rspro_client_conn);
+	OSMO_ASSERT(conn);
 
-	LOGPFSML(fi, LOGL_DEBUG, "Associating pre-existing slotmaps (if any)\n");
-	/* Link all known mappings to this new bank */
-	slotmaps_wrlock(slotmaps);
-	llist_for_each_entry(map, &slotmaps->mappings, list) {
-		if (map->bank.bank_id == conn->bank.bank_id)
-			_slotmap_state_change(map, SLMAP_S_NEW, &conn->bank.maps_new);
+	conn->srv = trunk->srv;
+	conn->shard = shard;
+	OSMO_STRLCPY_ARRAY(conn->remote_ip, trunk->remote_ip);
+	OSMO_STRLCPY_ARRAY(conn->remote_port, trunk->remote_port);
+	conn->client.trunk = trunk;
+	INIT_LLIST_HEAD(&conn->client.slots);
+	INIT_LLIST_HEAD(&conn->bank.maps_new);
+	INIT_LLIST_HEAD(&conn->bank.maps_unack);
+	INIT_LLIST_HEAD(&conn->bank.maps_active);
+	INIT_LLIST_HEAD(&conn->bank.maps_delreq);
+	INIT_LLIST_HEAD(&conn->bank.maps_deleting);
+	hash_init(conn->bank.pending_ops);
+	osmo_timer_setup(&conn->bank.op_timer, map_op_timer_cb, conn);
+
+	conn->fi = server_client_fsm_alloc(shard->ctx, conn);
+	if (!conn->fi) {
+		LOGPFSML(trunk->fi, LOGL_ERROR, "Unable to allocate FSM for a further slot\n");
+		talloc_free(conn);
+		client_conn_send(trunk, rspro_gen_ConnectClientRes(&trunk->srv->comp_id,
+								   ResultCode_illegalClientId));
+		return;
 	}
-	slotmaps_unlock(slotmaps);
+	llist_add_tail(&conn->client.slot_list, &trunk->client.slots);
+	/* a slot costs this shard about as much as a connection of its own */
+	atomic_fetch_add(&shard->num_conns, 1);
+
+	pthread_rwlock_wrlock(&conn->srv->rwlock);
+	llist_add_tail(&conn->list, &conn->srv->connections);
+	pthread_rwlock_unlock(&conn->srv->rwlock);
+
+	osmo_fsm_inst_dispatch(conn->fi, CLNTC_E_TCP_UP, NULL);
+	osmo_fsm_inst_dispatch(conn->fi, CLNTC_E_CLIENT_CONN, (void *) pdu);
 }
 
 static void clnt_st_connected_client(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
 	struct rspro_client_conn *conn = fi->priv;
-	BankSlot_t bslot;
-	RsproPDU_t *tx;
+	const bool *active = data;
 
 	switch (event) {
 	case CLNTC_E_CL_CFG_BANKD: /* Send [new] Bankd information to client */
-		bank_slot2rspro(&bslot, &conn->client.bankd.slot);
-		tx = rspro_gen_ConfigClientBankReq(&bslot, conn->client.bankd.ip,
-						   conn->client.bankd.port);
-		client_conn_send(conn, tx);
+		client_conn_pace_cfg(conn, active && *active);
+		break;
+	case CLNTC_E_CLIENT_CONN: /* another slot of a multi-slot client */
+		client_conn_add_slot(conn, data);
 		break;
 	default:
 		OSMO_ASSERT(0);
@@ -408,58 +1063,89 @@ static void clnt_st_connected_bankd(struct osmo_fsm_inst *fi, uint32_t event, vo
 {
 	struct rspro_client_conn *conn = fi->priv;
 	struct slotmaps *slotmaps = conn->srv->slotmaps;
-	const __attribute__((unused)) RsproPDU_t *rx = NULL;
-	struct slot_mapping *map, *map2;
+	const RsproPDU_t *rx = NULL;
+	const BankLoadInd_t *load;
+	struct slot_mapping *map;
+	char mapname[64];
+	long res;
 
 	switch (event) {
 	case CLNTC_E_CREATE_MAP_RES: /* Bankd acknowledges mapping was created */
 		rx = data;
 		slotmaps_wrlock(slotmaps);
-		/* FIXME: resolve map by pdu->tag */
-		/* as hack use first element of conn->maps_unack */
-		map = llist_first_entry(&conn->bank.maps_unack, struct slot_mapping, bank_list);
-		if (!map) {
+		map = _map_op_find(conn, rx->tag, &conn->bank.maps_unack);
+		if (!map || map->state != SLMAP_S_UNACKNOWLEDGED) {
 			slotmaps_unlock(slotmaps);
-			LOGPFSML(fi, LOGL_NOTICE, "CreateMapRes but no unacknowledged map");
+			LOGPFSML(fi, LOGL_NOTICE, "CreateMapRes(tag=%ld) for no unacknowledged map\n", rx->tag);
 			break;
 		}
-		_slotmap_state_change(map, SLMAP_S_ACTIVE, &conn->bank.maps_active);
+		_map_op_done(conn, map);
+		res = rspro_get_result(rx);
+		if (_slotmap_unlinked(map)) {
+			/* deleted via REST while the create was outstanding */
+			if (res != ResultCode_ok) {
+				/* bankd never had it; nothing to release */
+				_slotmap_del(map->maps, map);
+			} else {
+				LOGPFSML(fi, LOGL_INFO, "Slot Map %s was deleted while being created; "
+					 "removing it again\n", slotmap_name(mapname, sizeof(mapname), map));
+				/* sent by the _push_pending_maps() below; we are the bankd's own
+				 * shard, so marking it dirty would never be drained */
+				_slotmap_state_change(map, SLMAP_S_DELETE_REQ, &conn->bank.maps_delreq);
+			}
+			map = NULL;
+		} else if (res != ResultCode_ok) {
+			LOGPFSML(fi, LOGL_ERROR, "Bankd rejected Slot Map %s with result %ld\n",
+				 slotmap_name(mapname, sizeof(mapname), map), res);
+			/* keep the map, but don't push it to this bankd again */
+			_slotmap_state_change(map, SLMAP_S_NEW, NULL);
+			map = NULL;
+		} else
+			_slotmap_state_change(map, SLMAP_S_ACTIVE, &conn->bank.maps_active);
+		_push_pending_maps(conn);
+		_check_push_complete(conn);
 		slotmaps_unlock(slotmaps);
-		_update_client_for_slotmap(map, conn->srv, conn);
+		if (map)
+			_update_client_for_slotmap(map, conn->srv, conn);
 		break;
 	case CLNTC_E_REMOVE_MAP_RES: /* Bankd acknowledges mapping was removed */
 		rx = data;
 		slotmaps_wrlock(slotmaps);
-		/* FIXME: resolve map by pdu->tag */
-		/* as hack use first element of conn->maps_deleting */
-		map = llist_first_entry(&conn->bank.maps_deleting, struct slot_mapping, bank_list);
-		if (!map) {
+		map = _map_op_find(conn, rx->tag, &conn->bank.maps_deleting);
+		if (!map || map->state != SLMAP_S_DELETING) {
 			slotmaps_unlock(slotmaps);
-			LOGPFSML(fi, LOGL_NOTICE, "RemoveMapRes but no unacknowledged map");
+			LOGPFSML(fi, LOGL_NOTICE, "RemoveMapRes(tag=%ld) for no map being deleted\n", rx->tag);
 			break;
 		}
+		_map_op_done(conn, map);
+		res = rspro_get_result(rx);
+		if (res != ResultCode_ok) {
+			/* whatever bankd has, it is not this map; so it's gone just the same */
+			LOGPFSML(fi, LOGL_NOTICE, "Bankd failed to remove Slot Map %s with result %ld; "
+				 "deleting it anyway\n", slotmap_name(mapname, sizeof(mapname), map), res);
+		}
+		_push_pending_maps(conn);
+		_check_push_complete(conn);
 		slotmaps_unlock(slotmaps);
 		/* update client! */
-		OSMO_ASSERT(map->state == SLMAP_S_DELETING);
 		_update_client_for_slotmap(map, conn->srv, conn);
 		/* slotmap_del() will remove it from both global and bank list */
 		slotmap_del(map->maps, map);
 		break;
 	case CLNTC_E_PUSH: /* check if any create or delete requests are pending */
 		slotmaps_wrlock(slotmaps);
-		/* send any pending create requests */
-		llist_for_each_entry_safe(map, map2, &conn->bank.maps_new, bank_list) {
-			RsproPDU_t *pdu = slotmap2CreateMappingReq(map);
-			client_conn_send(conn, pdu);
-			_slotmap_state_change(map, SLMAP_S_UNACKNOWLEDGED, &conn->bank.maps_unack);
-		}
-		/* send any pending delete requests */
-		llist_for_each_entry_safe(map, map2, &conn->bank.maps_delreq, bank_list) {
-			RsproPDU_t *pdu = slotmap2RemoveMappingReq(map);
-			client_conn_send(conn, pdu);
-			_slotmap_state_change(map, SLMAP_S_DELETING, &conn->bank.maps_deleting);
-		}
+		_push_pending_maps(conn);
 		slotmaps_unlock(slotmaps);
+		client_conn_flush(conn);
+		break;
+	case CLNTC_E_BANK_LOAD_IND:
+		rx = data;
+		load = &rx->msg.choice.bankLoadInd;
+		atomic_store(&conn->bank.load.active_slots, load->activeSlots);
+		atomic_store(&conn->bank.load.apdu_rate, load->apduRate);
+		atomic_store(&conn->bank.load.mean_latency_us, load->meanLatencyUs);
+		LOGPFSML(fi, LOGL_DEBUG, "Load: %ld active slots, %ld APDU/s, %ld us mean latency\n",
+			 load->activeSlots, load->apduRate, load->meanLatencyUs);
 		break;
 	default:
 		OSMO_ASSERT(0);
@@ -505,9 +1191,20 @@ static int server_client_fsm_timer_cb(struct osmo_fsm_inst *fi)
 static void server_client_cleanup(struct osmo_fsm_inst *fi, enum osmo_fsm_term_cause cause)
 {
 	struct rspro_client_conn *conn = fi->priv;
+	struct rspro_client_conn *slot, *slot2;
+
+	/* the slots carried by this connection go down with it */
+	llist_for_each_entry_safe(slot, slot2, &conn->client.slots, client.slot_list) {
+		if (slot->fi)
+			osmo_fsm_inst_term(slot->fi, OSMO_FSM_TERM_PARENT, NULL);
+	}
+
 	/* this call will destroy the IPA connection, which will in turn call closed_cb()
-	 * which will try to deliver a E_TCP_DOWN event. Clear conn->fi to avoid that loop */
+	 * which will try to deliver a E_TCP_DOWN event. Clear conn->fi to avoid that loop.
+	 * Take the lock, as the main thread reads conn->fi for the state snapshot */
+	pthread_rwlock_wrlock(&conn->srv->rwlock);
 	conn->fi = NULL;
+	pthread_rwlock_unlock(&conn->srv->rwlock);
 	rspro_client_conn_destroy(conn);
 }
 
@@ -533,14 +1230,14 @@ static const struct osmo_fsm_state server_client_fsm_states[] = {
 	},
 	[CLNTC_ST_CONNECTED_CLIENT] = {
 		.name = "CONNECTED_CLIENT",
-		.in_event_mask = S(CLNTC_E_CL_CFG_BANKD),
+		.in_event_mask = S(CLNTC_E_CL_CFG_BANKD) | S(CLNTC_E_CLIENT_CONN),
 		.action = clnt_st_connected_client,
 		.onenter = clnt_st_connected_client_onenter,
 	},
 	[CLNTC_ST_CONNECTED_BANKD] = {
 		.name = "CONNECTED_BANKD",
 		.in_event_mask = S(CLNTC_E_CREATE_MAP_RES) | S(CLNTC_E_REMOVE_MAP_RES) |
-				 S(CLNTC_E_PUSH),
+				 S(CLNTC_E_PUSH) | S(CLNTC_E_BANK_LOAD_IND),
 		.action = clnt_st_connected_bankd,
 		.onenter = clnt_st_connected_bankd_onenter,
 	},
@@ -566,7 +1263,7 @@ static struct osmo_fsm remsim_server_client_fsm = {
 struct osmo_fsm_inst *server_client_fsm_alloc(void *ctx, struct rspro_client_conn *conn)
 {
 	//const char *id = osmo_sock_get_name2(conn->peer->ofd.fd);
-	return osmo_fsm_inst_alloc(&remsim_server_client_fsm, ctx, conn, LOGL_DEBUG, NULL);
+	return osmo_fsm_inst_alloc(conn->shard->fsm, ctx, conn, LOGL_DEBUG, NULL);
 }
 
 
@@ -583,42 +1280,57 @@ static __attribute__((constructor)) void on_dso_load(void)
 struct rspro_client_conn *_client_conn_by_slot(struct rspro_server *srv, const struct client_slot *cslot)
 {
 	struct rspro_client_conn *conn;
-	llist_for_each_entry(conn, &srv->clients, list) {
+	hash_for_each_possible(srv->clients_by_slot, conn, hnode_slot, client_slot_key(cslot)) {
 		if (client_slot_equals(&conn->client.slot, cslot))
 			return conn;
 	}
 	return NULL;
 }
-struct rspro_client_conn *client_conn_by_slot(struct rspro_server *srv, const struct client_slot *cslot)
+
+/* the connection of the lowest slot of the given client; caller must hold srv->rwlock */
+struct rspro_client_conn *_client_conn_by_id(struct rspro_server *srv, uint16_t client_id)
 {
-	struct rspro_client_conn *conn;
-	pthread_rwlock_rdlock(&srv->rwlock);
-	conn = _client_conn_by_slot(srv, cslot);
-	pthread_rwlock_unlock(&srv->rwlock);
-	return conn;
+	struct rspro_client_conn *conn, *ret = NULL;
+	hash_for_each_possible(srv->clients_by_id, conn, hnode_id, client_id) {
+		if (conn->client.slot.client_id != client_id)
+			continue;
+		if (!ret || conn->client.slot.slot_nr < ret->client.slot.slot_nr)
+			ret = conn;
+	}
+	return ret;
 }
 
 struct rspro_client_conn *_bankd_conn_by_id(struct rspro_server *srv, uint16_t bank_id)
 {
 	struct rspro_client_conn *conn;
-	llist_for_each_entry(conn, &srv->banks, list) {
+	hash_for_each_possible(srv->banks_by_id, conn, hnode_id, bank_id) {
 		if (conn->bank.bank_id == bank_id)
 			return conn;
 	}
 	return NULL;
 }
-struct rspro_client_conn *bankd_conn_by_id(struct rspro_server *srv, uint16_t bank_id)
+
+uint64_t bankd_load_permille(struct rspro_server *srv, uint16_t bank_id)
 {
 	struct rspro_client_conn *conn;
+	uint64_t load = UINT64_MAX;
+
 	pthread_rwlock_rdlock(&srv->rwlock);
 	conn = _bankd_conn_by_id(srv, bank_id);
+	if (conn) {
+		/* APDUs per second times microseconds each, in permille of one second */
+		load = (uint64_t) atomic_load(&conn->bank.load.apdu_rate) *
+			atomic_load(&conn->bank.load.mean_latency_us) / 1000;
+	}
 	pthread_rwlock_unlock(&srv->rwlock);
-	return conn;
+
+	return load;
 }
 
 static int handle_rx_rspro(struct rspro_client_conn *conn, const RsproPDU_t *pdu)
 {
 	LOGPFSML(conn->fi, LOGL_DEBUG, "Rx RSPRO %s\n", rspro_msgt_name(pdu));
+	atomic_fetch_add(&conn->rx_pdus, 1);
 
 	switch (pdu->msg.present) {
 	case RsproPDUchoice_PR_connectClientReq:
@@ -639,6 +1351,9 @@ static int handle_rx_rspro(struct rspro_client_conn *conn, const RsproPDU_t *pdu
 	case RsproPDUchoice_PR_configClientBankRes:
 		/* TODO: store somewhere that client has ACKed? */
 		break;
+	case RsproPDUchoice_PR_bankLoadInd:
+		osmo_fsm_inst_dispatch(conn->fi, CLNTC_E_BANK_LOAD_IND, (void *)pdu);
+		break;
 	default:
 		LOGPFSML(conn->fi, LOGL_ERROR, "Received unknown/unimplemented RSPRO msg_type %s\n",
 			 rspro_msgt_name(pdu));
@@ -713,8 +1428,9 @@ static int sock_read_cb(struct osmo_stream_srv *peer, int res, struct msgb *msg)
 {
 	enum ipaccess_proto ipa_proto = osmo_ipa_msgb_cb_proto(msg);
 	struct rspro_client_conn *conn = osmo_stream_srv_get_data(peer);
+	RsproPDU_t *pdus[RSPRO_BATCH_MAX_PDUS];
 	RsproPDU_t *pdu;
-	int rc;
+	int i, num, rc;
 
 	if (res <= 0) {
 		LOGPFSML(conn->fi, LOGL_NOTICE, "failed reading from socket: %d\n", res);
@@ -730,6 +1446,24 @@ static int sock_read_cb(struct osmo_stream_srv *peer, int res, struct msgb *msg)
 	case IPAC_PROTO_OSMO:
 		switch (osmo_ipa_msgb_cb_proto_ext(msg)) {
 		case IPAC_PROTO_EXT_RSPRO:
+			if (conn->bank.batch) {
+				num = rspro_dec_msg_batch(msg, pdus, ARRAY_SIZE(pdus));
+				if (num <= 0) {
+					rc = -EIO;
+					break;
+				}
+				rc = 0;
+				for (i = 0; i < num; i++) {
+					/* stop processing if the connection was closed meanwhile */
+					if (rc == 0 && osmo_stream_srv_get_data(peer) == conn)
+						rc = handle_rx_rspro(conn, pdus[i]);
+					ASN_STRUCT_FREE(asn_DEF_RsproPDU, pdus[i]);
+				}
+				/* send any requests queued while processing the responses */
+				if (osmo_stream_srv_get_data(peer) == conn)
+					client_conn_flush(conn);
+				break;
+			}
 			pdu = rspro_dec_msg(msg);
 			if (!pdu) {
 				rc = -EIO;
@@ -765,7 +1499,9 @@ static int sock_closed_cb(struct osmo_stream_srv *peer)
 	osmo_stream_srv_set_data(peer, NULL);
 	if (conn->ka_fi) {
 		osmo_ipa_ka_fsm_stop(conn->ka_fi);
+		pthread_mutex_lock(&g_ka_fsm_mutex);
 		osmo_ipa_ka_fsm_free(conn->ka_fi);
+		pthread_mutex_unlock(&g_ka_fsm_mutex);
 		conn->ka_fi = NULL;
 	}
 	if (conn->fi) {
@@ -796,18 +1532,22 @@ static int ipa_keepalive_timeout_cb(struct osmo_ipa_ka_fsm_inst *ka_fi, void *da
 }
 
 
-/* a new TCP connection was accepted on the RSPRO server socket */
-static int accept_cb(struct osmo_stream_srv_link *link, int fd)
+/* serve a newly accepted TCP connection in the shard of the calling thread; the caller has
+ * already accounted for it in shard->num_conns */
+static int shard_conn_create(struct rspro_shard *shard, int fd)
 {
-	struct rspro_server *srv = osmo_stream_srv_link_get_data(link);
+	struct rspro_server *srv = shard->srv;
 	struct rspro_client_conn *conn;
 
-	conn = talloc_zero(srv, struct rspro_client_conn);
+	conn = talloc_zero(shard->ctx, struct rspro_client_conn);
 	OSMO_ASSERT(conn);
 
 	conn->srv = srv;
+	conn->shard = shard;
+	osmo_sock_get_ip_and_port(fd, conn->remote_ip, sizeof(conn->remote_ip),
+				  conn->remote_port, sizeof(conn->remote_port), false);
 	/* don't allocate peer under 'conn', as it must survive 'conn' during teardown */
-	conn->peer = osmo_stream_srv_create2(link, link, fd, conn);
+	conn->peer = osmo_stream_srv_create2(shard->ctx, srv->link, fd, conn);
 	if (!conn->peer)
 		goto out_err;
 	osmo_stream_srv_set_read_cb(conn->peer, sock_read_cb);
@@ -816,12 +1556,14 @@ static int accept_cb(struct osmo_stream_srv_link *link, int fd)
 
 	/* don't allocate 'fi' as slave from 'conn', as 'fi' needs to survive 'conn' during
 	 * teardown */
-	conn->fi = server_client_fsm_alloc(srv, conn);
+	conn->fi = server_client_fsm_alloc(shard->ctx, conn);
 	if (!conn->fi)
 		goto out_err_conn;
 
 	/* use ipa_keepalive_fsm to periodically send an IPA_PING and expect a PONG in response */
+	pthread_mutex_lock(&g_ka_fsm_mutex);
 	conn->ka_fi = osmo_ipa_ka_fsm_alloc(conn->peer, conn->fi->id);
+	pthread_mutex_unlock(&g_ka_fsm_mutex);
 	if (!conn->ka_fi)
 		goto out_err_fi;
 	osmo_ipa_ka_fsm_set_data(conn->ka_fi, conn->peer);
@@ -836,6 +1578,9 @@ static int accept_cb(struct osmo_stream_srv_link *link, int fd)
 	INIT_LLIST_HEAD(&conn->bank.maps_active);
 	INIT_LLIST_HEAD(&conn->bank.maps_delreq);
 	INIT_LLIST_HEAD(&conn->bank.maps_deleting);
+	hash_init(conn->bank.pending_ops);
+	osmo_timer_setup(&conn->bank.op_timer, map_op_timer_cb, conn);
+	INIT_LLIST_HEAD(&conn->client.slots);
 
 	pthread_rwlock_wrlock(&conn->srv->rwlock);
 	llist_add_tail(&conn->list, &srv->connections);
@@ -851,16 +1596,433 @@ out_err_conn:
 	/* the above will free 'conn' down the chain */
 	return -1;
 out_err:
+	atomic_fetch_sub(&shard->num_conns, 1);
 	talloc_free(conn);
 	return -1;
 }
 
-/* call-back if we were triggered by a rest_api thread */
-int event_fd_cb(struct osmo_fd *ofd, unsigned int what)
+/* serve a new TCP connection in the shard with the fewest connections (main thread) */
+static int accept_dispatch(struct rspro_server *srv, int fd)
+{
+	struct rspro_shard *shard = srv->shards[0];
+	struct shard_msg *msg;
+	unsigned int i;
+
+	/* count it right away, so a burst of new connections is spread across shards, too */
+	for (i = 1; i < srv->num_shards; i++) {
+		if (atomic_load(&srv->shards[i]->num_conns) < atomic_load(&shard->num_conns))
+			shard = srv->shards[i];
+	}
+	atomic_fetch_add(&shard->num_conns, 1);
+	if (shard == g_cur_shard)
+		return shard_conn_create(shard, fd);
+
+	msg = calloc(1, sizeof(*msg));
+	if (!msg) {
+		atomic_fetch_sub(&shard->num_conns, 1);
+		return -1;
+	}
+	msg->type = SHARD_MSG_ACCEPT;
+	msg->u.fd = fd;
+	shard_post(shard, msg);
+	return 0;
+}
+
+/* a new connection waiting to be served, see accept_cb() */
+struct pending_accept {
+	struct llist_head list;
+	int fd;
+};
+
+/* serve as many of the deferred new connections as the rate permits */
+static void accept_pacer_run(void *data)
+{
+	struct rspro_server *srv = data;
+	struct pending_accept *pa;
+	unsigned int wait_ms;
+
+	while ((pa = llist_first_entry_or_null(&srv->accept_queue, struct pending_accept, list))) {
+		wait_ms = pacer_take(&srv->accept_pacer);
+		if (wait_ms) {
+			pacer_wait(&srv->accept_pacer, wait_ms);
+			return;
+		}
+		llist_del(&pa->list);
+		srv->accept_pacer.num--;
+		if (accept_dispatch(srv, pa->fd) < 0)
+			LOGP(DMAIN, LOGL_ERROR, "Cannot serve new connection\n");
+		talloc_free(pa);
+	}
+
+	LOGP(DMAIN, LOGL_NOTICE, "Backlog of %u new connections served in %" PRId64 " ms; %u refused\n",
+	     srv->accept_pacer.backlog_total, pacer_backlog_ms(&srv->accept_pacer), srv->accept_refused);
+}
+
+/* a new TCP connection was accepted on the RSPRO server socket (in the main thread) */
+static int accept_cb(struct osmo_stream_srv_link *link, int fd)
+{
+	struct rspro_server *srv = osmo_stream_srv_link_get_data(link);
+	struct pending_accept *pa;
+
+	/* nobody may overtake connections which are waiting already */
+	if (!srv->accept_pacer.num && !pacer_take(&srv->accept_pacer))
+		return accept_dispatch(srv, fd);
+
+	if (srv->accept_pacer.num >= srv->accept_max_queued) {
+		/* it would time out waiting for its ConnectClientRes anyway; have it back off */
+		close(fd);
+		srv->accept_refused++;
+		return 0;
+	}
+
+	pa = talloc_zero(srv, struct pending_accept);
+	if (!pa)
+		return -1;
+	pa->fd = fd;
+	if (pacer_defer(&srv->accept_pacer)) {
+		LOGP(DMAIN, LOGL_NOTICE, "Pacing new connections at %u/s\n", srv->accept_pacer.rate);
+		srv->accept_refused = 0;
+	}
+	llist_add_tail(&pa->list, &srv->accept_queue);
+	if (!osmo_timer_pending(&srv->accept_pacer.timer))
+		accept_pacer_run(srv);
+	return 0;
+}
+
+/***********************************************************************
+ * queue of bankd connections with pending slotmap work
+ *
+ * This is an intrusive variant of Dmitry Vyukov's non-blocking MPSC queue:
+ * producers only ever do a single atomic exchange, the (single) consumer
+ * never blocks them.  Every bankd connection has a statically allocated
+ * node, so no allocation is needed, and 'dirty' avoids queueing it twice.
+ ***********************************************************************/
+
+static void dirty_queue_init(struct dirty_queue *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+}
+
+static void dirty_queue_push(struct dirty_queue *q, struct dirty_node *node)
+{
+	struct dirty_node *prev;
+
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* only to be called from the thread of the shard owning the queue. Returns NULL if the queue is
+ * empty, or if a producer is in the middle of a push; it will trigger the eventfd once it is done */
+static struct dirty_node *dirty_queue_pop(struct dirty_queue *q)
+{
+	struct dirty_node *tail = q->tail;
+	struct dirty_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+		return NULL;
+	/* 'tail' is the last node: re-insert the stub behind it, so we can dequeue it */
+	dirty_queue_push(q, &q->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/* remove given connection from the queue of its shard; only to be called from the shard's
+ * thread. Caller must hold srv->rwlock for writing, which guarantees no producer is in the
+ * middle of a push */
+static void _dirty_queue_remove(struct rspro_client_conn *conn)
+{
+	struct dirty_queue *q = &conn->shard->dirty;
+	struct dirty_node *node, *next, *keep = NULL;
+
+	if (!atomic_load(&conn->bank.dirty))
+		return;
+
+	while ((node = dirty_queue_pop(q))) {
+		if (node == &conn->bank.dirty_node)
+			continue;
+		atomic_store_explicit(&node->next, keep, memory_order_relaxed);
+		keep = node;
+	}
+	/* re-queue all others; 'keep' is in reverse order, so the original order is restored */
+	for (node = keep; node; node = next) {
+		next = atomic_load_explicit(&node->next, memory_order_relaxed);
+		dirty_queue_push(q, node);
+	}
+	atomic_store(&conn->bank.dirty, false);
+}
+
+/* queue a bankd connection for a CLNTC_E_PUSH by its shard. Caller must hold srv->rwlock
+ * (for reading is sufficient) */
+void _bankd_conn_mark_dirty(struct rspro_client_conn *conn)
+{
+	if (atomic_exchange(&conn->bank.dirty, true))
+		return;
+	dirty_queue_push(&conn->shard->dirty, &conn->bank.dirty_node);
+	/* the calling thread drains its own queue before returning to its select loop */
+	if (conn->shard != g_cur_shard)
+		shard_wakeup(conn->shard);
+}
+
+void _slotmap_attach_bankd(struct rspro_server *srv, struct slot_mapping *map)
+{
+	struct rspro_client_conn *conn;
+
+	pthread_rwlock_rdlock(&srv->rwlock);
+	conn = _bankd_conn_by_id(srv, map->bank.bank_id);
+	if (conn) {
+		_slotmap_state_change(map, SLMAP_S_NEW, &conn->bank.maps_new);
+		/* Notify the conn FSM about some new maps being available */
+		_bankd_conn_mark_dirty(conn);
+	}
+	pthread_rwlock_unlock(&srv->rwlock);
+}
+
+void _slotmap_mark_deleted(struct rspro_server *srv, struct slot_mapping *map)
+{
+	struct rspro_client_conn *conn;
+
+	_slotmap_store_del(srv->store, map);
+
+	/* delete map from global list + indexes to ensure it's not found by further lookups,
+	 * particularly in case somebody wants to create a new map for the same bank/slot */
+	_slotmap_unlink(map->maps, map);
+
+	switch (map->state) {
+	case SLMAP_S_NEW:
+		/* new map, not yet sent to bank: we can remove it immediately */
+		/* delete from bank list (if any) */
+		llist_del(&map->bank_list);
+		/* safely initialize list head to avoid trouble when del_slotmap() does another llist_del() */
+		INIT_LLIST_HEAD(&map->bank_list);
+		_slotmap_del(map->maps, map);
+		break;
+	case SLMAP_S_UNACKNOWLEDGED:
+		/* map has been sent to bank already, but wasn't acknowledged yet.  We can't send
+		 * the RemoveMappingReq before the bankd has processed the create, so leave it
+		 * in maps_unack; the CreateMappingRes handler sees it's no longer in the table
+		 * and either frees it or moves it on to DELETE_REQ */
+		break;
+	case SLMAP_S_ACTIVE:
+		/* map is fully active. Need to move it to DELETE_REQ state + trigger rspro thread,
+		 * so the deletion can propagate to the bankd */
+		pthread_rwlock_rdlock(&srv->rwlock);
+		conn = _bankd_conn_by_id(srv, map->bank.bank_id);
+		_slotmap_state_change(map, SLMAP_S_DELETE_REQ, &conn->bank.maps_delreq);
+		_bankd_conn_mark_dirty(conn);
+		pthread_rwlock_unlock(&srv->rwlock);
+		break;
+	case SLMAP_S_DELETE_REQ:
+		/* REST had already requested deletion, but RSPRO thread hasn't issued the delete
+		 * command to the bankd yet: Do nothing */
+		break;
+	case SLMAP_S_DELETING:
+		/* we had already requested deletion of this map previously: Do nothing */
+		break;
+	default:
+		OSMO_ASSERT(0);
+	}
+}
+
+uint32_t bulk_slotmap_id(const struct bulk_slotmap *item)
+{
+	return (item->bank.bank_id << 16) | item->bank.slot_nr;
+}
+
+int bulk_slotmap_cmp(const void *a, const void *b)
+{
+	uint32_t id_a = bulk_slotmap_id(*(const struct bulk_slotmap **) a);
+	uint32_t id_b = bulk_slotmap_id(*(const struct bulk_slotmap **) b);
+
+	return id_a < id_b ? -1 : id_a > id_b;
+}
+
+unsigned int _bulk_create(struct rspro_server *srv, struct bulk_slotmap *items, size_t num)
+{
+	struct rspro_client_conn *conn;
+	struct slot_mapping *map;
+	unsigned int created = 0;
+	size_t i;
+
+	pthread_rwlock_rdlock(&srv->rwlock);
+	for (i = 0; i < num; i++) {
+		if (items[i].status)
+			continue;
+		map = _slotmap_add(srv->slotmaps, &items[i].bank, &items[i].client);
+		if (!map) {
+			items[i].status = 409;
+			continue;
+		}
+		_slotmap_store_add(srv->store, map);
+		/* associate with already-connected bankd, if any */
+		conn = _bankd_conn_by_id(srv, map->bank.bank_id);
+		if (conn) {
+			_slotmap_state_change(map, SLMAP_S_NEW, &conn->bank.maps_new);
+			_bankd_conn_mark_dirty(conn);
+		}
+		items[i].status = 201;
+		created++;
+	}
+	pthread_rwlock_unlock(&srv->rwlock);
+
+	return created;
+}
+
+/* the entry of the new table for given map, if it is contained identically */
+static struct bulk_slotmap *replace_find(struct slotmap_replace *r, const struct slot_mapping *map)
+{
+	struct bulk_slotmap key, *pkey = &key, **found;
+
+	key.bank = map->bank;
+	found = bsearch(&pkey, r->sorted, r->num_sorted, sizeof(*r->sorted), bulk_slotmap_cmp);
+	if (found && client_slot_equals(&(*found)->client, &map->client))
+		return *found;
+	return NULL;
+}
+
+int _slotmaps_replace(struct rspro_server *srv, struct slotmap_replace *r)
+{
+	struct slot_mapping *map, *map2;
+	struct bulk_slotmap *item;
+
+	/* The RemoveMappingReq of a map whose create is outstanding can only be sent once the
+	 * bankd responded, i.e. after the CreateMappingReq of a new map for the same bank slot,
+	 * which the removal would then undo.  Rather than holding back such creations, have the
+	 * caller try again a little later */
+	llist_for_each_entry(map, &srv->slotmaps->mappings, list) {
+		if (map->state == SLMAP_S_UNACKNOWLEDGED && !replace_find(r, map))
+			return -EBUSY;
+	}
+
+	/* remove all maps not contained (identically) in the new table */
+	llist_for_each_entry_safe(map, map2, &srv->slotmaps->mappings, list) {
+		item = replace_find(r, map);
+		if (item) {
+			item->status = 200;
+			continue;
+		}
+		if (r->deleted_cb)
+			r->deleted_cb(map, r->data);
+		_slotmap_mark_deleted(srv, map);
+		r->num_deleted++;
+	}
+	/* create all maps which didn't exist yet */
+	r->num_created = _bulk_create(srv, r->items, r->num_items);
+	return 0;
+}
+
+/* main thread: allocate a slot for a client which connected without having a slotmap */
+static void pool_alloc_for_client(struct rspro_server *srv, const struct client_slot *client,
+				  const struct timespec *start)
+{
+	struct slot_mapping *map = NULL;
+	struct sim_pool *pool;
+	char mapname[64];
+
+	slotmaps_wrlock(srv->slotmaps);
+	/* the client may have been mapped meanwhile, e.g. via REST */
+	pool = _sim_pool_for_client(srv->pools, client->client_id);
+	if (pool && !_slotmap_by_client(srv->slotmaps, client))
+		map = _sim_pool_alloc(pool, client, start);
+	if (map) {
+		_slotmap_store_add(srv->store, map);
+		_slotmap_attach_bankd(srv, map);
+		LOGP(DMAIN, LOGL_INFO, "Slot Map %s allocated from SIM pool '%s'\n",
+		     slotmap_name(mapname, sizeof(mapname), map), pool->name);
+	}
+	slotmaps_unlock(srv->slotmaps);
+}
+
+/* a function to be executed in the main thread on behalf of another thread */
+struct srv_cmd {
+	struct llist_head list;
+	void (*fn)(struct rspro_server *srv, void *data);
+	void *data;
+	bool done;
+};
+
+/*! Execute a function in the main thread and wait for its completion.
+ *  All changes to the server state are made by the main thread; other (REST) threads hand
+ *  them over as commands, so they never compete with RSPRO processing for the write locks.
+ *  Once this returns, the published state snapshot includes the changes made by fn.
+ *  Must not be called from the main thread. */
+void rspro_server_exec(struct rspro_server *srv, void (*fn)(struct rspro_server *srv, void *data), void *data)
+{
+	struct srv_cmd cmd = {
+		.fn = fn,
+		.data = data,
+	};
+
+	pthread_mutex_lock(&srv->cmds.mutex);
+	llist_add_tail(&cmd.list, &srv->cmds.queue);
+	pthread_mutex_unlock(&srv->cmds.mutex);
+
+	shard_wakeup(srv->shards[0]);
+
+	pthread_mutex_lock(&srv->cmds.mutex);
+	while (!cmd.done)
+		pthread_cond_wait(&srv->cmds.cond, &srv->cmds.mutex);
+	pthread_mutex_unlock(&srv->cmds.mutex);
+}
+
+static void shard_handle_msg(struct rspro_shard *shard, struct shard_msg *msg)
+{
+	struct rspro_server *srv = shard->srv;
+	struct rspro_client_conn *conn;
+
+	switch (msg->type) {
+	case SHARD_MSG_ACCEPT:
+		if (shard_conn_create(shard, msg->u.fd) < 0)
+			LOGP(DMAIN, LOGL_ERROR, "Shard %u: cannot serve new connection\n", shard->nr);
+		break;
+	case SHARD_MSG_CL_BANKD:
+		/* the client may have gone (or even reconnected to another shard) meanwhile */
+		pthread_rwlock_rdlock(&srv->rwlock);
+		conn = _client_conn_by_slot(srv, &msg->u.cl_bankd.client);
+		if (conn && conn->shard != shard)
+			conn = NULL;
+		pthread_rwlock_unlock(&srv->rwlock);
+		if (conn)
+			client_conn_set_bankd(conn, &msg->u.cl_bankd.bank, &msg->u.cl_bankd.endpoint,
+					      msg->u.cl_bankd.active);
+		break;
+	case SHARD_MSG_POOL_ALLOC:
+		pool_alloc_for_client(srv, &msg->u.pool_alloc.client, &msg->u.pool_alloc.start);
+		break;
+	case SHARD_MSG_STOP:
+		shard->stop = true;
+		break;
+	}
+}
+
+/* call-back if our shard was triggered by another thread */
+static int shard_event_cb(struct osmo_fd *ofd, unsigned int what)
 {
-	struct rspro_server *srv = ofd->data;
+	struct rspro_shard *shard = ofd->data;
+	struct rspro_server *srv = shard->srv;
 	struct rspro_client_conn *conn;
-	bool non_empty_new, non_empty_del;
+	struct srv_cmd *cmd, *cmd2;
+	struct shard_msg *msg, *msg2;
+	struct dirty_node *node;
+	LLIST_HEAD(cmds);
+	LLIST_HEAD(msgs);
 	uint64_t value;
 	int rc;
 
@@ -871,20 +2033,50 @@ int event_fd_cb(struct osmo_fd *ofd, unsigned int what)
 		return rc;
 	}
 
-	LOGP(DMAIN, LOGL_INFO, "Event FD arrived, checking for any pending work\n");
+	LOGP(DMAIN, LOGL_DEBUG, "Event FD of shard %u arrived, checking for any pending work\n",
+	     shard->nr);
 
-	pthread_rwlock_rdlock(&srv->rwlock);
-	llist_for_each_entry(conn, &srv->banks, list) {
-		slotmaps_rdlock(srv->slotmaps);
-		non_empty_new = llist_empty(&conn->bank.maps_new);
-		non_empty_del = llist_empty(&conn->bank.maps_delreq);
-		slotmaps_unlock(srv->slotmaps);
+	/* commands of REST threads are only executed by the main thread */
+	if (shard->nr == 0) {
+		pthread_mutex_lock(&srv->cmds.mutex);
+		llist_splice_init(&srv->cmds.queue, &cmds);
+		pthread_mutex_unlock(&srv->cmds.mutex);
+		llist_for_each_entry(cmd, &cmds, list)
+			cmd->fn(srv, cmd->data);
+	}
 
+	pthread_mutex_lock(&shard->mutex);
+	llist_splice_init(&shard->msgq, &msgs);
+	pthread_mutex_unlock(&shard->mutex);
+	llist_for_each_entry_safe(msg, msg2, &msgs, list) {
+		llist_del(&msg->list);
+		shard_handle_msg(shard, msg);
+		free(msg);
+	}
+
+	/* only the shard's own thread ever removes its connections from srv->banks, so no need
+	 * to lock */
+	while ((node = dirty_queue_pop(&shard->dirty))) {
+		conn = container_of(node, struct rspro_client_conn, bank.dirty_node);
+		/* clear before dispatching, so any concurrent change re-queues the connection */
+		atomic_store(&conn->bank.dirty, false);
 		/* trigger FSM to send any pending new/deleted maps */
-		if (non_empty_new || non_empty_del)
+		if (conn->fi)
 			osmo_fsm_inst_dispatch(conn->fi, CLNTC_E_PUSH, NULL);
 	}
-	pthread_rwlock_unlock(&srv->rwlock);
+
+	if (llist_empty(&cmds))
+		return 0;
+
+	/* make the result visible to REST readers before reporting completion */
+	state_snapshot_publish(srv);
+	pthread_mutex_lock(&srv->cmds.mutex);
+	llist_for_each_entry_safe(cmd, cmd2, &cmds, list) {
+		llist_del(&cmd->list);
+		cmd->done = true;
+	}
+	pthread_cond_broadcast(&srv->cmds.cond);
+	pthread_mutex_unlock(&srv->cmds.mutex);
 
 	return 0;
 }
@@ -894,11 +2086,26 @@ static void _unlink_all_slotmaps(struct rspro_client_conn *conn)
 {
 	struct slot_mapping *smap, *smap2;
 
+	/* none of the outstanding requests will be answered anymore */
+	osmo_timer_del(&conn->bank.op_timer);
+	llist_for_each_entry(smap, &conn->bank.maps_unack, bank_list) {
+		hash_del(&smap->op.hnode);
+		smap->op.tag = 0;
+	}
+	conn->bank.num_inflight = 0;
+	conn->bank.push_ops = 0;
+
 	llist_for_each_entry_safe(smap, smap2, &conn->bank.maps_new, bank_list) {
 		/* unlink from list and keep in state NEW */
 		_slotmap_state_change(smap, SLMAP_S_NEW, NULL);
 	}
 	llist_for_each_entry_safe(smap, smap2, &conn->bank.maps_unack, bank_list) {
+		/* already deleted via REST: whatever the bankd did with it, it's gone with the
+		 * connection just like maps_deleting below */
+		if (_slotmap_unlinked(smap)) {
+			_slotmap_del(smap->maps, smap);
+			continue;
+		}
 		/* unlink from list and change to state NEW */
 		_slotmap_state_change(smap, SLMAP_S_NEW, NULL);
 	}
@@ -919,6 +2126,15 @@ static void _unlink_all_slotmaps(struct rspro_client_conn *conn)
 /* only to be used by the FSM cleanup. */
 static void rspro_client_conn_destroy(struct rspro_client_conn *conn)
 {
+	client_conn_cfg_dequeue(conn);
+	if (conn->client.trunk)
+		llist_del(&conn->client.slot_list);
+
+	if (conn->bank.tx_batch) {
+		msgb_free(conn->bank.tx_batch);
+		conn->bank.tx_batch = NULL;
+	}
+
 	/* this will internally call closed_cb() which will dispatch a TCP_DOWN event */
 	if (conn->peer) {
 		struct osmo_stream_srv *peer = conn->peer;
@@ -927,18 +2143,181 @@ static void rspro_client_conn_destroy(struct rspro_client_conn *conn)
 		return;
 	} /* else: destroy initiated by conn->peer's closed_cb(). */
 
-	/* ensure all slotmaps are unlinked + returned to NEW or deleted */
+	/* ensure all slotmaps are unlinked + returned to NEW or deleted.  Unlist the connection
+	 * while holding the slotmaps lock, so no other thread can link new maps to it after */
 	slotmaps_wrlock(conn->srv->slotmaps);
-	_unlink_all_slotmaps(conn);
-	slotmaps_unlock(conn->srv->slotmaps);
-
 	pthread_rwlock_wrlock(&conn->srv->rwlock);
 	llist_del(&conn->list);
+	/* harmless if not hashed */
+	hash_del(&conn->hnode_slot);
+	hash_del(&conn->hnode_id);
+	if (conn->listed && conn->comp_id.type == ComponentType_remsimBankd)
+		state_log_bank(conn->bank.bank_id, conn->bank.num_slots, &conn->bank.endpoint, true);
+	else if (conn->listed)
+		state_log_client(&conn->client.slot, true);
+	if (conn->listed)
+		conns_changed(conn->srv);
+	_dirty_queue_remove(conn);
 	pthread_rwlock_unlock(&conn->srv->rwlock);
+	_unlink_all_slotmaps(conn);
+	slotmaps_unlock(conn->srv->slotmaps);
 
+	atomic_fetch_sub(&conn->shard->num_conns, 1);
 	talloc_free(conn);
 }
 
+/* set up a shard; the thread serving it must register shard->event_ofd */
+static struct rspro_shard *shard_alloc(struct rspro_server *srv, unsigned int nr)
+{
+	struct rspro_shard *shard = talloc_zero(srv, struct rspro_shard);
+	int rc;
+
+	if (!shard)
+		return NULL;
+	shard->srv = srv;
+	shard->nr = nr;
+	pthread_mutex_init(&shard->mutex, NULL);
+	INIT_LLIST_HEAD(&shard->msgq);
+	dirty_queue_init(&shard->dirty);
+	atomic_init(&shard->num_conns, 0);
+	INIT_LLIST_HEAD(&shard->cfg_active);
+	INIT_LLIST_HEAD(&shard->cfg_other);
+
+	rc = eventfd(0, 0);
+	if (rc < 0) {
+		pthread_mutex_destroy(&shard->mutex);
+		talloc_free(shard);
+		return NULL;
+	}
+	osmo_fd_setup(&shard->event_ofd, rc, OSMO_FD_READ, shard_event_cb, shard, 0);
+
+	return shard;
+}
+
+static void *shard_thread_main(void *arg)
+{
+	struct rspro_shard *shard = arg;
+	uint64_t rev, last_rev = 0;
+	char name[16];
+	int rc;
+
+	snprintf(name, sizeof(name), "rspro-io%u", shard->nr);
+	rc = osmo_ctx_init(name);
+	OSMO_ASSERT(rc == 0);
+	osmo_select_init();
+
+	g_cur_shard = shard;
+	shard->ctx = talloc_named_const(NULL, 0, name);
+	OSMO_ASSERT(shard->ctx);
+	talloc_asn1_ctx = talloc_named_const(shard->ctx, 0, "asn1");
+
+	rc = osmo_fd_register(&shard->event_ofd);
+	OSMO_ASSERT(rc == 0);
+
+	while (!shard->stop) {
+		osmo_select_main(0);
+		/* have the main thread publish a new state snapshot if we changed anything */
+		rev = state_log_rev();
+		if (rev != last_rev) {
+			last_rev = rev;
+			shard_wakeup(shard->srv->shards[0]);
+		}
+	}
+
+	/* the cleanup of a client connection also terminates the slots it carries, so always
+	 * start over at the head of the list */
+	while (!llist_empty(&shard->fsm->instances)) {
+		struct osmo_fsm_inst *fi = llist_first_entry(&shard->fsm->instances,
+							     struct osmo_fsm_inst, list);
+		osmo_fsm_inst_term(fi, OSMO_FSM_TERM_REQUEST, NULL);
+	}
+	osmo_fd_unregister(&shard->event_ofd);
+	talloc_free(shard->ctx);
+	shard->ctx = NULL;
+
+	return NULL;
+}
+
+/* stop the thread of a shard started by rspro_server_start_shards(), and free the shard */
+static void shard_stop(struct rspro_shard *shard)
+{
+	struct shard_msg *msg, *msg2;
+	int rc;
+
+	msg = calloc(1, sizeof(*msg));
+	if (!msg) {
+		LOGP(DMAIN, LOGL_ERROR, "Out of memory; cannot stop RSPRO I/O thread %u\n", shard->nr);
+		return;
+	}
+	msg->type = SHARD_MSG_STOP;
+	shard_post(shard, msg);
+	rc = pthread_join(shard->thread, NULL);
+	if (rc != 0) {
+		LOGP(DMAIN, LOGL_ERROR, "Cannot join RSPRO I/O thread %u: %s\n", shard->nr, strerror(rc));
+		return;
+	}
+
+	/* messages posted after the stop */
+	llist_for_each_entry_safe(msg, msg2, &shard->msgq, list) {
+		if (msg->type == SHARD_MSG_ACCEPT)
+			close(msg->u.fd);
+		free(msg);
+	}
+	close(shard->event_ofd.fd);
+	pthread_mutex_destroy(&shard->mutex);
+	osmo_fsm_unregister(shard->fsm);
+	talloc_free(shard);
+}
+
+/*! Start additional RSPRO I/O threads, across which new connections are distributed.
+ *  To be called from the main thread before it enters its select loop, once srv->cfg is set
+ *  up; this also sets up the pacing of new connections and client configurations.
+ *  \param[in] srv rspro_server on which we operate
+ *  \param[in] num_shards total number of I/O threads, including the main thread
+ *  \returns 0 on success; negative on error */
+int rspro_server_start_shards(struct rspro_server *srv, unsigned int num_shards)
+{
+	struct rspro_shard *shard;
+	unsigned int config_rate;
+	int rc;
+
+	if (num_shards < 1 || num_shards > RSPRO_MAX_SHARDS)
+		return -EINVAL;
+
+	/* the configuration rate is shared by the shards, as they are equally busy */
+	config_rate = srv->cfg.config_rate ? OSMO_MAX(srv->cfg.config_rate / num_shards, 1) : 0;
+	pacer_init(&srv->accept_pacer, srv->cfg.accept_rate, accept_pacer_run, srv);
+	/* ConnectClientRes must arrive within 10s, else the client gives up; so does waiting */
+	srv->accept_max_queued = srv->cfg.accept_rate ? srv->cfg.accept_rate * 8 : UINT_MAX;
+	pacer_init(&srv->shards[0]->cfg_pacer, config_rate, cfg_pacer_run, srv->shards[0]);
+
+	while (srv->num_shards < num_shards) {
+		shard = shard_alloc(srv, srv->num_shards);
+		if (!shard)
+			return -ENOMEM;
+		/* before the thread starts, which is the only one to touch it afterwards */
+		pacer_init(&shard->cfg_pacer, config_rate, cfg_pacer_run, shard);
+
+		/* each shard has its own FSM type, see struct rspro_shard */
+		shard->fsm = talloc(shard, struct osmo_fsm);
+		OSMO_ASSERT(shard->fsm);
+		*shard->fsm = remsim_server_client_fsm;
+		shard->fsm->name = talloc_asprintf(shard->fsm, "%s_%u", remsim_server_client_fsm.name,
+						   shard->nr);
+		OSMO_ASSERT(osmo_fsm_register(shard->fsm) == 0);
+
+		rc = pthread_create(&shard->thread, NULL, shard_thread_main, shard);
+		if (rc != 0) {
+			LOGP(DMAIN, LOGL_ERROR, "Cannot start RSPRO I/O thread: %s\n", strerror(rc));
+			return -rc;
+		}
+		srv->shards[srv->num_shards++] = shard;
+	}
+	LOGP(DMAIN, LOGL_NOTICE, "Serving RSPRO connections in %u I/O threads\n", srv->num_shards);
+
+	return 0;
+}
+
 
 struct rspro_server *rspro_server_create(void *ctx, const char *host, uint16_t port)
 
@@ -948,12 +2327,26 @@ struct rspro_server *rspro_server_create(void *ctx, const char *host, uint16_t p
 	OSMO_ASSERT(srv);
 
 	pthread_rwlock_init(&srv->rwlock, NULL);
+	pthread_mutex_init(&srv->cmds.mutex, NULL);
+	pthread_cond_init(&srv->cmds.cond, NULL);
+	INIT_LLIST_HEAD(&srv->cmds.queue);
 	pthread_rwlock_wrlock(&srv->rwlock);
 	INIT_LLIST_HEAD(&srv->connections);
 	INIT_LLIST_HEAD(&srv->clients);
 	INIT_LLIST_HEAD(&srv->banks);
+	hash_init(srv->clients_by_slot);
+	hash_init(srv->clients_by_id);
+	hash_init(srv->banks_by_id);
 	pthread_rwlock_unlock(&srv->rwlock);
 
+	atomic_init(&srv->next_tag, 0);
+	srv->cfg.max_inflight = 128;
+	srv->cfg.op_timeout_s = 10;
+	srv->cfg.op_max_retries = 3;
+	srv->cfg.accept_rate = 500;
+	srv->cfg.config_rate = 500;
+	INIT_LLIST_HEAD(&srv->accept_queue);
+
 	srv->link = osmo_stream_srv_link_create(ctx);
 	if (!srv->link)
 		goto out_free;
@@ -965,28 +2358,57 @@ struct rspro_server *rspro_server_create(void *ctx, const char *host, uint16_t p
 	osmo_stream_srv_link_set_nodelay(srv->link, true);
 	osmo_stream_srv_link_set_accept_cb(srv->link, accept_cb);
 
-
-	rc = osmo_stream_srv_link_open(srv->link);
-	if (rc < 0)
+	/* shard 0 is served by the main thread, i.e. the caller */
+	srv->shards[0] = shard_alloc(srv, 0);
+	if (!srv->shards[0])
 		goto out_destroy;
+	srv->shards[0]->ctx = srv;
+	srv->shards[0]->fsm = &remsim_server_client_fsm;
+	srv->num_shards = 1;
+	g_cur_shard = srv->shards[0];
+	rc = osmo_fd_register(&srv->shards[0]->event_ofd);
+	if (rc < 0)
+		goto out_shard;
 
 	return srv;
 
+out_shard:
+	close(srv->shards[0]->event_ofd.fd);
+	pthread_mutex_destroy(&srv->shards[0]->mutex);
+	g_cur_shard = NULL;
 out_destroy:
 	osmo_stream_srv_link_destroy(srv->link);
 out_free:
 	pthread_rwlock_destroy(&srv->rwlock);
+	pthread_cond_destroy(&srv->cmds.cond);
+	pthread_mutex_destroy(&srv->cmds.mutex);
 	talloc_free(srv);
 
 	return NULL;
 }
 
+int rspro_server_listen(struct rspro_server *srv)
+{
+	return osmo_stream_srv_link_open(srv->link);
+}
+
 void rspro_server_destroy(struct rspro_server *srv)
 {
 	/* FIXME: clear all lists */
 
 	osmo_stream_srv_link_destroy(srv->link);
 	srv->link = NULL;
+	/* the I/O threads may still hand work to the main thread until they are gone */
+	while (srv->num_shards > 1) {
+		srv->num_shards--;
+		shard_stop(srv->shards[srv->num_shards]);
+		srv->shards[srv->num_shards] = NULL;
+	}
+	osmo_fd_unregister(&srv->shards[0]->event_ofd);
+	close(srv->shards[0]->event_ofd.fd);
+	pthread_mutex_destroy(&srv->shards[0]->mutex);
 	pthread_rwlock_destroy(&srv->rwlock);
+	pthread_cond_destroy(&srv->cmds.cond);
+	pthread_mutex_destroy(&srv->cmds.mutex);
 	talloc_free(srv);
 }
@@ -1,6 +1,10 @@
 #pragma once
 #include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
 #include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hashtable.h>
+#include <osmocom/core/timer.h>
 #include <osmocom/core/select.h>
 #include <osmocom/core/fsm.h>
 #include <osmocom/netif/stream.h>
@@ -8,6 +12,86 @@
 
 #include "rspro_util.h"
 #include "slotmap.h"
+#include "slotmap_store.h"
+#include "sim_pool.h"
+
+/* number of bits for the per-bankd hash table of outstanding map operations */
+#define PENDING_OPS_HASH_BITS	8
+/* number of bits for the hash tables indexing client and bankd connections */
+#define CONN_HASH_BITS		10
+
+/* maximum number of RSPRO I/O threads */
+#define RSPRO_MAX_SHARDS	64
+
+/* bank_ids for which we keep endpoints learned from a primary server, see warm_endpoints */
+#define RSPRO_NUM_BANK_IDS	1024
+
+/* node of the intrusive lock-free queue of bankd connections with pending slotmap work */
+struct dirty_node {
+	struct dirty_node *_Atomic next;
+};
+
+/* multi-producer, single-consumer queue of dirty_nodes */
+struct dirty_queue {
+	struct dirty_node *_Atomic head;
+	struct dirty_node *tail;
+	struct dirty_node stub;
+};
+
+/* Token bucket limiting the rate of some operation, along with a backlog of deferred ones.  Up
+ * to one second worth of operations may be done at once.  Only ever used by a single thread */
+struct pacer {
+	/* operations per second; 0 = unlimited */
+	unsigned int rate;
+	/* in thousandths of a token */
+	uint64_t milli_tokens;
+	struct timespec last;
+	/* fires when the next deferred operation is due */
+	struct osmo_timer_list timer;
+	/* number of deferred operations */
+	unsigned int num;
+	/* start of the current backlog, and the number of operations deferred in it; for
+	 * reporting how long it takes to recover from a reconnect storm */
+	struct timespec backlog_start;
+	unsigned int backlog_total;
+};
+
+/* An RSPRO I/O thread with its own select loop, serving a subset of the connections.  Shard 0
+ * is the main thread.  Connections never move between shards, and their FSMs, timers and
+ * sockets are only ever touched by the thread of their shard; everything else is handed over
+ * as a message */
+struct rspro_shard {
+	struct rspro_server *srv;
+	unsigned int nr;
+	pthread_t thread;
+	/* talloc context of this shard's thread, not to be used by any other thread */
+	void *ctx;
+	/* FSM type of the connections of this shard; libosmocore keeps a list of instances
+	 * per type, which may only be modified by one thread */
+	struct osmo_fsm *fsm;
+	/* eventfd to wake up the select loop of this shard */
+	struct osmo_fd event_ofd;
+
+	/* messages from other threads, see shard_post() */
+	pthread_mutex_t mutex;
+	struct llist_head msgq;
+
+	/* bankd connections of this shard with pending slotmap work.  Pushed to by the main
+	 * thread while holding srv->rwlock for reading; popped only by the shard's thread */
+	struct dirty_queue dirty;
+
+	/* set by SHARD_MSG_STOP; only used by the shard's own thread */
+	bool stop;
+
+	/* number of connections, for balancing new ones across shards */
+	atomic_uint num_conns;
+
+	/* client connections of this shard waiting for their ConfigClientBankReq.  Clients whose
+	 * slotmap is ACTIVE go first, as they can resume service right away */
+	struct pacer cfg_pacer;
+	struct llist_head cfg_active;
+	struct llist_head cfg_other;
+};
 
 struct rspro_server {
 	struct osmo_stream_srv_link *link;
@@ -15,21 +99,81 @@ struct rspro_server {
 	struct llist_head connections;
 	struct llist_head clients;
 	struct llist_head banks;
-	/* rwlock protecting any of the lists above */
+	/* indexes of the connections on the clients and banks lists */
+	DECLARE_HASHTABLE(clients_by_slot, CONN_HASH_BITS);
+	DECLARE_HASHTABLE(clients_by_id, CONN_HASH_BITS);
+	DECLARE_HASHTABLE(banks_by_id, CONN_HASH_BITS);
+	/* endpoints of the bankds as known to the primary server we took over from, indexed by
+	 * bank_id; used for warm slotmaps until their bankd connects to us */
+	struct rspro_endpoint warm_endpoints[RSPRO_NUM_BANK_IDS];
+	/* rwlock protecting any of the lists, indexes and endpoints above */
 	pthread_rwlock_t rwlock;
+	/* bumped whenever a connection joins or leaves the clients/banks lists, or reaches its
+	 * connected state; tells state_snapshot_publish() whether to copy the connections */
+	_Atomic uint64_t conns_rev;
 
 	struct slotmaps *slotmaps;
+	/* persistent storage of slotmaps (optional) */
+	struct slotmap_store *store;
+	/* SIM pools from which slotmaps are allocated on demand */
+	struct sim_pools *pools;
 
 	/* our own (server) component identity */
 	struct app_comp_id comp_id;
+
+	/* RSPRO I/O threads; shards[0] is the main thread */
+	struct rspro_shard *shards[RSPRO_MAX_SHARDS];
+	unsigned int num_shards;
+
+	/* functions to be executed in the main thread on behalf of REST threads,
+	 * see rspro_server_exec() */
+	struct {
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		struct llist_head queue;
+	} cmds;
+
+	/* used to allocate OperationTags for requests; shared by all shards */
+	atomic_uint next_tag;
+
+	/* newly accepted connections waiting to be served by a shard (main thread only) */
+	struct pacer accept_pacer;
+	struct llist_head accept_queue;
+	/* maximum length of accept_queue, and connections refused for exceeding it */
+	unsigned int accept_max_queued;
+	unsigned int accept_refused;
+
+	struct {
+		/* maximum number of unacknowledged Create/RemoveMappingReq per bankd */
+		unsigned int max_inflight;
+		/* seconds after which an unacknowledged request is re-transmitted */
+		unsigned int op_timeout_s;
+		/* number of re-transmissions before we give up on the bankd connection */
+		unsigned int op_max_retries;
+		/* new connections accepted per second; 0 = unlimited */
+		unsigned int accept_rate;
+		/* ConfigClientBankReq sent per second (by all shards together); 0 = unlimited */
+		unsigned int config_rate;
+	} cfg;
 };
 
 /* representing a single client connection to an RSPRO server */
 struct rspro_client_conn {
 	/* global list of connections */
 	struct llist_head list;
+	/* on srv->banks or srv->clients, rather than srv->connections */
+	bool listed;
+	/* in srv->clients_by_slot (clients only) */
+	struct hlist_node hnode_slot;
+	/* in srv->clients_by_id or srv->banks_by_id */
+	struct hlist_node hnode_id;
 	/* back-pointer to rspro_server */
 	struct rspro_server *srv;
+	/* I/O thread serving this connection */
+	struct rspro_shard *shard;
+	/* address of the peer */
+	char remote_ip[INET6_ADDRSTRLEN];
+	char remote_port[6];
 	/* reference to the underlying IPA server connection */
 	struct osmo_stream_srv *peer;
 	/* FSM instance for this connection */
@@ -38,6 +182,9 @@ struct rspro_client_conn {
 	struct app_comp_id comp_id;
 	/* keep-alive handling FSM */
 	struct osmo_ipa_ka_fsm_inst *ka_fi;
+	/* RSPRO PDUs received and sent; written by our shard only, read by the metrics */
+	atomic_ulong rx_pdus;
+	atomic_ulong tx_pdus;
 
 	struct {
 		struct llist_head maps_new;
@@ -47,23 +194,101 @@ struct rspro_client_conn {
 		struct llist_head maps_deleting;
 		uint16_t bank_id;
 		uint16_t num_slots;
+		/* maps in maps_unack + maps_deleting, indexed by OperationTag */
+		DECLARE_HASHTABLE(pending_ops, PENDING_OPS_HASH_BITS);
+		unsigned int num_inflight;
+		/* re-transmission timer for the oldest unacknowledged request */
+		struct osmo_timer_list op_timer;
+		/* start of the current provisioning run, and operations completed in it */
+		struct timespec push_start;
+		unsigned int push_ops;
+		/* our node in shard->dirty, and whether it is currently queued there */
+		struct dirty_node dirty_node;
+		atomic_bool dirty;
+		/* bankd announced support for batch frames in its ConnectBankReq */
+		bool batch;
+		/* mappingsDigest of its ConnectBankReq; -1 if none */
+		int64_t maps_digest;
+		/* where clients shall connect to this bankd; resolved once in ConnectBankReq */
+		struct rspro_endpoint endpoint;
+		/* batch frame being assembled, flushed at the end of each main loop event */
+		struct msgb *tx_batch;
+		unsigned int tx_batch_num;
+		/* as last reported in BankLoadInd; read by other threads for placing new maps */
+		struct {
+			atomic_uint active_slots;
+			atomic_uint apdu_rate;
+			atomic_uint mean_latency_us;
+		} load;
 	} bank;
 	struct {
 		struct client_slot slot;
 		/* bankd configuration for this client (if any) */
 		struct {
 			struct bank_slot slot;
-			uint32_t ip;
-			uint16_t port;
+			struct rspro_endpoint endpoint;
 		} bankd;
+		/* in shard->cfg_active or cfg_other while waiting to be sent the bankd configuration */
+		struct llist_head cfg_list;
+		bool cfg_queued;
+		bool cfg_active;
+		/* if this client slot was connected via the connection of another one (its "trunk"):
+		 * that connection.  Such a slot has no peer and keep-alive of its own */
+		struct rspro_client_conn *trunk;
+		/* on a trunk: the further client slots it carries; on those: our entry in it */
+		struct llist_head slots;
+		struct llist_head slot_list;
 	} client;
 };
 
 struct rspro_server *rspro_server_create(void *ctx, const char *host, uint16_t port);
+/* start accepting RSPRO connections */
+int rspro_server_listen(struct rspro_server *srv);
 void rspro_server_destroy(struct rspro_server *srv);
-int event_fd_cb(struct osmo_fd *ofd, unsigned int what);
+int rspro_server_start_shards(struct rspro_server *srv, unsigned int num_shards);
+void rspro_server_exec(struct rspro_server *srv, void (*fn)(struct rspro_server *srv, void *data), void *data);
 
 struct rspro_client_conn *_client_conn_by_slot(struct rspro_server *srv, const struct client_slot *cslot);
-struct rspro_client_conn *client_conn_by_slot(struct rspro_server *srv, const struct client_slot *cslot);
+struct rspro_client_conn *_client_conn_by_id(struct rspro_server *srv, uint16_t client_id);
 struct rspro_client_conn *_bankd_conn_by_id(struct rspro_server *srv, uint16_t bank_id);
-struct rspro_client_conn *bankd_conn_by_id(struct rspro_server *srv, uint16_t bank_id);
+void _bankd_conn_mark_dirty(struct rspro_client_conn *conn);
+/* permille of the time the cards of a bankd are busy; UINT64_MAX if it is not connected */
+uint64_t bankd_load_permille(struct rspro_server *srv, uint16_t bank_id);
+/* associate a new map with its bankd, if connected; caller must hold slotmaps->rwlock for writing */
+void _slotmap_attach_bankd(struct rspro_server *srv, struct slot_mapping *map);
+/* remove a map from the table and have its bankd release it; main thread only, holding
+ * slotmaps->rwlock for writing */
+void _slotmap_mark_deleted(struct rspro_server *srv, struct slot_mapping *map);
+
+/* one entry of a bulk request, along with its HTTP-style result */
+struct bulk_slotmap {
+	struct bank_slot bank;
+	struct client_slot client;
+	/* 0 = not processed yet; 200 = unchanged/deleted; 201 = created; 400 = invalid;
+	 * 404 = not found; 409 = bank or client slot already in use */
+	int status;
+};
+uint32_t bulk_slotmap_id(const struct bulk_slotmap *item);
+/* qsort()/bsearch() comparison of two pointers to struct bulk_slotmap, by id */
+int bulk_slotmap_cmp(const void *a, const void *b);
+/* create maps for all not yet processed entries; main thread only, holding slotmaps->rwlock
+ * for writing.  Returns the number of created maps */
+unsigned int _bulk_create(struct rspro_server *srv, struct bulk_slotmap *items, size_t num);
+
+/* replacement of the entire slotmap table, see _slotmaps_replace() */
+struct slotmap_replace {
+	/* the new table, and its valid entries sorted by bulk_slotmap_cmp() */
+	struct bulk_slotmap *items;
+	size_t num_items;
+	struct bulk_slotmap **sorted;
+	size_t num_sorted;
+	/* optional: called for each map that is deleted */
+	void (*deleted_cb)(const struct slot_mapping *map, void *data);
+	void *data;
+	unsigned int num_created;
+	unsigned int num_deleted;
+};
+/* delete all maps not contained identically in the new table and create the missing ones;
+ * main thread only, holding slotmaps->rwlock for writing.  Returns -EBUSY without changing
+ * anything if a map to be deleted is still waiting for its CreateMappingRes */
+int _slotmaps_replace(struct rspro_server *srv, struct slotmap_replace *r);
@@ -0,0 +1,324 @@
+/* SIM pools of the remsim-server
+ *
+ * A pool is a named set of bank slots, e.g. all SIMs of one operator or tenant.  Clients are
+ * allocated a slotmap with any free slot of a pool, either on request of the REST interface or
+ * automatically when they connect.  Each pool keeps the free slots of each of its banks on a
+ * list, which is kept up to date by observing all changes of the slotmap table.  So allocation
+ * only depends on the number of banks of a pool (to pick the least loaded one), not on how many
+ * slots are in use, and slotmaps created or deleted by other means are accounted for.
+ *
+ * Pools are shared between the main thread (modifying them) and the REST threads (reporting
+ * them), so unlike most of the server state they are allocated with malloc().
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hashtable.h>
+
+#include "debug.h"
+#include "slotmap.h"
+#include "sim_pool.h"
+
+static inline uint32_t bank_slot_key(const struct bank_slot *bank)
+{
+	return (bank->bank_id << 16) | bank->slot_nr;
+}
+
+static struct sim_pool_slot *_slot_by_bank(struct sim_pools *pools, const struct bank_slot *bank)
+{
+	struct sim_pool_slot *slot;
+
+	hash_for_each_possible(pools->by_bank, slot, hnode, bank_slot_key(bank)) {
+		if (bank_slot_equals(&slot->bank, bank))
+			return slot;
+	}
+	return NULL;
+}
+
+struct sim_pools *sim_pools_init(struct slotmaps *maps)
+{
+	struct sim_pools *pools = calloc(1, sizeof(*pools));
+	if (!pools)
+		return NULL;
+
+	pools->maps = maps;
+	INIT_LLIST_HEAD(&pools->pools);
+	hash_init(pools->by_bank);
+	pthread_rwlock_init(&pools->rwlock, NULL);
+
+	return pools;
+}
+
+struct sim_pool *_sim_pool_by_name(struct sim_pools *pools, const char *name)
+{
+	struct sim_pool *pool;
+
+	llist_for_each_entry(pool, &pools->pools, list) {
+		if (!strcmp(pool->name, name))
+			return pool;
+	}
+	return NULL;
+}
+
+struct sim_pool *_sim_pool_for_client(struct sim_pools *pools, uint16_t client_id)
+{
+	struct sim_pool *pool;
+
+	llist_for_each_entry(pool, &pools->pools, list) {
+		if (pool->auto_first_client >= 0 &&
+		    client_id >= pool->auto_first_client && client_id <= pool->auto_last_client)
+			return pool;
+	}
+	return NULL;
+}
+
+/* would the new pool 'name' share any slot or client with another pool? */
+static bool _sim_pool_conflicts(struct sim_pools *pools, const char *name, const struct sim_pool_range *ranges,
+				unsigned int num_ranges, int auto_first_client, int auto_last_client)
+{
+	struct sim_pool_slot *slot;
+	struct sim_pool *pool;
+	struct bank_slot bank;
+	unsigned int i, j;
+
+	for (i = 0; i < num_ranges; i++) {
+		/* within the new pool */
+		for (j = 0; j < i; j++) {
+			if (ranges[i].bank_id == ranges[j].bank_id &&
+			    ranges[i].first_slot < ranges[j].first_slot + ranges[j].num_slots &&
+			    ranges[j].first_slot < ranges[i].first_slot + ranges[i].num_slots)
+				return true;
+		}
+		/* with other pools */
+		bank.bank_id = ranges[i].bank_id;
+		for (j = 0; j < ranges[i].num_slots; j++) {
+			bank.slot_nr = ranges[i].first_slot + j;
+			slot = _slot_by_bank(pools, &bank);
+			if (slot && strcmp(slot->pool->name, name))
+				return true;
+		}
+	}
+
+	if (auto_first_client < 0)
+		return false;
+	llist_for_each_entry(pool, &pools->pools, list) {
+		if (pool->auto_first_client < 0 || !strcmp(pool->name, name))
+			continue;
+		if (auto_first_client <= pool->auto_last_client && pool->auto_first_client <= auto_last_client)
+			return true;
+	}
+	return false;
+}
+
+static void sim_pool_free(struct sim_pool *pool)
+{
+	free(pool->banks);
+	free(pool->slots);
+	free(pool->ranges);
+	free(pool);
+}
+
+/* caller must hold slotmaps->rwlock and pools->rwlock for writing */
+static void __sim_pool_del(struct sim_pools *pools, struct sim_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->num_slots; i++)
+		hash_del(&pool->slots[i].hnode);
+	llist_del(&pool->list);
+	sim_pool_free(pool);
+}
+
+int _sim_pool_create(struct sim_pools *pools, const char *name, const struct sim_pool_range *ranges,
+		     unsigned int num_ranges, int auto_first_client, int auto_last_client)
+{
+	unsigned int i, j, num_slots = 0, num_banks = 0;
+	struct sim_pool_bank *pbank;
+	struct sim_pool_slot *slot;
+	struct sim_pool *pool, *old;
+	bool replaced = false;
+
+	if (_sim_pool_conflicts(pools, name, ranges, num_ranges, auto_first_client, auto_last_client))
+		return -EBUSY;
+
+	for (i = 0; i < num_ranges; i++) {
+		num_slots += ranges[i].num_slots;
+		/* count each bank only at its first range */
+		for (j = 0; j < i; j++) {
+			if (ranges[j].bank_id == ranges[i].bank_id)
+				break;
+		}
+		if (j == i)
+			num_banks++;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+	pool->pools = pools;
+	OSMO_STRLCPY_ARRAY(pool->name, name);
+	pool->auto_first_client = auto_first_client;
+	pool->auto_last_client = auto_last_client;
+	pool->ranges = calloc(num_ranges ? num_ranges : 1, sizeof(*pool->ranges));
+	pool->slots = calloc(num_slots ? num_slots : 1, sizeof(*pool->slots));
+	pool->banks = calloc(num_banks ? num_banks : 1, sizeof(*pool->banks));
+	if (!pool->ranges || !pool->slots || !pool->banks) {
+		sim_pool_free(pool);
+		return -ENOMEM;
+	}
+	memcpy(pool->ranges, ranges, num_ranges * sizeof(*ranges));
+	pool->num_ranges = num_ranges;
+
+	pthread_rwlock_wrlock(&pools->rwlock);
+	old = _sim_pool_by_name(pools, name);
+	if (old) {
+		__sim_pool_del(pools, old);
+		replaced = true;
+	}
+
+	for (i = 0; i < num_ranges; i++) {
+		for (j = 0; j < pool->num_banks; j++) {
+			if (pool->banks[j].bank_id == ranges[i].bank_id)
+				break;
+		}
+		pbank = &pool->banks[j];
+		if (j == pool->num_banks) {
+			pool->num_banks++;
+			pbank->bank_id = ranges[i].bank_id;
+			INIT_LLIST_HEAD(&pbank->free);
+		}
+		pbank->num_slots += ranges[i].num_slots;
+
+		for (j = 0; j < ranges[i].num_slots; j++) {
+			slot = &pool->slots[pool->num_slots++];
+			slot->pool = pool;
+			slot->pbank = pbank;
+			slot->bank.bank_id = ranges[i].bank_id;
+			slot->bank.slot_nr = ranges[i].first_slot + j;
+			hash_add(pools->by_bank, &slot->hnode, bank_slot_key(&slot->bank));
+			if (_slotmap_by_bank(pools->maps, &slot->bank)) {
+				INIT_LLIST_HEAD(&slot->list);
+				continue;
+			}
+			slot->free = true;
+			llist_add_tail(&slot->list, &pbank->free);
+			pbank->num_free++;
+			pool->num_free++;
+		}
+	}
+	llist_add_tail(&pool->list, &pools->pools);
+	pthread_rwlock_unlock(&pools->rwlock);
+
+	LOGP(DMAIN, LOGL_NOTICE, "SIM pool '%s' %s with %u slots, %u of them free\n", name,
+	     replaced ? "replaced" : "created", pool->num_slots, pool->num_free);
+
+	return 0;
+}
+
+void _sim_pool_del(struct sim_pools *pools, struct sim_pool *pool)
+{
+	LOGP(DMAIN, LOGL_NOTICE, "SIM pool '%s' removed\n", pool->name);
+
+	pthread_rwlock_wrlock(&pools->rwlock);
+	__sim_pool_del(pools, pool);
+	pthread_rwlock_unlock(&pools->rwlock);
+}
+
+static void stats_update_max(atomic_ulong *max, unsigned long val)
+{
+	unsigned long cur = atomic_load(max);
+
+	while (val > cur && !atomic_compare_exchange_weak(max, &cur, val))
+		;
+}
+
+uint64_t _sim_pool_bank_load(const struct sim_pool *pool, const struct sim_pool_bank *pbank)
+{
+	uint64_t load = 0;
+
+	if (pool->pools->bank_load_cb) {
+		load = pool->pools->bank_load_cb(pbank->bank_id);
+		if (load == UINT64_MAX)
+			return load;
+	}
+	return load + (pbank->num_slots - atomic_load(&pbank->num_free)) * 1000 / pbank->num_slots;
+}
+
+struct slot_mapping *_sim_pool_alloc(struct sim_pool *pool, const struct client_slot *client,
+				     const struct timespec *start)
+{
+	struct sim_pool_bank *pbank = NULL;
+	struct sim_pool_slot *slot;
+	struct slot_mapping *map;
+	uint64_t load, min_load = 0;
+	struct timespec now;
+	unsigned int i;
+	int64_t us;
+
+	/* banks which are not available right now are only used if there is no other */
+	for (i = 0; i < pool->num_banks; i++) {
+		if (!pool->banks[i].num_free)
+			continue;
+		load = _sim_pool_bank_load(pool, &pool->banks[i]);
+		if (!pbank || load < min_load) {
+			pbank = &pool->banks[i];
+			min_load = load;
+		}
+	}
+
+	if (!pbank) {
+		LOGP(DMAIN, LOGL_NOTICE, "SIM pool '%s' exhausted; cannot allocate a slot for C(%u:%u)\n",
+		     pool->name, client->client_id, client->slot_nr);
+		atomic_fetch_add(&pool->stats.failures, 1);
+		return NULL;
+	}
+
+	slot = llist_first_entry(&pbank->free, struct sim_pool_slot, list);
+	/* takes the slot off the free list via _sim_pools_slotmap_changed() */
+	map = _slotmap_add(pool->pools->maps, &slot->bank, client);
+	if (!map) {
+		atomic_fetch_add(&pool->stats.failures, 1);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+	if (us < 0)
+		us = 0;
+	atomic_fetch_add(&pool->stats.allocs, 1);
+	atomic_fetch_add(&pool->stats.latency_us_total, us);
+	stats_update_max(&pool->stats.latency_us_max, us);
+
+	return map;
+}
+
+void _sim_pools_slotmap_changed(struct sim_pools *pools, const struct slot_mapping *map, bool removed)
+{
+	struct sim_pool_slot *slot;
+
+	if (!pools)
+		return;
+	slot = _slot_by_bank(pools, &map->bank);
+	if (!slot || slot->free == removed)
+		return;
+
+	if (removed) {
+		llist_add_tail(&slot->list, &slot->pbank->free);
+		slot->pbank->num_free++;
+		slot->pool->num_free++;
+	} else {
+		llist_del(&slot->list);
+		INIT_LLIST_HEAD(&slot->list);
+		slot->pbank->num_free--;
+		slot->pool->num_free--;
+	}
+	slot->free = removed;
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hashtable.h>
+
+#include "slotmap.h"
+
+/* number of bits for the hash table indexing the slots of all pools by bank:slot */
+#define SIM_POOL_HASH_BITS	12
+/* maximum length of a pool name, which is also used in REST URLs */
+#define SIM_POOL_NAME_LEN	32
+
+/* a range of consecutive slots of one bank, as configured */
+struct sim_pool_range {
+	uint16_t bank_id;
+	uint16_t first_slot;
+	uint16_t num_slots;
+};
+
+/* the slots of a pool on one bank */
+struct sim_pool_bank {
+	uint16_t bank_id;
+	unsigned int num_slots;
+	/* free slots, oldest released first; so all SIMs are used evenly */
+	struct llist_head free;
+	atomic_uint num_free;
+};
+
+/* a bank slot which is a member of a pool */
+struct sim_pool_slot {
+	/* in sim_pools->by_bank */
+	struct hlist_node hnode;
+	/* in pbank->free, if free */
+	struct llist_head list;
+	struct sim_pool *pool;
+	struct sim_pool_bank *pbank;
+	struct bank_slot bank;
+	/* not used by any slotmap */
+	bool free;
+};
+
+/* a named set of bank slots from which slotmaps are allocated on demand, e.g. all SIMs of one
+ * operator or tenant */
+struct sim_pool {
+	/* in sim_pools->pools */
+	struct llist_head list;
+	struct sim_pools *pools;
+	char name[SIM_POOL_NAME_LEN];
+
+	/* clients with a client_id in this range are allocated a slot of this pool when they
+	 * connect without having a slotmap; -1 if none */
+	int auto_first_client;
+	int auto_last_client;
+
+	struct sim_pool_range *ranges;
+	unsigned int num_ranges;
+	struct sim_pool_slot *slots;
+	unsigned int num_slots;
+	struct sim_pool_bank *banks;
+	unsigned int num_banks;
+	atomic_uint num_free;
+
+	struct {
+		atomic_ulong allocs;
+		atomic_ulong failures;
+		/* from the allocation request until the slotmap was created */
+		atomic_ulong latency_us_total;
+		atomic_ulong latency_us_max;
+	} stats;
+};
+
+/* all pools of a server.  The slots of a pool (and their free list) are protected by
+ * slotmaps->rwlock.  The list of pools is only modified while holding both slotmaps->rwlock
+ * and our own rwlock for writing, so holding either of them is enough to read it */
+struct sim_pools {
+	struct slotmaps *maps;
+	struct llist_head pools;
+	DECLARE_HASHTABLE(by_bank, SIM_POOL_HASH_BITS);
+	pthread_rwlock_t rwlock;
+
+	/* optional: how busy the cards of a bank are, in permille of the time; UINT64_MAX if the
+	 * bank is not available.  Called with slotmaps->rwlock or our rwlock held */
+	uint64_t (*bank_load_cb)(uint16_t bank_id);
+};
+
+struct sim_pools *sim_pools_init(struct slotmaps *maps);
+
+/* lookup of a pool; caller must hold slotmaps->rwlock or pools->rwlock */
+struct sim_pool *_sim_pool_by_name(struct sim_pools *pools, const char *name);
+/* pool whose auto-allocation range covers client_id, if any; same locking as above */
+struct sim_pool *_sim_pool_for_client(struct sim_pools *pools, uint16_t client_id);
+
+/* create a pool or replace the one of the same name; existing slotmaps are kept.  Returns
+ * -EBUSY if any slot or the auto-allocation range is already part of another pool.  Caller
+ * must hold slotmaps->rwlock for writing */
+int _sim_pool_create(struct sim_pools *pools, const char *name, const struct sim_pool_range *ranges,
+		     unsigned int num_ranges, int auto_first_client, int auto_last_client);
+/* remove a pool; existing slotmaps are kept.  Caller must hold slotmaps->rwlock for writing */
+void _sim_pool_del(struct sim_pools *pools, struct sim_pool *pool);
+
+/* load of a bank of the pool when placing new maps, lower is better: the sum of the time its
+ * cards are busy and the share of its slots in use, both in permille */
+uint64_t _sim_pool_bank_load(const struct sim_pool *pool, const struct sim_pool_bank *pbank);
+
+/* create a slotmap for client with the least recently used free slot of the least loaded bank
+ * of the pool.  start is the time the allocation was requested, for the latency statistics.
+ * Returns NULL if the pool is exhausted or the client already has a slotmap.  Caller must
+ * hold slotmaps->rwlock for writing */
+struct slot_mapping *_sim_pool_alloc(struct sim_pool *pool, const struct client_slot *client,
+				     const struct timespec *start);
+
+/* keep track of slots being used by slotmaps; to be called from slotmaps->change_cb */
+void _sim_pools_slotmap_changed(struct sim_pools *pools, const struct slot_mapping *map, bool removed);
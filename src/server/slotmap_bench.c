@@ -0,0 +1,178 @@
+/* Micro-benchmark of the slotmap indexes
+ *
+ * Adds N maps, looks each of them up by bank:slot, client:slot and map id in random
+ * order, looks up as many absent keys, and deletes all maps again, for N = 1k, 10k and
+ * 100k unless other sizes are given on the command line.  Reports the mean time per
+ * operation.  The maps are laid out as the server sees them in the field: bankds with 256
+ * slots and clients with 4 slots each.
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/application.h>
+
+#include "debug.h"
+#include "slotmap.h"
+
+/* the lookups of each kind are repeated until at least this many were done */
+#define BENCH_MIN_LOOKUPS	1000000
+#define BENCH_BANK_SLOTS	256
+#define BENCH_CLIENT_SLOTS	4
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_slots(unsigned int i, struct bank_slot *bank, struct client_slot *client)
+{
+	bank->bank_id = i / BENCH_BANK_SLOTS;
+	bank->slot_nr = i % BENCH_BANK_SLOTS;
+	client->client_id = i / BENCH_CLIENT_SLOTS;
+	client->slot_nr = i % BENCH_CLIENT_SLOTS;
+}
+
+/* random permutation of 0..n-1, so the lookups don't walk the tables in order */
+static unsigned int *bench_order(void *ctx, unsigned int n)
+{
+	unsigned int *order = talloc_array(ctx, unsigned int, n);
+	unsigned int i, j, tmp;
+
+	OSMO_ASSERT(order);
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	return order;
+}
+
+static void bench_report(unsigned int n, const char *what, uint64_t ns, unsigned int ops)
+{
+	printf("%7u maps: %-10s %8.1f ns/op\n", n, what, (double) ns / ops);
+}
+
+static void bench_run(void *ctx, unsigned int n)
+{
+	struct slotmaps *maps = slotmap_init(ctx);
+	struct slot_mapping **all;
+	unsigned int *order;
+	struct bank_slot bank;
+	struct client_slot client;
+	unsigned int rounds = (BENCH_MIN_LOOKUPS + n - 1) / n;
+	unsigned int i, r, found;
+	uint64_t start;
+
+	OSMO_ASSERT(maps);
+	all = talloc_array(ctx, struct slot_mapping *, n);
+	OSMO_ASSERT(all);
+	order = bench_order(ctx, n);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		bench_slots(order[i], &bank, &client);
+		all[order[i]] = slotmap_add(maps, &bank, &client);
+		OSMO_ASSERT(all[order[i]]);
+	}
+	bench_report(n, "add", now_ns() - start, n);
+
+	found = 0;
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < n; i++) {
+			bench_slots(order[i], &bank, &client);
+			found += slotmap_by_bank(maps, &bank) != NULL;
+		}
+	}
+	bench_report(n, "by_bank", now_ns() - start, rounds * n);
+	OSMO_ASSERT(found == rounds * n);
+
+	found = 0;
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < n; i++) {
+			bench_slots(order[i], &bank, &client);
+			found += slotmap_by_client(maps, &client) != NULL;
+		}
+	}
+	bench_report(n, "by_client", now_ns() - start, rounds * n);
+	OSMO_ASSERT(found == rounds * n);
+
+	found = 0;
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		slotmaps_rdlock(maps);
+		for (i = 0; i < n; i++)
+			found += _slotmap_by_id(maps, slotmap_get_id(all[order[i]])) != NULL;
+		slotmaps_unlock(maps);
+	}
+	bench_report(n, "by_id", now_ns() - start, rounds * n);
+	OSMO_ASSERT(found == rounds * n);
+
+	/* client slots beyond the ones in use */
+	found = 0;
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < n; i++) {
+			bench_slots(order[i], &bank, &client);
+			client.slot_nr += BENCH_CLIENT_SLOTS;
+			found += slotmap_by_client(maps, &client) != NULL;
+		}
+	}
+	bench_report(n, "miss", now_ns() - start, rounds * n);
+	OSMO_ASSERT(found == 0);
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		slotmap_del(maps, all[order[i]]);
+	bench_report(n, "del", now_ns() - start, n);
+	OSMO_ASSERT(llist_empty(&maps->mappings));
+
+	talloc_free(order);
+	talloc_free(all);
+	talloc_free(maps);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int default_sizes[] = { 1000, 10000, 100000 };
+	void *ctx = talloc_named_const(NULL, 0, "slotmap_bench");
+	unsigned int i, n;
+
+	osmo_init_logging2(ctx, &log_info);
+	/* the maps are logged at INFO level */
+	log_set_log_level(osmo_stderr_target, LOGL_NOTICE);
+	srandom(1);
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			n = strtoul(argv[i], NULL, 0);
+			/* the client ids of the synthetic maps are 16 bits wide */
+			if (n == 0 || n / BENCH_CLIENT_SLOTS > UINT16_MAX) {
+				fprintf(stderr, "Invalid number of maps: %s\n", argv[i]);
+				exit(2);
+			}
+			bench_run(ctx, n);
+		}
+	} else {
+		for (i = 0; i < ARRAY_SIZE(default_sizes); i++)
+			bench_run(ctx, default_sizes[i]);
+	}
+
+	talloc_free(ctx);
+	return 0;
+}
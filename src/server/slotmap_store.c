@@ -0,0 +1,596 @@
+/* Persistent storage of the remsim-server slotmap table
+ *
+ * The table is stored as a compacted snapshot in <path>, plus an append-only
+ * journal of all changes since that snapshot in <path>.journal.  On startup,
+ * both are memory-mapped and replayed; the journal is compacted into a new
+ * snapshot once it has grown larger than the table itself.
+ *
+ * Only the set of mappings is stored.  Their state (NEW, ACTIVE, ...) is a
+ * property of the respective bankd connection and re-established once the
+ * bankd (re)connects.  Both files use host byte order, as they are only ever
+ * read back by the same server.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/linuxlist.h>
+
+#include "debug.h"
+#include "slotmap.h"
+#include "slotmap_store.h"
+#include "rspro_server.h"
+
+#define STORE_MAGIC		0x4d534d52	/* "RMSM" */
+#define STORE_VERSION		1
+
+/* don't compact the journal before it has at least this many records */
+#define STORE_COMPACT_MIN_RECS	4096
+
+#define STORE_CSUM_INIT		2166136261u
+
+enum store_rec_type {
+	STORE_REC_ADD	= 1,
+	STORE_REC_DEL	= 2,
+};
+
+struct store_map {
+	uint16_t bank_id;
+	uint16_t bank_slot;
+	uint16_t client_id;
+	uint16_t client_slot;
+} __attribute__((packed));
+
+/* header of the snapshot file, followed by num_maps struct store_map */
+struct store_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_maps;
+	/* checksum over all struct store_map following the header */
+	uint32_t csum;
+} __attribute__((packed));
+
+/* one record of the journal */
+struct store_rec {
+	uint16_t type;		/* enum store_rec_type */
+	uint16_t reserved;
+	struct store_map map;
+	/* checksum over the preceding members; detects records torn by a crash */
+	uint32_t csum;
+} __attribute__((packed));
+
+struct slotmap_store {
+	struct slotmaps *maps;
+	char *path;
+	char *journal_path;
+	char *tmp_path;
+	int journal_fd;
+
+	/* serializes slotmap_store_sync(), so the journal_fd isn't replaced under a running
+	 * fdatasync(); taken before slotmaps->rwlock */
+	pthread_mutex_t sync_mutex;
+
+	/* protects all members below, and writes to journal_fd; nests inside slotmaps->rwlock */
+	pthread_mutex_t mutex;
+	/* number of records in the journal, and of maps in the table */
+	unsigned int num_recs;
+	unsigned int num_maps;
+	/* sequence number of the last record written / known to be on disk */
+	uint64_t written_seq;
+	uint64_t synced_seq;
+	/* a journal write failed; the next sync re-writes the snapshot */
+	bool failed;
+};
+
+/* FNV-1a; we only need to detect torn or garbage data, not malicious one */
+static uint32_t store_csum(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *cur = data;
+
+	while (len--) {
+		hash ^= *cur++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static int64_t elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void map2store(struct store_map *out, const struct slot_mapping *map)
+{
+	out->bank_id = map->bank.bank_id;
+	out->bank_slot = map->bank.slot_nr;
+	out->client_id = map->client.client_id;
+	out->client_slot = map->client.slot_nr;
+}
+
+/* apply one stored operation to the table. After an interrupted compaction, the journal may
+ * overlap with the snapshot, so this must be idempotent: any existing map for the same bank
+ * or client slot is replaced.  Caller must hold slotmaps->rwlock for writing */
+static void _store_apply(struct slotmaps *maps, enum store_rec_type type, const struct store_map *sm)
+{
+	struct bank_slot bank = { .bank_id = sm->bank_id, .slot_nr = sm->bank_slot };
+	struct client_slot client = { .client_id = sm->client_id, .slot_nr = sm->client_slot };
+	struct slot_mapping *map;
+
+	/* the REST interface refuses those; don't restore what nothing else could handle */
+	if (sm->bank_id >= RSPRO_NUM_BANK_IDS) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Ignoring stored slotmap of invalid bank %u\n", sm->bank_id);
+		return;
+	}
+
+	map = _slotmap_by_bank(maps, &bank);
+	if (map)
+		_slotmap_del(maps, map);
+	if (type != STORE_REC_ADD)
+		return;
+
+	map = _slotmap_by_client(maps, &client);
+	if (map)
+		_slotmap_del(maps, map);
+	_slotmap_add(maps, &bank, &client);
+}
+
+/* memory-map given file read-only. Returns 0 with *data = NULL if it doesn't exist or is empty */
+static int store_mmap(const char *path, const uint8_t **data, size_t *len)
+{
+	struct stat sb;
+	void *ptr;
+	int fd;
+
+	*data = NULL;
+	*len = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return -errno;
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	ptr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return -errno;
+
+	*data = ptr;
+	*len = sb.st_size;
+	return 0;
+}
+
+/* caller must hold slotmaps->rwlock for writing */
+static int _store_load_snapshot(struct slotmap_store *st)
+{
+	const struct store_hdr *hdr;
+	const struct store_map *sm;
+	const uint8_t *data;
+	size_t len;
+	uint32_t i;
+	int rc;
+
+	rc = store_mmap(st->path, &data, &len);
+	if (rc < 0) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Cannot read slotmap snapshot %s: %s\n", st->path, strerror(-rc));
+		return rc;
+	}
+	if (!data)
+		return 0;
+
+	hdr = (const struct store_hdr *) data;
+	sm = (const struct store_map *) (data + sizeof(*hdr));
+	if (len < sizeof(*hdr) || hdr->magic != STORE_MAGIC || hdr->version != STORE_VERSION ||
+	    len != sizeof(*hdr) + (size_t) hdr->num_maps * sizeof(*sm) ||
+	    hdr->csum != store_csum(STORE_CSUM_INIT, sm, (size_t) hdr->num_maps * sizeof(*sm))) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Slotmap snapshot %s is corrupt; refusing to start\n", st->path);
+		munmap((void *) data, len);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < hdr->num_maps; i++)
+		_store_apply(st->maps, STORE_REC_ADD, &sm[i]);
+
+	munmap((void *) data, len);
+	return 0;
+}
+
+/* caller must hold slotmaps->rwlock for writing. Returns the length of the valid part */
+static ssize_t _store_load_journal(struct slotmap_store *st)
+{
+	const struct store_rec *rec;
+	const uint8_t *data;
+	size_t len, off;
+	int rc;
+
+	rc = store_mmap(st->journal_path, &data, &len);
+	if (rc < 0) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Cannot read slotmap journal %s: %s\n", st->journal_path,
+		     strerror(-rc));
+		return rc;
+	}
+	if (!data)
+		return 0;
+
+	for (off = 0; off + sizeof(*rec) <= len; off += sizeof(*rec)) {
+		rec = (const struct store_rec *) (data + off);
+		if (rec->csum != store_csum(STORE_CSUM_INIT, rec, offsetof(struct store_rec, csum)))
+			break;
+		if (rec->type != STORE_REC_ADD && rec->type != STORE_REC_DEL)
+			break;
+		_store_apply(st->maps, rec->type, &rec->map);
+		st->num_recs++;
+	}
+	if (off != len) {
+		/* only the tail can be torn; anything past it was never acknowledged */
+		LOGP(DSLOTMAP, LOGL_NOTICE, "Discarding %zu bytes of incomplete slotmap journal %s\n",
+		     len - off, st->journal_path);
+	}
+
+	munmap((void *) data, len);
+	return off;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *cur = data;
+	ssize_t rc;
+
+	while (len) {
+		rc = write(fd, cur, len);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		cur += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/* make the rename of the snapshot durable */
+static void store_sync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int fd;
+
+	OSMO_STRLCPY_ARRAY(dir, path);
+	slash = strrchr(dir, '/');
+	if (slash == dir)
+		slash[1] = '\0';
+	else if (slash)
+		*slash = '\0';
+	else
+		OSMO_STRLCPY_ARRAY(dir, ".");
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+/* replace the journal by one with only the records past 'off', which were written while the
+ * new snapshot was written.  Caller must hold st->mutex */
+static int _store_switch_journal(struct slotmap_store *st, off_t off)
+{
+	struct stat sb;
+	uint8_t *tail;
+	size_t len;
+	ssize_t rc;
+	int fd;
+
+	if (fstat(st->journal_fd, &sb) < 0)
+		return -errno;
+	/* the common case: nothing changed in the meantime */
+	if (sb.st_size <= off) {
+		if (ftruncate(st->journal_fd, 0) < 0)
+			return -errno;
+		st->num_recs = 0;
+		return 0;
+	}
+
+	len = sb.st_size - off;
+	tail = malloc(len);
+	if (!tail)
+		return -ENOMEM;
+	rc = pread(st->journal_fd, tail, len, off);
+	if (rc != (ssize_t) len) {
+		rc = rc < 0 ? -errno : -EIO;
+		goto out_free;
+	}
+
+	/* the snapshot was renamed already, so we can re-use its temporary file */
+	fd = open(st->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		rc = -errno;
+		goto out_free;
+	}
+	rc = write_all(fd, tail, len);
+	if (rc == 0 && fdatasync(fd) < 0)
+		rc = -errno;
+	if (rc == 0 && rename(st->tmp_path, st->journal_path) < 0)
+		rc = -errno;
+	if (rc < 0) {
+		close(fd);
+		goto out_free;
+	}
+	store_sync_dir(st->journal_path);
+
+	close(st->journal_fd);
+	st->journal_fd = fd;
+	st->num_recs = len / sizeof(struct store_rec);
+
+out_free:
+	free(tail);
+	return rc;
+}
+
+/* write a new snapshot of the current table and truncate the journal.  Caller must hold
+ * st->sync_mutex */
+static int store_compact(struct slotmap_store *st)
+{
+	struct store_map *buf = NULL;
+	struct slot_mapping *map;
+	struct store_hdr hdr;
+	struct timespec start;
+	struct stat sb;
+	unsigned int num = 0;
+	off_t off = 0;
+	int fd, rc = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* only copy the table under the locks; the disk is written without them, so neither the
+	 * slotmap writers nor the journal have to wait for it */
+	slotmaps_rdlock(st->maps);
+	pthread_mutex_lock(&st->mutex);
+	/* talloc is not thread-safe, and we may be called from any REST thread */
+	buf = malloc((llist_count(&st->maps->mappings) + 1) * sizeof(*buf));
+	if (buf) {
+		llist_for_each_entry(map, &st->maps->mappings, list)
+			map2store(&buf[num++], map);
+		if (fstat(st->journal_fd, &sb) < 0)
+			rc = -errno;
+		else
+			off = sb.st_size;
+		st->num_maps = num;
+		/* a record failing to be journalled from now on must trigger another snapshot */
+		st->failed = false;
+	} else
+		rc = -ENOMEM;
+	pthread_mutex_unlock(&st->mutex);
+	slotmaps_unlock(st->maps);
+	if (rc < 0)
+		goto out;
+
+	hdr.magic = STORE_MAGIC;
+	hdr.version = STORE_VERSION;
+	hdr.num_maps = num;
+	hdr.csum = store_csum(STORE_CSUM_INIT, buf, num * sizeof(*buf));
+
+	fd = open(st->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		rc = -errno;
+		goto out;
+	}
+	rc = write_all(fd, &hdr, sizeof(hdr));
+	if (rc == 0)
+		rc = write_all(fd, buf, num * sizeof(*buf));
+	if (rc == 0 && fsync(fd) < 0)
+		rc = -errno;
+	close(fd);
+	if (rc < 0)
+		goto out;
+
+	if (rename(st->tmp_path, st->path) < 0) {
+		rc = -errno;
+		goto out;
+	}
+	store_sync_dir(st->path);
+
+	/* if we crash before the journal is switched, it is simply replayed on top of the new
+	 * snapshot, which is harmless */
+	pthread_mutex_lock(&st->mutex);
+	rc = _store_switch_journal(st, off);
+	/* the records past the snapshot were synced along with the new journal */
+	if (rc == 0)
+		st->synced_seq = st->written_seq;
+	pthread_mutex_unlock(&st->mutex);
+
+out:
+	free(buf);
+
+	if (rc < 0) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Cannot write slotmap snapshot %s: %s\n", st->path, strerror(-rc));
+		/* retry on the next sync */
+		pthread_mutex_lock(&st->mutex);
+		st->failed = true;
+		pthread_mutex_unlock(&st->mutex);
+	} else
+		LOGP(DSLOTMAP, LOGL_INFO, "Wrote slotmap snapshot of %u maps in %" PRId64 " ms\n",
+		     num, elapsed_ms(&start));
+	return rc;
+}
+
+static void _store_append(struct slotmap_store *st, enum store_rec_type type, const struct slot_mapping *map)
+{
+	struct store_rec rec;
+	int rc;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	map2store(&rec.map, map);
+	rec.csum = store_csum(STORE_CSUM_INIT, &rec, offsetof(struct store_rec, csum));
+
+	pthread_mutex_lock(&st->mutex);
+	rc = write_all(st->journal_fd, &rec, sizeof(rec));
+	if (rc < 0) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Cannot write slotmap journal %s: %s\n", st->journal_path,
+		     strerror(-rc));
+		st->failed = true;
+	} else
+		st->num_recs++;
+	if (type == STORE_REC_ADD)
+		st->num_maps++;
+	else if (st->num_maps)
+		st->num_maps--;
+	st->written_seq++;
+	pthread_mutex_unlock(&st->mutex);
+}
+
+/* record the addition of a map; caller must hold slotmaps->rwlock for writing */
+void _slotmap_store_add(struct slotmap_store *st, const struct slot_mapping *map)
+{
+	if (st)
+		_store_append(st, STORE_REC_ADD, map);
+}
+
+/* record the removal of a map; caller must hold slotmaps->rwlock for writing */
+void _slotmap_store_del(struct slotmap_store *st, const struct slot_mapping *map)
+{
+	if (st)
+		_store_append(st, STORE_REC_DEL, map);
+}
+
+/* make all changes recorded so far durable, compacting the journal if required.
+ * Must be called without holding slotmaps->rwlock */
+int slotmap_store_sync(struct slotmap_store *st)
+{
+	uint64_t seq;
+	bool compact, synced;
+	int rc = 0;
+
+	if (!st)
+		return 0;
+
+	pthread_mutex_lock(&st->sync_mutex);
+	pthread_mutex_lock(&st->mutex);
+	seq = st->written_seq;
+	synced = st->synced_seq >= seq;
+	compact = st->failed ||
+		  (st->num_recs > STORE_COMPACT_MIN_RECS && st->num_recs > st->num_maps);
+	pthread_mutex_unlock(&st->mutex);
+
+	/* a new snapshot makes everything durable, including what failed to be journalled */
+	if (compact) {
+		rc = store_compact(st);
+		goto out_unlock;
+	}
+	if (synced)
+		goto out_unlock;
+
+	/* not under the mutex, so journal writers don't have to wait for the disk */
+	if (fdatasync(st->journal_fd) < 0) {
+		rc = -errno;
+		LOGP(DSLOTMAP, LOGL_ERROR, "Cannot sync slotmap journal %s: %s\n", st->journal_path,
+		     strerror(-rc));
+		goto out_unlock;
+	}
+
+	pthread_mutex_lock(&st->mutex);
+	if (st->synced_seq < seq)
+		st->synced_seq = seq;
+	pthread_mutex_unlock(&st->mutex);
+
+out_unlock:
+	pthread_mutex_unlock(&st->sync_mutex);
+	return rc;
+}
+
+/*! Open the persistent slotmap storage and restore all maps from it.
+ *  \param[in] ctx talloc context from which to allocate
+ *  \param[in] maps (empty) slotmap table to restore into
+ *  \param[in] path file name of the snapshot; the journal is stored next to it
+ *  \returns the store on success; NULL on error */
+struct slotmap_store *slotmap_store_open(void *ctx, struct slotmaps *maps, const char *path)
+{
+	struct slotmap_store *st;
+	struct timespec start;
+	ssize_t journal_len;
+	int rc;
+
+	st = talloc_zero(ctx, struct slotmap_store);
+	if (!st)
+		return NULL;
+	st->maps = maps;
+	st->journal_fd = -1;
+	st->path = talloc_strdup(st, path);
+	st->journal_path = talloc_asprintf(st, "%s.journal", path);
+	st->tmp_path = talloc_asprintf(st, "%s.tmp", path);
+	pthread_mutex_init(&st->sync_mutex, NULL);
+	pthread_mutex_init(&st->mutex, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	slotmaps_wrlock(maps);
+	rc = _store_load_snapshot(st);
+	journal_len = rc < 0 ? rc : _store_load_journal(st);
+	st->num_maps = llist_count(&maps->mappings);
+	slotmaps_unlock(maps);
+	if (journal_len < 0)
+		goto out_free;
+
+	st->journal_fd = open(st->journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (st->journal_fd < 0) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Cannot open slotmap journal %s: %s\n", st->journal_path,
+		     strerror(errno));
+		goto out_free;
+	}
+	/* drop any incomplete record at the end */
+	if (ftruncate(st->journal_fd, journal_len) < 0) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Cannot truncate slotmap journal %s: %s\n", st->journal_path,
+		     strerror(errno));
+		goto out_close;
+	}
+
+	LOGP(DSLOTMAP, LOGL_NOTICE, "Restored %u slotmaps from %s (%u journal records) in %" PRId64 " ms\n",
+	     st->num_maps, st->path, st->num_recs, elapsed_ms(&start));
+
+	slotmap_store_sync(st);
+
+	return st;
+
+out_close:
+	close(st->journal_fd);
+out_free:
+	pthread_mutex_destroy(&st->mutex);
+	pthread_mutex_destroy(&st->sync_mutex);
+	talloc_free(st);
+	return NULL;
+}
+
+void slotmap_store_close(struct slotmap_store *st)
+{
+	if (!st)
+		return;
+	slotmap_store_sync(st);
+	close(st->journal_fd);
+	pthread_mutex_destroy(&st->mutex);
+	pthread_mutex_destroy(&st->sync_mutex);
+	talloc_free(st);
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+#include "slotmap.h"
+
+/* optional persistent storage of the slotmap table: a compacted snapshot plus an
+ * append-only journal of the changes made since */
+struct slotmap_store;
+
+struct slotmap_store *slotmap_store_open(void *ctx, struct slotmaps *maps, const char *path);
+void slotmap_store_close(struct slotmap_store *st);
+
+/* record a change; caller must hold slotmaps->rwlock for writing. st may be NULL */
+void _slotmap_store_add(struct slotmap_store *st, const struct slot_mapping *map);
+void _slotmap_store_del(struct slotmap_store *st, const struct slot_mapping *map);
+
+/* make all recorded changes durable and compact the journal if it has grown too
+ * large; must be called without holding slotmaps->rwlock. st may be NULL */
+int slotmap_store_sync(struct slotmap_store *st);
@@ -0,0 +1,145 @@
+/* Log of recent changes to the remsim-server state (slotmaps, bankd and client
+ * connections), each with a monotonically increasing revision.  It is the basis
+ * for delta queries, long-polling and Server-Sent Events in the REST interface.
+ *
+ * Changes are recorded by any thread into a fixed-size ring buffer; readers
+ * wanting changes older than what the ring still holds have to re-read the
+ * full state instead.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <osmocom/core/utils.h>
+
+#include "rspro_util.h"
+#include "slotmap.h"
+#include "state_log.h"
+
+static pthread_mutex_t g_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_log_cond = PTHREAD_COND_INITIALIZER;
+static struct state_log_entry g_log[STATE_LOG_SIZE];
+/* first revision of this process, and the most recent one */
+static uint64_t g_first_rev = 1;
+static uint64_t g_rev;
+
+/* Revisions are derived from the start time (in units of 2^-20 seconds), so they keep
+ * increasing across restarts unless more than a million changes per second of uptime
+ * happen.  This way, watchers can't confuse revisions of a previous server process with
+ * ours.  The values stay below 2^53, so they are exact in JavaScript too. */
+void state_log_init(void)
+{
+	pthread_mutex_lock(&g_log_mutex);
+	g_rev = (uint64_t) time(NULL) << 20;
+	g_first_rev = g_rev + 1;
+	pthread_mutex_unlock(&g_log_mutex);
+}
+
+uint64_t state_log_rev(void)
+{
+	uint64_t rev;
+
+	pthread_mutex_lock(&g_log_mutex);
+	rev = g_rev;
+	pthread_mutex_unlock(&g_log_mutex);
+
+	return rev;
+}
+
+static void state_log_append(const struct state_log_entry *entry)
+{
+	struct state_log_entry *e;
+
+	pthread_mutex_lock(&g_log_mutex);
+	e = &g_log[++g_rev & (STATE_LOG_SIZE - 1)];
+	*e = *entry;
+	e->rev = g_rev;
+	pthread_cond_broadcast(&g_log_cond);
+	pthread_mutex_unlock(&g_log_mutex);
+}
+
+void state_log_slotmap(const struct slot_mapping *map, bool removed)
+{
+	struct state_log_entry e = {
+		.type = STATE_LOG_SLOTMAP,
+		.removed = removed,
+		.u.slotmap = {
+			.bank = map->bank,
+			.client = map->client,
+			.state = map->state,
+		},
+	};
+	state_log_append(&e);
+}
+
+void state_log_bank(uint16_t bank_id, uint16_t num_slots, const struct rspro_endpoint *endpoint,
+		    bool removed)
+{
+	struct state_log_entry e = {
+		.type = STATE_LOG_BANK,
+		.removed = removed,
+		.u.bank = {
+			.bank_id = bank_id,
+			.num_slots = num_slots,
+			.endpoint = *endpoint,
+		},
+	};
+	state_log_append(&e);
+}
+
+void state_log_client(const struct client_slot *slot, bool removed)
+{
+	struct state_log_entry e = {
+		.type = STATE_LOG_CLIENT,
+		.removed = removed,
+		.u.client = *slot,
+	};
+	state_log_append(&e);
+}
+
+/*! Retrieve the changes after a given revision, optionally waiting for them.
+ *  \param[in] since revision the caller has already seen
+ *  \param[out] out caller-allocated array receiving the changes, oldest first
+ *  \param[in] max number of elements in out
+ *  \param[in] timeout_ms time to wait for changes if there are none yet; 0 for no waiting
+ *  \param[out] rev revision of the last returned change; the current revision if none
+ *  \returns number of changes; -ESTALE if changes after 'since' are no longer available,
+ *  	     in which case the caller has to re-read the full state as of *rev */
+int state_log_get(uint64_t since, struct state_log_entry *out, unsigned int max, int timeout_ms,
+		  uint64_t *rev)
+{
+	struct timespec deadline;
+	uint64_t oldest, r;
+	unsigned int num = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&g_log_mutex);
+	while (timeout_ms > 0 && g_rev == since) {
+		if (pthread_cond_timedwait(&g_log_cond, &g_log_mutex, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	oldest = g_rev >= g_first_rev + STATE_LOG_SIZE ? g_rev - STATE_LOG_SIZE + 1 : g_first_rev;
+	if (since > g_rev || since + 1 < oldest) {
+		*rev = g_rev;
+		pthread_mutex_unlock(&g_log_mutex);
+		return -ESTALE;
+	}
+
+	for (r = since + 1; r <= g_rev && num < max; r++)
+		out[num++] = g_log[r & (STATE_LOG_SIZE - 1)];
+	*rev = num ? out[num - 1].rev : g_rev;
+	pthread_mutex_unlock(&g_log_mutex);
+
+	return num;
+}
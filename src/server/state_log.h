@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rspro_util.h"
+#include "slotmap.h"
+
+/* number of most recent changes kept for delta queries / watchers; power of two */
+#define STATE_LOG_SIZE	8192
+
+enum state_log_type {
+	STATE_LOG_SLOTMAP,
+	STATE_LOG_BANK,
+	STATE_LOG_CLIENT,
+};
+
+/* a single change of server state, as reported to REST watchers */
+struct state_log_entry {
+	/* revision of the server state after this change */
+	uint64_t rev;
+	enum state_log_type type;
+	/* the object is gone (slotmap deleted, bankd or client disconnected) */
+	bool removed;
+	union {
+		struct {
+			struct bank_slot bank;
+			struct client_slot client;
+			enum slot_mapping_state state;
+		} slotmap;
+		struct {
+			uint16_t bank_id;
+			uint16_t num_slots;
+			/* where clients reach the bankd */
+			struct rspro_endpoint endpoint;
+		} bank;
+		struct client_slot client;
+	} u;
+};
+
+void state_log_init(void);
+uint64_t state_log_rev(void);
+
+/* record a change; callers must hold the lock protecting the respective object for writing,
+ * so the revision is consistent with what readers holding that lock see */
+void state_log_slotmap(const struct slot_mapping *map, bool removed);
+void state_log_bank(uint16_t bank_id, uint16_t num_slots, const struct rspro_endpoint *endpoint,
+		    bool removed);
+void state_log_client(const struct client_slot *slot, bool removed);
+
+int state_log_get(uint64_t since, struct state_log_entry *out, unsigned int max, int timeout_ms,
+		  uint64_t *rev);
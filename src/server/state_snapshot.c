@@ -0,0 +1,387 @@
+/* Immutable, versioned snapshots of the remsim-server state for the REST interface
+ *
+ * The main thread publishes a new snapshot after each batch of changes to slotmaps, bankd
+ * and client connections.  REST threads read the most recent one without taking any lock,
+ * so a slow REST client can never delay the RSPRO signalling in the main thread.
+ *
+ * Slotmaps are grouped into one chunk per bank_id.  A new snapshot is derived from the
+ * previous one plus the changes recorded in the state log since, re-using the chunks of
+ * all banks without changes.  Only if the state log doesn't reach back far enough, the
+ * whole slotmap table is copied.  The connections are shared likewise, and only copied
+ * again once rspro_server->conns_rev tells us that any of them changed; a busy slotmap
+ * table thus doesn't make each publish O(connections).
+ *
+ * Readers announce themselves in g_acquiring while loading the pointer and taking their
+ * reference.  Replaced snapshots are retired, and freed by the main thread once it has
+ * seen g_acquiring at zero after the replacement (so no reader can still pick them up)
+ * and their reference count has dropped to zero.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/fsm.h>
+
+#include "debug.h"
+#include "slotmap.h"
+#include "rspro_server.h"
+#include "state_log.h"
+#include "state_snapshot.h"
+
+osmo_static_assert(SNAP_NUM_CHUNKS >= RSPRO_NUM_BANK_IDS, snap_chunk_per_bank_id);
+
+static struct state_snapshot *_Atomic g_snap;
+/* number of readers between loading g_snap and taking their reference */
+static atomic_uint g_acquiring;
+
+/* main thread only */
+static LLIST_HEAD(g_retired);
+static struct state_log_entry g_log_buf[STATE_LOG_SIZE];
+
+static struct snap_chunk *chunk_alloc(unsigned int num)
+{
+	struct snap_chunk *chunk = calloc(1, sizeof(*chunk) + num * sizeof(chunk->maps[0]));
+	if (chunk)
+		chunk->refcnt = 1;
+	return chunk;
+}
+
+static void chunk_put(struct snap_chunk *chunk)
+{
+	if (chunk && --chunk->refcnt == 0)
+		free(chunk);
+}
+
+static void conns_put(struct snap_conns *conns)
+{
+	if (conns && --conns->refcnt == 0)
+		free(conns);
+}
+
+static void snapshot_free(struct state_snapshot *snap)
+{
+	int i;
+
+	for (i = 0; i < SNAP_NUM_CHUNKS; i++)
+		chunk_put(snap->slotmaps[i]);
+	conns_put(snap->bank_conns);
+	conns_put(snap->client_conns);
+	free(snap);
+}
+
+static int snap_key_cmp(const void *a, const void *b)
+{
+	uint32_t ka = *(const uint32_t *) a, kb = *(const uint32_t *) b;
+	return ka < kb ? -1 : ka > kb;
+}
+
+unsigned int snap_lower_bound(const void *rows, unsigned int num, size_t row_size, uint32_t key)
+{
+	const uint8_t *base = rows;
+	unsigned int lo = 0, hi = num, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (*(const uint32_t *) (base + mid * row_size) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* copy all connections of a list; caller must hold srv->rwlock */
+static struct snap_conns *_copy_conns(struct llist_head *list, bool bank)
+{
+	struct rspro_client_conn *conn;
+	struct snap_conns *conns;
+	struct snap_conn *c;
+	unsigned int num = llist_count(list);
+
+	conns = calloc(1, sizeof(*conns) + num * sizeof(conns->conns[0]));
+	if (!conns)
+		return NULL;
+	conns->refcnt = 1;
+	conns->num = num;
+
+	c = conns->conns;
+	llist_for_each_entry(conn, list, list) {
+		if (conn->fi) {
+			if (conn->fi->id)
+				OSMO_STRLCPY_ARRAY(c->peer, conn->fi->id);
+			c->state = osmo_fsm_inst_state_name(conn->fi);
+		}
+		c->comp_id = conn->comp_id;
+		c->client = conn->client.slot;
+		c->bank_id = conn->bank.bank_id;
+		c->num_slots = conn->bank.num_slots;
+		if (bank) {
+			c->key = conn->bank.bank_id;
+			c->endpoint = conn->bank.endpoint;
+		} else
+			c->key = (conn->client.slot.client_id << 16) | conn->client.slot.slot_nr;
+		c++;
+	}
+	qsort(conns->conns, num, sizeof(conns->conns[0]), snap_key_cmp);
+
+	return conns;
+}
+
+/* copy the entire slotmap table; caller must hold slotmaps->rwlock */
+static int _copy_slotmaps(struct state_snapshot *snap, struct slotmaps *maps)
+{
+	unsigned int count[SNAP_NUM_CHUNKS] = { 0 };
+	struct slot_mapping *map;
+	struct snap_chunk *chunk;
+	struct snap_slotmap *row;
+	int i;
+
+	llist_for_each_entry(map, &maps->mappings, list) {
+		if (map->bank.bank_id < SNAP_NUM_CHUNKS)
+			count[map->bank.bank_id]++;
+	}
+	for (i = 0; i < SNAP_NUM_CHUNKS; i++) {
+		if (!count[i])
+			continue;
+		snap->slotmaps[i] = chunk_alloc(count[i]);
+		if (!snap->slotmaps[i])
+			return -ENOMEM;
+	}
+
+	llist_for_each_entry(map, &maps->mappings, list) {
+		if (map->bank.bank_id >= SNAP_NUM_CHUNKS)
+			continue;
+		chunk = snap->slotmaps[map->bank.bank_id];
+		row = &chunk->maps[chunk->num++];
+		row->key = slotmap_get_id(map);
+		row->bank = map->bank;
+		row->client = map->client;
+		row->state = map->state;
+	}
+
+	for (i = 0; i < SNAP_NUM_CHUNKS; i++) {
+		chunk = snap->slotmaps[i];
+		if (!chunk)
+			continue;
+		qsort(chunk->maps, chunk->num, sizeof(chunk->maps[0]), snap_key_cmp);
+		snap->num_slotmaps += chunk->num;
+	}
+	return 0;
+}
+
+static uint32_t log_slotmap_key(const struct state_log_entry *e)
+{
+	return (e->u.slotmap.bank.bank_id << 16) | e->u.slotmap.bank.slot_nr;
+}
+
+/* order by key, and the most recent change of each key first */
+static int log_slotmap_cmp(const void *a, const void *b)
+{
+	const struct state_log_entry *ea = *(const struct state_log_entry **) a;
+	const struct state_log_entry *eb = *(const struct state_log_entry **) b;
+	uint32_t ka = log_slotmap_key(ea), kb = log_slotmap_key(eb);
+
+	if (ka != kb)
+		return ka < kb ? -1 : 1;
+	return ea->rev > eb->rev ? -1 : ea->rev < eb->rev;
+}
+
+/* merge the (sorted, de-duplicated) changes of one bank into a copy of its previous chunk */
+static struct snap_chunk *chunk_merge(const struct snap_chunk *old, struct state_log_entry **changes,
+				      unsigned int num_changes)
+{
+	unsigned int old_num = old ? old->num : 0, i = 0, j = 0;
+	struct snap_chunk *chunk;
+	struct snap_slotmap *row;
+
+	chunk = chunk_alloc(old_num + num_changes);
+	if (!chunk)
+		return NULL;
+
+	while (i < old_num || j < num_changes) {
+		if (j == num_changes || (i < old_num && old->maps[i].key < log_slotmap_key(changes[j]))) {
+			chunk->maps[chunk->num++] = old->maps[i++];
+			continue;
+		}
+		/* the change replaces (or removes) any previous version of the map */
+		if (i < old_num && old->maps[i].key == log_slotmap_key(changes[j]))
+			i++;
+		if (!changes[j]->removed) {
+			row = &chunk->maps[chunk->num++];
+			row->key = log_slotmap_key(changes[j]);
+			row->bank = changes[j]->u.slotmap.bank;
+			row->client = changes[j]->u.slotmap.client;
+			row->state = changes[j]->u.slotmap.state;
+		}
+		j++;
+	}
+	return chunk;
+}
+
+/* derive the slotmaps of snap from those of prev plus the changes in log */
+static int apply_slotmap_changes(struct state_snapshot *snap, const struct state_snapshot *prev,
+				 struct state_log_entry *log, unsigned int num_log)
+{
+	struct state_log_entry **changes;
+	unsigned int num = 0, i, start;
+	struct snap_chunk *chunk;
+	uint16_t bank_id;
+
+	changes = calloc(num_log ? num_log : 1, sizeof(*changes));
+	if (!changes)
+		return -ENOMEM;
+
+	for (i = 0; i < num_log; i++) {
+		if (log[i].type == STATE_LOG_SLOTMAP && log[i].u.slotmap.bank.bank_id < SNAP_NUM_CHUNKS)
+			changes[num++] = &log[i];
+	}
+	qsort(changes, num, sizeof(*changes), log_slotmap_cmp);
+	/* only the first (most recent) change of each map counts */
+	for (i = 0, start = 0; i < num; i++) {
+		if (start > 0 && log_slotmap_key(changes[i]) == log_slotmap_key(changes[start - 1]))
+			continue;
+		changes[start++] = changes[i];
+	}
+	num = start;
+
+	for (i = 0; i < SNAP_NUM_CHUNKS; i++) {
+		snap->slotmaps[i] = prev->slotmaps[i];
+		if (snap->slotmaps[i])
+			snap->slotmaps[i]->refcnt++;
+	}
+
+	/* copy-on-write of the chunks of all banks with changes */
+	for (start = 0; start < num; start = i) {
+		bank_id = changes[start]->u.slotmap.bank.bank_id;
+		for (i = start; i < num && changes[i]->u.slotmap.bank.bank_id == bank_id; i++)
+			;
+		chunk = chunk_merge(prev->slotmaps[bank_id], &changes[start], i - start);
+		if (!chunk) {
+			free(changes);
+			return -ENOMEM;
+		}
+		chunk_put(snap->slotmaps[bank_id]);
+		if (chunk->num == 0) {
+			chunk_put(chunk);
+			chunk = NULL;
+		}
+		snap->slotmaps[bank_id] = chunk;
+	}
+	free(changes);
+
+	for (i = 0; i < SNAP_NUM_CHUNKS; i++) {
+		if (snap->slotmaps[i])
+			snap->num_slotmaps += snap->slotmaps[i]->num;
+	}
+	return 0;
+}
+
+/* free all retired snapshots which no reader can pick up or still uses */
+static void reclaim_retired(void)
+{
+	struct state_snapshot *snap, *snap2;
+	bool quiet;
+
+	if (llist_empty(&g_retired))
+		return;
+
+	/* nobody is between loading g_snap and taking a reference: none of the retired
+	 * snapshots (replaced before this point) can gain new references anymore */
+	quiet = atomic_load(&g_acquiring) == 0;
+	llist_for_each_entry_safe(snap, snap2, &g_retired, list) {
+		if (quiet)
+			snap->quiesced = true;
+		if (snap->quiesced && atomic_load(&snap->refcnt) == 0) {
+			llist_del(&snap->list);
+			snapshot_free(snap);
+		}
+	}
+}
+
+void state_snapshot_publish(struct rspro_server *srv)
+{
+	struct state_snapshot *prev = atomic_load(&g_snap), *snap;
+	uint64_t rev = 0;
+	int num = -ESTALE, rc;
+
+	reclaim_retired();
+
+	if (prev && prev->rev == state_log_rev() && prev->conns_rev == atomic_load(&srv->conns_rev))
+		return;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		goto out_err;
+	INIT_LLIST_HEAD(&snap->list);
+
+	slotmaps_rdlock(srv->slotmaps);
+	pthread_rwlock_rdlock(&srv->rwlock);
+	/* slotmaps and connections are changed (and their changes logged) by the main and I/O
+	 * threads only while holding the respective lock for writing, so the state log can't move
+	 * on while we're copying */
+	snap->rev = state_log_rev();
+	if (prev)
+		num = state_log_get(prev->rev, g_log_buf, ARRAY_SIZE(g_log_buf), 0, &rev);
+	if (num >= 0 && rev == snap->rev)
+		rc = apply_slotmap_changes(snap, prev, g_log_buf, num);
+	else
+		rc = _copy_slotmaps(snap, srv->slotmaps);
+	/* the revision may also be bumped without srv->rwlock after a connection's state change;
+	 * then we copy once more next time */
+	snap->conns_rev = atomic_load(&srv->conns_rev);
+	if (prev && prev->conns_rev == snap->conns_rev) {
+		snap->bank_conns = prev->bank_conns;
+		snap->bank_conns->refcnt++;
+		snap->client_conns = prev->client_conns;
+		snap->client_conns->refcnt++;
+	} else {
+		snap->bank_conns = _copy_conns(&srv->banks, true);
+		snap->client_conns = _copy_conns(&srv->clients, false);
+	}
+	pthread_rwlock_unlock(&srv->rwlock);
+	slotmaps_unlock(srv->slotmaps);
+
+	if (rc < 0 || !snap->bank_conns || !snap->client_conns) {
+		snapshot_free(snap);
+		goto out_err;
+	}
+	snap->banks = snap->bank_conns->conns;
+	snap->num_banks = snap->bank_conns->num;
+	snap->clients = snap->client_conns->conns;
+	snap->num_clients = snap->client_conns->num;
+
+	atomic_store(&g_snap, snap);
+	if (prev)
+		llist_add_tail(&prev->list, &g_retired);
+	reclaim_retired();
+	return;
+
+out_err:
+	LOGP(DMAIN, LOGL_ERROR, "Cannot publish state snapshot; REST API reports stale state\n");
+}
+
+struct state_snapshot *state_snapshot_get(void)
+{
+	struct state_snapshot *snap;
+
+	atomic_fetch_add(&g_acquiring, 1);
+	snap = atomic_load(&g_snap);
+	if (snap)
+		atomic_fetch_add(&snap->refcnt, 1);
+	atomic_fetch_sub(&g_acquiring, 1);
+
+	return snap;
+}
+
+void state_snapshot_put(struct state_snapshot *snap)
+{
+	/* the main thread frees it once it's retired and unused */
+	if (snap)
+		atomic_fetch_sub(&snap->refcnt, 1);
+}
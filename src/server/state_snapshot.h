@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <osmocom/core/linuxlist.h>
+
+#include "rspro_util.h"
+#include "slotmap.h"
+
+struct rspro_server;
+
+/* slotmaps are grouped by bank_id; maps of larger bank_ids than RSPRO_NUM_BANK_IDS are
+ * refused by the REST interface, the slotmap store and replication alike */
+#define SNAP_NUM_CHUNKS	1024
+
+/* a client or bankd connection, as reported by the REST interface */
+struct snap_conn {
+	/* sort key: bankId for banks, clientId << 16 | slotNr for clients */
+	uint32_t key;
+	char peer[32];
+	const char *state;
+	struct app_comp_id comp_id;
+	struct client_slot client;
+	uint16_t bank_id;
+	uint16_t num_slots;
+	/* banks only: where clients reach the bankd */
+	struct rspro_endpoint endpoint;
+};
+
+/* the client or bankd connections, sorted by key.  Shared between all snapshots in which
+ * they didn't change; the reference count is only ever touched by the main thread */
+struct snap_conns {
+	unsigned int refcnt;
+	unsigned int num;
+	struct snap_conn conns[];
+};
+
+/* a slot mapping, as reported by the REST interface */
+struct snap_slotmap {
+	/* sort key: the slotmap id */
+	uint32_t key;
+	struct bank_slot bank;
+	struct client_slot client;
+	enum slot_mapping_state state;
+};
+
+/* the slotmaps of one bank_id, sorted by key.  Shared between all snapshots in which they
+ * didn't change; the reference count is only ever touched by the main thread */
+struct snap_chunk {
+	unsigned int refcnt;
+	unsigned int num;
+	struct snap_slotmap maps[];
+};
+
+/* Immutable copy of the server state as of a given revision of the state log.  Published by
+ * the main thread whenever the state changed; any thread may read it without locking */
+struct state_snapshot {
+	/* references held by readers, see state_snapshot_get() */
+	atomic_uint refcnt;
+	/* revision of the state log this snapshot represents */
+	uint64_t rev;
+	/* rspro_server->conns_rev the connections were copied at */
+	uint64_t conns_rev;
+
+	/* sorted by key; point into bank_conns / client_conns */
+	struct snap_conn *banks;
+	unsigned int num_banks;
+	struct snap_conn *clients;
+	unsigned int num_clients;
+	struct snap_conns *bank_conns;
+	struct snap_conns *client_conns;
+
+	/* indexed by bank_id; NULL if there are no maps for that bank */
+	struct snap_chunk *slotmaps[SNAP_NUM_CHUNKS];
+	unsigned int num_slotmaps;
+
+	/* main thread only: list of retired snapshots waiting to be freed */
+	struct llist_head list;
+	bool quiesced;
+};
+
+/* main thread only: publish a new snapshot if the state changed since the last one */
+void state_snapshot_publish(struct rspro_server *srv);
+
+/* any thread: obtain a reference to the most recent snapshot, and release it again */
+struct state_snapshot *state_snapshot_get(void);
+void state_snapshot_put(struct state_snapshot *snap);
+
+/* index of the first element of a sorted array of snap_conn/snap_slotmap with a key >= key */
+unsigned int snap_lower_bound(const void *rows, unsigned int num, size_t row_size, uint32_t key);
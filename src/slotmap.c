@@ -21,12 +21,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdatomic.h>
 
 #include <pthread.h>
 
 #include <talloc.h>
 
 #include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hash.h>
 #include <osmocom/core/utils.h>
 
 #include "slotmap.h"
@@ -53,20 +55,153 @@ uint32_t slotmap_get_id(const struct slot_mapping *map)
 	return (map->bank.bank_id << 16) | map->bank.slot_nr;
 }
 
+uint32_t slotmap_digest(const struct slot_mapping *map)
+{
+	/* FNV-1a over both slots; summing these up makes the digest of a set of maps
+	 * independent of their order */
+	const uint16_t v[4] = { map->bank.bank_id, map->bank.slot_nr, map->client.client_id,
+				map->client.slot_nr };
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(v); i++) {
+		hash ^= v[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static inline uint32_t bank_slot_key(const struct bank_slot *bank)
+{
+	return (bank->bank_id << 16) | bank->slot_nr;
+}
+
+static inline uint32_t client_slot_key(const struct client_slot *client)
+{
+	return (client->client_id << 16) | client->slot_nr;
+}
+
+/***********************************************************************
+ * open-addressing indexes
+ *
+ * Linear probing over a power-of-two sized table, grown when it becomes half full and
+ * shrunk when it drops below 1/8.  Deletion shifts the following entries of the cluster
+ * back, so there are no tombstones and lookups of absent keys stop at the first free
+ * entry.  The keys are unique within an index.
+ ***********************************************************************/
+
+static struct slot_mapping *index_lookup(const struct slotmap_index *idx, uint32_t key)
+{
+	uint32_t mask = (1U << idx->bits) - 1;
+	uint32_t i = hash_32(key, idx->bits);
+
+	while (idx->entries[i].map) {
+		if (idx->entries[i].key == key)
+			return idx->entries[i].map;
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static void _index_insert(struct slotmap_index_entry *entries, unsigned int bits, uint32_t key,
+			  struct slot_mapping *map)
+{
+	uint32_t mask = (1U << bits) - 1;
+	uint32_t i = hash_32(key, bits);
+
+	while (entries[i].map)
+		i = (i + 1) & mask;
+	entries[i].key = key;
+	entries[i].map = map;
+}
+
+static int index_resize(void *ctx, struct slotmap_index *idx, unsigned int bits)
+{
+	struct slotmap_index_entry *entries;
+	uint32_t i;
+
+	entries = talloc_zero_array(ctx, struct slotmap_index_entry, 1U << bits);
+	if (!entries)
+		return -ENOMEM;
+
+	if (idx->entries) {
+		for (i = 0; i < (1U << idx->bits); i++) {
+			if (idx->entries[i].map)
+				_index_insert(entries, bits, idx->entries[i].key, idx->entries[i].map);
+		}
+		talloc_free(idx->entries);
+	}
+	idx->entries = entries;
+	idx->bits = bits;
+	return 0;
+}
+
+/* make room for one more entry; must be called before index_insert() */
+static int index_reserve(void *ctx, struct slotmap_index *idx)
+{
+	if ((idx->count + 1) * 2 <= (1U << idx->bits))
+		return 0;
+	return index_resize(ctx, idx, idx->bits + 1);
+}
+
+static void index_insert(struct slotmap_index *idx, uint32_t key, struct slot_mapping *map)
+{
+	_index_insert(idx->entries, idx->bits, key, map);
+	idx->count++;
+}
+
+/* remove the entry of given map, if it is (still) in the index */
+static void index_remove(void *ctx, struct slotmap_index *idx, uint32_t key,
+			 const struct slot_mapping *map)
+{
+	uint32_t mask = (1U << idx->bits) - 1;
+	uint32_t i = hash_32(key, idx->bits);
+	uint32_t j, home;
+
+	while (idx->entries[i].map && idx->entries[i].key != key)
+		i = (i + 1) & mask;
+	/* a map with the same key may have been added since this one was unlinked */
+	if (idx->entries[i].map != map)
+		return;
+
+	/* move each following entry of the cluster into the hole, unless its home
+	 * position lies cyclically within (hole, entry] */
+	for (j = (i + 1) & mask; idx->entries[j].map; j = (j + 1) & mask) {
+		home = hash_32(idx->entries[j].key, idx->bits);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			idx->entries[i] = idx->entries[j];
+			i = j;
+		}
+	}
+	idx->entries[i].map = NULL;
+	idx->count--;
+
+	/* shrinking is an optimization; keep the larger table if we cannot allocate */
+	if (idx->bits > SLOTMAP_INDEX_MIN_BITS && idx->count * 8 < (1U << idx->bits))
+		index_resize(ctx, idx, idx->bits - 1);
+}
+
+/* lookup of map by client:slot; caller must hold slotmaps->rwlock */
+struct slot_mapping *_slotmap_by_client(struct slotmaps *maps, const struct client_slot *client)
+{
+	return index_lookup(&maps->by_client, client_slot_key(client));
+}
+
 /* thread-safe lookup of map by client:slot */
 struct slot_mapping *slotmap_by_client(struct slotmaps *maps, const struct client_slot *client)
 {
 	struct slot_mapping *map;
 
 	slotmaps_rdlock(maps);
-	llist_for_each_entry(map, &maps->mappings, list) {
-		if (client_slot_equals(&map->client, client)) {
-			slotmaps_unlock(maps);
-			return map;
-		}
-	}
+	map = _slotmap_by_client(maps, client);
 	slotmaps_unlock(maps);
-	return NULL;
+	return map;
+}
+
+/* lookup of map by bank:slot; caller must hold slotmaps->rwlock */
+struct slot_mapping *_slotmap_by_bank(struct slotmaps *maps, const struct bank_slot *bank)
+{
+	return index_lookup(&maps->by_bank, bank_slot_key(bank));
 }
 
 /* thread-safe lookup of map by bank:slot */
@@ -75,42 +210,42 @@ struct slot_mapping *slotmap_by_bank(struct slotmaps *maps, const struct bank_sl
 	struct slot_mapping *map;
 
 	slotmaps_rdlock(maps);
-	llist_for_each_entry(map, &maps->mappings, list) {
-		if (bank_slot_equals(&map->bank, bank)) {
-			slotmaps_unlock(maps);
-			return map;
-		}
-	}
+	map = _slotmap_by_bank(maps, bank);
 	slotmaps_unlock(maps);
-	return NULL;
+	return map;
+}
 
+/* lookup of map by slotmap_get_id(); caller must hold slotmaps->rwlock */
+struct slot_mapping *_slotmap_by_id(struct slotmaps *maps, uint32_t id)
+{
+	/* the map id is the bank:slot key */
+	return index_lookup(&maps->by_bank, id);
 }
 
-/* thread-safe creating of a new bank<->client map */
-struct slot_mapping *slotmap_add(struct slotmaps *maps, const struct bank_slot *bank,
-				 const struct client_slot *client)
+/* creating of a new bank<->client map; caller must hold slotmaps->rwlock for writing */
+struct slot_mapping *_slotmap_add(struct slotmaps *maps, const struct bank_slot *bank,
+				  const struct client_slot *client)
 {
 	struct slot_mapping *map;
 	char mapname[64];
 
-	/* We assume a single thread (main thread) will ever update the mappings,
-	 * and hence we don't have any races by first grabbing + releasing the read
-	 * lock twice before grabbing the writelock below */
-
-	map = slotmap_by_bank(maps, bank);
+	map = _slotmap_by_bank(maps, bank);
 	if (map) {
 		LOGP(DSLOTMAP, LOGL_ERROR, "BANKD %u:%u already in use, cannot add new map\n",
 			bank->bank_id, bank->slot_nr);
 		return NULL;
 	}
 
-	map = slotmap_by_client(maps, client);
+	map = _slotmap_by_client(maps, client);
 	if (map) {
 		LOGP(DSLOTMAP, LOGL_ERROR, "CLIENT %u:%u already in use, cannot add new map\n",
 			client->client_id, client->slot_nr);
 		return NULL;
 	}
 
+	if (index_reserve(maps, &maps->by_bank) < 0 || index_reserve(maps, &maps->by_client) < 0)
+		return NULL;
+
 	/* allocate new mapping and add to list of mappings */
 	map = talloc_zero(maps, struct slot_mapping);
 	if (!map)
@@ -120,19 +255,51 @@ struct slot_mapping *slotmap_add(struct slotmaps *maps, const struct bank_slot *
 	map->bank = *bank;
 	map->client = *client;
 
-	slotmaps_wrlock(maps);
 	llist_add_tail(&map->list, &maps->mappings);
+	index_insert(&maps->by_bank, bank_slot_key(bank), map);
+	index_insert(&maps->by_client, client_slot_key(client), map);
 #ifdef REMSIM_SERVER
 	map->state = SLMAP_S_NEW;
+	map->prev_state = SLMAP_S_NEW;
+	clock_gettime(CLOCK_MONOTONIC, &map->entered[SLMAP_S_NEW]);
 	INIT_LLIST_HEAD(&map->bank_list); /* to ensure llist_del() always succeeds */
 #endif
-	slotmaps_unlock(maps);
 
 	LOGP(DSLOTMAP, LOGL_INFO, "Slot Map %s added\n", slotmap_name(mapname, sizeof(mapname), map));
+	if (maps->change_cb)
+		maps->change_cb(map, false);
 
 	return map;
 }
 
+/* thread-safe creating of a new bank<->client map */
+struct slot_mapping *slotmap_add(struct slotmaps *maps, const struct bank_slot *bank,
+				 const struct client_slot *client)
+{
+	struct slot_mapping *map;
+
+	slotmaps_wrlock(maps);
+	map = _slotmap_add(maps, bank, client);
+	slotmaps_unlock(maps);
+
+	return map;
+}
+
+/* remove map from the global list and indexes without freeing it; caller must hold
+ * slotmaps->rwlock for writing */
+void _slotmap_unlink(struct slotmaps *maps, struct slot_mapping *map)
+{
+	/* only report maps that are still in the table */
+	if (maps->change_cb && !llist_empty(&map->list))
+		maps->change_cb(map, true);
+	llist_del(&map->list);
+	/* safely initialize list head to avoid trouble when _slotmap_del() does another llist_del() */
+	INIT_LLIST_HEAD(&map->list);
+	/* only removes the entries still pointing to this map, so a second call is harmless */
+	index_remove(maps, &maps->by_bank, bank_slot_key(&map->bank), map);
+	index_remove(maps, &maps->by_client, client_slot_key(&map->client), map);
+}
+
 /* thread-safe removal of a bank<->client map */
 void _slotmap_del(struct slotmaps *maps, struct slot_mapping *map)
 {
@@ -140,9 +307,12 @@ void _slotmap_del(struct slotmaps *maps, struct slot_mapping *map)
 
 	LOGP(DSLOTMAP, LOGL_INFO, "Slot Map %s deleted\n", slotmap_name(mapname, sizeof(mapname), map));
 
-	llist_del(&map->list);
+	_slotmap_unlink(maps, map);
 #ifdef REMSIM_SERVER
 	llist_del(&map->bank_list);
+	hash_del(&map->op.hnode);
+	if (maps->transition_cb)
+		maps->transition_cb(map, true);
 #endif
 
 	talloc_free(map);
@@ -168,21 +338,201 @@ void slotmap_del_all(struct slotmaps *maps)
 	slotmaps_unlock(maps);
 }
 
+#ifdef SLOTMAP_LOCK_STATS
+struct slotmap_lock_stats g_slotmap_lock_stats;
+
+void slotmaps_lock_contended(pthread_rwlock_t *lock, bool write)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (write)
+		pthread_rwlock_wrlock(lock);
+	else
+		pthread_rwlock_rdlock(lock);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	atomic_fetch_add(&g_slotmap_lock_stats.contended, 1);
+	atomic_fetch_add(&g_slotmap_lock_stats.wait_us, (end.tv_sec - start.tv_sec) * 1000000 +
+						       (end.tv_nsec - start.tv_nsec) / 1000);
+}
+#endif
+
 struct slotmaps *slotmap_init(void *ctx)
 {
 	struct slotmaps *sm = talloc_zero(ctx, struct slotmaps);
 
+	if (!sm)
+		return NULL;
+
 	INIT_LLIST_HEAD(&sm->mappings);
+	if (index_resize(sm, &sm->by_bank, SLOTMAP_INDEX_MIN_BITS) < 0 ||
+	    index_resize(sm, &sm->by_client, SLOTMAP_INDEX_MIN_BITS) < 0) {
+		talloc_free(sm);
+		return NULL;
+	}
 	pthread_rwlock_init(&sm->rwlock, NULL);
 
+	atomic_init(&sm->snapshot, NULL);
+	/* epoch 0 is reserved for 'reader is idle' */
+	atomic_init(&sm->epoch, 1);
+	INIT_LLIST_HEAD(&sm->readers);
+	INIT_LLIST_HEAD(&sm->retired);
+	pthread_mutex_init(&sm->readers_mutex, NULL);
+
 	return sm;
 }
 
+/***********************************************************************
+ * lock-free read path
+ *
+ * The modifying thread periodically publishes an immutable snapshot of all maps,
+ * stored in an open-addressing table indexed by client:slot.  Readers announce the
+ * global epoch before dereferencing the snapshot pointer and clear it afterwards.
+ * Each replaced snapshot is tagged with the epoch in which it was replaced, and only
+ * freed once no reader is still inside a lookup that started in an older epoch.
+ ***********************************************************************/
+
+struct slotmap_snap_entry {
+	bool used;
+	struct client_slot client;
+	struct bank_slot bank;
+};
+
+struct slotmap_snapshot {
+	/* entry in slotmaps->retired, once replaced */
+	struct llist_head list;
+	/* epoch in which this snapshot was replaced */
+	uint64_t retire_epoch;
+	/* number of bits of the table size */
+	unsigned int bits;
+	struct slotmap_snap_entry entries[0];
+};
+
+static struct slotmap_snapshot *snapshot_build(struct slotmaps *maps)
+{
+	struct slotmap_snapshot *snap;
+	struct slot_mapping *map;
+	unsigned int count = 0, bits = 4;
+
+	llist_for_each_entry(map, &maps->mappings, list)
+		count++;
+	/* keep the load factor at or below 50% */
+	while ((1U << bits) < count * 2)
+		bits++;
+
+	snap = talloc_zero_size(maps, sizeof(*snap) + (1U << bits) * sizeof(snap->entries[0]));
+	if (!snap)
+		return NULL;
+	snap->bits = bits;
+
+	llist_for_each_entry(map, &maps->mappings, list) {
+		uint32_t mask = (1U << bits) - 1;
+		uint32_t i = hash_32(client_slot_key(&map->client), bits);
+
+		while (snap->entries[i].used)
+			i = (i + 1) & mask;
+		snap->entries[i].used = true;
+		snap->entries[i].client = map->client;
+		snap->entries[i].bank = map->bank;
+	}
+
+	return snap;
+}
+
+/* free all retired snapshots no longer visible to any reader; caller holds readers_mutex */
+static void _snapshot_reclaim(struct slotmaps *maps)
+{
+	struct slotmap_snapshot *snap, *snap2;
+	struct slotmap_reader *rd;
+	uint64_t oldest = UINT64_MAX;
+
+	llist_for_each_entry(rd, &maps->readers, list) {
+		uint64_t e = atomic_load(&rd->epoch);
+		if (e && e < oldest)
+			oldest = e;
+	}
+
+	llist_for_each_entry_safe(snap, snap2, &maps->retired, list) {
+		/* readers in epoch >= retire_epoch loaded the pointer after it was replaced */
+		if (snap->retire_epoch <= oldest) {
+			llist_del(&snap->list);
+			talloc_free(snap);
+		}
+	}
+}
+
+void slotmap_publish(struct slotmaps *maps)
+{
+	struct slotmap_snapshot *snap, *old;
+	uint64_t epoch;
+
+	slotmaps_rdlock(maps);
+	snap = snapshot_build(maps);
+	slotmaps_unlock(maps);
+	if (!snap) {
+		LOGP(DSLOTMAP, LOGL_ERROR, "Cannot allocate slotmap snapshot\n");
+		return;
+	}
+
+	old = atomic_exchange(&maps->snapshot, snap);
+	epoch = atomic_fetch_add(&maps->epoch, 1) + 1;
+
+	pthread_mutex_lock(&maps->readers_mutex);
+	if (old) {
+		old->retire_epoch = epoch;
+		llist_add_tail(&old->list, &maps->retired);
+	}
+	_snapshot_reclaim(maps);
+	pthread_mutex_unlock(&maps->readers_mutex);
+}
+
+void slotmap_reader_register(struct slotmaps *maps, struct slotmap_reader *rd)
+{
+	atomic_init(&rd->epoch, 0);
+	pthread_mutex_lock(&maps->readers_mutex);
+	llist_add_tail(&rd->list, &maps->readers);
+	pthread_mutex_unlock(&maps->readers_mutex);
+}
+
+void slotmap_reader_unregister(struct slotmaps *maps, struct slotmap_reader *rd)
+{
+	pthread_mutex_lock(&maps->readers_mutex);
+	llist_del(&rd->list);
+	pthread_mutex_unlock(&maps->readers_mutex);
+}
+
+int slotmap_lookup_client(struct slotmaps *maps, struct slotmap_reader *rd,
+			  const struct client_slot *client, struct bank_slot *bank)
+{
+	struct slotmap_snapshot *snap;
+	int rc = -ENOENT;
+
+	atomic_store(&rd->epoch, atomic_load(&maps->epoch));
+	snap = atomic_load(&maps->snapshot);
+	if (snap) {
+		uint32_t mask = (1U << snap->bits) - 1;
+		uint32_t i = hash_32(client_slot_key(client), snap->bits);
+
+		for (; snap->entries[i].used; i = (i + 1) & mask) {
+			if (client_slot_equals(&snap->entries[i].client, client)) {
+				*bank = snap->entries[i].bank;
+				rc = 0;
+				break;
+			}
+		}
+	}
+	atomic_store(&rd->epoch, 0);
+
+	return rc;
+}
+
 #ifdef REMSIM_SERVER
 
 void _Slotmap_state_change(struct slot_mapping *map, enum slot_mapping_state new_state,
 			   struct llist_head *new_bank_list, const char *file, int line)
 {
+	bool changed = map->state != new_state;
 	char mapname[64];
 
 	LOGPSRC(DMAIN, LOGL_INFO, file, line, "Slot Map %s state change: %s -> %s\n",
@@ -190,12 +540,22 @@ void _Slotmap_state_change(struct slot_mapping *map, enum slot_mapping_state new
 		get_value_string(slot_map_state_name, map->state),
 		get_value_string(slot_map_state_name, new_state));
 
+	/* re-attaching a map to a new bankd connection restarts the clock of its state */
+	clock_gettime(CLOCK_MONOTONIC, &map->entered[new_state]);
+	if (changed)
+		map->prev_state = map->state;
 	map->state = new_state;
 	llist_del(&map->bank_list);
 	if (new_bank_list)
 		llist_add_tail(&map->bank_list, new_bank_list);
 	else
 		INIT_LLIST_HEAD(&map->bank_list);
+
+	/* maps already removed from the table (on their way out) are not reported anymore */
+	if (changed && map->maps->change_cb && !llist_empty(&map->list))
+		map->maps->change_cb(map, false);
+	if (changed && map->maps->transition_cb)
+		map->maps->transition_cb(map, false);
 }
 
 
@@ -1,11 +1,17 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <pthread.h>
 #include <osmocom/core/linuxlist.h>
+#include <osmocom/core/hashtable.h>
 
 #define REMSIM_SERVER 1
 
+/* log2 of the initial (and minimum) number of slots of each index of struct slotmaps */
+#define SLOTMAP_INDEX_MIN_BITS	4
+
 struct bank_slot {
 	uint16_t bank_id;
 	uint16_t slot_nr;
@@ -39,6 +45,7 @@ enum slot_mapping_state {
 	SLMAP_S_DELETE_REQ,	/* fully active map; REST has requested deletion */
 	SLMAP_S_DELETING,	/* RSPRO has issued Remove to bankd, but bankd hasn't confirmed yet */
 };
+#define SLMAP_S_NUM		(SLMAP_S_DELETING + 1)
 extern const struct value_string slot_map_state_name[];
 static inline const char *slotmap_state_name(enum slot_mapping_state st)
 {
@@ -59,26 +66,107 @@ struct slot_mapping {
 #ifdef REMSIM_SERVER
 	struct llist_head bank_list;
 	enum slot_mapping_state state;
+	/* the map was ACTIVE at its bankd as of the primary server we took over from; it can be
+	 * re-used without re-provisioning once the bankd re-connects */
+	bool warm;
+	/* time the map last entered (or was re-attached in) each state, and the state it was in
+	 * before the current one; for the provisioning latency metrics */
+	struct timespec entered[SLMAP_S_NUM];
+	enum slot_mapping_state prev_state;
+	/* outstanding Create/RemoveMappingReq towards the bankd, if any */
+	struct {
+		/* OperationTag of the request; 0 if none is outstanding */
+		uint32_t tag;
+		/* entry in rspro_client_conn->bank.pending_ops */
+		struct hlist_node hnode;
+		/* number of re-transmissions so far */
+		unsigned int retries;
+		/* time of the last (re-)transmission */
+		struct timespec sent;
+	} op;
 #endif
 };
 
+/* open-addressing (linear probing) index of maps by a 32bit key; the key is kept next to the
+ * map pointer so probing never has to dereference other maps */
+struct slotmap_index_entry {
+	uint32_t key;
+	/* NULL if the slot is unused */
+	struct slot_mapping *map;
+};
+
+struct slotmap_index {
+	struct slotmap_index_entry *entries;
+	/* log2 of the number of entries */
+	unsigned int bits;
+	/* number of used entries; kept at or below 50% of the entries */
+	unsigned int count;
+};
+
+/* immutable copy of all maps, indexed by client:slot; see slotmap_publish() */
+struct slotmap_snapshot;
+
+/* a thread performing lock-free lookups via slotmap_lookup_client() */
+struct slotmap_reader {
+	/* entry in slotmaps->readers */
+	struct llist_head list;
+	/* global epoch observed when entering the current lookup; 0 while idle */
+	_Atomic uint64_t epoch;
+};
+
 /* collection of slot mappings */
 struct slotmaps {
 	struct llist_head mappings;
+	/* index by bank:slot; as the map id is derived from bank:slot, this is also the id index */
+	struct slotmap_index by_bank;
+	/* index by client:slot */
+	struct slotmap_index by_client;
 	pthread_rwlock_t rwlock;
+
+	/* lock-free read path: most recently published snapshot + current epoch */
+	struct slotmap_snapshot *_Atomic snapshot;
+	_Atomic uint64_t epoch;
+	/* registered readers and replaced snapshots awaiting reclamation, both
+	 * protected by readers_mutex */
+	struct llist_head readers;
+	struct llist_head retired;
+	pthread_mutex_t readers_mutex;
+
+	/* optional call-back on every addition, state change and removal of a map in the
+	 * table; called with rwlock held for writing */
+	void (*change_cb)(const struct slot_mapping *map, bool removed);
+	/* optional call-back on every state change of a map and when it is freed, including maps
+	 * already removed from the table on their way out; called with rwlock held for writing */
+	void (*transition_cb)(const struct slot_mapping *map, bool freed);
 };
 
 uint32_t slotmap_get_id(const struct slot_mapping *map);
+const char *slotmap_name(char *buf, size_t buf_len, const struct slot_mapping *map);
+/* hash of a map; the sum over all maps of a bankd (modulo 2^31) is its mappingsDigest */
+uint32_t slotmap_digest(const struct slot_mapping *map);
 
+/* lookup of map by client:slot; caller must hold slotmaps->rwlock */
+struct slot_mapping *_slotmap_by_client(struct slotmaps *maps, const struct client_slot *client);
 /* thread-safe lookup of map by client:slot */
 struct slot_mapping *slotmap_by_client(struct slotmaps *maps, const struct client_slot *client);
 
+/* lookup of map by bank:slot; caller must hold slotmaps->rwlock */
+struct slot_mapping *_slotmap_by_bank(struct slotmaps *maps, const struct bank_slot *bank);
 /* thread-safe lookup of map by bank:slot */
 struct slot_mapping *slotmap_by_bank(struct slotmaps *maps, const struct bank_slot *bank);
 
+/* lookup of map by slotmap_get_id(); caller must hold slotmaps->rwlock */
+struct slot_mapping *_slotmap_by_id(struct slotmaps *maps, uint32_t id);
+
+/* creating of a new bank<->client map; caller must hold slotmaps->rwlock for writing */
+struct slot_mapping *_slotmap_add(struct slotmaps *maps, const struct bank_slot *bank, const struct client_slot *client);
 /* thread-safe creating of a new bank<->client map */
 struct slot_mapping *slotmap_add(struct slotmaps *maps, const struct bank_slot *bank, const struct client_slot *client);
 
+/* remove map from the global list and indexes without freeing it; caller must hold
+ * slotmaps->rwlock for writing */
+void _slotmap_unlink(struct slotmaps *maps, struct slot_mapping *map);
+
 /* thread-safe removal of a bank<->client map */
 void slotmap_del(struct slotmaps *maps, struct slot_mapping *map);
 void _slotmap_del(struct slotmaps *maps, struct slot_mapping *map);
@@ -89,6 +177,19 @@ void slotmap_del_all(struct slotmaps *maps);
 /* initialize the entire map collection */
 struct slotmaps *slotmap_init(void *ctx);
 
+/* publish the current set of maps to lock-free readers; to be called by the (single)
+ * modifying thread after any change it wants readers to observe */
+void slotmap_publish(struct slotmaps *maps);
+
+/* register / unregister a thread for lock-free lookups */
+void slotmap_reader_register(struct slotmaps *maps, struct slotmap_reader *rd);
+void slotmap_reader_unregister(struct slotmaps *maps, struct slotmap_reader *rd);
+
+/* lock-free lookup of the bank:slot mapped to client:slot in the last published snapshot.
+ * Never blocks; returns 0 and a copy of the bank slot, or -ENOENT */
+int slotmap_lookup_client(struct slotmaps *maps, struct slotmap_reader *rd,
+			  const struct client_slot *client, struct bank_slot *bank);
+
 #ifdef SLOTMAP_DEBUG
 #define slotmaps_rdlock(maps) do {		\
 	printf("%s:%u = slotmap_rdlock()\n", __FILE__, __LINE__);		\
@@ -104,6 +205,30 @@ struct slotmaps *slotmap_init(void *ctx);
 	printf("%s:%u = slotmap_unlock()\n", __FILE__, __LINE__);		\
 	pthread_rwlock_unlock(&(maps)->rwlock);	\
 } while (0)
+#elif defined(SLOTMAP_LOCK_STATS)
+/* count how often (and for how long) threads had to wait for slotmaps->rwlock */
+struct slotmap_lock_stats {
+	atomic_ulong acquired;
+	atomic_ulong contended;
+	atomic_ulong wait_us;
+};
+extern struct slotmap_lock_stats g_slotmap_lock_stats;
+/* block on a lock we failed to take right away, accounting for the time it takes */
+void slotmaps_lock_contended(pthread_rwlock_t *lock, bool write);
+
+#define slotmaps_rdlock(maps) do {		\
+	if (pthread_rwlock_tryrdlock(&(maps)->rwlock))	\
+		slotmaps_lock_contended(&(maps)->rwlock, false);	\
+	atomic_fetch_add(&g_slotmap_lock_stats.acquired, 1);	\
+} while (0)
+
+#define slotmaps_wrlock(maps) do {		\
+	if (pthread_rwlock_trywrlock(&(maps)->rwlock))	\
+		slotmaps_lock_contended(&(maps)->rwlock, true);	\
+	atomic_fetch_add(&g_slotmap_lock_stats.acquired, 1);	\
+} while (0)
+
+#define slotmaps_unlock(maps) pthread_rwlock_unlock(&(maps)->rwlock)
 #else
 #define slotmaps_rdlock(maps) pthread_rwlock_rdlock(&(maps)->rwlock)
 #define slotmaps_wrlock(maps) pthread_rwlock_wrlock(&(maps)->rwlock)